@@ -267,6 +267,7 @@ if test "$gssapi" != no; then
   AC_CHECK_FUNCS(gss_decapsulate_token)
   AC_CHECK_FUNCS(gss_encapsulate_token)
   AC_CHECK_FUNCS(gss_oid_equal)
+  AC_CHECK_FUNCS(gss_wrap_iov)
   LIBS="$cmu_save_LIBS"
 else
   AC_MSG_RESULT([disabled])
@@ -54,6 +54,7 @@
  * Server Function Summary
  *  sasl_server_init  Load and initialize server plug-ins (call once)
  *  sasl_server_new   Initialize server connection context: sasl_conn_t
+ *  sasl_server_reset Make a server connection context ready for reuse
  *  sasl_listmech     Create list of available mechanisms
  *  sasl_server_start Begin an authentication exchange
  *  sasl_server_step  Perform one authentication exchange step
@@ -98,6 +99,7 @@
  *     call sasl_getprop to get username
  *     call sasl_getprop/sasl_encode/sasl_decode() if using security layer
  *  7. call sasl_dispose(), may return to step 2
+ *     (or keep the context and call sasl_server_reset() at step 2)
  *  8. call sasl_done() when program terminates
  *
  *************************************************
@@ -808,6 +810,10 @@ typedef struct sasl_channel_binding {
 
 #define SASL_CHANNEL_BINDING    21
 
+/* largest SASL packet sasl_encodev_into can produce (unsigned), that is
+ * the size of a buffer that holds any packet */
+#define SASL_MAXPACKET          22
+
 /* set property in SASL connection state
  * returns:
  *  SASL_OK       -- value set
@@ -993,6 +999,24 @@ LIBSASL_API int sasl_server_new(const char *service,
 				unsigned flags,
 				sasl_conn_t **pconn);
 
+/* make a server connection context ready for a new session, as
+ *  sasl_server_new would have left it, but keeping its service,
+ *  serverFQDN, user_realm, callbacks, flags and the options read through
+ *  the getopt callback, and the memory it has allocated.  The mechanism
+ *  and its state, the security layer, the security and external
+ *  properties, channel binding and GSS credentials are all dropped.
+ *  iplocalport    -- as for sasl_server_new, for the new session
+ *  ipremoteport   -- as for sasl_server_new, for the new session
+ *
+ * returns:
+ *  SASL_OK        -- success
+ *  SASL_BADPARAM  -- not a server connection, or a bad IP address
+ *  SASL_NOMEM     -- not enough memory
+ */
+LIBSASL_API int sasl_server_reset(sasl_conn_t *conn,
+				  const char *iplocalport,
+				  const char *ipremoteport);
+
 /* Return an array of NUL-terminated strings, terminated by a NULL pointer,
  * which lists all possible mechanisms that the library can supply
  *
@@ -1255,6 +1279,26 @@ LIBSASL_API int sasl_encodev(sasl_conn_t *conn,
 			     const struct iovec *invec, unsigned numiov,
 			     const char **output, unsigned *outputlen);
 
+/* encode a block of data for transmission using security layer into
+ *  caller supplied buffers, one SASL packet per buffer, without joining
+ *  the packets into one output, so they can go to writev() as they are
+ *  outvec  -- on input the buffers (a buffer of SASL_MAXPACKET bytes
+ *             holds any packet), on output the packets, each at the
+ *             start of its buffer.  If there is no security layer the
+ *             packets are the input iovecs and nothing is copied.
+ *  numout  -- on input the number of buffers, on output of packets
+ * returns:
+ *  SASL_OK      -- success
+ *  SASL_NOTDONE -- security layer negotiation not finished
+ *  SASL_TOOWEAK -- the security layer doesn't give its packet size,
+ *		    use sasl_encodev()
+ *  SASL_BUFOVER -- too few buffers, or one too small for its packet;
+ *		    nothing was encoded
+ */
+LIBSASL_API int sasl_encodev_into(sasl_conn_t *conn,
+				  const struct iovec *invec, unsigned numiov,
+				  struct iovec *outvec, unsigned *numout);
+
 /* decode a block of data received using security layer
  *  returning the input buffer if there is no security layer.
  *  output is only valid until next call to sasl_decode
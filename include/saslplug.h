@@ -153,8 +153,13 @@ typedef struct sasl_utils {
     int (*auxprop_store)(sasl_conn_t *conn,
 			 struct propctx *ctx, const char *user);
 
+    /* allocate memory that is freed all at once with the connection
+     * (by sasl_dispose or sasl_server_reset) and must not be freed
+     * otherwise.  NULL in utils that belong to no connection.
+     */
+    void *(*arena_alloc)(sasl_conn_t *conn, size_t size);
+
     /* for additions which don't require a version upgrade; set to 0 */
-    int (*spare_fptr1)();
     int (*spare_fptr2)();
 } sasl_utils_t;
 
@@ -196,10 +201,16 @@ typedef struct sasl_out_params {
     const void *gss_peer_name;
     const void *gss_local_name;
     const char *cbindingname;   /* channel binding name from packet */
-    int (*spare_fptr1)();
+    /* Optional: encode straight into a caller supplied buffer of outlen
+     * bytes (sasl_encodev_into).  Returns SASL_BUFOVER, with no state
+     * changed, if the packet would not fit. */
+    int (*encode_into)(void *context, const struct iovec *invec,
+		       unsigned numiov, char *out, unsigned outlen,
+		       unsigned *outputlen);
     int (*spare_fptr2)();
     unsigned int cbindingdisp;  /* channel binding disposition from client */
-    int spare_int2;
+    unsigned maxpacket;         /* largest packet encode produces from
+				 * maxoutbuf bytes, or 0 if not known */
     int spare_int3;
     int spare_int4;
 
@@ -385,11 +385,16 @@ int prop_getnames(struct propctx *ctx, const char **names,
 void prop_clear(struct propctx *ctx, int requests) 
 {
     struct proppool *new_pool, *tmp;
+    size_t values_size = (ctx->used_values+1) * sizeof(struct propval);
     unsigned i;
 
-    /* We're going to need a new proppool once we reset things */
-    new_pool = alloc_proppool(ctx->mem_base->size +
-			      (ctx->used_values+1) * sizeof(struct propval));
+    /* We're going to need a new proppool once we reset things.  Only
+       grow it if the values would take up more than half of it, or a
+       context that is cleared over and over (one that is reused with
+       sasl_server_reset) would grow without bound. */
+    new_pool = alloc_proppool(ctx->mem_base->size >= 2 * values_size ?
+			      ctx->mem_base->size :
+			      ctx->mem_base->size + values_size);
 
     if(requests) {
 	/* We're wiping the whole shebang */
@@ -535,6 +535,291 @@ static int retry_read(int fd, void *buf0, unsigned nbyte, unsigned delta)
 }
 #endif
 
+#if defined(HAVE_SASLAUTHD) && !defined(USE_DOORS)
+/*
+ * Persistent saslauthd connections.
+ *
+ * With "saslauthd_pool_size" set, each process keeps up to that many
+ * connections to saslauthd open and speaks protocol version 2 on
+ * them: after a handshake, every request is tagged with a 32 bit id
+ * and the connection stays open for the next one. A pooled
+ * connection carries one request at a time; when all of them are
+ * busy, or saslauthd doesn't know about version 2, we fall back to
+ * the one connection per request protocol.
+ */
+#define SASLAUTHD_PROTO_MARKER 0xffff
+#define SASLAUTHD_PROTO_VERSION 2
+#define SASLAUTHD_POOL_MAX 64
+/* seconds to wait on a pooled connection, so a saslauthd with every
+   worker busy doesn't hang us */
+#define SASLAUTHD_POOL_TIMEOUT 30
+
+typedef struct saslauthd_pool_conn {
+    int fd;     /* -1 if not connected */
+    int busy;   /* a request is in flight */
+} saslauthd_pool_conn_t;
+
+static saslauthd_pool_conn_t saslauthd_pool[SASLAUTHD_POOL_MAX];
+static void *saslauthd_pool_mutex = NULL;
+static pid_t saslauthd_pool_pid = 0;
+static int saslauthd_pool_disabled = 0;
+static unsigned int saslauthd_pool_id = 0;
+static char saslauthd_pool_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+#ifndef HAVE_STRLCPY
+/* as BSD strlcpy(): copy what fits, NUL terminated, and return the
+   length of 'src' so the caller can tell if it was cut short */
+static size_t saslauthd_pool_strlcpy(char *dst, const char *src, size_t len)
+{
+    size_t n = strlen(src);
+
+    if (len > 0) {
+	size_t c = n < len ? n : len - 1;
+
+	memcpy(dst, src, c);
+	dst[c] = '\0';
+    }
+
+    return n;
+}
+#define strlcpy(d, s, n) saslauthd_pool_strlcpy((d), (s), (n))
+#endif
+
+/* close the idle connections, caller holds the mutex */
+static void saslauthd_pool_flush(void)
+{
+    int i;
+
+    for (i = 0; i < SASLAUTHD_POOL_MAX; i++) {
+	if (saslauthd_pool[i].fd != -1 && !saslauthd_pool[i].busy) {
+	    close(saslauthd_pool[i].fd);
+	    saslauthd_pool[i].fd = -1;
+	}
+    }
+}
+
+/*
+ * Connect to saslauthd and negotiate protocol version 2.
+ * Returns the socket, -1 on error or -2 if saslauthd refused.
+ */
+static int saslauthd_pool_connect(const char *pwpath)
+{
+    struct sockaddr_un srvaddr;
+    unsigned short hello[2];
+    unsigned short count;
+    char response[64];
+    struct iovec iov[1];
+    struct timeval tv;
+    int s;
+
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == -1) return -1;
+
+#ifdef SO_SNDTIMEO
+    /* connect() waits for room in a full listen queue this long */
+    tv.tv_sec = SASLAUTHD_POOL_TIMEOUT;
+    tv.tv_usec = 0;
+    (void) setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#endif
+
+    memset((char *)&srvaddr, 0, sizeof(srvaddr));
+    srvaddr.sun_family = AF_UNIX;
+    strncpy(srvaddr.sun_path, pwpath, sizeof(srvaddr.sun_path));
+
+    if (connect(s, (struct sockaddr *) &srvaddr, sizeof(srvaddr)) == -1) {
+	close(s);
+	return -1;
+    }
+
+    hello[0] = htons(SASLAUTHD_PROTO_MARKER);
+    hello[1] = htons(SASLAUTHD_PROTO_VERSION);
+    iov[0].iov_base = (char *) hello;
+    iov[0].iov_len = sizeof(hello);
+
+    if (retry_writev(s, iov, 1, SASLAUTHD_POOL_TIMEOUT) == -1 ||
+	retry_read(s, &count, sizeof(count), SASLAUTHD_POOL_TIMEOUT)
+	    < (int) sizeof(count)) {
+	close(s);
+	return -1;
+    }
+
+    count = ntohs(count);
+    if (count < 2 || count >= sizeof(response) ||
+	retry_read(s, response, count, SASLAUTHD_POOL_TIMEOUT) < count) {
+	close(s);
+	return -1;
+    }
+
+    /* older servers take the marker for an oversized login */
+    if (strncmp(response, "OK", 2)) {
+	close(s);
+	return -2;
+    }
+
+    return s;
+}
+
+/*
+ * Send one request on a pooled connection.
+ * Returns 0 and fills in 'response', -1 on I/O error or -2 if
+ * saslauthd didn't answer within SASLAUTHD_POOL_TIMEOUT seconds.
+ */
+static int saslauthd_pool_talk(int s, unsigned int id,
+			       char *query, unsigned query_len,
+			       char *response, unsigned response_len)
+{
+    struct iovec iov[2];
+    unsigned int rid;
+    unsigned short count;
+    char discard[256];
+    unsigned n;
+
+    iov[0].iov_base = (char *) &id;
+    iov[0].iov_len = sizeof(id);
+    iov[1].iov_base = query;
+    iov[1].iov_len = query_len;
+
+    if (retry_writev(s, iov, 2, SASLAUTHD_POOL_TIMEOUT) == -1)
+	return -1;
+
+    if (retry_read(s, &rid, sizeof(rid), SASLAUTHD_POOL_TIMEOUT)
+	    < (int) sizeof(rid))
+	return errno == ETIMEDOUT ? -2 : -1;
+
+    if (rid != id ||
+	retry_read(s, &count, sizeof(count), SASLAUTHD_POOL_TIMEOUT)
+	    < (int) sizeof(count))
+	return -1;
+
+    count = ntohs(count);
+    if (count < 2) /* MUST have at least "OK" or "NO" */
+	return -1;
+
+    n = count < response_len ? count : response_len - 1;
+    if (retry_read(s, response, n, SASLAUTHD_POOL_TIMEOUT) < (int) n)
+	return -1;
+    response[n] = '\0';
+
+    /* keep the stream in sync */
+    for (count -= n; count > 0; count -= n) {
+	n = count < sizeof(discard) ? count : sizeof(discard);
+	if (retry_read(s, discard, n, SASLAUTHD_POOL_TIMEOUT) < (int) n)
+	    return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Run a request through the pool. Returns 0 if 'response' holds
+ * saslauthd's answer, -1 if the caller should use a one-shot
+ * connection instead, or -2 if saslauthd timed out on it.
+ */
+static int saslauthd_pool_request(const char *pwpath, int pool_size,
+				  char *query, unsigned query_len,
+				  char *response, unsigned response_len)
+{
+    int i, s, reused, r, result = -1;
+    unsigned int id;
+
+    if (pool_size > SASLAUTHD_POOL_MAX) pool_size = SASLAUTHD_POOL_MAX;
+
+    if (!saslauthd_pool_mutex || sasl_MUTEX_LOCK(saslauthd_pool_mutex) != 0)
+	return -1;
+
+    if (saslauthd_pool_pid != getpid()) {
+	/* we were forked, the connections belong to our parent */
+	for (i = 0; i < SASLAUTHD_POOL_MAX; i++) {
+	    if (saslauthd_pool[i].fd != -1) close(saslauthd_pool[i].fd);
+	    saslauthd_pool[i].fd = -1;
+	    saslauthd_pool[i].busy = 0;
+	}
+	saslauthd_pool_pid = getpid();
+    }
+
+    if (strcmp(saslauthd_pool_path, pwpath)) {
+	saslauthd_pool_flush();
+	saslauthd_pool_disabled = 0;
+
+	/* a path that doesn't fit would connect us somewhere else */
+	if (strlcpy(saslauthd_pool_path, pwpath, sizeof(saslauthd_pool_path))
+	    >= sizeof(saslauthd_pool_path)) {
+	    saslauthd_pool_path[0] = '\0';
+	    sasl_MUTEX_UNLOCK(saslauthd_pool_mutex);
+	    return -1;
+	}
+    }
+
+    if (saslauthd_pool_disabled) {
+	sasl_MUTEX_UNLOCK(saslauthd_pool_mutex);
+	return -1;
+    }
+
+    /* prefer an idle connection that is already open */
+    for (s = -1, i = 0; i < pool_size; i++) {
+	if (saslauthd_pool[i].busy) continue;
+	if (s == -1 || saslauthd_pool[i].fd != -1) s = i;
+	if (saslauthd_pool[i].fd != -1) break;
+    }
+
+    if (s == -1) {
+	sasl_MUTEX_UNLOCK(saslauthd_pool_mutex);
+	return -1;
+    }
+
+    i = s;
+    saslauthd_pool[i].busy = 1;
+    s = saslauthd_pool[i].fd;
+    id = htonl(++saslauthd_pool_id);
+    sasl_MUTEX_UNLOCK(saslauthd_pool_mutex);
+
+    /* an idle connection with something to read was closed by saslauthd */
+    if (s != -1 && read_wait(s, 0) == 0) {
+	close(s);
+	s = -1;
+    }
+
+    for (reused = (s != -1); ; reused = 0) {
+	if (s == -1) {
+	    s = saslauthd_pool_connect(pwpath);
+	    if (s == -2) {
+		s = -1;
+		sasl_MUTEX_LOCK(saslauthd_pool_mutex);
+		saslauthd_pool_disabled = 1;
+		sasl_MUTEX_UNLOCK(saslauthd_pool_mutex);
+	    }
+	    if (s == -1) break;
+	}
+
+	r = saslauthd_pool_talk(s, id, query, query_len,
+				response, response_len);
+	if (r == 0) {
+	    result = 0;
+	    break;
+	}
+
+	close(s);
+	s = -1;
+
+	/* a busy saslauthd won't do better on another connection */
+	if (r == -2) {
+	    result = -2;
+	    break;
+	}
+
+	/* saslauthd may have dropped an idle connection, try once more */
+	if (!reused) break;
+    }
+
+    sasl_MUTEX_LOCK(saslauthd_pool_mutex);
+    saslauthd_pool[i].fd = s;
+    saslauthd_pool[i].busy = 0;
+    sasl_MUTEX_UNLOCK(saslauthd_pool_mutex);
+
+    return result;
+}
+#endif /* HAVE_SASLAUTHD && !USE_DOORS */
+
 #ifdef HAVE_SASLAUTHD
 /* saslauthd-authenticated login */
 static int saslauthd_verify_password(sasl_conn_t *conn,
@@ -555,11 +840,18 @@ static int saslauthd_verify_password(sasl_conn_t *conn,
     char *freeme = NULL;
 #ifdef USE_DOORS
     door_arg_t arg;
+#else
+    const char *pool_opt = NULL;
+    int pool_size = 0;
 #endif
 
     /* check to see if the user configured a rundir */
     if (_sasl_getcallback(conn, SASL_CB_GETOPT, &getopt, &context) == SASL_OK) {
 	getopt(context, NULL, "saslauthd_path", &p, NULL);
+#ifndef USE_DOORS
+	getopt(context, NULL, "saslauthd_pool_size", &pool_opt, NULL);
+	if (pool_opt) pool_size = atoi(pool_opt);
+#endif
     }
     if (p) {
 	strncpy(pwpath, p, sizeof(pwpath));
@@ -659,6 +951,19 @@ static int saslauthd_verify_password(sasl_conn_t *conn,
 #else
     /* unix sockets */
 
+    if (pool_size > 0) {
+	switch (saslauthd_pool_request(pwpath, pool_size, query,
+				       query_end - query,
+				       response, sizeof(response))) {
+	case 0:
+	    goto pooled;
+	case -2:
+	    sasl_seterror(conn, 0, "saslauthd did not answer in %d seconds",
+			  SASLAUTHD_POOL_TIMEOUT);
+	    goto fail;
+	}
+    }
+
     s = socket(AF_UNIX, SOCK_STREAM, 0);
     if (s == -1) {
 	sasl_seterror(conn, 0, "cannot create socket for saslauthd: %m", errno);
@@ -721,6 +1026,7 @@ static int saslauthd_verify_password(sasl_conn_t *conn,
     }
 
     close(s);
+ pooled:
 #endif /* USE_DOORS */
   
     if(freeme) free(freeme);
@@ -975,3 +1281,39 @@ struct sasl_verify_password_s _sasl_verify_password[] = {
 #endif
     { NULL, NULL }
 };
+
+/* per-process password checking state, set up by sasl_server_init() */
+int _sasl_checkpw_init(void)
+{
+#if defined(HAVE_SASLAUTHD) && !defined(USE_DOORS)
+    int i;
+
+    if (!saslauthd_pool_mutex)
+	saslauthd_pool_mutex = sasl_MUTEX_ALLOC();
+    if (!saslauthd_pool_mutex) return SASL_FAIL;
+
+    for (i = 0; i < SASLAUTHD_POOL_MAX; i++) {
+	saslauthd_pool[i].fd = -1;
+	saslauthd_pool[i].busy = 0;
+    }
+    saslauthd_pool_pid = getpid();
+    saslauthd_pool_disabled = 0;
+    saslauthd_pool_path[0] = '\0';
+#endif
+
+    return SASL_OK;
+}
+
+void _sasl_checkpw_done(void)
+{
+#if defined(HAVE_SASLAUTHD) && !defined(USE_DOORS)
+    if (!saslauthd_pool_mutex) return;
+
+    /* don't close connections we inherited from our parent */
+    if (saslauthd_pool_pid == getpid())
+	saslauthd_pool_flush();
+
+    sasl_MUTEX_FREE(saslauthd_pool_mutex);
+    saslauthd_pool_mutex = NULL;
+#endif
+}
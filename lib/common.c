@@ -575,6 +575,181 @@ cleanup:
     RETURN(conn, result);
 }
  
+/* Largest packet the security layer makes from maxoutbuf bytes.  A
+   plugin that doesn't say is given SASL_ENCODEV_EXTRA bytes of
+   framing; sasl_encodev_into() won't use such a layer. */
+static unsigned _sasl_maxpacket(sasl_conn_t *conn)
+{
+    if (conn->oparams.encode == NULL)
+	return conn->oparams.maxoutbuf;
+    if (conn->oparams.maxpacket)
+	return conn->oparams.maxpacket;
+    return conn->oparams.maxoutbuf + SASL_ENCODEV_EXTRA;
+}
+
+/* Encode one packet into out: straight into it, if the plugin can,
+   or else through the plugin's own buffer */
+static int
+_sasl_encode_into(sasl_conn_t *conn,
+		  const struct iovec *invec,
+		  unsigned numiov,
+		  struct iovec *out)
+{
+    int result;
+    const char *output;
+    unsigned outputlen;
+
+    if (conn->oparams.encode_into != NULL) {
+	result = conn->oparams.encode_into(conn->context, invec, numiov,
+					   out->iov_base,
+					   (unsigned) out->iov_len,
+					   &outputlen);
+    } else {
+	result = conn->oparams.encode(conn->context, invec, numiov,
+				      &output, &outputlen);
+	if (result == SASL_OK) {
+	    if (outputlen > out->iov_len) {
+		/* The plugin's packets are bigger than its maxpacket
+		   says.  Its sequence number has moved on: the layer
+		   can't be used any further. */
+		sasl_seterror(conn, 0,
+			      "security layer packet larger than SASL_MAXPACKET");
+		return SASL_BUFOVER;
+	    }
+	    memcpy(out->iov_base, output, outputlen);
+	}
+    }
+
+    if (result == SASL_OK)
+	out->iov_len = outputlen;
+
+    return result;
+}
+
+/* security-encode an iovec into caller supplied buffers, one packet
+   per buffer */
+int sasl_encodev_into(sasl_conn_t *conn,
+		      const struct iovec *invec,
+		      unsigned numiov,
+		      struct iovec *outvec,
+		      unsigned *numout)
+{
+    int result = SASL_OK;
+    struct iovec stack_invec[16];
+    struct iovec *cur_invec = stack_invec;
+    unsigned cur_numiov;
+    size_t total_size = 0;
+    size_t want, take, offset;
+    unsigned maxoutbuf, overhead;
+    unsigned num_packets;
+    unsigned i, j, k;
+
+    if (!conn) return SASL_BADPARAM;
+    if (!invec || !outvec || !numout || numiov < 1) {
+	PARAMERROR(conn);
+    }
+
+    if (!conn->props.maxbufsize) {
+	sasl_seterror(conn, 0,
+		      "called sasl_encodev_into with application that does not support security layers");
+	return SASL_TOOWEAK;
+    }
+
+    /* No security layer: the input is the output */
+    if (conn->oparams.encode == NULL) {
+	if (numiov > *numout) {
+	    sasl_seterror(conn, 0, "sasl_encodev_into: too few output buffers");
+	    RETURN(conn, SASL_BUFOVER);
+	}
+	for (i = 0; i < numiov; i++) {
+	    outvec[i] = invec[i];
+	}
+	*numout = numiov;
+
+	RETURN(conn, SASL_OK);
+    }
+
+    maxoutbuf = conn->oparams.maxoutbuf;
+    if (maxoutbuf == 0) INTERROR(conn, SASL_FAIL);
+
+    /* Without the plugin's exact maxpacket a later packet could turn
+       out too big once earlier ones were already encoded */
+    if (conn->oparams.maxpacket == 0) {
+	sasl_seterror(conn, 0,
+		      "sasl_encodev_into: security layer does not give its packet size");
+	RETURN(conn, SASL_TOOWEAK);
+    }
+    overhead = conn->oparams.maxpacket - maxoutbuf;
+
+    for (i = 0; i < numiov; i++) {
+	total_size += invec[i].iov_len;
+    }
+
+    /* Check all the buffers before any packet is encoded: the layer
+       can't take a packet back */
+    num_packets = (unsigned) ((total_size + maxoutbuf - 1) / maxoutbuf);
+    if (num_packets > *numout) {
+	sasl_seterror(conn, 0, "sasl_encodev_into: too few output buffers");
+	RETURN(conn, SASL_BUFOVER);
+    }
+    for (k = 0; k < num_packets; k++) {
+	want = total_size - (size_t) k * maxoutbuf;
+	if (want > maxoutbuf) want = maxoutbuf;
+	if (outvec[k].iov_len < want + overhead) {
+	    sasl_seterror(conn, 0,
+			  "sasl_encodev_into: output buffer %u is too small", k);
+	    RETURN(conn, SASL_BUFOVER);
+	}
+    }
+
+    /* A packet takes pieces of at most numiov input iovecs */
+    if (numiov > sizeof(stack_invec) / sizeof(stack_invec[0])) {
+	cur_invec = sasl_ALLOC(sizeof(struct iovec) * numiov);
+	if (cur_invec == NULL) MEMERROR(conn);
+    }
+
+    i = 0;
+    offset = 0;
+    for (k = 0; k < num_packets; k++) {
+	want = total_size - (size_t) k * maxoutbuf;
+	if (want > maxoutbuf) want = maxoutbuf;
+
+	/* point at the packet's bytes in the input, without copying */
+	cur_numiov = 0;
+	while (want > 0) {
+	    take = invec[i].iov_len - offset;
+	    if (take > want) take = want;
+	    if (take > 0) {
+		cur_invec[cur_numiov].iov_base = (char *) invec[i].iov_base + offset;
+		cur_invec[cur_numiov].iov_len = take;
+		cur_numiov++;
+	    }
+	    offset += take;
+	    want -= take;
+	    if (offset == invec[i].iov_len) {
+		i++;
+		offset = 0;
+	    }
+	}
+
+	result = _sasl_encode_into(conn, cur_invec, cur_numiov, &outvec[k]);
+	if (result != SASL_OK) {
+	    /* the packets before this one are gone too */
+	    for (j = 0; j < k; j++) outvec[j].iov_len = 0;
+	    goto cleanup;
+	}
+    }
+
+    *numout = num_packets;
+
+cleanup:
+    if (cur_invec != stack_invec) {
+        sasl_FREE(cur_invec);
+    }
+
+    RETURN(conn, result);
+}
+
 /* output is only valid until next call to sasl_decode */
 int sasl_decode(sasl_conn_t *conn,
 		const char *input, unsigned inputlen,
@@ -834,6 +1009,8 @@ void _sasl_conn_dispose(sasl_conn_t *conn) {
       sasl_FREE(conn->multipacket_encoded_data.data);
   }
 
+  _sasl_arena_free(conn, 0);
+
   /* oparams sub-members should be freed by the plugin, in so much
    * as they were allocated by the plugin */
 }
@@ -864,6 +1041,10 @@ int sasl_getprop(sasl_conn_t *conn, int propnum, const void **pvalue)
   case SASL_MAXOUTBUF:
       *(unsigned **)pvalue = &conn->oparams.maxoutbuf;
       break;
+  case SASL_MAXPACKET:
+      conn->maxpacket = _sasl_maxpacket(conn);
+      *(unsigned **)pvalue = &conn->maxpacket;
+      break;
   case SASL_GETOPTCTX:
       result = _sasl_getcallback(conn, SASL_CB_GETOPT, &getopt, &context);
       if(result != SASL_OK) break;
@@ -1021,6 +1202,11 @@ int sasl_setprop(sasl_conn_t *conn, int propnum, const void *value)
   if (!conn)
     return SASL_BADPARAM;
 
+  /* mech_avail may answer differently once any property has changed,
+     so a kept sasl_listmech() result is no good any more */
+  if (conn->type == SASL_CONN_SERVER)
+    ((sasl_server_conn_t *)conn)->listmech.valid = 0;
+
   switch(propnum)
   {
   case SASL_SSF_EXTERNAL:
@@ -1905,6 +2091,60 @@ _sasl_log (sasl_conn_t *conn,
 
 
 
+/* Hand out size bytes of the connection's arena.  Blocks are only
+   ever added, and are all freed with the connection, so a handshake
+   that makes many small allocations costs a few calls to malloc. */
+void *_sasl_arena_alloc(sasl_conn_t *conn, size_t size)
+{
+    sasl_arena_block_t *block;
+    size_t blocksize;
+    void *ret;
+
+    if (!conn) return NULL;
+
+    /* keep everything aligned as the block's data is */
+    size = (size + sizeof(double) - 1) & ~(sizeof(double) - 1);
+    if (size == 0) size = sizeof(double);
+
+    block = conn->arena;
+    if (!block || block->size - block->used < size) {
+	blocksize = (size > SASL_ARENA_BLOCK_SIZE) ? size : SASL_ARENA_BLOCK_SIZE;
+	block = sasl_ALLOC(sizeof(sasl_arena_block_t) - sizeof(double) +
+			   blocksize);
+	if (!block) return NULL;
+
+	block->size = blocksize;
+	block->used = 0;
+	block->next = conn->arena;
+	conn->arena = block;
+    }
+
+    ret = (char *) block->data + block->used;
+    block->used += size;
+
+    return ret;
+}
+
+/* Free the connection's arena.  Plugins may have left secrets in it,
+   so what was handed out is wiped first.  If keep is set, the first
+   block made is kept, empty, for the connection's next session. */
+void _sasl_arena_free(sasl_conn_t *conn, int keep)
+{
+    sasl_arena_block_t *block, *next;
+
+    for (block = conn->arena; block; block = next) {
+	next = block->next;
+	sasl_erasebuffer((char *) block->data, (unsigned) block->used);
+	if (keep && !next) {
+	    block->used = 0;
+	    conn->arena = block;
+	} else {
+	    sasl_FREE(block);
+	}
+    }
+    if (!keep) conn->arena = NULL;
+}
+
 /* Allocate and Init a sasl_utils_t structure */
 sasl_utils_t *
 _sasl_alloc_utils(sasl_conn_t *conn,
@@ -1983,8 +2223,10 @@ _sasl_alloc_utils(sasl_conn_t *conn,
 #endif
 
   /* Spares */
+  utils->arena_alloc = conn ? &_sasl_arena_alloc : NULL;
+
   utils->spare_fptr = NULL;
-  utils->spare_fptr1 = utils->spare_fptr2 = NULL;
+  utils->spare_fptr2 = NULL;
   
   return utils;
 }
@@ -2313,14 +2555,19 @@ int sasl_listmech(sasl_conn_t *conn,
 		  unsigned *plen,
 		  int *pcount)
 {
+    int ret;
+
+    /* RETURN() evaluates its value twice, so not the listing itself */
     if(!conn) {
 	return SASL_BADPARAM;
     } else if(conn->type == SASL_CONN_SERVER) {
-	RETURN(conn, _sasl_server_listmech(conn, user, prefix, sep, suffix,
-					   result, plen, pcount));
+	ret = _sasl_server_listmech(conn, user, prefix, sep, suffix,
+				    result, plen, pcount);
+	RETURN(conn, ret);
     } else if (conn->type == SASL_CONN_CLIENT) {
-	RETURN(conn, _sasl_client_listmech(conn, prefix, sep, suffix,
-					   result, plen, pcount));
+	ret = _sasl_client_listmech(conn, prefix, sep, suffix,
+				    result, plen, pcount);
+	RETURN(conn, ret);
     }
     
     PARAMERROR(conn);
@@ -130,6 +130,17 @@ typedef struct buffer_info
     size_t reallen;
 } buffer_info_t;
 
+/* A block of a connection's arena (see _sasl_arena_alloc) */
+typedef struct sasl_arena_block
+{
+    struct sasl_arena_block *next;
+    size_t size;		/* bytes in data */
+    size_t used;		/* bytes of data handed out */
+    double data[1];		/* aligned for anything */
+} sasl_arena_block_t;
+
+#define SASL_ARENA_BLOCK_SIZE 4096
+
 typedef int add_plugin_t(const char *, void *);
 
 typedef struct add_plugin_list 
@@ -186,6 +197,11 @@ struct sasl_conn {
 
   /* Allocated by sasl_encodev if the output contains multiple SASL packet. */
   buffer_info_t multipacket_encoded_data;
+
+  unsigned maxpacket;		/* for sasl_getprop(SASL_MAXPACKET) */
+
+  /* Memory that lives as long as the connection, freed all at once */
+  sasl_arena_block_t *arena;
 };
 
 /* Server Conn Type Information */
@@ -193,6 +209,7 @@ struct sasl_conn {
 typedef struct mechanism
 {
     server_sasl_mechanism_t m;
+    int index;			/* order of registration, for mech_allowed */
     struct mechanism *next;
 } mechanism_t;
 
@@ -213,6 +230,23 @@ typedef struct context_list
     struct context_list *next;
 } context_list_t;
 
+/* What the last _sasl_server_listmech() result on a connection was
+   made for; while all of it still holds, the result is reused */
+typedef struct listmech_cache
+{
+    int valid;
+    sasl_security_properties_t props;
+    sasl_ssf_t external_ssf;
+    int external_authid;	/* external.auth_id is set */
+    unsigned int flags;
+    int cbinding;		/* SASL_CB_PRESENT, SASL_CB_CRITICAL << 1 */
+    int mech_length;		/* mechlist->mech_length */
+    char *affixes;		/* prefix, sep and suffix, each NUL ended */
+    size_t affixes_len;
+    unsigned count;
+    int notdone;		/* a mech_avail said SASL_NOTDONE for it */
+} listmech_cache_t;
+
 typedef struct sasl_server_conn {
     sasl_conn_t base; /* parts common to server + client */
 
@@ -223,6 +257,13 @@ typedef struct sasl_server_conn {
     mechanism_t *mech; /* mechanism trying to use */
     sasl_server_params_t *sparams;
     context_list_t *mech_contexts;
+
+    /* the mech_list option, parsed against the registered mechanisms */
+    char *mech_list;		/* option value; NULL if all are allowed */
+    int mech_list_length;	/* mechlist->mech_length when parsed */
+    unsigned char *mech_allowed; /* one bit per mechanism_t index */
+
+    listmech_cache_t listmech;
 } sasl_server_conn_t;
 
 /* Client Conn Type Information */
@@ -386,6 +427,10 @@ _sasl_alloc_utils(sasl_conn_t *conn,
 		  sasl_global_callbacks_t *global_callbacks);
 extern int _sasl_free_utils(const sasl_utils_t ** utils);
 
+/* per-connection arena, see common.c */
+extern void *_sasl_arena_alloc(sasl_conn_t *conn, size_t size);
+extern void _sasl_arena_free(sasl_conn_t *conn, int keep);
+
 extern int
 _sasl_getcallback(sasl_conn_t * conn,
 		  unsigned long callbackid,
@@ -460,6 +505,9 @@ extern int sasl_config_init(const char *filename);
 extern const char *sasl_config_getstring(const char *key,const char *def);
 
 /* checkpw.c */
+extern int _sasl_checkpw_init(void);
+extern void _sasl_checkpw_done(void);
+
 #ifdef DO_SASL_CHECKAPOP
 extern int _sasl_auxprop_verify_apop(sasl_conn_t *conn,
 				     const char *userstr,
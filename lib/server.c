@@ -293,6 +293,13 @@ static void server_dispose(sasl_conn_t *pconn)
       sasl_FREE(cur);
   }  
   s_conn->mech_contexts = NULL;
+
+  if (s_conn->mech_list)
+      sasl_FREE(s_conn->mech_list);
+  if (s_conn->mech_allowed)
+      sasl_FREE(s_conn->mech_allowed);
+  if (s_conn->listmech.affixes)
+      sasl_FREE(s_conn->listmech.affixes);
   
   _sasl_free_utils(&s_conn->sparams->utils);
 
@@ -389,6 +396,7 @@ int sasl_server_add_plugin(const char *plugname,
 
         /* mech->m.f = NULL; */
 
+	mech->index = mechlist->mech_length;
 	mech->next = mechlist->mech_list;
 	mechlist->mech_list = mech;
 	mechlist->mech_length++;
@@ -437,6 +445,8 @@ static int server_done(void) {
   /* Free the auxprop plugins */
   _sasl_auxprop_free();
 
+  _sasl_checkpw_done();
+
   global_callbacks.callbacks = NULL;
   global_callbacks.appname = NULL;
 
@@ -657,6 +667,7 @@ static int parse_mechlist_file(const char *mechlistfile)
 
 	/* insert mechanism into mechlist */
 	n->m.plug = nplug;
+	n->index = mechlist->mech_length;
 	n->next = mechlist->mech_list;
 	mechlist->mech_list = n;
 	mechlist->mech_length++;
@@ -742,6 +753,12 @@ int sasl_server_init(const sasl_callback_t *callbacks,
 	return ret;
     }
 
+    ret = _sasl_checkpw_init();
+    if (ret != SASL_OK) {
+	server_done();
+	return ret;
+    }
+
     vf = _sasl_find_verifyfile_callback(callbacks);
 
     /* load config file if applicable */
@@ -994,6 +1011,148 @@ int sasl_server_new(const char *service,
   return result;
 }
 
+/* make a server connection context ready for a new session, keeping
+ * what sasl_server_new set up that doesn't depend on the session */
+int sasl_server_reset(sasl_conn_t *conn,
+		      const char *iplocalport,
+		      const char *ipremoteport)
+{
+  sasl_server_conn_t *s_conn = (sasl_server_conn_t *) conn;
+  context_list_t *cur, *cur_next;
+  int result;
+
+  if (_sasl_server_active==0) return SASL_NOTINIT;
+  if (!conn) return SASL_BADPARAM;
+  if (conn->type != SASL_CONN_SERVER) PARAMERROR(conn);
+
+  /* the mechanism of the last session, and any mech_avail made */
+  if (s_conn->mech && conn->context
+      && s_conn->mech->m.plug->mech_dispose) {
+    s_conn->mech->m.plug->mech_dispose(conn->context,
+				       s_conn->sparams->utils);
+  }
+  conn->context = NULL;
+  s_conn->mech = NULL;
+
+  for(cur = s_conn->mech_contexts; cur; cur=cur_next) {
+      cur_next = cur->next;
+      if(cur->context)
+	  cur->mech->m.plug->mech_dispose(cur->context, s_conn->sparams->utils);
+      sasl_FREE(cur);
+  }
+  s_conn->mech_contexts = NULL;
+
+  s_conn->sent_last = 0;
+  s_conn->authenticated = 0;
+  s_conn->listmech.valid = 0;
+
+  /* the session's properties, as sasl_server_new leaves them; the
+     buffers stay for the next session */
+  memset(&conn->oparams, 0, sizeof(sasl_out_params_t));
+  memset(&conn->props, 0, sizeof(conn->props));
+  /* the names canon_user left of the last session, which a disposed
+     connection takes with it */
+  memset(conn->user_buf, 0, sizeof(conn->user_buf));
+  memset(conn->authid_buf, 0, sizeof(conn->authid_buf));
+  if (conn->external.auth_id)
+      sasl_FREE(conn->external.auth_id);
+  memset(&conn->external, 0, sizeof(_sasl_external_properties_t));
+  conn->multipacket_encoded_data.curlen = 0;
+
+  s_conn->sparams->props = conn->props;
+  s_conn->sparams->external_ssf = 0;
+  s_conn->sparams->gss_creds = NULL;
+  s_conn->sparams->cbinding = NULL;
+
+  prop_clear(s_conn->sparams->propctx, 1);
+  _sasl_arena_free(conn, 1);
+
+  conn->error_code = SASL_OK;
+  conn->error_buf[0] = '\0';
+  conn->errdetail_buf[0] = '\0';
+
+  result = sasl_setprop(conn, SASL_IPLOCALPORT, iplocalport);
+  if (result != SASL_OK) RETURN(conn, result);
+
+  result = sasl_setprop(conn, SASL_IPREMOTEPORT, ipremoteport);
+  if (result != SASL_OK) RETURN(conn, result);
+
+  RETURN(conn, SASL_OK);
+}
+
+/*
+ * Bring the connection's mech_allowed bitmap up to date with the
+ * mech_list option.  The option is only parsed again when its value
+ * or the set of registered mechanisms has changed, so mech_permitted
+ * need not tokenize it for every mechanism it is asked about.
+ */
+static int update_mech_allowed(sasl_conn_t *conn)
+{
+    sasl_server_conn_t *s_conn = (sasl_server_conn_t *)conn;
+    sasl_getopt_t *getopt;
+    void *context;
+    const char *mlist = NULL;
+    const char *cp;
+    mechanism_t *m;
+    int plus = 0;
+
+    /* get the list of allowed mechanisms (default = all) */
+    if (_sasl_getcallback(conn, SASL_CB_GETOPT, &getopt, &context)
+            == SASL_OK) {
+	getopt(context, NULL, "mech_list", &mlist, NULL);
+    }
+
+    if (!mlist && !s_conn->mech_list) {
+	/* still no list */
+	return SASL_OK;
+    }
+
+    if (mlist && s_conn->mech_list
+	&& s_conn->mech_list_length == mechlist->mech_length
+	&& !strcmp(mlist, s_conn->mech_list)) {
+	/* nothing changed */
+	return SASL_OK;
+    }
+
+    /* a list made for the old value is no good now */
+    s_conn->listmech.valid = 0;
+
+    if (s_conn->mech_list) sasl_FREE(s_conn->mech_list);
+    if (s_conn->mech_allowed) sasl_FREE(s_conn->mech_allowed);
+    s_conn->mech_list = NULL;
+    s_conn->mech_allowed = NULL;
+
+    if (!mlist) return SASL_OK;
+
+    if (_sasl_strdup(mlist, &s_conn->mech_list, NULL) != SASL_OK)
+	return SASL_NOMEM;
+
+    s_conn->mech_allowed = sasl_ALLOC((mechlist->mech_length + 7) / 8);
+    if (!s_conn->mech_allowed) {
+	sasl_FREE(s_conn->mech_list);
+	s_conn->mech_list = NULL;
+	return SASL_NOMEM;
+    }
+    memset(s_conn->mech_allowed, 0, (mechlist->mech_length + 7) / 8);
+    s_conn->mech_list_length = mechlist->mech_length;
+
+    /* check each plugin against the list */
+    while (*mlist) {
+	for (cp = mlist; *cp && !isspace((int) *cp); cp++);
+	for (m = mechlist->mech_list; m; m = m->next) {
+	    if (_sasl_is_equal_mech(mlist, m->m.plug->mech_name,
+				    (size_t) (cp - mlist), &plus)) {
+		/* found a match */
+		s_conn->mech_allowed[m->index / 8] |= 1 << (m->index % 8);
+	    }
+	}
+	mlist = cp;
+	while (*mlist && isspace((int) *mlist)) mlist++;
+    }
+
+    return SASL_OK;
+}
+
 /*
  * The rule is:
  * IF mech strength + external strength < min ssf THEN FAIL
@@ -1008,7 +1167,6 @@ static int mech_permitted(sasl_conn_t *conn,
     int ret;
     int myflags;
     context_list_t *cur;
-    sasl_getopt_t *getopt;
     void *context;
     sasl_ssf_t minssf = 0;
 
@@ -1021,31 +1179,10 @@ static int mech_permitted(sasl_conn_t *conn,
     
     plug = mech->m.plug;
 
-    /* get the list of allowed mechanisms (default = all) */
-    if (_sasl_getcallback(conn, SASL_CB_GETOPT, &getopt, &context)
-            == SASL_OK) {
-	const char *mlist = NULL;
-	int plus = 0;
-
-	getopt(context, NULL, "mech_list", &mlist, NULL);
-
-	/* if we have a list, check the plugin against it */
-	if (mlist) {
-	    const char *cp;
-
-	    while (*mlist) {
-		for (cp = mlist; *cp && !isspace((int) *cp); cp++);
-		if (_sasl_is_equal_mech(mlist, plug->mech_name, (size_t) (cp - mlist), &plus)) {
-		    /* found a match */
-		    break;
-		}
-		mlist = cp;
-		while (*mlist && isspace((int) *mlist)) mlist++;
-	    }
-
-	    if (!*mlist) return SASL_NOMECH;  /* reached EOS -> not in our list */
-	}
-    }
+    /* is it in the mech_list option? (see update_mech_allowed) */
+    if (s_conn->mech_allowed &&
+	!(s_conn->mech_allowed[mech->index / 8] & (1 << (mech->index % 8))))
+	return SASL_NOMECH;
 
     /* setup parameters for the call to mech_avail */
     s_conn->sparams->serverFQDN=conn->serverFQDN;
@@ -1093,7 +1230,10 @@ static int mech_permitted(sasl_conn_t *conn,
 	    s_conn->mech_contexts = cur;
 	}
 	
-	/* SASL_NOTDONE might also get us here */
+	/* SASL_NOTDONE might also get us here: the mech may be available
+	   later in the session, so a list made now can't be kept */
+	if(ret == SASL_NOTDONE)
+	    s_conn->listmech.notdone = 1;
 
 	/* Error should be set by mech_avail call */
 	return SASL_NOMECH;
@@ -1246,7 +1386,13 @@ int sasl_server_start(sasl_conn_t *conn,
 	goto done;
     }
 
+    /* starting may change what mech_avail says, and what is loaded */
+    s_conn->listmech.valid = 0;
+
     /* Make sure that we're willing to use this mech */
+    if ((result = update_mech_allowed(conn)) != SASL_OK) {
+	MEMERROR(conn);
+    }
     if ((result = mech_permitted(conn, m)) != SASL_OK) {
 	goto done;
     }
@@ -1525,9 +1671,97 @@ static unsigned mech_names_len()
   return result;
 }
 
+/* The security properties mech_permitted looks at, whether there is an
+ * external authentication id (which EXTERNAL's mech_avail needs), and
+ * the separators, as _sasl_server_listmech was last called with on this
+ * connection.
+ * prefix and suffix may be NULL.
+ */
+static int listmech_cached(sasl_server_conn_t *s_conn,
+			   const char *prefix,
+			   const char *sep,
+			   const char *suffix)
+{
+  sasl_conn_t *conn = &s_conn->base;
+  listmech_cache_t *cache = &s_conn->listmech;
+  const char *affix[3];
+  const char *cp;
+  int lup;
+
+  if (!cache->valid
+      || cache->mech_length != mechlist->mech_length
+      || cache->external_ssf != conn->external.ssf
+      || cache->external_authid != (conn->external.auth_id != NULL)
+      || cache->flags != conn->flags
+      || cache->cbinding != (SASL_CB_PRESENT(s_conn->sparams) |
+			     SASL_CB_CRITICAL(s_conn->sparams) << 1)
+      || cache->props.min_ssf != conn->props.min_ssf
+      || cache->props.max_ssf != conn->props.max_ssf
+      || cache->props.maxbufsize != conn->props.maxbufsize
+      || cache->props.security_flags != conn->props.security_flags
+      || cache->props.property_names != conn->props.property_names
+      || cache->props.property_values != conn->props.property_values)
+      return 0;
+
+  affix[0] = prefix ? prefix : "";
+  affix[1] = sep;
+  affix[2] = suffix ? suffix : "";
+
+  for (cp = cache->affixes, lup = 0; lup < 3; lup++) {
+      if (strcmp(cp, affix[lup])) return 0;
+      cp += strlen(cp) + 1;
+  }
+
+  return 1;
+}
+
+/* Remember what the list now in conn->mechlist_buf was made for,
+ * unless a mechanism wasn't sure yet whether it is available */
+static void listmech_store(sasl_server_conn_t *s_conn,
+			   const char *prefix,
+			   const char *sep,
+			   const char *suffix,
+			   unsigned count)
+{
+  sasl_conn_t *conn = &s_conn->base;
+  listmech_cache_t *cache = &s_conn->listmech;
+  size_t prefixlen, seplen, suffixlen;
+
+  cache->valid = 0;
+
+  if (cache->notdone)
+      return;
+
+  prefixlen = prefix ? strlen(prefix) : 0;
+  seplen = strlen(sep);
+  suffixlen = suffix ? strlen(suffix) : 0;
+
+  if (_buf_alloc(&cache->affixes, &cache->affixes_len,
+		 prefixlen + seplen + suffixlen + 3) != SASL_OK)
+      return;
+
+  memcpy(cache->affixes, prefix ? prefix : "", prefixlen + 1);
+  memcpy(cache->affixes + prefixlen + 1, sep, seplen + 1);
+  memcpy(cache->affixes + prefixlen + seplen + 2, suffix ? suffix : "",
+	 suffixlen + 1);
+
+  cache->props = conn->props;
+  cache->external_ssf = conn->external.ssf;
+  cache->external_authid = (conn->external.auth_id != NULL);
+  cache->flags = conn->flags;
+  cache->cbinding = SASL_CB_PRESENT(s_conn->sparams) |
+		    SASL_CB_CRITICAL(s_conn->sparams) << 1;
+  cache->mech_length = mechlist->mech_length;
+  cache->count = count;
+  cache->valid = 1;
+}
+
 /* This returns a list of mechanisms in a NUL-terminated string
  *
  * The default behavior is to seperate with spaces if sep==NULL
+ *
+ * The list is kept with the connection and given out again for as long
+ * as the properties it was made for stay the same.
  */
 int _sasl_server_listmech(sasl_conn_t *conn,
 			  const char *user __attribute__((unused)),
@@ -1543,6 +1777,7 @@ int _sasl_server_listmech(sasl_conn_t *conn,
   int ret;
   size_t resultlen;
   int flag;
+  unsigned count;
   const char *mysep;
   sasl_server_conn_t *s_conn = (sasl_server_conn_t *) conn;  /* cast */
 
@@ -1568,6 +1803,20 @@ int _sasl_server_listmech(sasl_conn_t *conn,
   if (! mechlist || mechlist->mech_length <= 0)
       INTERROR(conn, SASL_NOMECH);
 
+  if (update_mech_allowed(conn) != SASL_OK)
+      MEMERROR(conn);
+
+  if (listmech_cached(s_conn, prefix, mysep, suffix)) {
+      if (plen != NULL)
+	  *plen = (unsigned) strlen(conn->mechlist_buf);
+      if (pcount != NULL)
+	  *pcount = s_conn->listmech.count;
+
+      *result = conn->mechlist_buf;
+
+      return SASL_OK;
+  }
+
   resultlen = (prefix ? strlen(prefix) : 0)
             + (strlen(mysep) * (mechlist->mech_length - 1) * 2)
 	    + (mech_names_len() * 2) /* including -PLUS variant */
@@ -1586,6 +1835,8 @@ int _sasl_server_listmech(sasl_conn_t *conn,
   listptr = mechlist->mech_list;  
    
   flag = 0;
+  count = 0;
+  s_conn->listmech.notdone = 0;
   /* make list */
   for (lup = 0; lup < mechlist->mech_length; lup++) {
       /* currently, we don't use the "user" parameter for anything */
@@ -1597,8 +1848,7 @@ int _sasl_server_listmech(sasl_conn_t *conn,
            */
           if (!SASL_CB_PRESENT(s_conn->sparams) ||
               !SASL_CB_CRITICAL(s_conn->sparams)) {
-            if (pcount != NULL)
-	      (*pcount)++;
+            count++;
             if (flag)
               strcat(conn->mechlist_buf, mysep);
             else
@@ -1613,8 +1863,7 @@ int _sasl_server_listmech(sasl_conn_t *conn,
            */
 	  if ((listptr->m.plug->features & SASL_FEAT_CHANNEL_BINDING) &&
 	      SASL_CB_PRESENT(s_conn->sparams)) {
-	    if (pcount != NULL)
-		(*pcount)++;
+	    count++;
             if (flag)
               strcat(conn->mechlist_buf, mysep);
             else
@@ -1630,8 +1879,12 @@ int _sasl_server_listmech(sasl_conn_t *conn,
   if (suffix)
       strcat(conn->mechlist_buf,suffix);
 
+  listmech_store(s_conn, prefix, mysep, suffix, count);
+
   if (plen!=NULL)
       *plen = (unsigned) strlen(conn->mechlist_buf);
+  if (pcount!=NULL)
+      *pcount = count;
 
   *result = conn->mechlist_buf;
 
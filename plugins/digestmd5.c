@@ -249,7 +249,6 @@ typedef struct context {
     unsigned out_buf_len;
     
     /* for encoding/decoding */
-    buffer_info_t *enc_in_buf;
     char *encode_buf, *decode_buf, *decode_packet_buf;
     unsigned encode_buf_len, decode_buf_len, decode_packet_buf_len;
 
@@ -887,8 +886,9 @@ static int enc_3des(context_t *text,
     /* determine padding length */
     paddinglen = 8 - ((inputlen + 10) % 8);
     
-    /* now construct the full stuff to be ciphered */
-    memcpy(output, input, inputlen);                /* text */
+    /* now construct the full stuff to be ciphered (in place, if
+       output is input) */
+    memmove(output, input, inputlen);               /* text */
     memset(output+inputlen, paddinglen, paddinglen);/* pad  */
     memcpy(output+inputlen+paddinglen, digest, 10); /* hmac */
     
@@ -1008,8 +1008,9 @@ static int enc_des(context_t *text,
     /* determine padding length */
     paddinglen = 8 - ((inputlen+10) % 8);
 
-    /* now construct the full stuff to be ciphered */
-    memcpy(output, input, inputlen);                /* text */
+    /* now construct the full stuff to be ciphered (in place, if
+       output is input) */
+    memmove(output, input, inputlen);               /* text */
     memset(output+inputlen, paddinglen, paddinglen);/* pad  */
     memcpy(output+inputlen+paddinglen, digest, 10); /* hmac */
     
@@ -1328,80 +1329,76 @@ static const unsigned short version = 1;
  * integrity:
  * len, HMAC(ki, {SeqNum, msg})[0..9], x0001, SeqNum
  */
-static int digestmd5_encode(void *context,
-			    const struct iovec *invec,
-			    unsigned numiov,
-			    const char **output,
-			    unsigned *outputlen)
+static int digestmd5_encode_into(void *context,
+				 const struct iovec *invec,
+				 unsigned numiov,
+				 char *output,
+				 unsigned outlen,
+				 unsigned *outputlen)
 {
     context_t *text = (context_t *) context;
     int tmp;
     unsigned int tmpnum;
     unsigned short int tmpshort;
-    int ret;
+    unsigned inlen = 0, i;
     char *out;
-    struct buffer_info *inblob, bufinfo;
     
     if(!context || !invec || !numiov || !output || !outputlen) {
 	PARAMERROR(text->utils);
 	return SASL_BADPARAM;
     }
     
-    if (numiov > 1) {
-	ret = _plug_iovec_to_buf(text->utils, invec, numiov, &text->enc_in_buf);
-	if (ret != SASL_OK) return ret;
-	inblob = text->enc_in_buf;
-    } else {
-	/* avoid the data copy */
-	bufinfo.data = invec[0].iov_base;
-	bufinfo.curlen = invec[0].iov_len;
-	inblob = &bufinfo;
+    for (i = 0; i < numiov; i++) {
+	inlen += invec[i].iov_len;
     }
     
-    /* make sure the output buffer is big enough for this blob */
-    ret = _plug_buf_alloc(text->utils, &(text->encode_buf),
-			  &(text->encode_buf_len),
-			  (4 +			/* for length */
-			   inblob->curlen +	/* for content */
-			   10 +			/* for MAC */
-			   8 +			/* maximum pad */
-			   6));			/* for ver and seqnum */
-    if(ret != SASL_OK) return ret;
+    /* make sure the output buffer is big enough for this packet,
+       before the sequence number is used up */
+    if (outlen < (4 +			/* for length */
+		  inlen +		/* for content */
+		  10 +			/* for MAC */
+		  8 +			/* maximum pad */
+		  6)) {			/* for ver and seqnum */
+	return SASL_BUFOVER;
+    }
     
     /* skip by the length for now */
-    out = (text->encode_buf)+4;
+    out = output+4;
     
     /* construct (seqnum, msg)
      *
-     * Use the output buffer so that the message text is already in place
-     * for an integrity-only layer.
+     * Gather the message straight into the output buffer, so that it
+     * is already in place for an integrity-only layer, and is
+     * encrypted where it lies for a privacy layer.
      */
     tmpnum = htonl(text->seqnum);
-    memcpy(text->encode_buf, &tmpnum, 4);
-    memcpy(text->encode_buf + 4, inblob->data, inblob->curlen);
+    memcpy(output, &tmpnum, 4);
+    for (i = 0, tmp = 4; i < numiov; i++) {
+	memcpy(output + tmp, invec[i].iov_base, invec[i].iov_len);
+	tmp += invec[i].iov_len;
+    }
     
     if (text->cipher_enc) {
 	unsigned char digest[16];
 
 	/* HMAC(ki, (seqnum, msg) ) */
-	text->utils->hmac_md5((const unsigned char *) text->encode_buf,
-			      inblob->curlen + 4, 
+	text->utils->hmac_md5((const unsigned char *) output,
+			      inlen + 4, 
 			      text->Ki_send, HASHLEN, digest);
 
 	/* calculate the encrypted part */
-	text->cipher_enc(text, inblob->data, inblob->curlen,
-			 digest, out, outputlen);
+	text->cipher_enc(text, out, inlen, digest, out, outputlen);
 	out+=(*outputlen);
     }
     else {
 	/* HMAC(ki, (seqnum, msg) ) -- put directly into output buffer */
-	text->utils->hmac_md5((const unsigned char *) text->encode_buf,
-			      inblob->curlen + 4, 
+	text->utils->hmac_md5((const unsigned char *) output,
+			      inlen + 4, 
 			      text->Ki_send, HASHLEN,
-			      text->encode_buf + inblob->curlen + 4);
+			      output + inlen + 4);
 
-	*outputlen = inblob->curlen + 10; /* for message + CMAC */
-	out+=inblob->curlen + 10;
+	*outputlen = inlen + 10; /* for message + CMAC */
+	out+=inlen + 10;
     }
     
     /* copy in version */
@@ -1419,16 +1416,53 @@ static int digestmd5_encode(void *context,
     
     /* put the 1st 4 bytes in */
     tmp=htonl(*outputlen);  
-    memcpy(text->encode_buf, &tmp, 4);
+    memcpy(output, &tmp, 4);
     
     (*outputlen)+=4;
     
-    *output = text->encode_buf;
     text->seqnum++;
     
     return SASL_OK;
 }
 
+static int digestmd5_encode(void *context,
+			    const struct iovec *invec,
+			    unsigned numiov,
+			    const char **output,
+			    unsigned *outputlen)
+{
+    context_t *text = (context_t *) context;
+    unsigned inlen = 0, i;
+    int ret;
+    
+    if(!context || !invec || !numiov || !output || !outputlen) {
+	PARAMERROR(text->utils);
+	return SASL_BADPARAM;
+    }
+    
+    for (i = 0; i < numiov; i++) {
+	inlen += invec[i].iov_len;
+    }
+    
+    /* make sure the output buffer is big enough for this blob */
+    ret = _plug_buf_alloc(text->utils, &(text->encode_buf),
+			  &(text->encode_buf_len),
+			  (4 +			/* for length */
+			   inlen +		/* for content */
+			   10 +			/* for MAC */
+			   8 +			/* maximum pad */
+			   6));			/* for ver and seqnum */
+    if(ret != SASL_OK) return ret;
+    
+    ret = digestmd5_encode_into(context, invec, numiov, text->encode_buf,
+				text->encode_buf_len, outputlen);
+    if(ret != SASL_OK) return ret;
+    
+    *output = text->encode_buf;
+    
+    return SASL_OK;
+}
+
 static int digestmd5_decode_packet(void *context,
 					   const char *input,
 					   unsigned inputlen,
@@ -1521,11 +1555,10 @@ static int digestmd5_decode(void *context,
     context_t *text = (context_t *) context;
     int ret;
     
-    ret = _plug_decode(&text->decode_context, input, inputlen,
-		       &text->decode_buf, &text->decode_buf_len, outputlen,
-		       digestmd5_decode_packet, text);
-    
-    *output = text->decode_buf;
+    /* a packet that arrives whole is decoded straight from the input */
+    ret = _plug_decode_direct(&text->decode_context, input, inputlen,
+			      &text->decode_buf, &text->decode_buf_len,
+			      outputlen, output, digestmd5_decode_packet, text);
     
     return ret;
 }
@@ -1563,11 +1596,6 @@ static void digestmd5_common_mech_dispose(void *conn_context,
     if (text->decode_packet_buf) utils->free(text->decode_packet_buf);
     if (text->out_buf) utils->free(text->out_buf);
     
-    if (text->enc_in_buf) {
-	if (text->enc_in_buf->data) utils->free(text->enc_in_buf->data);
-	utils->free(text->enc_in_buf);
-    }
-    
     utils->free(conn_context);
 }
 
@@ -2068,7 +2096,11 @@ static int digestmd5_server_mech_step2(server_context_t *stext,
     sparams->utils->log(sparams->utils->conn, SASL_LOG_DEBUG,
 			"DIGEST-MD5 server step 2");
 
-    in = sparams->utils->malloc(clientinlen + 1);
+    in = _plug_arena_alloc(sparams->utils, clientinlen + 1);
+    if (in == NULL) {
+	MEMERROR(sparams->utils);
+	return SASL_NOMEM;
+    }
     
     memcpy(in, clientin, clientinlen);
     in[clientinlen] = 0;
@@ -2093,11 +2125,11 @@ static int digestmd5_server_mech_step2(server_context_t *stext,
 	 */
 	
 	if (strcasecmp(name, "username") == 0) {
-	    _plug_strdup(sparams->utils, value, &username, NULL);
+	    _plug_arena_strdup(sparams->utils, value, &username, NULL);
 	} else if (strcasecmp(name, "authzid") == 0) {
-	    _plug_strdup(sparams->utils, value, &authorization_id, NULL);
+	    _plug_arena_strdup(sparams->utils, value, &authorization_id, NULL);
 	} else if (strcasecmp(name, "cnonce") == 0) {
-	    _plug_strdup(sparams->utils, value, (char **) &cnonce, NULL);
+	    _plug_arena_strdup(sparams->utils, value, (char **) &cnonce, NULL);
 	} else if (strcasecmp(name, "nc") == 0) {
 	    if (htoi((unsigned char *) value, &noncecount) != SASL_OK) {
 		SETERROR(sparams->utils,
@@ -2112,11 +2144,11 @@ static int digestmd5_server_mech_step2(server_context_t *stext,
 		result = SASL_FAIL;
 		goto FreeAllMem;
 	    }
-	    _plug_strdup(sparams->utils, value, &realm, NULL);
+	    _plug_arena_strdup(sparams->utils, value, &realm, NULL);
 	} else if (strcasecmp(name, "nonce") == 0) {
-	    _plug_strdup(sparams->utils, value, (char **) &nonce, NULL);
+	    _plug_arena_strdup(sparams->utils, value, (char **) &nonce, NULL);
 	} else if (strcasecmp(name, "qop") == 0) {
-	    _plug_strdup(sparams->utils, value, &qop, NULL);
+	    _plug_arena_strdup(sparams->utils, value, &qop, NULL);
 	} else if (strcasecmp(name, "digest-uri") == 0) {
             size_t service_len;
 
@@ -2127,7 +2159,7 @@ static int digestmd5_server_mech_step2(server_context_t *stext,
 		goto FreeAllMem;
 	    }
 
-	    _plug_strdup(sparams->utils, value, &digesturi, NULL);
+	    _plug_arena_strdup(sparams->utils, value, &digesturi, NULL);
 
 	    /* Verify digest-uri format:
 	     *
@@ -2147,9 +2179,9 @@ static int digestmd5_server_mech_step2(server_context_t *stext,
             /* xxx we don't verify the hostname component */
             
 	} else if (strcasecmp(name, "response") == 0) {
-	    _plug_strdup(sparams->utils, value, &response, NULL);
+	    _plug_arena_strdup(sparams->utils, value, &response, NULL);
 	} else if (strcasecmp(name, "cipher") == 0) {
-	    _plug_strdup(sparams->utils, value, &cipher, NULL);
+	    _plug_arena_strdup(sparams->utils, value, &cipher, NULL);
 	} else if (strcasecmp(name, "maxbuf") == 0) {
 	    maxbuf_count++;
 	    if (maxbuf_count != 1) {
@@ -2182,7 +2214,7 @@ static int digestmd5_server_mech_step2(server_context_t *stext,
 		result = SASL_FAIL;
 		goto FreeAllMem;
 	    }
-	    _plug_strdup(sparams->utils, value, &charset, NULL);
+	    _plug_arena_strdup(sparams->utils, value, &charset, NULL);
 	} else {
 	    sparams->utils->log(sparams->utils->conn, SASL_LOG_DEBUG,
 				"DIGEST-MD5 unrecognized pair %s/%s: ignoring",
@@ -2253,7 +2285,7 @@ static int digestmd5_server_mech_step2(server_context_t *stext,
         /* From 2821bis:
            If the directive is missing, "realm-value" will set to
            the empty string when computing A1. */
-	_plug_strdup(sparams->utils, "", &realm, NULL);
+	_plug_arena_strdup(sparams->utils, "", &realm, NULL);
 	sparams->utils->log(sparams->utils->conn, SASL_LOG_DEBUG,
 			"The client didn't send a realm, assuming empty string.");
         if (text->realm[0] != '\0') {
@@ -2386,7 +2418,7 @@ static int digestmd5_server_mech_step2(server_context_t *stext,
 
     /* defaulting qop to "auth" if not specified */
     if (qop == NULL) {
-	_plug_strdup(sparams->utils, "auth", &qop, NULL);      
+	_plug_arena_strdup(sparams->utils, "auth", &qop, NULL);      
     }
     
     /* check which layer/cipher to use */
@@ -2426,14 +2458,17 @@ static int digestmd5_server_mech_step2(server_context_t *stext,
 	}
 	
 	oparams->encode=&digestmd5_encode;
+	oparams->encode_into=&digestmd5_encode_into;
 	oparams->decode=&digestmd5_decode;
     } else if (!strcasecmp(qop, "auth-int") &&
 	       stext->requiressf <= 1 && stext->limitssf >= 1) {
 	oparams->encode = &digestmd5_encode;
+	oparams->encode_into = &digestmd5_encode_into;
 	oparams->decode = &digestmd5_decode;
 	oparams->mech_ssf = 1;
     } else if (!strcasecmp(qop, "auth") && stext->requiressf == 0) {
 	oparams->encode = NULL;
+	oparams->encode_into = NULL;
 	oparams->decode = NULL;
 	oparams->mech_ssf = 0;
     } else {
@@ -2491,6 +2526,8 @@ static int digestmd5_server_mech_step2(server_context_t *stext,
 	/* MAC block (integrity) */
 	oparams->maxoutbuf -= 16;
     }
+    /* length, MAC, maximum pad, version and seqnum */
+    oparams->maxpacket = oparams->mech_ssf ? oparams->maxoutbuf + 28 : 0;
     
     oparams->param_version = 0;
     
@@ -2568,10 +2605,12 @@ static int digestmd5_server_mech_step2(server_context_t *stext,
 	    if (text->nonce_count == 1) {
 		/* successful initial auth, create new entry */
 		clear_reauth_entry(&text->reauth->e[val], SERVER, sparams->utils);
-		text->reauth->e[val].authid = username; username = NULL;
+		_plug_strdup(sparams->utils, username,
+			     &text->reauth->e[val].authid, NULL);
 		text->reauth->e[val].realm = text->realm; text->realm = NULL;
 		text->reauth->e[val].nonce = text->nonce; text->nonce = NULL;
-		text->reauth->e[val].cnonce = cnonce; cnonce = NULL;
+		_plug_strdup(sparams->utils, (char *) cnonce,
+			     (char **) &text->reauth->e[val].cnonce, NULL);
 	    }
 	    if (text->nonce_count <= text->reauth->e[val].nonce_count) {
 		/* paranoia.  prevent replay attacks */
@@ -2595,30 +2634,20 @@ static int digestmd5_server_mech_step2(server_context_t *stext,
     }
 
     /* free everything */
-    if (in_start) sparams->utils->free (in_start);
-    
-    if (username != NULL)
-	sparams->utils->free (username);
-    if (authorization_id != NULL)
-	sparams->utils->free (authorization_id);
-    if (realm != NULL)
-	sparams->utils->free (realm);
-    if (nonce != NULL)
-	sparams->utils->free (nonce);
-    if (cnonce != NULL)
-	sparams->utils->free (cnonce);
-    if (response != NULL)
-	sparams->utils->free (response);
-    if (cipher != NULL)
-	sparams->utils->free (cipher);
+    _plug_arena_free(sparams->utils, in_start);
+    
+    _plug_arena_free(sparams->utils, username);
+    _plug_arena_free(sparams->utils, authorization_id);
+    _plug_arena_free(sparams->utils, realm);
+    _plug_arena_free(sparams->utils, nonce);
+    _plug_arena_free(sparams->utils, cnonce);
+    _plug_arena_free(sparams->utils, response);
+    _plug_arena_free(sparams->utils, cipher);
     if (serverresponse != NULL)
 	sparams->utils->free(serverresponse);
-    if (charset != NULL)
-	sparams->utils->free (charset);
-    if (digesturi != NULL)
-	sparams->utils->free (digesturi);
-    if (qop!=NULL)
-	sparams->utils->free (qop);  
+    _plug_arena_free(sparams->utils, charset);
+    _plug_arena_free(sparams->utils, digesturi);
+    _plug_arena_free(sparams->utils, qop);
     if (sec)
 	_plug_free_secret(sparams->utils, &sec);
     
@@ -2954,6 +2983,7 @@ static int make_client_response(context_t *text,
     case DIGEST_PRIVACY:
 	qop = "auth-conf";
 	oparams->encode = &digestmd5_encode; 
+	oparams->encode_into = &digestmd5_encode_into;
 	oparams->decode = &digestmd5_decode;
 	oparams->mech_ssf = ctext->cipher->ssf;
 
@@ -2966,6 +2996,7 @@ static int make_client_response(context_t *text,
     case DIGEST_INTEGRITY:
 	qop = "auth-int";
 	oparams->encode = &digestmd5_encode;
+	oparams->encode_into = &digestmd5_encode_into;
 	oparams->decode = &digestmd5_decode;
 	oparams->mech_ssf = 1;
 	break;
@@ -2973,13 +3004,15 @@ static int make_client_response(context_t *text,
     default:
 	qop = "auth";
 	oparams->encode = NULL;
+	oparams->encode_into = NULL;
 	oparams->decode = NULL;
 	oparams->mech_ssf = 0;
     }
 
-    digesturi = params->utils->malloc(strlen(params->service) + 1 +
-				      strlen(params->serverFQDN) + 1 +
-				      1);
+    digesturi = _plug_arena_alloc(params->utils,
+				  strlen(params->service) + 1 +
+				  strlen(params->serverFQDN) + 1 +
+				  1);
     if (digesturi == NULL) {
 	result = SASL_NOMEM;
 	goto FreeAllocatedMem;
@@ -3123,6 +3156,8 @@ static int make_client_response(context_t *text,
 	/* MAC block (integrity) */
 	oparams->maxoutbuf -= 16;
     }
+    /* length, MAC, maximum pad, version and seqnum */
+    oparams->maxpacket = oparams->mech_ssf ? oparams->maxoutbuf + 28 : 0;
     
     text->seqnum = 0;	/* for integrity/privacy */
     text->rec_seqnum = 0;	/* for integrity/privacy */
@@ -3148,7 +3183,7 @@ static int make_client_response(context_t *text,
     result = SASL_OK;
 
   FreeAllocatedMem:
-    if (digesturi) params->utils->free(digesturi);
+    _plug_arena_free(params->utils, digesturi);
     if (response) params->utils->free(response);
 
     return result;
@@ -3179,7 +3214,7 @@ static int parse_server_challenge(client_context_t *ctext,
 	return SASL_FAIL;
     }
 
-    in_start = in = params->utils->malloc(serverinlen + 1);
+    in_start = in = _plug_arena_alloc(params->utils, serverinlen + 1);
     if (in == NULL) return SASL_NOMEM;
     
     memcpy(in, serverin, serverinlen);
@@ -3507,7 +3542,7 @@ SKIP_SPACES_IN_CIPHER:
     *noutrealm = nrealm;
 
   FreeAllocatedMem:
-    if (in_start) params->utils->free(in_start);
+    _plug_arena_free(params->utils, in_start);
 
     if (result != SASL_OK && realms) {
 	int lup;
@@ -3849,7 +3884,7 @@ digestmd5_client_mech_step3(client_context_t *ctext,
 		       "DIGEST-MD5 client step 3");
 
     /* Verify that server is really what he claims to be */
-    in_start = in = params->utils->malloc(serverinlen + 1);
+    in_start = in = _plug_arena_alloc(params->utils, serverinlen + 1);
     if (in == NULL) return SASL_NOMEM;
 
     memcpy(in, serverin, serverinlen);
@@ -3886,7 +3921,7 @@ digestmd5_client_mech_step3(client_context_t *ctext,
 	}
     }
     
-    params->utils->free(in_start);
+    _plug_arena_free(params->utils, in_start);
 
     if (params->utils->mutex_lock(text->reauth->mutex) == SASL_OK) { /* LOCK */
 	unsigned val = hash(params->serverFQDN) % text->reauth->size;
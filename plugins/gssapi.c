@@ -430,6 +430,109 @@ static int gssapi_integrity_encode(void *context, const struct iovec *invec,
     return sasl_gss_encode(context,invec,numiov,output,outputlen,0);
 }
 
+#ifdef HAVE_GSS_WRAP_IOV
+/* Wrap straight into the caller's buffer: gss_wrap_iov() works in
+   place over header, message, padding and trailer laid end to end,
+   which is the same token gss_wrap() would have made. */
+static int 
+sasl_gss_encode_into(void *context, const struct iovec *invec,
+		     unsigned numiov, char *output, unsigned outlen,
+		     unsigned *outputlen, int privacy)
+{
+    context_t *text = (context_t *)context;
+    OM_uint32 maj_stat, min_stat;
+    gss_iov_buffer_desc iov[4];
+    size_t inlen = 0, toklen;
+    unsigned i;
+    char *out;
+    int len;
+    
+    if(!output || !outputlen) return SASL_BADPARAM;
+    
+    if (text->state != SASL_GSSAPI_STATE_AUTHENTICATED) return SASL_NOTDONE;
+    
+    for (i = 0; i < numiov; i++) {
+	inlen += invec[i].iov_len;
+    }
+    
+    iov[0].type = GSS_IOV_BUFFER_TYPE_HEADER;
+    iov[1].type = GSS_IOV_BUFFER_TYPE_DATA;
+    iov[1].buffer.length = inlen;
+    iov[2].type = GSS_IOV_BUFFER_TYPE_PADDING;
+    iov[3].type = GSS_IOV_BUFFER_TYPE_TRAILER;
+    
+    GSS_LOCK_MUTEX(text->utils);
+    maj_stat = gss_wrap_iov_length(&min_stat, text->gss_ctx, privacy,
+				   GSS_C_QOP_DEFAULT, NULL, iov, 4);
+    GSS_UNLOCK_MUTEX(text->utils);
+    
+    if (GSS_ERROR(maj_stat)) {
+	sasl_gss_seterror(text->utils, maj_stat, min_stat);
+	return SASL_FAIL;
+    }
+    
+    toklen = iov[0].buffer.length + inlen +
+	iov[2].buffer.length + iov[3].buffer.length;
+    if (toklen + 4 > outlen) return SASL_BUFOVER;
+    
+    /* lay the token out after the length */
+    out = output + 4;
+    iov[0].buffer.value = out;
+    out += iov[0].buffer.length;
+    iov[1].buffer.value = out;
+    for (i = 0; i < numiov; i++) {
+	memcpy(out, invec[i].iov_base, invec[i].iov_len);
+	out += invec[i].iov_len;
+    }
+    iov[2].buffer.value = out;
+    out += iov[2].buffer.length;
+    iov[3].buffer.value = out;
+    
+    GSS_LOCK_MUTEX(text->utils);
+    maj_stat = gss_wrap_iov(&min_stat, text->gss_ctx, privacy,
+			    GSS_C_QOP_DEFAULT, NULL, iov, 4);
+    GSS_UNLOCK_MUTEX(text->utils);
+    
+    if (GSS_ERROR(maj_stat)) {
+	sasl_gss_seterror(text->utils, maj_stat, min_stat);
+	return SASL_FAIL;
+    }
+    
+    /* the padding may have come out shorter than was allowed for:
+       close the gap before the trailer */
+    out = (char *) iov[2].buffer.value + iov[2].buffer.length;
+    if (iov[3].buffer.length && out != iov[3].buffer.value) {
+	memmove(out, iov[3].buffer.value, iov[3].buffer.length);
+    }
+    toklen = iov[0].buffer.length + inlen +
+	iov[2].buffer.length + iov[3].buffer.length;
+    
+    len = htonl(toklen);
+    memcpy(output, &len, 4);
+    *outputlen = toklen + 4;
+    
+    return SASL_OK;
+}
+
+static int gssapi_privacy_encode_into(void *context,
+				      const struct iovec *invec,
+				      unsigned numiov, char *output,
+				      unsigned outlen, unsigned *outputlen)
+{
+    return sasl_gss_encode_into(context,invec,numiov,output,outlen,
+				outputlen,1);
+}
+
+static int gssapi_integrity_encode_into(void *context,
+					const struct iovec *invec,
+					unsigned numiov, char *output,
+					unsigned outlen, unsigned *outputlen)
+{
+    return sasl_gss_encode_into(context,invec,numiov,output,outlen,
+				outputlen,0);
+}
+#endif /* HAVE_GSS_WRAP_IOV */
+
 static int gssapi_decode_packet(void *context,
 				const char *input, unsigned inputlen,
 				char **output, unsigned *outputlen)
@@ -480,7 +583,7 @@ static int gssapi_decode_packet(void *context,
 	if (output) {
 	    result = _plug_buf_alloc(text->utils, &text->decode_once_buf,
 				     &text->decode_once_buf_len,
-				     *outputlen);
+				     *outputlen + 1); /* +1 for NUL */
 	    if(result != SASL_OK) {
 		GSS_LOCK_MUTEX(text->utils);
 		gss_release_buffer(&min_stat, output_token);
@@ -505,11 +608,10 @@ static int gssapi_decode(void *context,
     context_t *text = (context_t *) context;
     int ret;
     
-    ret = _plug_decode(&text->decode_context, input, inputlen,
-		       &text->decode_buf, &text->decode_buf_len, outputlen,
-		       gssapi_decode_packet, text);
-    
-    *output = text->decode_buf;
+    /* a packet that arrives whole is decoded straight from the input */
+    ret = _plug_decode_direct(&text->decode_context, input, inputlen,
+			      &text->decode_buf, &text->decode_buf_len,
+			      outputlen, output, gssapi_decode_packet, text);
     
     return ret;
 }
@@ -1108,16 +1210,23 @@ select_layers:
 
 	if (layerchoice == 1 && text->requiressf == 0) { /* no encryption */
 	    oparams->encode = NULL;
+	    oparams->encode_into = NULL;
 	    oparams->decode = NULL;
 	    oparams->mech_ssf = 0;
 	} else if (layerchoice == 2 && text->requiressf <= 1 &&
 		   text->limitssf >= 1) { /* integrity */
 	    oparams->encode=&gssapi_integrity_encode;
+#ifdef HAVE_GSS_WRAP_IOV
+	    oparams->encode_into = &gssapi_integrity_encode_into;
+#endif
 	    oparams->decode=&gssapi_decode;
 	    oparams->mech_ssf=1;
 	} else if (layerchoice == 4 && text->requiressf <= K5_MAX_SSF &&
 		   text->limitssf >= K5_MAX_SSF) { /* privacy */
 	    oparams->encode = &gssapi_privacy_encode;
+#ifdef HAVE_GSS_WRAP_IOV
+	    oparams->encode_into = &gssapi_privacy_encode_into;
+#endif
 	    oparams->decode = &gssapi_decode;
 	    /* FIX ME: Need to extract the proper value here */
 	    oparams->mech_ssf = K5_MAX_SSF;
@@ -1203,6 +1312,8 @@ select_layers:
         }
 
 	if (oparams->mech_ssf) {
+	    /* length and a token of at most the peer's maxbuf */
+	    oparams->maxpacket = oparams->maxoutbuf + 4;
  	    maj_stat = gss_wrap_size_limit( &min_stat,
 					    text->gss_ctx,
 					    1,
@@ -1697,6 +1808,9 @@ select_layers:
 	if (allowed >= K5_MAX_SSF && need <= K5_MAX_SSF && (serverhas & 4)) {
 	    /* encryption */
 	    oparams->encode = &gssapi_privacy_encode;
+#ifdef HAVE_GSS_WRAP_IOV
+	    oparams->encode_into = &gssapi_privacy_encode_into;
+#endif
 	    oparams->decode = &gssapi_decode;
 	    /* FIX ME: Need to extract the proper value here */
 	    oparams->mech_ssf = K5_MAX_SSF;
@@ -1704,12 +1818,16 @@ select_layers:
 	} else if (allowed >= 1 && need <= 1 && (serverhas & 2)) {
 	    /* integrity */
 	    oparams->encode = &gssapi_integrity_encode;
+#ifdef HAVE_GSS_WRAP_IOV
+	    oparams->encode_into = &gssapi_integrity_encode_into;
+#endif
 	    oparams->decode = &gssapi_decode;
 	    oparams->mech_ssf = 1;
 	    mychoice = 2;
 	} else if (need <= 0 && (serverhas & 1)) {
 	    /* no layer */
 	    oparams->encode = NULL;
+	    oparams->encode_into = NULL;
 	    oparams->decode = NULL;
 	    oparams->mech_ssf = 0;
 	    mychoice = 1;
@@ -1729,6 +1847,8 @@ select_layers:
         }
 
 	if(oparams->mech_ssf) {
+	    /* length and a token of at most the peer's maxbuf */
+	    oparams->maxpacket = oparams->maxoutbuf + 4;
             maj_stat = gss_wrap_size_limit( &min_stat,
                                             text->gss_ctx,
                                             1,
@@ -286,6 +286,51 @@ void _plug_free_string(const sasl_utils_t *utils, char **str)
   *str=NULL;
 }
 
+/* Allocate memory that lives until the connection is disposed of.
+ * Falls back to utils->malloc when the library has no arena for us,
+ * so it must always be released with _plug_arena_free().
+ */
+void *_plug_arena_alloc(const sasl_utils_t *utils, size_t len)
+{
+    if (utils->arena_alloc && utils->conn)
+	return utils->arena_alloc(utils->conn, len);
+
+    return utils->malloc(len);
+}
+
+int _plug_arena_strdup(const sasl_utils_t * utils, const char *in,
+		       char **out, int *outlen)
+{
+    size_t len;
+
+    if(!utils || !in || !out) {
+	if(utils) PARAMERROR(utils);
+	return SASL_BADPARAM;
+    }
+
+    len = strlen(in);
+
+    *out = _plug_arena_alloc(utils, len + 1);
+    if (!*out) {
+	MEMERROR(utils);
+	return SASL_NOMEM;
+    }
+
+    memcpy(*out, in, len + 1);
+
+    if (outlen)
+	*outlen = len;
+
+    return SASL_OK;
+}
+
+void _plug_arena_free(const sasl_utils_t *utils, void *ptr)
+{
+    if (!ptr || (utils->arena_alloc && utils->conn)) return;
+
+    utils->free(ptr);
+}
+
 void _plug_free_secret(const sasl_utils_t *utils, sasl_secret_t **secret) 
 {
     if(!utils || !secret || !(*secret)) return;
@@ -618,24 +663,34 @@ void _plug_decode_init(decode_context_t *text,
 /*
  * Decode as much of the input as possible (possibly none),
  * using decode_pkt() to decode individual packets.
+ *
+ * If result is not NULL a packet that is whole in the input is decoded
+ * from there, and only a packet split across calls is gathered in
+ * text->buffer.  If the input is exactly one whole packet, *result is
+ * then left pointing at the packet as decode_pkt() decoded it, and
+ * nothing is appended to the output buffer.  Otherwise *result is
+ * *output.
  */
-int _plug_decode(decode_context_t *text,
-		 const char *input, unsigned inputlen,
-		 char **output,		/* output buffer */
-		 unsigned *outputsize,	/* current size of output buffer */
-		 unsigned *outputlen,	/* length of data in output buffer */
-		 int (*decode_pkt)(void *rock,
-				   const char *input, unsigned inputlen,
-				   char **output, unsigned *outputlen),
-		 void *rock)
+static int _plug_decode_common(decode_context_t *text,
+			       const char *input, unsigned inputlen,
+			       char **output,	/* output buffer */
+			       unsigned *outputsize, /* current size of output buffer */
+			       unsigned *outputlen, /* length of data in output buffer */
+			       const char **result,
+			       int (*decode_pkt)(void *rock,
+						 const char *input, unsigned inputlen,
+						 char **output, unsigned *outputlen),
+			       void *rock)
 {
     unsigned int tocopy;
     unsigned diff;
+    const char *packet;
     char *tmp;
     unsigned tmplen;
     int ret;
     
     *outputlen = 0;
+    if (result) *result = *output;
 
     while (inputlen) { /* more input */
 	if (text->needsize) { /* need to get the rest of the 4-byte size */
@@ -662,10 +717,6 @@ int _plug_decode(decode_context_t *text,
 		    return SASL_FAIL;
 		}
 	    
-		if (!text->buffer)
-		    text->buffer = text->utils->malloc(text->in_maxbuf);
-		if (text->buffer == NULL) return SASL_NOMEM;
-
 		text->cursize = 0;
 	    } else {
 		/* We do NOT have the entire 4-byte size...
@@ -676,21 +727,42 @@ int _plug_decode(decode_context_t *text,
 
 	diff = text->size - text->cursize; /* bytes needed for full packet */
 
-	if (inputlen < diff) {	/* not a complete packet, need more input */
-	    memcpy(text->buffer + text->cursize, input, inputlen);
-	    text->cursize += inputlen;
-	    return SASL_OK;
-	}
+	if (result && text->cursize == 0 && inputlen >= diff) {
+	    /* the whole packet is in the input: decode it from there */
+	    packet = input;
+	} else {
+	    if (!text->buffer)
+		text->buffer = text->utils->malloc(text->in_maxbuf);
+	    if (text->buffer == NULL) return SASL_NOMEM;
 
-	/* copy the rest of the packet */
-	memcpy(text->buffer + text->cursize, input, diff);
+	    if (inputlen < diff) { /* not a complete packet, need more input */
+		memcpy(text->buffer + text->cursize, input, inputlen);
+		text->cursize += inputlen;
+		return SASL_OK;
+	    }
+
+	    /* copy the rest of the packet */
+	    memcpy(text->buffer + text->cursize, input, diff);
+	    packet = text->buffer;
+	}
 	input += diff;
 	inputlen -= diff;
 
 	/* decode the packet (no need to free tmp) */
-	ret = decode_pkt(rock, text->buffer, text->size, &tmp, &tmplen);
+	ret = decode_pkt(rock, packet, text->size, &tmp, &tmplen);
 	if (ret != SASL_OK) return ret;
 
+	/* reset for the next packet */
+	text->needsize = 4;
+
+	if (result && *outputlen == 0 && inputlen == 0) {
+	    /* the only packet: hand it back where it is */
+	    tmp[tmplen] = '\0';
+	    *result = tmp;
+	    *outputlen = tmplen;
+	    break;
+	}
+
 	/* append the decoded packet to the output */
 	ret = _plug_buf_alloc(text->utils, output, outputsize,
 			      *outputlen + tmplen + 1); /* +1 for NUL */
@@ -701,14 +773,49 @@ int _plug_decode(decode_context_t *text,
 
 	/* protect stupid clients */
 	*(*output + *outputlen) = '\0';
-
-	/* reset for the next packet */
-	text->needsize = 4;
+	if (result) *result = *output;
     }
 
     return SASL_OK;    
 }
 
+int _plug_decode(decode_context_t *text,
+		 const char *input, unsigned inputlen,
+		 char **output,		/* output buffer */
+		 unsigned *outputsize,	/* current size of output buffer */
+		 unsigned *outputlen,	/* length of data in output buffer */
+		 int (*decode_pkt)(void *rock,
+				   const char *input, unsigned inputlen,
+				   char **output, unsigned *outputlen),
+		 void *rock)
+{
+    return _plug_decode_common(text, input, inputlen,
+			       output, outputsize, outputlen, NULL,
+			       decode_pkt, rock);
+}
+
+/*
+ * As _plug_decode(), but the decoded data is at *result, which may be
+ * the packet as decode_pkt() left it.  decode_pkt() is handed the
+ * caller's input, which it must not write to, and must leave a byte
+ * free after its output for the NUL.
+ */
+int _plug_decode_direct(decode_context_t *text,
+			const char *input, unsigned inputlen,
+			char **output,		/* output buffer */
+			unsigned *outputsize,	/* current size of output buffer */
+			unsigned *outputlen,	/* length of decoded data */
+			const char **result,	/* the decoded data */
+			int (*decode_pkt)(void *rock,
+					  const char *input, unsigned inputlen,
+					  char **output, unsigned *outputlen),
+			void *rock)
+{
+    return _plug_decode_common(text, input, inputlen,
+			       output, outputsize, outputlen, result,
+			       decode_pkt, rock);
+}
+
 void _plug_decode_free(decode_context_t *text)
 {
     if (text->buffer) text->utils->free(text->buffer);
@@ -148,6 +148,10 @@ int _plug_strdup(const sasl_utils_t * utils, const char *in,
 	         char **out, int *outlen);
 void _plug_free_string(const sasl_utils_t *utils, char **str);
 void _plug_free_secret(const sasl_utils_t *utils, sasl_secret_t **secret);
+void *_plug_arena_alloc(const sasl_utils_t *utils, size_t len);
+int _plug_arena_strdup(const sasl_utils_t * utils, const char *in,
+		       char **out, int *outlen);
+void _plug_arena_free(const sasl_utils_t *utils, void *ptr);
 
 #define _plug_get_userid(utils, result, prompt_need) \
 	_plug_get_simple(utils, SASL_CB_USER, 0, result, prompt_need)
@@ -197,6 +201,15 @@ int _plug_decode(decode_context_t *text,
 				   char **output, unsigned *outputlen),
 		 void *rock);
 
+int _plug_decode_direct(decode_context_t *text,
+			const char *input, unsigned inputlen,
+			char **output, unsigned *outputsize,
+			unsigned *outputlen, const char **result,
+			int (*decode_pkt)(void *rock,
+					  const char *input, unsigned inputlen,
+					  char **output, unsigned *outputlen),
+			void *rock);
+
 void _plug_decode_free(decode_context_t *text);
 
 int _plug_parseuser(const sasl_utils_t *utils,
@@ -688,13 +688,16 @@ static int MakeBuffer(const sasl_utils_t *utils, char **buf, unsigned *buflen,
  * Extract an SRP buffer into the data specified by the fmt string.
  *
  * A '-' flag means don't allocate memory for the data ('o' only).
+ * A '+' flag means allocate it from the connection's arena ('o' and 's'),
+ * for data that is only needed by the current step; release it with
+ * _plug_arena_free().
  */
 static int UnBuffer(const sasl_utils_t *utils, const char *buf,
 		    unsigned buflen, const char *fmt, ...)
 {
     va_list ap;
     char *p;
-    int r = SASL_OK, noalloc;
+    int r = SASL_OK, noalloc, arena;
     BIGNUM *mpi;
     char **os, **str;
     uint32 *u;
@@ -735,6 +738,9 @@ static int UnBuffer(const sasl_utils_t *utils, const char *buf,
 	/* check for noalloc flag */
 	if ((noalloc = (*++p == '-'))) ++p;
 
+	/* check for arena flag */
+	if ((arena = (*p == '+'))) ++p;
+
 	switch (*p) {
 	case 'm':
 	    /* MPI */
@@ -788,7 +794,8 @@ static int UnBuffer(const sasl_utils_t *utils, const char *buf,
 	    if (noalloc)
 		*os = (char *) buf;
 	    else {
-		*os = (char *) utils->malloc(len);
+		*os = arena ? (char *) _plug_arena_alloc(utils, len) :
+		    (char *) utils->malloc(len);
 		if (!*os) {
 		    r = SASL_NOMEM;
 		    goto done;
@@ -820,7 +827,8 @@ static int UnBuffer(const sasl_utils_t *utils, const char *buf,
 	    }
 	    
 	    str = va_arg(ap, char **);
-	    *str = (char *) utils->malloc(len+1); /* +1 for NUL */
+	    *str = arena ? (char *) _plug_arena_alloc(utils, len+1) :
+		(char *) utils->malloc(len+1); /* +1 for NUL */
 	    if (!*str) {
 		r = SASL_NOMEM;
 		goto done;
@@ -1825,7 +1833,7 @@ static int srp_server_mech_step1(context_t *text,
      *
      */
     result = UnBuffer(params->utils, clientin, clientinlen,
-		      "%s%s%s%o", &text->authid, &text->userid, &sid,
+		      "%s%s%+s%+o", &text->authid, &text->userid, &sid,
 		      &cnlen, &cn);
     if (result) {
 	params->utils->seterror(params->utils->conn, 0, 
@@ -1979,8 +1987,8 @@ static int srp_server_mech_step1(context_t *text,
     result = SASL_CONTINUE;
     
   cleanup:
-    if (sid) params->utils->free(sid);
-    if (cn) params->utils->free(cn);
+    _plug_arena_free(params->utils, sid);
+    _plug_arena_free(params->utils, cn);
     if (user) params->utils->free(user);
     if (realm) params->utils->free(realm);
     
@@ -2998,7 +3006,7 @@ srp_client_mech_step3(context_t *text,
      *   { os(M2) os(sIV) utf8(sid) uint(ttl) }
      */
     result = UnBuffer(params->utils, serverin, serverinlen,
-		      "%-o%-o%s%u", &M2len, &M2, &sIVlen, &sIV,
+		      "%-o%-o%+s%u", &M2len, &M2, &sIVlen, &sIV,
 		      &sid, &ttl);
     if (result) {
 	params->utils->seterror(params->utils->conn, 0, 
@@ -3054,7 +3062,7 @@ srp_client_mech_step3(context_t *text,
     result = SASL_OK;
     
   cleanup:
-    if (sid) params->utils->free(sid);
+    _plug_arena_free(params->utils, sid);
     
     return result;
 }
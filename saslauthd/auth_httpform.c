@@ -58,6 +58,8 @@
 #endif
 
 /* PUBLIC DEPENDENCIES */
+#include "mechanisms.h"
+
 #include <unistd.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -70,21 +72,83 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
-#include <signal.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/time.h>
+#ifdef HAVE_PTHREAD_RWLOCK
+# include <pthread.h>
+#endif
 
-#include "mechanisms.h"
 #include "utils.h"
 #include "cfile.h"
 #include "globals.h"
+#include "stats.h"
 #include "auth_httpform.h"
+#include "connpool.h"
 /* END PUBLIC DEPENDENCIES */
 
 #ifndef MAX
 #define MAX(p,q) ((p >= q) ? p : q)
 #endif
 
+#define NETWORK_IO_TIMEOUT 30		/* network I/O timeout (seconds) */
+#define RESP_LEN 1000			/* size of read response buffer  */
+#define HTTP_POOL_MAX 64		/* httpform_pool_size limit */
+#define HTTP_PIPELINE_MAX 32		/* httpform_pipeline limit */
+#define HTTP_TRIES 3			/* connections a check may take */
+
+/*
+ * Connection pool.
+ *
+ * With httpform_pool_size set in saslauthd.conf, each saslauthd
+ * process keeps up to that many HTTP/1.1 connections to the server
+ * open between requests, so a check costs one round trip rather than
+ * a connect and a round trip.  Up to httpform_pipeline POSTs from
+ * different threads (-j) can be on a connection at once; responses
+ * come back in the order of the requests, and the thread that reads
+ * one hands it to the one waiting for it.  Each response is read to
+ * the end of its body (Content-Length or chunked) for the next one
+ * to follow.
+ *
+ * A response that closes the connection (Connection: close, HTTP/1.0
+ * without keep-alive, a body up to EOF) retires it, and the POSTs
+ * sent behind it are sent again elsewhere.  Connections idle for
+ * longer than httpform_pool_idle seconds are made anew, before the
+ * server's keep-alive timeout drops them.
+ *
+ * Without a pool, each check makes its own connection and sends
+ * "Connection: close".
+ */
+#define HTTP_CLOSED	POOL_CLOSED
+#define HTTP_READY	POOL_READY	/* connected, takes requests */
+#define HTTP_DONE	POOL_DONE	/* closing or broken, takes none */
+
+#define HTTP_ANSWERED	1		/* the response is in */
+#define HTTP_BROKEN	(-1)		/* the connection failed under it */
+#define HTTP_RESEND	(-2)		/* sent behind a closing response, or
+					   on a kept connection the server
+					   has since dropped */
+
+/* a POST sent, and its status line once it's in */
+typedef struct http_wait {
+    int done;				/* HTTP_ANSWERED, _BROKEN, _RESEND */
+    char status[RESP_LEN];		/* the status line */
+    struct http_wait *next;
+} http_wait;
+
+typedef struct {
+    pool_conn pc;			/* state (HTTP_*), POSTs in flight */
+    int fd;				/* -1 when closed */
+    int answered;			/* responses read on it */
+    http_wait *waiting;			/* POSTs without a response */
+    int len;				/* bytes read ahead in buf */
+    char buf[RESP_LEN];
+} http_conn;
+
 /* PRIVATE DEPENDENCIES */
 static cfile config = NULL;
 static const char *r_host = "localhost";  /* remote host (mech_option) */
@@ -92,11 +156,26 @@ static const char *r_port = "80";       /* remote port (mech_option) */
 static const char *r_uri = NULL;        /* URI to call (mech_option) */
 static const char *formdata = NULL;     /* HTML form data (mech_option) */
 static struct addrinfo *ai = NULL;      /* remote host, as looked up    */
+static int pool_size = 0;               /* httpform_pool_size, 0: none  */
+static int pipeline = 1;                /* httpform_pipeline            */
+static int pool_idle = 4;               /* httpform_pool_idle (seconds) */
+static http_conn *pool = NULL;
+#ifdef HAVE_PTHREAD_RWLOCK
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+# define POOL_LOCK()		pthread_mutex_lock(&pool_lock)
+# define POOL_UNLOCK()		pthread_mutex_unlock(&pool_lock)
+# define POOL_WAIT()		pthread_cond_wait(&pool_cond, &pool_lock)
+# define POOL_BROADCAST()	pthread_cond_broadcast(&pool_cond)
+#else
+/* a single thread never has to wait for a connection */
+# define POOL_LOCK()
+# define POOL_UNLOCK()
+# define POOL_WAIT()
+# define POOL_BROADCAST()
+#endif
 /* END PRIVATE DEPENDENCIES */
 
-#define NETWORK_IO_TIMEOUT 30		/* network I/O timeout (seconds) */
-#define RESP_LEN 1000			/* size of read response buffer  */
-
 #define TWO_CRLF "\r\n\r\n"
 #define CRLF "\r\n"
 #define SPACE " "
@@ -109,47 +188,7 @@ static struct addrinfo *ai = NULL;      /* remote host, as looked up    */
 #define RESP_IERROR	"NO [ALERT] saslauthd internal error"
 #define RESP_UNAVAILABLE "NO [ALERT] The remote authentication server is currently unavailable"
 #define RESP_UNEXPECTED	"NO [ALERT] Unexpected response from remote authentication server"
-
-/* FUNCTION: sig_null */
 
-/* SYNOPSIS
- * Catch and ignore a signal.
- * END SYNOPSIS */
-
-static RETSIGTYPE				/* R: OS dependent */
-sig_null (
-  /* PARAMETERS */
-  int sig					/* I: signal being caught */
-  /* END PARAMETERS */
-  )
-{
-    switch (sig) {
-	
-      case SIGALRM:
-	signal(SIGALRM, sig_null);
-	break;
-
-      case SIGPIPE:
-	signal(SIGPIPE, sig_null);
-	break;
-
-      default:
-	logger(L_INFO, "auth_httpform", "unexpected signal %d", sig);
-	break;
-    }
-#ifdef __APPLE__
-    return;
-#else /* __APPLE__ */
-# if RETSIGTYPE == void
-    return;
-# else /* RETSIGTYPE */
-    return 0;
-# endif /* RETSIGTYPE */
-#endif /* __APPLE__ */
-}
-
-/* END FUNCTION: sig_null */
-
 /* FUNCTION: url_escape */
 
 /* SYNOPSIS
@@ -324,7 +363,7 @@ static char *create_post_data(
  * END SYNOPSIS */
 static char *build_sasl_response(
   /* PARAMETERS */
-  const char *http_response
+  char *http_response
   /* END PARAMETERS */
   )
 {
@@ -343,9 +382,18 @@ static char *build_sasl_response(
     }
 
     /* isolate the HTTP response code and string */
-    http_response_code = strpbrk(http_response, SPACE) + 1;
-    http_response_string = strpbrk(http_response_code, SPACE) + 1;
-    *(http_response_string-1) = '\0';  /* replace space after code with 0 */
+    http_response_code = strpbrk(http_response, SPACE);
+    if (http_response_code == NULL) {
+        logger(L_INFO, "auth_httpform", "malformed response to auth request: %s",
+               http_response);
+        return strdup(RESP_UNEXPECTED);
+    }
+    http_response_code++;
+    http_response_string = strpbrk(http_response_code, SPACE);
+    if (http_response_string != NULL)
+        *http_response_string++ = '\0';  /* replace space after code with 0 */
+    else
+        http_response_string = http_response_code + strlen(http_response_code);
 
     if (!strcmp(http_response_code, HTTP_STATUS_SUCCESS)) {
         return strdup("OK remote authentication successful");
@@ -384,6 +432,7 @@ auth_httpform_init (
 {
     /* VARIABLES */
     int rc;
+    int i;
     char *configname = NULL;
     struct addrinfo hints;
     /* END VARIABLES */
@@ -409,6 +458,9 @@ auth_httpform_init (
         r_port = cfile_getstring(config, "httpform_port", r_port);
         r_uri = cfile_getstring(config, "httpform_uri", r_uri);
         formdata = cfile_getstring(config, "httpform_data", formdata);
+        pool_size = cfile_getint(config, "httpform_pool_size", pool_size);
+        pipeline = cfile_getint(config, "httpform_pipeline", pipeline);
+        pool_idle = cfile_getint(config, "httpform_pool_idle", pool_idle);
     }
     
     if (formdata == NULL || r_uri == NULL) {
@@ -416,6 +468,15 @@ auth_httpform_init (
         return -1;
     }
 
+    if (pool_size < 0)
+        pool_size = 0;
+    if (pool_size > HTTP_POOL_MAX)
+        pool_size = HTTP_POOL_MAX;
+    if (pipeline < 1)
+        pipeline = 1;
+    if (pipeline > HTTP_PIPELINE_MAX)
+        pipeline = HTTP_PIPELINE_MAX;
+
     /* lookup the host/port - taken from auth_rimap */
     if (ai)
         freeaddrinfo(ai);
@@ -438,11 +499,572 @@ auth_httpform_init (
         return -1;
     }
 
+    /* the connections are made by the workers, after the fork */
+    if (pool_size && !pool) {
+        if (!(pool = calloc(pool_size, sizeof(http_conn)))) {
+            syslog(LOG_ERR, "auth_httpform_init: out of memory");
+            return -1;
+        }
+        for (i = 0; i < pool_size; i++)
+            pool[i].fd = -1;
+    }
+
     return 0;
 }
 
 /* END FUNCTION: auth_httpform_init */
-
+
+/* FUNCTION: http_connect */
+
+/* SYNOPSIS
+ * Connect c to the remote server, trying its addresses in turn.
+ * END SYNOPSIS */
+
+static int                              /* R: 0, or -1 if none answered */
+http_connect (
+  /* PARAMETERS */
+  http_conn *c                          /* I/O: closed connection */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    struct addrinfo *r;                 /* remote socket address info   */
+    struct pollfd pfd;
+    socklen_t errlen;
+    char hbuf[NI_MAXHOST], pbuf[NI_MAXSERV];
+    int saved_errno;
+    int niflags;
+    int on = 1;
+    int rc;
+    /* END VARIABLES */
+
+    for (r = ai; r; r = r->ai_next) {
+        c->fd = socket(r->ai_family, r->ai_socktype, r->ai_protocol);
+        if (c->fd < 0)
+            continue;
+        /* pipelined requests mustn't wait for the ACKs of the ones before */
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        /* connect() with the I/O timeout */
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK);
+        rc = connect(c->fd, r->ai_addr, r->ai_addrlen);
+        if (rc < 0 && errno == EINPROGRESS) {
+            pfd.fd = c->fd;
+            pfd.events = POLLOUT;
+            do {
+                rc = poll(&pfd, 1, NETWORK_IO_TIMEOUT * 1000);
+            } while (rc < 0 && errno == EINTR);
+            errlen = sizeof(saved_errno);
+            if (rc == 0)
+                errno = ETIMEDOUT;
+            else if (rc > 0 &&
+                     getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &saved_errno, &errlen) == 0)
+                errno = saved_errno;
+            rc = (rc > 0 && errno == 0) ? 0 : -1;
+        }
+        if (rc >= 0) {
+            fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) & ~O_NONBLOCK);
+            c->pc.state = HTTP_READY;
+            c->len = 0;
+            c->answered = 0;
+            c->pc.last_used = time(NULL);
+            return 0;
+        }
+
+        saved_errno = errno;
+        close(c->fd);
+        c->fd = -1;
+        niflags = (NI_NUMERICHOST | NI_NUMERICSERV);
+#ifdef NI_WITHSCOPEID
+        if (r->ai_family == AF_INET6)
+            niflags |= NI_WITHSCOPEID;
+#endif
+        if (getnameinfo(r->ai_addr, r->ai_addrlen, hbuf, sizeof(hbuf),
+                        pbuf, sizeof(pbuf), niflags) != 0) {
+            strlcpy(hbuf, "unknown", sizeof(hbuf));
+            strlcpy(pbuf, "unknown", sizeof(pbuf));
+        }
+        errno = saved_errno;
+        syslog(LOG_WARNING, "auth_httpform: connect %s[%s]/%s: %m",
+               ai->ai_canonname ? ai->ai_canonname : r_host, hbuf, pbuf);
+    }
+
+    if (getnameinfo(ai->ai_addr, ai->ai_addrlen, NULL, 0,
+                    pbuf, sizeof(pbuf), NI_NUMERICSERV) != 0)
+        strlcpy(pbuf, "unknown", sizeof(pbuf));
+    syslog(LOG_WARNING, "auth_httpform: couldn't connect to %s/%s",
+           ai->ai_canonname ? ai->ai_canonname : r_host, pbuf);
+
+    c->pc.state = HTTP_CLOSED;
+    return -1;
+}
+
+/* END FUNCTION: http_connect */
+
+/* FUNCTION: http_close */
+
+static void
+http_close (
+  /* PARAMETERS */
+  http_conn *c                          /* I/O: connection */
+  /* END PARAMETERS */
+  )
+{
+    if (c->fd >= 0)
+        (void) close(c->fd);
+    c->fd = -1;
+    c->pc.state = HTTP_CLOSED;
+    c->len = 0;
+}
+
+/* END FUNCTION: http_close */
+
+/* FUNCTION: http_fill */
+
+/* SYNOPSIS
+ * Read more of the response into c's buffer.
+ * END SYNOPSIS */
+
+static int                              /* R: bytes read, 0 at EOF, -1 */
+http_fill (
+  /* PARAMETERS */
+  http_conn *c                          /* I/O: connection */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    struct pollfd pfd;
+    int rc;
+    /* END VARIABLES */
+
+    for (;;) {
+        pfd.fd = c->fd;
+        pfd.events = POLLIN;
+        rc = poll(&pfd, 1, NETWORK_IO_TIMEOUT * 1000);
+        if (rc == 0) {
+            syslog(LOG_WARNING, "auth_httpform: read (response): timed out");
+            return -1;
+        }
+        if (rc > 0)
+            rc = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc < 0) {
+            syslog(LOG_WARNING, "auth_httpform: read (response): %m");
+            return -1;
+        }
+        c->len += rc;
+        return rc;
+    }
+}
+
+/* END FUNCTION: http_fill */
+
+/* FUNCTION: http_getline */
+
+/* SYNOPSIS
+ * The next line of the response, without its CRLF. Lines longer
+ * than len are cut short.
+ * END SYNOPSIS */
+
+static int                              /* R: 0, or -1 on error or EOF */
+http_getline (
+  /* PARAMETERS */
+  http_conn *c,                         /* I/O: connection */
+  char *line,                           /* O: the line */
+  int len                               /* I: size of line */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    char *nl;
+    int n;
+    /* END VARIABLES */
+
+    while (!(nl = memchr(c->buf, '\n', c->len))) {
+        if (c->len == sizeof(c->buf))
+            c->len = 0;                 /* overlong line, drop its start */
+        if (http_fill(c) <= 0)
+            return -1;
+    }
+
+    n = nl - c->buf;
+    if (n > 0 && c->buf[n - 1] == '\r')
+        n--;
+    if (n >= len)
+        n = len - 1;
+    memcpy(line, c->buf, n);
+    line[n] = '\0';
+
+    c->len -= nl + 1 - c->buf;
+    memmove(c->buf, nl + 1, c->len);
+
+    return 0;
+}
+
+/* END FUNCTION: http_getline */
+
+/* FUNCTION: http_skip */
+
+/* SYNOPSIS
+ * Read past n bytes of the response body.
+ * END SYNOPSIS */
+
+static int                              /* R: 0, or -1 on error or EOF */
+http_skip (
+  /* PARAMETERS */
+  http_conn *c,                         /* I/O: connection */
+  unsigned long n                       /* I: bytes to skip */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    unsigned long k;
+    /* END VARIABLES */
+
+    for (;;) {
+        k = (unsigned long)c->len < n ? (unsigned long)c->len : n;
+        c->len -= k;
+        memmove(c->buf, c->buf + k, c->len);
+        n -= k;
+        if (n == 0)
+            return 0;
+        if (http_fill(c) <= 0)
+            return -1;
+    }
+}
+
+/* END FUNCTION: http_skip */
+
+/* FUNCTION: http_token */
+
+/* SYNOPSIS
+ * Whether the comma separated header value v lists token.
+ * END SYNOPSIS */
+
+static int
+http_token (
+  /* PARAMETERS */
+  const char *v,                        /* I: header value */
+  const char *token                     /* I: token, e.g. "close" */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    size_t len = strlen(token);
+    /* END VARIABLES */
+
+    for (;;) {
+        while (*v == ' ' || *v == '\t' || *v == ',')
+            v++;
+        if (!*v)
+            return 0;
+        if (!strncasecmp(v, token, len) &&
+            (v[len] == '\0' || v[len] == ',' || v[len] == ' ' ||
+             v[len] == '\t' || v[len] == ';'))
+            return 1;
+        while (*v && *v != ',')
+            v++;
+    }
+}
+
+/* END FUNCTION: http_token */
+
+/* FUNCTION: http_response */
+
+/* SYNOPSIS
+ * Read a whole response from c, body included, so the next one
+ * can follow: its status line, and whether the connection can be
+ * used again.
+ * END SYNOPSIS */
+
+static int                              /* R: 0, or -1 on error */
+http_response (
+  /* PARAMETERS */
+  http_conn *c,                         /* I/O: connection */
+  char *status,                         /* O: the status line */
+  int len,                              /* I: size of status */
+  int *keep                             /* O: the connection stays open */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    char line[RESP_LEN];
+    char *v;
+    long length;                        /* Content-Length, or -1 */
+    unsigned long chunk;
+    int chunked;
+    int code;
+    /* END VARIABLES */
+
+    do {
+        if (http_getline(c, status, len) != 0)
+            return -1;
+        if (strncmp(status, "HTTP/1.", 7) || !(v = strchr(status, ' '))) {
+            syslog(LOG_WARNING, "auth_httpform: not an HTTP response: %s", status);
+            return -1;
+        }
+        code = atoi(v + 1);
+
+        /* HTTP/1.1 keeps the connection open unless told otherwise */
+        *keep = (status[7] == '1');
+        length = -1;
+        chunked = 0;
+
+        for (;;) {
+            if (http_getline(c, line, sizeof(line)) != 0)
+                return -1;              /* the headers were cut off */
+            if (!line[0])
+                break;
+            if (!(v = strchr(line, ':')))
+                continue;
+            for (*v++ = '\0'; *v == ' ' || *v == '\t'; v++)
+                ;
+            if (!strcasecmp(line, "Content-Length"))
+                length = strtol(v, NULL, 10);
+            else if (!strcasecmp(line, "Transfer-Encoding"))
+                chunked = http_token(v, "chunked");
+            else if (!strcasecmp(line, "Connection") && http_token(v, "close"))
+                *keep = 0;
+            else if (!strcasecmp(line, "Connection") && http_token(v, "keep-alive"))
+                *keep = 1;
+        }
+    } while (code >= 100 && code < 200);        /* 100 Continue and such */
+
+    /* now past the body */
+    if (code == 204 || code == 304) {
+        return 0;
+    } else if (chunked) {
+        for (;;) {
+            if (http_getline(c, line, sizeof(line)) != 0)
+                return -1;
+            chunk = strtoul(line, NULL, 16);
+            if (chunk == 0)
+                break;
+            if (http_skip(c, chunk) != 0 ||
+                http_getline(c, line, sizeof(line)) != 0)
+                return -1;
+        }
+        /* trailer */
+        do {
+            if (http_getline(c, line, sizeof(line)) != 0)
+                return -1;
+        } while (line[0]);
+    } else if (length >= 0) {
+        if (http_skip(c, length) != 0)
+            return -1;
+    } else {
+        /* the body ends with the connection */
+        *keep = 0;
+    }
+
+    return 0;
+}
+
+/* END FUNCTION: http_response */
+
+/* FUNCTION: http_fail */
+
+/* SYNOPSIS
+ * c takes no more requests: the ones waiting on it are sent again
+ * elsewhere (how is counted as a failed try or not). The last of
+ * them to leave closes it.
+ * END SYNOPSIS */
+
+static void
+http_fail (
+  /* PARAMETERS */
+  http_conn *c,                         /* I/O: connection */
+  int how                               /* I: HTTP_BROKEN or HTTP_RESEND */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    http_wait *w;
+    /* END VARIABLES */
+
+    for (w = c->waiting; w; w = w->next)
+        w->done = how;
+    c->waiting = NULL;
+    c->pc.state = HTTP_DONE;
+}
+
+/* END FUNCTION: http_fail */
+
+/* FUNCTION: http_wait_response */
+
+/* SYNOPSIS
+ * Wait for w's response on c, reading the connection's responses,
+ * which come in the order of the requests, if no other thread is.
+ * Called with the pool locked.
+ * END SYNOPSIS */
+
+static void
+http_wait_response (
+  /* PARAMETERS */
+  http_conn *c,                         /* I/O: connection */
+  http_wait *w                          /* I/O: our request */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    char status[RESP_LEN];
+    http_wait *first;
+    int keep;
+    int rc;
+    /* END VARIABLES */
+
+    while (!w->done) {
+        if (c->pc.reading) {
+            POOL_WAIT();
+            continue;
+        }
+        c->pc.reading = 1;
+        POOL_UNLOCK();
+        rc = http_response(c, status, sizeof(status), &keep);
+        POOL_LOCK();
+        c->pc.reading = 0;
+
+        if (rc != 0) {
+            http_fail(c, c->answered ? HTTP_RESEND : HTTP_BROKEN);
+        } else if ((first = c->waiting) != NULL) {
+            c->answered++;
+            c->waiting = first->next;
+            strlcpy(first->status, status, sizeof(first->status));
+            first->done = HTTP_ANSWERED;
+            /* the server closes it after this one */
+            if (!keep)
+                http_fail(c, HTTP_RESEND);
+        }
+        POOL_BROADCAST();
+    }
+}
+
+/* END FUNCTION: http_wait_response */
+
+/* FUNCTION: http_drop */
+
+/* SYNOPSIS
+ * http_close() for pool_get().
+ * END SYNOPSIS */
+
+static void
+http_drop (
+  /* PARAMETERS */
+  pool_conn *pc                         /* I/O: connection */
+  /* END PARAMETERS */
+  )
+{
+    http_close((http_conn *) pc);
+}
+
+/* END FUNCTION: http_drop */
+
+/* FUNCTION: http_check */
+
+/* SYNOPSIS
+ * Send the request on a pooled connection and wait for the response.
+ * END SYNOPSIS */
+
+static const char *                     /* R: NULL, or a response string */
+http_check (
+  /* PARAMETERS */
+  char *req,                            /* I: the request */
+  int reqlen,                           /* I: its length */
+  http_wait *w                          /* O: the response */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    http_conn *c;
+    http_wait **wp;
+    struct timeval start;
+    int rc;
+    /* END VARIABLES */
+
+    POOL_LOCK();
+    while (!(c = (http_conn *) pool_get(pool, sizeof(*pool), pool_size,
+                                        pipeline, pool_idle, http_drop)))
+        POOL_WAIT();
+
+    if (c->pc.opening) {
+        POOL_UNLOCK();
+        gettimeofday(&start, NULL);
+        rc = http_connect(c);
+        stats_phase(STATS_PHASE_CONNECT, &start);
+        POOL_LOCK();
+        c->pc.opening = 0;
+        POOL_BROADCAST();
+        if (rc != 0) {
+            POOL_UNLOCK();
+            return "NO [ALERT] Couldn't contact remote authentication server";
+        }
+    }
+
+    /* sent with the pool locked, in the order of c->waiting */
+    w->done = 0;
+    w->next = NULL;
+    for (wp = &c->waiting; *wp; wp = &(*wp)->next)
+        ;
+    *wp = w;
+    c->pc.inflight++;
+    if (tx_rec(c->fd, req, reqlen) < reqlen) {
+        syslog(LOG_WARNING, "auth_httpform: failed to send request");
+        http_fail(c, c->answered ? HTTP_RESEND : HTTP_BROKEN);
+    }
+
+    http_wait_response(c, w);
+
+    if (pool_put(&c->pc))
+        http_close(c);
+    POOL_BROADCAST();
+    POOL_UNLOCK();
+
+    return NULL;
+}
+
+/* END FUNCTION: http_check */
+
+/* FUNCTION: http_check_once */
+
+/* SYNOPSIS
+ * Without a pool: connect, send the request and close, every time.
+ * END SYNOPSIS */
+
+static const char *                     /* R: NULL, or a response string */
+http_check_once (
+  /* PARAMETERS */
+  char *req,                            /* I: the request */
+  int reqlen,                           /* I: its length */
+  http_wait *w                          /* O: the response */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    http_conn conn;
+    int keep;
+    /* END VARIABLES */
+
+    memset(&conn, 0, sizeof(conn));
+    conn.fd = -1;
+
+    if (http_connect(&conn) != 0)
+        return "NO [ALERT] Couldn't contact remote authentication server";
+
+    if (tx_rec(conn.fd, req, reqlen) < reqlen) {
+        syslog(LOG_WARNING, "auth_httpform: failed to send request");
+        w->done = HTTP_BROKEN;
+    } else {
+        w->done = http_response(&conn, w->status, sizeof(w->status), &keep)
+            ? HTTP_BROKEN : HTTP_ANSWERED;
+    }
+    http_close(&conn);                  /* we're done with the remote */
+
+    return NULL;
+}
+
+/* END FUNCTION: http_check_once */
+
 /* FUNCTION: auth_httpform */
 
 /* SYNOPSIS
@@ -468,70 +1090,23 @@ auth_httpform (
   )
 {
     /* VARIABLES */
-    int s=-1;                           /* socket to remote auth host   */
-    struct addrinfo *r;                 /* remote socket address info   */
     char *req;                          /* request, with user and pw    */
     char *escreq;                       /* URL-escaped request          */
-    char *c;                            /* scratch pointer              */
-    int rc;                             /* return code scratch area     */
     char postbuf[RESP_LEN];             /* request buffer               */
     int postlen;                        /* length of post request       */
-    char rbuf[RESP_LEN];                /* response read buffer         */
-    char hbuf[NI_MAXHOST], pbuf[NI_MAXSERV];
-    int saved_errno;
-    int niflags;
+    const char *err;                    /* failure response string      */
+    http_wait w;                        /* the response                 */
+    struct timeval start;
+    int tries, sends;
     /* END VARIABLES */
 
     /* sanity checks */
     assert(user != NULL);
     assert(password != NULL);
 
-    /*establish connection to remote */
-    for (r = ai; r; r = r->ai_next) {
-        s = socket(r->ai_family, r->ai_socktype, r->ai_protocol);
-        if (s < 0)
-            continue;
-        if (connect(s, r->ai_addr, r->ai_addrlen) >= 0)
-            break;
-        close(s);
-        s = -1;
-        saved_errno = errno;
-        niflags = (NI_NUMERICHOST | NI_NUMERICSERV);
-#ifdef NI_WITHSCOPEID
-        if (r->ai_family == AF_INET6)
-            niflags |= NI_WITHSCOPEID;
-#endif
-        if (getnameinfo(r->ai_addr, r->ai_addrlen, hbuf, sizeof(hbuf),
-                        pbuf, sizeof(pbuf), niflags) != 0) {
-            strlcpy(hbuf, "unknown", sizeof(hbuf));
-            strlcpy(pbuf, "unknown", sizeof(pbuf));
-        }
-        errno = saved_errno;
-        syslog(LOG_WARNING, "auth_httpform: connect %s[%s]/%s: %m",
-               ai->ai_canonname ? ai->ai_canonname : r_host, hbuf, pbuf);
-    }
-    if (s < 0) {
-        if (getnameinfo(ai->ai_addr, ai->ai_addrlen, NULL, 0,
-                        pbuf, sizeof(pbuf), NI_NUMERICSERV) != 0)
-            strlcpy(pbuf, "unknown", sizeof(pbuf));
-        syslog(LOG_WARNING, "auth_httpform: couldn't connect to %s/%s",
-               ai->ai_canonname ? ai->ai_canonname : r_host, pbuf);
-        return strdup("NO [ALERT] Couldn't contact remote authentication server");
-    }
-
-    /* CLAIM: we now have a TCP connection to the remote HTTP server */
-
-    /*
-     * Install noop signal handlers. These just reinstall the handler
-     * and return so that we take an EINTR during network I/O.
-     */
-    (void) signal(SIGALRM, sig_null);
-    (void) signal(SIGPIPE, sig_null);
-    
     /* build the HTTP request */
     req = create_post_data(formdata, user, password, realm);
     if (req == NULL) {
-        close(s);
         syslog(LOG_WARNING, "auth_httpform: create_post_data == NULL");
         return strdup(RESP_IERROR);
     }
@@ -539,7 +1114,6 @@ auth_httpform (
     if (escreq == NULL) {
         memset(req, 0, strlen(req));
         free(req); 
-        close(s);
         syslog(LOG_WARNING, "auth_httpform: url_escape == NULL");
         return strdup(RESP_IERROR);
     }
@@ -549,57 +1123,63 @@ auth_httpform (
               "Host: %s:%s" CRLF
               "User-Agent: saslauthd" CRLF
               "Accept: */*" CRLF
+              "%s"
               "Content-Type: application/x-www-form-urlencoded" CRLF
               "Content-Length: %d" TWO_CRLF
               "%s",
-              r_uri, r_host, r_port, strlen(escreq), escreq);
+              r_uri, r_host, r_port,
+              pool_size ? "" : "Connection: close" CRLF,
+              (int)strlen(escreq), escreq);
 
     if (flags & VERBOSE) {
         syslog(LOG_DEBUG, "auth_httpform: sending %s %s %s",
                r_host, r_uri, escreq);
     }
-    
-    /* send it */
-    alarm(NETWORK_IO_TIMEOUT);
-    rc = tx_rec(s, postbuf, postlen);
-    alarm(0);
-    
-    if (rc < postlen) {
-        syslog(LOG_WARNING, "auth_httpform: failed to send request");
-        memset(req, 0, strlen(req));
-        free(req); 
-        memset(escreq, 0, strlen(escreq));
-        free(escreq);
-        memset(postbuf, 0, postlen);
-        close(s);
-        return strdup(RESP_IERROR);
-    }
 
     /* don't need these any longer */
     memset(req, 0, strlen(req));
     free(req); 
     memset(escreq, 0, strlen(escreq));
     free(escreq);
-    memset(postbuf, 0, postlen);
-
-    /* read and parse the response */
-    alarm(NETWORK_IO_TIMEOUT);
-    rc = read(s, rbuf, sizeof(rbuf));
-    alarm(0);
-    
-    close(s);                    /* we're done with the remote */
 
-    if (rc == -1) {
-        syslog(LOG_WARNING, "auth_httpform: read (response): %m");
+    if (postlen < 0 || postlen >= RESP_LEN-1) {
+        syslog(LOG_WARNING, "auth_httpform: request too long");
+        memset(postbuf, 0, sizeof(postbuf));
         return strdup(RESP_IERROR);
     }
 
+    /*
+     * A new connection that fails is worth a few tries.  A request
+     * behind a response after which the server closed the connection,
+     * or on a kept one the server has dropped meanwhile, is just sent
+     * again (within reason).
+     */
+    gettimeofday(&start, NULL);
+    for (tries = sends = 0; tries < HTTP_TRIES &&
+             sends < HTTP_TRIES * HTTP_PIPELINE_MAX; sends++) {
+        if (pool_size)
+            err = http_check(postbuf, postlen, &w);
+        else
+            err = http_check_once(postbuf, postlen, &w);
+        if (err || w.done == HTTP_ANSWERED)
+            break;
+        if (w.done == HTTP_BROKEN)
+            tries++;
+    }
+    stats_phase(STATS_PHASE_AUTH, &start);
+
+    memset(postbuf, 0, postlen);
+
+    if (err)
+        return strdup(err);
+    if (w.done != HTTP_ANSWERED)
+        return strdup(RESP_IERROR);
+
     if (flags & VERBOSE) {
-        syslog(LOG_DEBUG, "auth_httpform: [%s] %s", user, rbuf);
+        syslog(LOG_DEBUG, "auth_httpform: [%s] %s", user, w.status);
     }
 
-    rbuf[rc] = '\0';             /* make sure str-funcs find null */
-    return build_sasl_response(rbuf);
+    return build_sasl_response(w.status);
 }
 
 /* END FUNCTION: auth_httpform */
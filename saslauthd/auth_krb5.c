@@ -52,12 +52,37 @@
 #include "globals.h" /* mech_option */
 #include "cfile.h"
 #include "krbtf.h"
+#include "utils.h"
 
 #ifdef AUTH_KRB5
 # include <krb5.h>
 static cfile config = 0;
 static char *keytabname = NULL; /* "system default" */
 static char *verify_principal = "host"; /* a principal in the default keytab */
+static int verify_rcache = 1; /* krb5_verify_rcache: none clears it */
+
+/*
+ * The context, the keytab and the principal of verify_principal are
+ * set up on a worker's first request and kept, rather than set up for
+ * every request: that took a parse of krb5.conf, a keytab lookup and,
+ * for MIT, a canonicalizing host name lookup each time.  They are set
+ * up again when krb5.conf or the keytab file change, which is checked
+ * for at most once a second.
+ *
+ * A krb5 context must not be used by two threads at once, so with
+ * the thread model (-j) each worker thread keeps its own, and the
+ * mechanism runs in parallel.
+ */
+#ifdef HAVE_THREAD_LOCAL
+# define K5_TLS __thread
+#else
+# define K5_TLS
+#endif
+static K5_TLS krb5_context k5_context = NULL;
+static K5_TLS krb5_keytab k5_keytab = NULL;
+static K5_TLS krb5_principal k5_server = NULL;	/* MIT only */
+static K5_TLS unsigned long k5_stamp = 0;
+static K5_TLS time_t k5_checked = 0;
 #endif /* AUTH_KRB5 */
 
 #include <errno.h>
@@ -65,6 +90,7 @@ static char *verify_principal = "host"; /* a principal in the default keytab */
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include "auth_krb5.h"
@@ -104,6 +130,8 @@ auth_krb5_init (
     if (config) {
 	keytabname = cfile_getstring(config, "krb5_keytab", keytabname);
 	verify_principal = cfile_getstring(config, "krb5_verify_principal", verify_principal);
+	if (!strcasecmp(cfile_getstring(config, "krb5_verify_rcache", "default"), "none"))
+	    verify_rcache = 0;
     }
 
     return 0;
@@ -115,6 +143,123 @@ auth_krb5_init (
 
 #ifdef AUTH_KRB5
 
+/* a fingerprint of krb5.conf and the keytab file as they are now */
+static unsigned long
+k5_files_stamp (
+  void
+  )
+{
+    char files[4096];
+    char ktname[1024];
+    const char *conf = getenv("KRB5_CONFIG");
+
+    strlcpy(files, conf ? conf : "/etc/krb5.conf", sizeof (files));
+
+    if (keytabname)
+	strlcpy(ktname, keytabname, sizeof (ktname));
+    else if (krb5_kt_default_name(k5_context, ktname, sizeof (ktname)))
+	ktname[0] = '\0';
+
+    /* only keytabs that are plain files can be watched */
+    if (!strncmp(ktname, "FILE:", 5)) {
+	strlcat(files, ":", sizeof (files));
+	strlcat(files, ktname + 5, sizeof (files));
+    } else if (!strncmp(ktname, "WRFILE:", 7)) {
+	strlcat(files, ":", sizeof (files));
+	strlcat(files, ktname + 7, sizeof (files));
+    } else if (ktname[0] == '/') {
+	strlcat(files, ":", sizeof (files));
+	strlcat(files, ktname, sizeof (files));
+    }
+
+    return files_stamp(files);
+}
+
+static void
+k5_release (
+  void
+  )
+{
+    if (k5_server)
+	krb5_free_principal(k5_context, k5_server);
+    if (k5_keytab)
+	krb5_kt_close(k5_context, k5_keytab);
+    if (k5_context)
+	krb5_free_context(k5_context);
+
+    k5_server = NULL;
+    k5_keytab = NULL;
+    k5_context = NULL;
+}
+
+/* the worker's context, keytab and verify principal, set up if need be */
+static krb5_context
+k5_get_context (
+  void
+  )
+{
+    time_t now = time(NULL);
+
+    if (k5_context) {
+	if (now == k5_checked)
+	    return k5_context;
+
+	k5_checked = now;
+	if (k5_files_stamp() == k5_stamp)
+	    return k5_context;
+
+	syslog(LOG_INFO, "auth_krb5: krb5.conf or keytab changed, reloading");
+	k5_release();
+    }
+
+    if (krb5_init_context(&k5_context)) {
+	k5_context = NULL;
+	syslog(LOG_ERR, "auth_krb5: krb5_init_context");
+	return NULL;
+    }
+
+    if (keytabname ? krb5_kt_resolve(k5_context, keytabname, &k5_keytab)
+		   : krb5_kt_default(k5_context, &k5_keytab)) {
+	k5_keytab = NULL;
+	k5_release();
+	syslog(LOG_ERR, "auth_krb5: krb5_kt_resolve");
+	return NULL;
+    }
+
+#ifndef KRB5_HEIMDAL
+    if (krb5_sname_to_principal(k5_context, NULL, verify_principal,
+				KRB5_NT_SRV_HST, &k5_server)) {
+	k5_server = NULL;
+	k5_release();
+	syslog(LOG_ERR, "auth_krb5: krb5_sname_to_principal");
+	return NULL;
+    }
+#endif
+
+    k5_checked = now;
+    k5_stamp = k5_files_stamp();
+
+    return k5_context;
+}
+
+/*
+ * krbtf's MEMORY:0 is one cache for the whole process, which the
+ * threads of -j would share; a memory cache of its own is made for
+ * each request instead.
+ */
+static krb5_error_code
+k5_cc_open (
+  krb5_context context,
+  const char *tfname,
+  krb5_ccache *ccache
+  )
+{
+    if (!strncmp(tfname, "MEMORY:", 7))
+	return krb5_cc_new_unique(context, "MEMORY", NULL, ccache);
+
+    return krb5_cc_resolve(context, tfname, ccache);
+}
+
 static int
 form_principal_name (
   const char *user,
@@ -179,7 +324,6 @@ auth_krb5 (
     /* VARIABLES */
     krb5_context context;
     krb5_ccache ccache = NULL;
-    krb5_keytab kt = NULL;
     krb5_principal auth_user;
     krb5_verify_opt opt;
     char * result;
@@ -192,8 +336,7 @@ auth_krb5 (
 	return strdup("NO saslauthd internal NULL password or username");
     }
 
-    if (krb5_init_context(&context)) {
-	syslog(LOG_ERR, "auth_krb5: krb5_init_context");
+    if (!(context = k5_get_context())) {
 	return strdup("NO saslauthd internal krb5_init_context error");
     }
 
@@ -203,7 +346,6 @@ auth_krb5 (
     }
 
     if (krb5_parse_name (context, principalbuf, &auth_user)) {
-	krb5_free_context(context);
 	syslog(LOG_ERR, "auth_krb5: krb5_parse_name");
 	return strdup("NO saslauthd internal krb5_parse_name error");
     }
@@ -213,28 +355,16 @@ auth_krb5 (
 	return strdup("NO saslauthd internal error");
     }
 
-    if (krb5_cc_resolve(context, tfname, &ccache)) {
+    if (k5_cc_open(context, tfname, &ccache)) {
 	krb5_free_principal(context, auth_user);
-	krb5_free_context(context);
 	syslog(LOG_ERR, "auth_krb5: krb5_cc_resolve");
 	return strdup("NO saslauthd internal error");
     }
 
-    if (keytabname) {
-	if (krb5_kt_resolve(context, keytabname, &kt)) {
-	    krb5_free_principal(context, auth_user);
-	    krb5_cc_destroy(context, ccache);
-	    krb5_free_context(context);
-	    syslog(LOG_ERR, "auth_krb5: krb5_kt_resolve");
-	    return strdup("NO saslauthd internal error");
-	}
-    }
-    
     krb5_verify_opt_init(&opt);
     krb5_verify_opt_set_secure(&opt, 1);
     krb5_verify_opt_set_ccache(&opt, ccache);
-    if (kt)
-	krb5_verify_opt_set_keytab(&opt,  kt);
+    krb5_verify_opt_set_keytab(&opt, k5_keytab);
     krb5_verify_opt_set_service(&opt, verify_principal);
     
     if (krb5_verify_user_opt(context, auth_user, password, &opt)) {
@@ -245,9 +375,6 @@ auth_krb5 (
     
     krb5_free_principal(context, auth_user);
     krb5_cc_destroy(context, ccache);
-    if (kt)
-	krb5_kt_close(context, kt);
-    krb5_free_context(context);
 
     return result;
 }
@@ -258,47 +385,30 @@ auth_krb5 (
 static int k5support_verify_tgt(krb5_context context, 
 				krb5_ccache ccache) 
 {
-    krb5_principal server;
     krb5_data packet;
-    krb5_keyblock *keyblock = NULL;
     krb5_auth_context auth_context = NULL;
+    krb5_creds in_creds, *out_creds = NULL;
     krb5_error_code k5_retcode;
-    krb5_keytab kt = NULL;
-    char thishost[BUFSIZ];
     int result = 0;
     
     memset(&packet, 0, sizeof(packet));
+    memset(&in_creds, 0, sizeof(in_creds));
 
-    if (krb5_sname_to_principal(context, NULL, verify_principal,
-				KRB5_NT_SRV_HST, &server)) {
-	return 0;
-    }
-
-    if (keytabname) {
-	if (krb5_kt_resolve(context, keytabname, &kt)) {
-	    goto fini;
-	}
-    }
-    
-    if (krb5_kt_read_service_key(context, kt, server, 0,
-				 0, &keyblock)) {
-	goto fini;
-    }
-    
-    if (keyblock) {
-	krb5_free_keyblock(context, keyblock);
-    }
-    
-    /* this duplicates work done in krb5_sname_to_principal
-     * oh well.
+    /*
+     * krb5_mk_req() would look the service principal up again, by
+     * host name; the one of k5_get_context() is at hand.  A missing
+     * key shows as a krb5_rd_req() failure.
      */
-    if (gethostname(thishost, BUFSIZ) < 0) {
+    if (krb5_cc_get_principal(context, ccache, &in_creds.client)) {
 	goto fini;
     }
-    thishost[BUFSIZ-1] = '\0';
-    
-    k5_retcode = krb5_mk_req(context, &auth_context, 0, verify_principal, 
-			     thishost, NULL, ccache, &packet);
+    in_creds.server = k5_server;
+
+    k5_retcode = krb5_get_credentials(context, 0, ccache, &in_creds, &out_creds);
+    if (k5_retcode == 0) {
+	k5_retcode = krb5_mk_req_extended(context, &auth_context, 0,
+					  NULL, out_creds, &packet);
+    }
     
     if (auth_context) {
 	krb5_auth_con_free(context, auth_context);
@@ -309,8 +419,20 @@ static int k5support_verify_tgt(krb5_context context,
 	goto fini;
     }
     
+    /*
+     * The ticket was got just now, by us, so the replay cache only
+     * costs disk I/O and a file lock that the workers contend on.
+     * Without KRB5_AUTH_CONTEXT_DO_TIME krb5_rd_req() doesn't use it.
+     */
+    if (!verify_rcache) {
+	if (krb5_auth_con_init(context, &auth_context)) {
+	    goto fini;
+	}
+	krb5_auth_con_setflags(context, auth_context, 0);
+    }
+
     if (krb5_rd_req(context, &auth_context, &packet, 
-		    server, NULL, NULL, NULL)) {
+		    k5_server, k5_keytab, NULL, NULL)) {
 	goto fini;
     }
 
@@ -323,7 +445,10 @@ static int k5support_verify_tgt(krb5_context context,
     result = 1;
  fini:
     krb5_free_data_contents(context, &packet);
-    krb5_free_principal(context, server);
+    if (in_creds.client)
+	krb5_free_principal(context, in_creds.client);
+    if (out_creds)
+	krb5_free_creds(context, out_creds);
     
     return result;
 }
@@ -361,8 +486,7 @@ auth_krb5 (
 	return strdup("NO saslauthd internal error");
     }
 
-    if (krb5_init_context(&context)) {
-	syslog(LOG_ERR, "auth_krb5: krb5_init_context");
+    if (!(context = k5_get_context())) {
 	return strdup("NO saslauthd internal error");
     }
 
@@ -372,7 +496,6 @@ auth_krb5 (
     }
 
     if (krb5_parse_name (context, principalbuf, &auth_user)) {
-	krb5_free_context(context);
 	syslog(LOG_ERR, "auth_krb5: krb5_parse_name");
 	return strdup("NO saslauthd internal error");
     }
@@ -382,16 +505,14 @@ auth_krb5 (
 	return strdup("NO saslauthd internal error");
     }
 
-    if (krb5_cc_resolve(context, tfname, &ccache)) {
+    if (k5_cc_open(context, tfname, &ccache)) {
 	krb5_free_principal(context, auth_user);
-	krb5_free_context(context);
 	syslog(LOG_ERR, "auth_krb5: krb5_cc_resolve");
 	return strdup("NO saslauthd internal error");
     }
     
     if (krb5_cc_initialize (context, ccache, auth_user)) {
 	krb5_free_principal(context, auth_user);
-	krb5_free_context(context);
 	syslog(LOG_ERR, "auth_krb5: krb5_cc_initialize");
 	return strdup("NO saslauthd internal error");
     }
@@ -404,7 +525,6 @@ auth_krb5 (
 				     0, NULL, &opts)) {
 	krb5_cc_destroy(context, ccache);
 	krb5_free_principal(context, auth_user);
-	krb5_free_context(context);
 	syslog(LOG_ERR, "auth_krb5: krb5_get_init_creds_password: %d", code);
 	return strdup("NO saslauthd internal error");
     }
@@ -413,7 +533,6 @@ auth_krb5 (
     if (krb5_cc_store_cred(context, ccache, &creds)) {
 	krb5_free_principal(context, auth_user);
 	krb5_cc_destroy(context, ccache);
-	krb5_free_context(context);
 	syslog(LOG_ERR, "auth_krb5: krb5_cc_store_cred");
 	return strdup("NO saslauthd internal error");
     }
@@ -434,7 +553,6 @@ auth_krb5 (
     krb5_free_cred_contents(context, &creds);
     krb5_free_principal(context, auth_user);
     krb5_cc_destroy(context, ccache);
-    krb5_free_context(context);
 
     return result;
 }
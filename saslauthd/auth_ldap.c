@@ -52,6 +52,13 @@
 #include "lak.h"
 #include "globals.h"
 
+#ifdef HAVE_PTHREAD_RWLOCK
+#include <pthread.h>
+
+/* the worker threads share one connection pool, set up by the first */
+static pthread_mutex_t lak_init_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 const char *SASLAUTHD_CONF_FILE = SASLAUTHD_CONF_FILE_DEFAULT;
 
 char *					/* R: allocated response string */
@@ -68,7 +75,13 @@ auth_ldap(
 	int rc = 0;
 
 	if (lak == NULL) {
+#ifdef HAVE_PTHREAD_RWLOCK
+		pthread_mutex_lock(&lak_init_lock);
+#endif
 		rc = lak_init(SASLAUTHD_CONF_FILE, &lak);
+#ifdef HAVE_PTHREAD_RWLOCK
+		pthread_mutex_unlock(&lak_init_lock);
+#endif
 		if (rc != LAK_OK) {
 			lak = NULL;
 			RETURN("NO");
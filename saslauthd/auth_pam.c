@@ -54,6 +54,8 @@
 
 # include <string.h>
 # include <syslog.h>
+# include <unistd.h>
+# include <sys/time.h>
 #ifdef HAVE_SECURITY_PAM_APPL_H
 # include <security/pam_appl.h>
 #elif defined(HAVE_PAM_PAM_APPL_H)
@@ -61,6 +63,9 @@
 #endif
 
 # include "auth_pam.h"
+# include "globals.h" /* mech_option, flags */
+# include "cfile.h"
+# include "stats.h"
 /* END PUBLIC DEPENDENCIES */
 
 
@@ -74,6 +79,34 @@ typedef struct {
 
 # define RETURN(x) return strdup(x)
 
+/*
+ * With pam_reuse_handle set in saslauthd.conf, a worker (a process,
+ * or a thread of -j) keeps the handle pam_start() made for a service
+ * and runs its next request for that service on it, with PAM_USER
+ * set to the new login and the password items cleared, rather than
+ * loading and initializing the service's module stack again.  A
+ * request that fails ends its handle, so what the modules kept of
+ * a failure doesn't carry over.  A worker keeps up to PAM_HANDLES
+ * services' handles and ends the oldest one for another service.
+ */
+#define PAM_HANDLES	8
+
+#ifdef HAVE_THREAD_LOCAL
+# define PAM_TLS __thread
+#else
+# define PAM_TLS
+#endif
+
+typedef struct {
+    char service[64];			/* service the handle was made for */
+    pam_handle_t *pamh;			/* NULL if the slot is free */
+    pam_appdata appdata;		/* the conversation's, per request */
+} pam_slot;
+
+static int reuse_handle = 0;
+static PAM_TLS pam_slot pam_slots[PAM_HANDLES];
+static PAM_TLS int pam_slot_next = 0;	/* the one to end next */
+
 
 /* FUNCTION: saslauthd_pam_conv */
 
@@ -178,6 +211,81 @@ ret_error:
 
 /* END FUNCTION: saslauthd_pam_conv */
 
+/* FUNCTION: auth_pam_init */
+
+int
+auth_pam_init (
+  void
+  )
+{
+    cfile config;
+    char *configname = 0;
+    char complaint[1024];
+
+    if (mech_option)
+	configname = mech_option;
+    else if (access(SASLAUTHD_CONF_FILE_DEFAULT, F_OK) == 0)
+	configname = SASLAUTHD_CONF_FILE_DEFAULT;
+
+    if (!configname)
+	return 0;
+
+    if (!(config = cfile_read(configname, complaint, sizeof (complaint)))) {
+	syslog(LOG_ERR, "auth_pam_init %s", complaint);
+	return -1;
+    }
+
+    reuse_handle = cfile_getswitch(config, "pam_reuse_handle", 0);
+    cfile_free(config);
+
+    return 0;
+}
+
+/* END FUNCTION: auth_pam_init */
+
+/* FUNCTION: pam_slot_get */
+
+/* SYNOPSIS
+ * The worker's kept handle for service, or a slot to keep one in
+ * (with pamh NULL).
+ * END SYNOPSIS */
+
+static pam_slot *
+pam_slot_get (
+  const char *service
+  )
+{
+    pam_slot *slot;
+    int i;
+
+    if (strlen(service) >= sizeof (pam_slots[0].service))
+	return NULL;
+
+    for (i = 0; i < PAM_HANDLES; i++) {
+	if (pam_slots[i].pamh && !strcmp(pam_slots[i].service, service))
+	    return &pam_slots[i];
+    }
+
+    for (i = 0; i < PAM_HANDLES; i++) {
+	if (!pam_slots[i].pamh)
+	    break;
+    }
+
+    if (i == PAM_HANDLES) {
+	i = pam_slot_next;
+	pam_slot_next = (pam_slot_next + 1) % PAM_HANDLES;
+	pam_end(pam_slots[i].pamh, PAM_SUCCESS);
+	pam_slots[i].pamh = NULL;
+    }
+
+    slot = &pam_slots[i];
+    strcpy(slot->service, service);
+
+    return slot;
+}
+
+/* END FUNCTION: pam_slot_get */
+
 /* FUNCTION: auth_pam */
 
 char *					/* R: allocated response string */
@@ -191,45 +299,92 @@ auth_pam (
   )
 {
     /* VARIABLES */
-    pam_appdata my_appdata;		/* application specific data */
+    pam_appdata local_appdata;		/* application specific data */
+    pam_appdata *my_appdata;		/* the one the conversation sees */
     struct pam_conv my_conv;		/* pam conversion data */
-    pam_handle_t *pamh;			/* pointer to PAM handle */
+    pam_handle_t *pamh = NULL;		/* pointer to PAM handle */
+    pam_slot *slot = NULL;		/* where the handle is kept */
+    struct timeval start;		/* phase timing */
     int rc;				/* return code holder */
     /* END VARIABLES */
 
-    my_appdata.login = login;
-    my_appdata.password = password;
-    my_appdata.pamh = NULL;
+#ifndef HAVE_THREAD_LOCAL
+    /* the slots would be shared by the threads */
+    if (reuse_handle && !(flags & USE_THREAD_MODEL))
+#else
+    if (reuse_handle)
+#endif
+	slot = pam_slot_get(service);
+
+    my_appdata = slot ? &slot->appdata : &local_appdata;
+    my_appdata->login = login;
+    my_appdata->password = password;
+
+    if (slot && slot->pamh) {
+	pamh = slot->pamh;
+	rc = pam_set_item(pamh, PAM_USER, login);
+	if (rc == PAM_SUCCESS)
+	    rc = pam_set_item(pamh, PAM_AUTHTOK, NULL);
+	if (rc == PAM_SUCCESS)
+	    rc = pam_set_item(pamh, PAM_OLDAUTHTOK, NULL);
+	if (rc != PAM_SUCCESS) {
+	    syslog(LOG_DEBUG, "DEBUG: auth_pam: pam_set_item failed: %s",
+		   pam_strerror(pamh, rc));
+	    pam_end(pamh, rc);
+	    pamh = slot->pamh = NULL;
+	}
+    }
 
-    my_conv.conv = saslauthd_pam_conv;
-    my_conv.appdata_ptr = &my_appdata;
+    if (!pamh) {
+	my_appdata->pamh = NULL;
 
-    rc = pam_start(service, login, &my_conv, &pamh);
-    if (rc != PAM_SUCCESS) {
-	syslog(LOG_DEBUG, "DEBUG: auth_pam: pam_start failed: %s",
-	       pam_strerror(pamh, rc));
-	RETURN("NO PAM start error");
-    }
+	my_conv.conv = saslauthd_pam_conv;
+	my_conv.appdata_ptr = my_appdata;
 
-    my_appdata.pamh = pamh;
+	gettimeofday(&start, NULL);
+	rc = pam_start(service, login, &my_conv, &pamh);
+	if (rc != PAM_SUCCESS) {
+	    syslog(LOG_DEBUG, "DEBUG: auth_pam: pam_start failed: %s",
+		   pam_strerror(pamh, rc));
+	    RETURN("NO PAM start error");
+	}
+	stats_phase(STATS_PHASE_START, &start);
 
+	my_appdata->pamh = pamh;
+    }
+
+    gettimeofday(&start, NULL);
     rc = pam_authenticate(pamh, PAM_SILENT);
+    stats_phase(STATS_PHASE_AUTH, &start);
     if (rc != PAM_SUCCESS) {
 	syslog(LOG_DEBUG, "DEBUG: auth_pam: pam_authenticate failed: %s",
 	       pam_strerror(pamh, rc));
 	pam_end(pamh, rc);
+	if (slot)
+	    slot->pamh = NULL;
 	RETURN("NO PAM auth error");
     }
 
+    gettimeofday(&start, NULL);
     rc = pam_acct_mgmt(pamh, PAM_SILENT);
+    stats_phase(STATS_PHASE_ACCOUNT, &start);
     if (rc != PAM_SUCCESS) {
 	syslog(LOG_DEBUG, "DEBUG: auth_pam: pam_acct_mgmt failed: %s",
 	       pam_strerror(pamh, rc));
 	pam_end(pamh, rc);
+	if (slot)
+	    slot->pamh = NULL;
 	RETURN("NO PAM acct error");
     }
 
-    pam_end(pamh, PAM_SUCCESS);
+    if (slot) {
+	/* the password is the caller's, don't keep pointing at it */
+	my_appdata->login = NULL;
+	my_appdata->password = NULL;
+	slot->pamh = pamh;
+    } else {
+	pam_end(pamh, PAM_SUCCESS);
+    }
     RETURN("OK");
 }
 
@@ -237,6 +392,14 @@ auth_pam (
 
 #else /* !AUTH_PAM */
 
+int
+auth_pam_init (
+  void
+  )
+{
+    return -1;
+}
+
 char *
 auth_pam(
   const char *login __attribute__((unused)),
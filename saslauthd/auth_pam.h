@@ -33,3 +33,4 @@
  * END COPYRIGHT */
 
 char *auth_pam(const char *, const char *, const char *, const char *);
+int auth_pam_init(void);
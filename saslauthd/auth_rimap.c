@@ -71,26 +71,107 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
-#include <signal.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#ifdef HAVE_PTHREAD_RWLOCK
+# include <pthread.h>
+#endif
 
 #include "auth_rimap.h"
 #include "utils.h"
 #include "globals.h"
+#include "cfile.h"
+#include "stats.h"
+#include "connpool.h"
 /* END PUBLIC DEPENDENCIES */
 
+#define DEFAULT_REMOTE_SERVICE "imap"	/* getservbyname() name for remote
+					   service we connect to.	 */
+#define TAG "saslauthd"			/* IMAP command tag, numbered */
+#define LOGOUT_CMD (TAG "0 LOGOUT\r\n")	/* IMAP logout command (with tag) */
+#define NETWORK_IO_TIMEOUT 30		/* network I/O timeout (seconds) */
+#define RESP_LEN 1000			/* size of read response buffer  */
+#define RIMAP_POOL_MAX 64		/* rimap_pool_size limit */
+#define RIMAP_PIPELINE_MAX 32		/* rimap_pipeline limit */
+#define RIMAP_TRIES 3			/* connections a check may take */
+
+/*
+ * Connection pool.
+ *
+ * With rimap_pool_size set in saslauthd.conf, each saslauthd process
+ * keeps that many connections to the remote server open and greeted,
+ * and sends the LOGINs on them, so a check costs one round trip
+ * rather than a connect, the banner and the LOGIN.  Their commands
+ * are tagged TAG<n>, so up to rimap_pipeline LOGINs from different
+ * threads (-j) can be on a connection at once; the thread that reads
+ * a response hands it to the one waiting for it.
+ *
+ * A LOGIN that fails leaves the connection as it was, ready for the
+ * next.  One that succeeds logs the connection in: it is logged out
+ * and closed once the LOGINs on it are answered (those sent behind
+ * the successful one are tried again elsewhere), and a replacement
+ * starts connecting right away, to be greeted by the time it's
+ * needed.  Connections idle for longer than rimap_pool_idle seconds
+ * are made anew, before the server's own timeout drops them.
+ */
+#define RIMAP_CLOSED	POOL_CLOSED
+#define RIMAP_OPENING	POOL_OPENING	/* connect() started, no banner yet */
+#define RIMAP_READY	POOL_READY	/* greeted, not logged in */
+#define RIMAP_DONE	POOL_DONE	/* logged in or broken, takes no LOGINs */
+
+#define RIMAP_ANSWERED	1		/* the LOGIN's response is in */
+#define RIMAP_BROKEN	(-1)		/* the connection failed under it */
+#define RIMAP_RESEND	(-2)		/* sent behind a successful LOGIN */
+
+/* a LOGIN sent, and its response once it's in */
+typedef struct rimap_wait {
+    unsigned long tag;			/* its tag number */
+    int done;				/* RIMAP_ANSWERED, _BROKEN, _RESEND */
+    char resp[RESP_LEN];		/* the response after the tag */
+    struct rimap_wait *next;
+} rimap_wait;
+
+typedef struct {
+    pool_conn pc;			/* state (RIMAP_*), LOGINs in flight */
+    int fd;				/* -1 when closed */
+    unsigned long tag;			/* last tag number sent */
+    unsigned long ok_tag;		/* the LOGIN that succeeded, or 0 */
+    struct addrinfo *addr;		/* the address connected to */
+    rimap_wait *waiting;		/* LOGINs without a response */
+    int len;				/* bytes read ahead in buf */
+    char buf[RESP_LEN];
+} rimap_conn;
+
 /* PRIVATE DEPENDENCIES */
 static const char *r_host = NULL;       /* remote hostname (mech_option) */
 static struct addrinfo *ai = NULL;	/* remote authentication host    */
+static int pool_size = 0;		/* rimap_pool_size, 0 for none   */
+static int pipeline = 1;		/* rimap_pipeline                */
+static int pool_idle = 30;		/* rimap_pool_idle (seconds)     */
+static rimap_conn *pool = NULL;
+#ifdef HAVE_PTHREAD_RWLOCK
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+# define POOL_LOCK()		pthread_mutex_lock(&pool_lock)
+# define POOL_UNLOCK()		pthread_mutex_unlock(&pool_lock)
+# define POOL_WAIT()		pthread_cond_wait(&pool_cond, &pool_lock)
+# define POOL_BROADCAST()	pthread_cond_broadcast(&pool_cond)
+#else
+/* a single thread never has to wait for a connection */
+# define POOL_LOCK()
+# define POOL_UNLOCK()
+# define POOL_WAIT()
+# define POOL_BROADCAST()
+#endif
 /* END PRIVATE DEPENDENCIES */
 
-#define DEFAULT_REMOTE_SERVICE "imap"	/* getservbyname() name for remote
-					   service we connect to.	 */
-#define TAG "saslauthd"			/* IMAP command tag */
-#define LOGIN_CMD (TAG " LOGIN ")	/* IMAP login command (with tag) */
-#define NETWORK_IO_TIMEOUT 30		/* network I/O timeout (seconds) */
-#define RESP_LEN 1000			/* size of read response buffer  */
+const char *rimap_config = SASLAUTHD_CONF_FILE_DEFAULT; /* pool settings */
 
 /* Common failure response strings for auth_rimap() */
 
@@ -98,47 +179,6 @@ static struct addrinfo *ai = NULL;	/* remote authentication host    */
 #define RESP_UNAVAILABLE "NO [ALERT] The remote authentication server is currently unavailable"
 #define RESP_UNEXPECTED	"NO [ALERT] Unexpected response from remote authentication server"
 
-/* FUNCTION: sig_null */
-
-/* SYNOPSIS
- * Catch and ignore a signal.
- * END SYNOPSIS */
-
-static RETSIGTYPE				/* R: OS dependent */
-sig_null (
-  /* PARAMETERS */
-  int sig					/* I: signal being caught */
-  /* END PARAMETERS */
-  )
-{
-
-    switch (sig) {
-	
-      case SIGALRM:
-	signal(SIGALRM, sig_null);
-	break;
-
-      case SIGPIPE:
-	signal(SIGPIPE, sig_null);
-	break;
-
-      default:
-	syslog(LOG_WARNING, "auth_rimap: unexpected signal %d", sig);
-	break;
-    }
-#ifdef __APPLE__
-    return;
-#else /* __APPLE__ */
-# if RETSIGTYPE == void
-    return;
-# else /* RETSIGTYPE */
-    return 0;
-# endif /* RETSIGTYPE */
-#endif /* __APPLE__ */
-}
-
-/* END FUNCTION: sig_null */
-
 /* FUNCTION: qstring */
 
 /* SYNOPSIS
@@ -163,6 +203,7 @@ qstring (
     p1 = s;
     while ((p1 = strchr(p1, '"')) != NULL) {
 	num_quotes++;
+	p1++;
     }
     
     if (!num_quotes) {
@@ -198,7 +239,8 @@ qstring (
 	}
 	*p2++ = *p1++;
     }
-    strcat(p2, "\"");
+    *p2++ = '"';
+    *p2 = '\0';
     return c;
 }
 
@@ -207,7 +249,8 @@ qstring (
 /* FUNCTION: auth_rimap_init */
 
 /* SYNOPSIS
- * Validate the host and service names for the remote server.
+ * Validate the host and service names for the remote server, and
+ * read the connection pool's settings.
  * END SYNOPSIS */
 
 int
@@ -222,6 +265,9 @@ auth_rimap_init (
     struct addrinfo hints;
     int err;
     char *c;				/* scratch pointer               */
+    cfile config;			/* pool settings                 */
+    char complaint[1024];
+    int i;
     /* END VARIABLES */
 
     if (mech_option == NULL) {
@@ -270,65 +316,82 @@ auth_rimap_init (
 	return -1;
     }
 
+    if (access(rimap_config, F_OK) == 0) {
+	if (!(config = cfile_read(rimap_config, complaint, sizeof(complaint)))) {
+	    syslog(LOG_ERR, "auth_rimap_init: %s", complaint);
+	    return -1;
+	}
+	pool_size = cfile_getint(config, "rimap_pool_size", pool_size);
+	pipeline = cfile_getint(config, "rimap_pipeline", pipeline);
+	pool_idle = cfile_getint(config, "rimap_pool_idle", pool_idle);
+	cfile_free(config);
+    }
+
+    if (pool_size < 0)
+	pool_size = 0;
+    if (pool_size > RIMAP_POOL_MAX)
+	pool_size = RIMAP_POOL_MAX;
+    if (pipeline < 1)
+	pipeline = 1;
+    if (pipeline > RIMAP_PIPELINE_MAX)
+	pipeline = RIMAP_PIPELINE_MAX;
+
+    /* the connections are made by the workers, after the fork */
+    if (pool_size && !pool) {
+	if (!(pool = calloc(pool_size, sizeof(rimap_conn)))) {
+	    syslog(LOG_ERR, "auth_rimap_init: out of memory");
+	    return -1;
+	}
+	for (i = 0; i < pool_size; i++)
+	    pool[i].fd = -1;
+    }
+
     return 0;
 }
 
 /* END FUNCTION: auth_rimap_init */
-
-/* FUNCTION: auth_rimap */
 
-/* SYNOPSIS
- * Proxy authenticate to a remote IMAP server.
- *
- * This mechanism takes the plaintext authenticator and password, forms
- * them into an IMAP LOGIN command, then attempts to authenticate to
- * a remote IMAP server using those values. If the remote authentication
- * succeeds the credentials are considered valid.
- *
- * NOTE: since IMSP uses the same form of LOGIN command as IMAP does,
- * this driver will also work with IMSP servers.
- */
+/* FUNCTION: rimap_connect */
 
-/* XXX This should be extended to support SASL PLAIN authentication */
+/* SYNOPSIS
+ * Start connecting c to the remote server, at the first of its
+ * addresses from r on that doesn't fail right away. The connect()
+ * completes in the background, rimap_greet() waits for it.
+ * END SYNOPSIS */
 
-char *					/* R: Allocated response string */
-auth_rimap (
+static int				/* R: 0, or -1 if no address is left */
+rimap_connect (
   /* PARAMETERS */
-  const char *login,			/* I: plaintext authenticator */
-  const char *password,			/* I: plaintext password */
-  const char *service __attribute__((unused)),
-  const char *realm __attribute__((unused))
+  rimap_conn *c,			/* I/O: closed connection */
+  struct addrinfo *r			/* I: first address to try */
   /* END PARAMETERS */
   )
 {
-    /* VARIABLES */
-    int	s=-1;				/* socket to remote auth host   */
-    struct addrinfo *r;			/* remote socket address info   */
-    struct iovec iov[5];		/* for sending LOGIN command    */
-    char *qlogin;			/* pointer to "quoted" login    */
-    char *qpass;			/* pointer to "quoted" password */
-    char *c;				/* scratch pointer              */
-    int rc;				/* return code scratch area     */
-    char rbuf[RESP_LEN];		/* response read buffer         */
     char hbuf[NI_MAXHOST], pbuf[NI_MAXSERV];
     int saved_errno;
     int niflags;
-    /* END VARIABLES */
+    int on = 1;
 
-    /* sanity checks */
-    assert(login != NULL);
-    assert(password != NULL);
-
-    /*establish connection to remote */
-    for (r = ai; r; r = r->ai_next) {
-	s = socket(r->ai_family, r->ai_socktype, r->ai_protocol);
-	if (s < 0)
+    for (; r; r = r->ai_next) {
+	c->fd = socket(r->ai_family, r->ai_socktype, r->ai_protocol);
+	if (c->fd < 0)
 	    continue;
-	if (connect(s, r->ai_addr, r->ai_addrlen) >= 0)
-	    break;
-	close(s);
-	s = -1;
+	fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK);
+	/* pipelined LOGINs mustn't wait for the ACKs of the ones before */
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	if (connect(c->fd, r->ai_addr, r->ai_addrlen) >= 0 ||
+	    errno == EINPROGRESS) {
+	    c->addr = r;
+	    c->pc.state = RIMAP_OPENING;
+	    c->len = 0;
+	    c->tag = 0;
+	    c->ok_tag = 0;
+	    c->pc.last_used = time(NULL);
+	    return 0;
+	}
 	saved_errno = errno;
+	close(c->fd);
+	c->fd = -1;
 	niflags = (NI_NUMERICHOST | NI_NUMERICSERV);
 #ifdef NI_WITHSCOPEID
 	if (r->ai_family == AF_INET6)
@@ -343,56 +406,504 @@ auth_rimap (
 	syslog(LOG_WARNING, "auth_rimap: connect %s[%s]/%s: %m",
 	       ai->ai_canonname ? ai->ai_canonname : r_host, hbuf, pbuf);
     }
-    if (s < 0) {
-	if (getnameinfo(ai->ai_addr, ai->ai_addrlen, NULL, 0,
-			pbuf, sizeof(pbuf), NI_NUMERICSERV) != 0)
-	    strlcpy(pbuf, "unknown", sizeof(pbuf));
-	syslog(LOG_WARNING, "auth_rimap: couldn't connect to %s/%s",
-	       ai->ai_canonname ? ai->ai_canonname : r_host, pbuf);
-	return strdup("NO [ALERT] Couldn't contact remote authentication server");
+
+    c->pc.state = RIMAP_CLOSED;
+    return -1;
+}
+
+/* END FUNCTION: rimap_connect */
+
+/* FUNCTION: rimap_close */
+
+/* SYNOPSIS
+ * Close c, logging out first if a LOGIN on it succeeded.
+ * END SYNOPSIS */
+
+static void
+rimap_close (
+  /* PARAMETERS */
+  rimap_conn *c				/* I/O: connection */
+  /* END PARAMETERS */
+  )
+{
+    if (c->fd >= 0) {
+	if (c->ok_tag)
+	    (void) write(c->fd, LOGOUT_CMD, sizeof(LOGOUT_CMD) - 1);
+	(void) close(c->fd);
     }
+    c->fd = -1;
+    c->pc.state = RIMAP_CLOSED;
+    c->len = 0;
+}
 
-    /* CLAIM: we now have a TCP connection to the remote IMAP server */
+/* END FUNCTION: rimap_close */
 
-    /*
-     * Install noop signal handlers. These just reinstall the handler
-     * and return so that we take an EINTR during network I/O.
-     */
-    (void) signal(SIGALRM, sig_null);
-    (void) signal(SIGPIPE, sig_null);
-    
-    /* read and parse the IMAP banner */
+/* FUNCTION: rimap_getline */
+
+/* SYNOPSIS
+ * Read the next response line from c, without its line termination.
+ * Lines longer than len are cut short.
+ * END SYNOPSIS */
 
-    alarm(NETWORK_IO_TIMEOUT);
-    rc = read(s, rbuf, sizeof(rbuf));
-    alarm(0);
-    if (rc == -1) {
-	syslog(LOG_WARNING, "auth_rimap: read (banner): %m");
-	(void) close(s);
-	return strdup("NO [ALERT] error synchronizing with remote authentication server");
+static int				/* R: 0, or -1 on error or timeout */
+rimap_getline (
+  /* PARAMETERS */
+  rimap_conn *c,			/* I/O: connection */
+  char *line,				/* O: the line */
+  int len				/* I: size of line */
+  /* END PARAMETERS */
+  )
+{
+    struct pollfd pfd;
+    char *nl;
+    int rc;
+
+    while (!(nl = memchr(c->buf, '\n', c->len))) {
+	if (c->len == sizeof(c->buf))
+	    c->len = 0;			/* overlong line, drop its start */
+
+	pfd.fd = c->fd;
+	pfd.events = POLLIN;
+	rc = poll(&pfd, 1, NETWORK_IO_TIMEOUT * 1000);
+	if (rc == 0) {
+	    syslog(LOG_WARNING, "auth_rimap: read: timed out");
+	    return -1;
+	}
+	if (rc < 0) {
+	    if (errno == EINTR)
+		continue;
+	    syslog(LOG_WARNING, "auth_rimap: poll: %m");
+	    return -1;
+	}
+
+	rc = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len);
+	if (rc < 0 && errno == EINTR)
+	    continue;
+	if (rc < 0) {
+	    syslog(LOG_WARNING, "auth_rimap: read: %m");
+	    return -1;
+	}
+	if (rc == 0) {
+	    if (flags & VERBOSE)
+		syslog(LOG_DEBUG, "auth_rimap: connection closed by remote");
+	    return -1;
+	}
+	c->len += rc;
     }
-    rbuf[rc] = '\0';			/* tie off response */
-    c = strpbrk(rbuf, "\r\n");
-    if (c != NULL) {
-	*c = '\0';			/* tie off line termination */
+
+    rc = nl - c->buf;
+    if (rc > 0 && c->buf[rc - 1] == '\r')
+	rc--;
+    if (rc >= len)
+	rc = len - 1;
+    memcpy(line, c->buf, rc);
+    line[rc] = '\0';
+
+    c->len -= nl + 1 - c->buf;
+    memmove(c->buf, nl + 1, c->len);
+
+    return 0;
+}
+
+/* END FUNCTION: rimap_getline */
+
+/* FUNCTION: rimap_greet */
+
+/* SYNOPSIS
+ * Wait for c's connect() to complete (trying the next addresses if
+ * it fails) and read and check the IMAP banner.
+ * END SYNOPSIS */
+
+static const char *			/* R: NULL, or a response string */
+rimap_greet (
+  /* PARAMETERS */
+  rimap_conn *c				/* I/O: opening connection */
+  /* END PARAMETERS */
+  )
+{
+    struct pollfd pfd;
+    socklen_t errlen;
+    char rbuf[RESP_LEN];
+    char pbuf[NI_MAXSERV];
+    int err;
+    int rc;
+
+    for (;;) {
+	if (c->pc.state == RIMAP_CLOSED && rimap_connect(c, ai) != 0) {
+	    if (getnameinfo(ai->ai_addr, ai->ai_addrlen, NULL, 0,
+			    pbuf, sizeof(pbuf), NI_NUMERICSERV) != 0)
+		strlcpy(pbuf, "unknown", sizeof(pbuf));
+	    syslog(LOG_WARNING, "auth_rimap: couldn't connect to %s/%s",
+		   ai->ai_canonname ? ai->ai_canonname : r_host, pbuf);
+	    return "NO [ALERT] Couldn't contact remote authentication server";
+	}
+
+	pfd.fd = c->fd;
+	pfd.events = POLLOUT;
+	do {
+	    rc = poll(&pfd, 1, NETWORK_IO_TIMEOUT * 1000);
+	} while (rc < 0 && errno == EINTR);
+
+	err = ETIMEDOUT;
+	errlen = sizeof(err);
+	if (rc > 0 && getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0 &&
+	    err == 0)
+	    break;
+
+	errno = err;
+	syslog(LOG_WARNING, "auth_rimap: connect %s: %m",
+	       ai->ai_canonname ? ai->ai_canonname : r_host);
+	close(c->fd);
+	c->fd = -1;
+	if (rimap_connect(c, c->addr->ai_next) != 0) {
+	    c->pc.state = RIMAP_CLOSED;
+	    return "NO [ALERT] Couldn't contact remote authentication server";
+	}
     }
 
-    if (!strncmp(rbuf, "* NO", sizeof("* NO")-1)) {
-	(void) close(s);
-	return strdup(RESP_UNAVAILABLE);
+    /* CLAIM: we now have a TCP connection to the remote IMAP server */
+
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) & ~O_NONBLOCK);
+
+    /* read and parse the IMAP banner */
+
+    if (rimap_getline(c, rbuf, sizeof(rbuf)) != 0) {
+	rimap_close(c);
+	return "NO [ALERT] error synchronizing with remote authentication server";
     }
-    if (!strncmp(rbuf, "* BYE", sizeof("* BYE")-1)) {
-	(void) close(s);
-	return strdup(RESP_UNAVAILABLE);
+
+    if (!strncmp(rbuf, "* NO", sizeof("* NO")-1) ||
+	!strncmp(rbuf, "* BYE", sizeof("* BYE")-1)) {
+	rimap_close(c);
+	return RESP_UNAVAILABLE;
     }
     if (strncmp(rbuf, "* OK", sizeof("* OK")-1)) {
 	syslog(LOG_WARNING,
 	       "auth_rimap: unexpected response during initial handshake: %s",
 	       rbuf);
-	(void) close(s);
-	return strdup(RESP_UNEXPECTED);
+	rimap_close(c);
+	return RESP_UNEXPECTED;
     }
-    
+
+    c->pc.state = RIMAP_READY;
+    return NULL;
+}
+
+/* END FUNCTION: rimap_greet */
+
+/* FUNCTION: rimap_send */
+
+/* SYNOPSIS
+ * Send a LOGIN, tagged with tag, on c.
+ * END SYNOPSIS */
+
+static int				/* R: 0, or -1 on error */
+rimap_send (
+  /* PARAMETERS */
+  rimap_conn *c,			/* I: connection */
+  unsigned long tag,			/* I: command tag number */
+  char *qlogin,				/* I: quoted login */
+  char *qpass				/* I: quoted password */
+  /* END PARAMETERS */
+  )
+{
+    struct iovec iov[5];		/* for sending LOGIN command    */
+    char cmd[64];
+
+    snprintf(cmd, sizeof(cmd), TAG "%lu LOGIN ", tag);
+
+    iov[0].iov_base = cmd;
+    iov[0].iov_len  = strlen(cmd);
+    iov[1].iov_base = qlogin;
+    iov[1].iov_len  = strlen(qlogin);
+    iov[2].iov_base = " ";
+    iov[2].iov_len  = sizeof(" ") - 1;
+    iov[3].iov_base = qpass;
+    iov[3].iov_len  = strlen(qpass);
+    iov[4].iov_base = "\r\n";
+    iov[4].iov_len  = sizeof("\r\n") - 1;
+
+    if (flags & VERBOSE) {
+	syslog(LOG_DEBUG, "auth_rimap: sending %s%s <password>", cmd, qlogin);
+    }
+    if (retry_writev(c->fd, iov, 5) == -1) {
+	syslog(LOG_WARNING, "auth_rimap: writev: %m");
+	return -1;
+    }
+
+    return 0;
+}
+
+/* END FUNCTION: rimap_send */
+
+/* FUNCTION: rimap_fail */
+
+/* SYNOPSIS
+ * c is broken: its LOGINs are to be tried again elsewhere and it
+ * takes no more. The last of them to leave closes it.
+ * END SYNOPSIS */
+
+static void
+rimap_fail (
+  /* PARAMETERS */
+  rimap_conn *c				/* I/O: connection */
+  /* END PARAMETERS */
+  )
+{
+    rimap_wait *w;
+
+    for (w = c->waiting; w; w = w->next)
+	w->done = RIMAP_BROKEN;
+    c->waiting = NULL;
+    c->pc.state = RIMAP_DONE;
+}
+
+/* END FUNCTION: rimap_fail */
+
+/* FUNCTION: rimap_dispatch */
+
+/* SYNOPSIS
+ * Hand a response line read from c to the LOGIN it answers.
+ *
+ * A LOGIN that succeeds puts the connection in the authenticated
+ * state, where the LOGINs sent behind it can't be answered for
+ * their own credentials: they are tried again on another
+ * connection, and this one is logged out and replaced.
+ * END SYNOPSIS */
+
+static void
+rimap_dispatch (
+  /* PARAMETERS */
+  rimap_conn *c,			/* I/O: connection */
+  const char *line			/* I: response line */
+  /* END PARAMETERS */
+  )
+{
+    rimap_wait **wp, *w;
+    unsigned long tag;
+    char *end;
+
+    if (!strncmp(line, "* BYE", sizeof("* BYE")-1)) {
+	if (flags & VERBOSE)
+	    syslog(LOG_DEBUG, "auth_rimap: %s", line);
+	rimap_fail(c);
+	return;
+    }
+
+    if (strncmp(line, TAG, sizeof(TAG)-1))
+	return;				/* untagged, or not ours */
+
+    tag = strtoul(line + sizeof(TAG)-1, &end, 10);
+    if (end == line + sizeof(TAG)-1 || *end != ' ')
+	return;
+
+    for (wp = &c->waiting; (w = *wp) != NULL; wp = &w->next) {
+	if (w->tag == tag)
+	    break;
+    }
+    if (!w)
+	return;
+    *wp = w->next;
+
+    if (c->ok_tag && tag > c->ok_tag) {
+	w->done = RIMAP_RESEND;
+	return;
+    }
+
+    strlcpy(w->resp, end + 1, sizeof(w->resp));
+    w->done = RIMAP_ANSWERED;
+
+    if (!strncmp(w->resp, "OK", 2)) {
+	c->ok_tag = tag;
+	c->pc.state = RIMAP_DONE;
+    }
+}
+
+/* END FUNCTION: rimap_dispatch */
+
+/* FUNCTION: rimap_drop */
+
+/* SYNOPSIS
+ * rimap_close() for pool_get().
+ * END SYNOPSIS */
+
+static void
+rimap_drop (
+  /* PARAMETERS */
+  pool_conn *pc				/* I/O: connection */
+  /* END PARAMETERS */
+  )
+{
+    rimap_close((rimap_conn *) pc);
+}
+
+/* END FUNCTION: rimap_drop */
+
+/* FUNCTION: rimap_check */
+
+/* SYNOPSIS
+ * Send a LOGIN on a pooled connection and wait for its response,
+ * reading the connection's responses for the other LOGINs on it
+ * too if no other thread is.
+ * END SYNOPSIS */
+
+static const char *			/* R: NULL, or a response string */
+rimap_check (
+  /* PARAMETERS */
+  char *qlogin,				/* I: quoted login */
+  char *qpass,				/* I: quoted password */
+  rimap_wait *w				/* O: the response */
+  /* END PARAMETERS */
+  )
+{
+    rimap_conn *c;
+    const char *err;
+    char line[RESP_LEN];
+    struct timeval start;
+    int rc;
+
+    POOL_LOCK();
+    while (!(c = (rimap_conn *) pool_get(pool, sizeof(*pool), pool_size,
+					 pipeline, pool_idle, rimap_drop)))
+	POOL_WAIT();
+
+    if (c->pc.opening) {
+	POOL_UNLOCK();
+	gettimeofday(&start, NULL);
+	err = rimap_greet(c);
+	stats_phase(STATS_PHASE_CONNECT, &start);
+	POOL_LOCK();
+	c->pc.opening = 0;
+	POOL_BROADCAST();
+	if (err) {
+	    POOL_UNLOCK();
+	    return err;
+	}
+    }
+
+    /* sent with the pool locked, so the tags go out in order */
+    w->tag = ++c->tag;
+    w->done = 0;
+    w->next = c->waiting;
+    c->waiting = w;
+    c->pc.inflight++;
+    if (rimap_send(c, w->tag, qlogin, qpass) != 0)
+	rimap_fail(c);
+
+    while (!w->done) {
+	if (c->pc.reading) {
+	    POOL_WAIT();
+	    continue;
+	}
+	c->pc.reading = 1;
+	POOL_UNLOCK();
+	rc = rimap_getline(c, line, sizeof(line));
+	POOL_LOCK();
+	c->pc.reading = 0;
+	if (rc != 0)
+	    rimap_fail(c);
+	else
+	    rimap_dispatch(c, line);
+	POOL_BROADCAST();
+    }
+
+    if (pool_put(&c->pc)) {
+	rimap_close(c);
+	/* get the replacement greeted while we're away */
+	rimap_connect(c, ai);
+    }
+    POOL_BROADCAST();
+    POOL_UNLOCK();
+
+    return NULL;
+}
+
+/* END FUNCTION: rimap_check */
+
+/* FUNCTION: rimap_check_once */
+
+/* SYNOPSIS
+ * Without a pool: connect, LOGIN and close, for every check.
+ * END SYNOPSIS */
+
+static const char *			/* R: NULL, or a response string */
+rimap_check_once (
+  /* PARAMETERS */
+  char *qlogin,				/* I: quoted login */
+  char *qpass,				/* I: quoted password */
+  rimap_wait *w				/* O: the response */
+  /* END PARAMETERS */
+  )
+{
+    rimap_conn conn;
+    const char *err;
+    char line[RESP_LEN];
+
+    memset(&conn, 0, sizeof(conn));
+    conn.fd = -1;
+
+    if ((err = rimap_greet(&conn)) != NULL)
+	return err;
+
+    w->tag = ++conn.tag;
+    w->done = 0;
+    w->next = NULL;
+    conn.waiting = w;
+    if (rimap_send(&conn, w->tag, qlogin, qpass) != 0)
+	rimap_fail(&conn);
+
+    while (!w->done) {
+	if (rimap_getline(&conn, line, sizeof(line)) != 0)
+	    rimap_fail(&conn);
+	else
+	    rimap_dispatch(&conn, line);
+    }
+    rimap_close(&conn);
+
+    return NULL;
+}
+
+/* END FUNCTION: rimap_check_once */
+
+/* FUNCTION: auth_rimap */
+
+/* SYNOPSIS
+ * Proxy authenticate to a remote IMAP server.
+ *
+ * This mechanism takes the plaintext authenticator and password, forms
+ * them into an IMAP LOGIN command, then attempts to authenticate to
+ * a remote IMAP server using those values. If the remote authentication
+ * succeeds the credentials are considered valid.
+ *
+ * NOTE: since IMSP uses the same form of LOGIN command as IMAP does,
+ * this driver will also work with IMSP servers.
+ */
+
+/* XXX This should be extended to support SASL PLAIN authentication */
+
+char *					/* R: Allocated response string */
+auth_rimap (
+  /* PARAMETERS */
+  const char *login,			/* I: plaintext authenticator */
+  const char *password,			/* I: plaintext password */
+  const char *service __attribute__((unused)),
+  const char *realm __attribute__((unused))
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    char *qlogin;			/* pointer to "quoted" login    */
+    char *qpass;			/* pointer to "quoted" password */
+    const char *err;			/* failure response string      */
+    rimap_wait w;			/* the LOGIN's response         */
+    struct timeval start;
+    int tries;
+    /* END VARIABLES */
+
+    /* sanity checks */
+    assert(login != NULL);
+    assert(password != NULL);
+
     /* build the LOGIN command */
 
     qlogin = qstring(login);		/* quote login */
@@ -402,7 +913,6 @@ auth_rimap (
 	    memset(qpass, 0, strlen(qpass));
 	    free(qpass);
 	}
-	(void) close(s);
 	syslog(LOG_WARNING, "auth_rimap: qstring(login) == NULL");
 	return strdup(RESP_IERROR);
     }
@@ -411,76 +921,53 @@ auth_rimap (
 	    memset(qlogin, 0, strlen(qlogin));
 	    free(qlogin);
 	}
-	(void) close(s);
 	syslog(LOG_WARNING, "auth_rimap: qstring(password) == NULL");
 	return strdup(RESP_IERROR);
     }
 
-    iov[0].iov_base = LOGIN_CMD;
-    iov[0].iov_len  = sizeof(LOGIN_CMD) - 1;
-    iov[1].iov_base = qlogin;
-    iov[1].iov_len  = strlen(qlogin);
-    iov[2].iov_base = " ";
-    iov[2].iov_len  = sizeof(" ") - 1;
-    iov[3].iov_base = qpass;
-    iov[3].iov_len  = strlen(qpass);
-    iov[4].iov_base = "\r\n";
-    iov[4].iov_len  = sizeof("\r\n") - 1;
-
-    if (flags & VERBOSE) {
-	syslog(LOG_DEBUG, "auth_rimap: sending %s%s %s",
-	       LOGIN_CMD, qlogin, qpass);
-    }
-    alarm(NETWORK_IO_TIMEOUT);
-    rc = retry_writev(s, iov, 5);
-    alarm(0);
-    if (rc == -1) {
-	syslog(LOG_WARNING, "auth_rimap: writev: %m");
-	memset(qlogin, 0, strlen(qlogin));
-	free(qlogin);
-	memset(qpass, 0, strlen(qlogin));
-	free(qpass);
-	(void)close(s);
-	return strdup(RESP_IERROR);
+    /*
+     * A pooled connection can turn out dead, which is worth a few
+     * tries, or logged in by a LOGIN ahead of ours, after which ours
+     * is sent again: that one was answered, so the checks progress.
+     */
+    gettimeofday(&start, NULL);
+    for (tries = 0; tries < RIMAP_TRIES; ) {
+	if (pool_size)
+	    err = rimap_check(qlogin, qpass, &w);
+	else
+	    err = rimap_check_once(qlogin, qpass, &w);
+	if (err || w.done == RIMAP_ANSWERED)
+	    break;
+	if (w.done == RIMAP_BROKEN)
+	    tries++;
     }
+    stats_phase(STATS_PHASE_AUTH, &start);
 
     /* don't need these any longer */
     memset(qlogin, 0, strlen(qlogin));
     free(qlogin);
-    memset(qpass, 0, strlen(qlogin));
+    memset(qpass, 0, strlen(qpass));
     free(qpass);
 
-    /* read and parse the LOGIN response */
-
-    alarm(NETWORK_IO_TIMEOUT);
-    rc = read(s, rbuf, sizeof(rbuf));
-    alarm(0);
-    (void) close(s);			/* we're done with the remote */
-    if (rc == -1) {
-	syslog(LOG_WARNING, "auth_rimap: read (response): %m");
-	return strdup(RESP_IERROR);
-    }
-
-    rbuf[rc] = '\0';			/* tie off response */
-    c = strpbrk(rbuf, "\r\n");
-    if (c != NULL) {
-	*c = '\0';			/* tie off line termination */
-    }
+    if (err)
+	return strdup(err);
+    if (w.done != RIMAP_ANSWERED)
+	return strdup(RESP_UNAVAILABLE);
 
-     if (!strncmp(rbuf, TAG " OK", sizeof(TAG " OK")-1)) {
+    if (!strncmp(w.resp, "OK", sizeof("OK")-1)) {
 	if (flags & VERBOSE) {
-	    syslog(LOG_DEBUG, "auth_rimap: [%s] %s", login, rbuf);
+	    syslog(LOG_DEBUG, "auth_rimap: [%s] %s", login, w.resp);
 	}
 	return strdup("OK remote authentication successful");
     }
-    if (!strncmp(rbuf, TAG " NO", sizeof(TAG " NO")-1)) {
+    if (!strncmp(w.resp, "NO", sizeof("NO")-1)) {
 	if (flags & VERBOSE) {
-	    syslog(LOG_DEBUG, "auth_rimap: [%s] %s", login, rbuf);
+	    syslog(LOG_DEBUG, "auth_rimap: [%s] %s", login, w.resp);
 	}
 	return strdup("NO remote server rejected your credentials");
     }
     syslog(LOG_WARNING, "auth_rimap: unexpected response to auth request: %s",
-	   rbuf);
+	   w.resp);
     return strdup(RESP_UNEXPECTED);
     
 }
@@ -27,3 +27,5 @@
 
 char *auth_rimap(const char *, const char *, const char *, const char *);
 int auth_rimap_init(void);
+
+extern const char *rimap_config;
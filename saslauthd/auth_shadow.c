@@ -42,6 +42,7 @@
 # include <stdlib.h>
 # include <string.h>
 # include <sys/types.h>
+# include <sys/stat.h>
 # include <time.h>
 # include <pwd.h>
 # include <syslog.h>
@@ -62,11 +63,260 @@
 # else /* ! HAVE_GETUSERPW */
 #  include <shadow.h>
 # endif /* ! HAVE_GETUSERPW */
+# if defined(HAVE_CRYPT_R) && defined(HAVE_CRYPT_H)
+#  include <crypt.h>
+# endif
+# ifdef HAVE_PTHREAD_RWLOCK
+#  include <pthread.h>
+# endif
 
 # include "auth_shadow.h"
+# include "cache.h"
+# include "cfile.h"
 # include "globals.h"
+# include "utils.h"
 /* END PUBLIC DEPENDENCIES */
-
+
+# ifdef HAVE_GETSPNAM
+
+#  if defined(_REENTRANT) || defined(GETXXNAM_R_5ARG)
+#   define SHADOW_REENTRANT		/* getpwnam_r() and getspnam_r() */
+#  endif
+
+#  ifdef HAVE_THREAD_LOCAL
+#   define SHADOW_TLS __thread
+#  else
+#   define SHADOW_TLS
+#  endif
+
+#  ifdef HAVE_CRYPT_R
+/* crypt_r()'s state is big (over 100k with some libcs): one per thread */
+static SHADOW_TLS struct crypt_data *shadow_crypt_data = NULL;
+#  endif
+
+/*
+ * Shadow entry cache.
+ *
+ * getpwnam() and getspnam() read /etc/passwd and /etc/shadow through
+ * from the start for every request.  With shadow_cache_size set in
+ * saslauthd.conf, each saslauthd process keeps that many looked up
+ * entries (the hash and the ageing fields, or that the login isn't
+ * there), tagged with a stamp of the two files' mtime, size and inode.
+ * Once either file changes, as the password tools replace them, every
+ * entry is stale and looked up again.  Only the files are watched, so
+ * this is for logins in the local files, not NIS or LDAP.
+ */
+#  define SHADOW_CACHE_MAX	65536	/* shadow_cache_size limit */
+#  define SHADOW_FILES		"/etc/passwd:/etc/shadow"
+
+#  define SHADOW_FOUND		0
+#  define SHADOW_NO_PASSWD	1	/* getpwnam() didn't know it */
+#  define SHADOW_NO_SHADOW	2	/* getspnam() didn't know it */
+
+typedef struct {
+    char login[64];			/* "" for an empty slot */
+    unsigned long stamp;		/* files_stamp() of SHADOW_FILES */
+    int status;				/* SHADOW_FOUND or SHADOW_NO_* */
+    char pwdp[PWBUFSZ];			/* sp_pwdp */
+    long lstchg;			/* sp_lstchg */
+    long max;				/* sp_max */
+    long expire;			/* sp_expire */
+} shadow_entry;
+
+static int shadow_cache_size = 0;
+static shadow_entry *shadow_cache = NULL;
+#  ifdef HAVE_PTHREAD_RWLOCK
+static pthread_mutex_t shadow_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#   define SHADOW_CACHE_LOCK()	pthread_mutex_lock(&shadow_cache_lock)
+#   define SHADOW_CACHE_UNLOCK()	pthread_mutex_unlock(&shadow_cache_lock)
+#  else
+#   define SHADOW_CACHE_LOCK()
+#   define SHADOW_CACHE_UNLOCK()
+#  endif
+
+# endif /* HAVE_GETSPNAM */
+
+/* FUNCTION: auth_shadow_init */
+
+/* SYNOPSIS
+ * Read the shadow_cache_size setting.
+ * END SYNOPSIS */
+
+int
+auth_shadow_init (
+  /* PARAMETERS */
+  void					/* no parameters */
+  /* END PARAMETERS */
+  )
+{
+# ifdef HAVE_GETSPNAM
+    /* VARIABLES */
+    cfile config;
+    char *configname = 0;
+    char complaint[1024];
+    /* END VARIABLES */
+
+    if (mech_option)
+	configname = mech_option;
+    else if (access(SASLAUTHD_CONF_FILE_DEFAULT, F_OK) == 0)
+	configname = SASLAUTHD_CONF_FILE_DEFAULT;
+
+    if (!configname)
+	return 0;
+
+    if (!(config = cfile_read(configname, complaint, sizeof (complaint)))) {
+	syslog(LOG_ERR, "auth_shadow_init %s", complaint);
+	return -1;
+    }
+
+    shadow_cache_size = cfile_getint(config, "shadow_cache_size", 0);
+    cfile_free(config);
+
+    if (shadow_cache_size < 0)
+	shadow_cache_size = 0;
+    if (shadow_cache_size > SHADOW_CACHE_MAX)
+	shadow_cache_size = SHADOW_CACHE_MAX;
+
+    /* the workers fork after this: each gets a copy of its own */
+    if (shadow_cache_size && !shadow_cache) {
+	if (!(shadow_cache = calloc(shadow_cache_size, sizeof (shadow_entry)))) {
+	    syslog(LOG_ERR, "auth_shadow_init: out of memory");
+	    return -1;
+	}
+    }
+# endif /* HAVE_GETSPNAM */
+
+    return 0;
+}
+
+/* END FUNCTION: auth_shadow_init */
+
+# ifdef HAVE_GETSPNAM
+
+/* FUNCTION: shadow_lookup */
+
+/* SYNOPSIS
+ * Look login up in the password and shadow databases.
+ * END SYNOPSIS */
+
+static void
+shadow_lookup (
+  /* PARAMETERS */
+  const char *login,			/* I: login to look up */
+  shadow_entry *entry			/* O: what was found */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    struct passwd	*pw;		/* return from getpwnam_r() */
+    struct spwd   	*sp;		/* return from getspnam_r() */
+#  ifdef SHADOW_REENTRANT
+    struct passwd pwbuf;
+    char pwdata[PWBUFSZ];		/* pwbuf indirect data goes in here */
+
+    struct spwd spbuf;
+    char spdata[PWBUFSZ];		/* spbuf indirect data goes in here */
+#  endif /* SHADOW_REENTRANT */
+    /* END VARIABLES */
+
+#  ifdef SHADOW_REENTRANT
+#    ifdef GETXXNAM_R_5ARG
+	(void) getpwnam_r(login, &pwbuf, pwdata, sizeof(pwdata), &pw);
+#    else
+    pw = getpwnam_r(login, &pwbuf, pwdata, sizeof(pwdata));
+#    endif /* GETXXNAM_R_5ARG */
+#  else
+    pw = getpwnam(login);
+#  endif /* SHADOW_REENTRANT */
+    endpwent();
+    if (pw == NULL) {
+	if (flags & VERBOSE) {
+	    syslog(LOG_DEBUG, "DEBUG: auth_shadow: getpwnam(%s) returned NULL", login);
+	}
+	entry->status = SHADOW_NO_PASSWD;
+	return;
+    }
+
+#  ifdef SHADOW_REENTRANT
+#    ifdef GETXXNAM_R_5ARG
+	(void) getspnam_r(login, &spbuf, spdata, sizeof(spdata), &sp);
+#    else
+    sp = getspnam_r(login, &spbuf, spdata, sizeof(spdata));
+#    endif /* GETXXNAM_R_5ARG */
+#  else
+    sp = getspnam(login);
+#  endif /* SHADOW_REENTRANT */
+    endspent();
+
+    if (sp == NULL) {
+	if (flags & VERBOSE) {
+	    syslog(LOG_DEBUG, "DEBUG: auth_shadow: getspnam(%s) returned NULL", login);
+	}
+	entry->status = SHADOW_NO_SHADOW;
+	return;
+    }
+
+    entry->status = SHADOW_FOUND;
+    strlcpy(entry->pwdp, sp->sp_pwdp, sizeof(entry->pwdp));
+    entry->lstchg = sp->sp_lstchg;
+    entry->max = sp->sp_max;
+    entry->expire = sp->sp_expire;
+#  ifdef SHADOW_REENTRANT
+    memset(spdata, 0, sizeof(spdata));
+#  endif
+}
+
+/* END FUNCTION: shadow_lookup */
+
+/* FUNCTION: shadow_get */
+
+/* SYNOPSIS
+ * Look login up, in the cache if it's there and still current.
+ * END SYNOPSIS */
+
+static void
+shadow_get (
+  /* PARAMETERS */
+  const char *login,			/* I: login to look up */
+  shadow_entry *entry			/* O: what was found */
+  /* END PARAMETERS */
+  )
+{
+    /* VARIABLES */
+    shadow_entry *slot;
+    unsigned long stamp;
+    /* END VARIABLES */
+
+    if (!shadow_cache || strlen(login) >= sizeof(entry->login)) {
+	shadow_lookup(login, entry);
+	return;
+    }
+
+    stamp = files_stamp(SHADOW_FILES);
+    slot = &shadow_cache[cache_hash(login, strlen(login)) % shadow_cache_size];
+
+    SHADOW_CACHE_LOCK();
+    if (slot->stamp == stamp && !strcmp(slot->login, login)) {
+	memcpy(entry, slot, sizeof(*entry));
+	SHADOW_CACHE_UNLOCK();
+	return;
+    }
+    SHADOW_CACHE_UNLOCK();
+
+    shadow_lookup(login, entry);
+
+    strlcpy(entry->login, login, sizeof(entry->login));
+    entry->stamp = stamp;
+
+    SHADOW_CACHE_LOCK();
+    memcpy(slot, entry, sizeof(*slot));
+    SHADOW_CACHE_UNLOCK();
+}
+
+/* END FUNCTION: shadow_get */
+
+# endif /* HAVE_GETSPNAM */
+
 /* FUNCTION: auth_shadow */
 
 /* SYNOPSIS
@@ -102,18 +352,10 @@ auth_shadow (
     /* VARIABLES */
     long today;				/* the current time */
     char *cpw;				/* pointer to crypt() result */
-    struct passwd	*pw;		/* return from getpwnam_r() */
-    struct spwd   	*sp;		/* return from getspnam_r() */
-#  ifdef _REENTRANT
-    struct passwd pwbuf;
-    char pwdata[PWBUFSZ];		/* pwbuf indirect data goes in here */
-
-    struct spwd spbuf;
-    char spdata[PWBUFSZ];		/* spbuf indirect data goes in here */
-#  endif /* _REENTRANT */
+    shadow_entry sp;			/* the login's shadow entry */
     /* END VARIABLES */
 
-#  define RETURN(x) return strdup(x)
+#  define RETURN(x) { memset(&sp, 0, sizeof(sp)); return strdup(x); }
 
     /*
      * "Magic" password field entries for SunOS.
@@ -130,44 +372,14 @@ auth_shadow (
 #  define SHADOW_PW_LOCKED "*LK*"	/* account locked (not used by us) */
 #  define SHADOW_PW_EPERM  "*NP*"	/* insufficient database perms */
 
-#  ifdef _REENTRANT
-#    ifdef GETXXNAM_R_5ARG
-	(void) getpwnam_r(login, &pwbuf, pwdata, sizeof(pwdata), &pw);
-#    else
-    pw = getpwnam_r(login, &pwbuf, pwdata, sizeof(pwdata));
-#    endif /* GETXXNAM_R_5ARG */
-#  else
-    pw = getpwnam(login);
-#  endif /* _REENTRANT */
-    endpwent();
-    if (pw == NULL) {
-	if (flags & VERBOSE) {
-	    syslog(LOG_DEBUG, "DEBUG: auth_shadow: getpwnam(%s) returned NULL", login);
-	}
+    shadow_get(login, &sp);
+    if (sp.status != SHADOW_FOUND) {
 	RETURN("NO");
     }
 
     today = (long)time(NULL)/(24L*60*60);
 
-#  ifdef _REENTRANT
-#    ifdef GETXXNAM_R_5ARG
-	(void) getspnam_r(login, &spbuf, spdata, sizeof(spdata), &sp);
-#    else
-    sp = getspnam_r(login, &spbuf, spdata, sizeof(spdata));
-#    endif /* GETXXNAM_R_5ARG */
-#  else
-    sp = getspnam(login);
-#  endif /* _REENTRANT */
-    endspent();
-
-    if (sp == NULL) {
-	if (flags & VERBOSE) {
-	    syslog(LOG_DEBUG, "DEBUG: auth_shadow: getspnam(%s) returned NULL", login);
-	}
-	RETURN("NO");
-    }
-
-    if (!strcmp(sp->sp_pwdp, SHADOW_PW_EPERM)) {
+    if (!strcmp(sp.pwdp, SHADOW_PW_EPERM)) {
 	if (flags & VERBOSE) {
 	    syslog(LOG_DEBUG, "DEBUG: auth_shadow: sp->sp_pwdp == SHADOW_PW_EPERM");
 	}
@@ -180,16 +392,23 @@ auth_shadow (
      * not returning any information about a login until we have validated
      * the password.
      */
-    cpw = strdup((const char *)crypt(password, sp->sp_pwdp));
-    if (strcmp(sp->sp_pwdp, cpw)) {
+#  ifdef HAVE_CRYPT_R
+    if (!shadow_crypt_data &&
+	!(shadow_crypt_data = calloc(1, sizeof(*shadow_crypt_data)))) {
+	syslog(LOG_ERR, "auth_shadow: out of memory");
+	RETURN("NO");
+    }
+    cpw = crypt_r(password, sp.pwdp, shadow_crypt_data);
+#  else
+    cpw = crypt(password, sp.pwdp);
+#  endif /* HAVE_CRYPT_R */
+    if (cpw == NULL || strcmp(sp.pwdp, cpw)) {
 	if (flags & VERBOSE) {
 	    syslog(LOG_DEBUG, "DEBUG: auth_shadow: pw mismatch: '%s' != '%s'",
-		   sp->sp_pwdp, cpw);
+		   sp.pwdp, cpw ? cpw : "(null)");
 	}
-	free(cpw);
 	RETURN("NO");
     }
-    free(cpw);
 
     /*
      * The following fields will be set to -1 if:
@@ -198,23 +417,23 @@ auth_shadow (
      *	2) The database is being served up by NIS.
      */
 
-    if ((sp->sp_expire != -1) && (today > sp->sp_expire)) {
+    if ((sp.expire != -1) && (today > sp.expire)) {
 	if (flags & VERBOSE) {
-	    syslog(LOG_DEBUG, "DEBUG: auth_shadow: account expired: %dl > %dl",
-		   today, sp->sp_expire);
+	    syslog(LOG_DEBUG, "DEBUG: auth_shadow: account expired: %ld > %ld",
+		   today, sp.expire);
 	}
 	RETURN("NO Account expired");
     }
 
     /* Remaining tests are relative to the last change date for the password */
 
-    if (sp->sp_lstchg != -1) {
+    if (sp.lstchg != -1) {
 
-	if ((sp->sp_max != -1) && ((sp->sp_lstchg + sp->sp_max) < today)) {
+	if ((sp.max != -1) && ((sp.lstchg + sp.max) < today)) {
 	    if (flags & VERBOSE) {
 		syslog(LOG_DEBUG,
 		       "DEBUG: auth_shadow: password expired: %ld + %ld < %ld",
-		       sp->sp_lstchg, sp->sp_max, today);
+		       sp.lstchg, sp.max, today);
 	    }
 	    RETURN("NO Password expired");
 	}
@@ -224,7 +443,6 @@ auth_shadow (
     }
     RETURN("OK");
 
-
 # elif defined(HAVE_GETUSERPW)
 
 /*************
@@ -26,3 +26,4 @@
  * END COPYRIGHT */
 
 char *auth_shadow(const char *, const char *, const char *, const char *);
+int auth_shadow_init(void);
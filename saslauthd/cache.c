@@ -50,22 +50,42 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <time.h>
+#include <sched.h>
+#ifdef __SSE2__
+/* the intrinsics headers need the __attribute__ saslauthd.h may
+ * have defined away */
+# undef __attribute__
+# include <emmintrin.h>
+#endif
 
 #include "cache.h"
 #include "utils.h"
 #include "globals.h"
 #include "md5global.h"
 #include "saslauthd_md5.h"
+#include "stats.h"
 
 /****************************************
  * module globals
  *****************************************/
-static  struct mm_ctl	mm;
-static  struct lock_ctl	lock;
-static  struct bucket	*table = NULL;
-static  struct stats	*table_stats = NULL;
-static  unsigned int	table_size = 0;
-static  unsigned int	table_timeout = 0;
+static  struct mm_ctl		mm;
+static  struct lock_ctl		lock;
+static  struct lock_impl	*lock_impl = NULL;
+static  struct cache_digest	*digest = NULL;
+static  unsigned char		digest_key[CACHE_DIGEST_KEY_LENGTH];
+static  struct cache_group	*table = NULL;
+static  struct stats		*table_stats = NULL;
+static  struct cache_counters	*counters = NULL;
+static  unsigned int		table_size = 0;
+static  unsigned int		table_timeout = 0;
+static  unsigned int		neg_ttl = CACHE_DEFAULT_NEG_TTL;
+static  unsigned int		max_failures = CACHE_DEFAULT_MAX_FAILURES;
+static  unsigned int		fail_window = CACHE_DEFAULT_FAIL_WINDOW;
+static  unsigned int		neg_timeout = 0;
+static  unsigned int		soft_ttl = CACHE_DEFAULT_SOFT_TTL;
+static  char			*snapshot_file = NULL;
+
+#define CACHE_COUNT(field)	STATS_ADD(counters[stats_slot % CACHE_COUNTER_SLOTS].field, 1)
 
 /****************************************
  * flags               global from saslauthd-main.c
@@ -74,6 +94,25 @@ static  unsigned int	table_timeout = 0;
  * logger()            function from utils.c
  *****************************************/
 
+/****************************************
+ * declarations/protos
+ *****************************************/
+static unsigned int	cache_match(const struct cache_group *, unsigned char);
+static int		cache_find(const struct cache_group *, unsigned char, int, const char *, unsigned int);
+static int		cache_insert(struct cache_group *, struct cache_result *, time_t);
+static int		cache_evict(struct cache_group *, int);
+static int		cache_expired(const struct bucket *, time_t);
+static void		cache_compact(struct cache_group *);
+static unsigned int	cache_probes(void);
+static unsigned int	cache_wlock_window(unsigned int, unsigned int *);
+static void		cache_unlock_window(unsigned int *, unsigned int);
+static unsigned int	cache_option_number(const char *, const char *);
+static int		cache_prepare(const char *, const char *, const char *, const char *, struct cache_result *);
+static int		cache_claim_refresh(unsigned int, int, struct cache_result *);
+static void		cache_load_snapshot(void);
+static void		cache_snapshot_checksum(struct cache_snapshot *, const char *, unsigned char *);
+static int		cache_init_digest(void);
+
 /*************************************************************
  * The initialization function. This function will setup
  * the hash table's memory region, initialize the table, etc.
@@ -97,8 +136,35 @@ int cache_init(void) {
 	if (table_size == 0)
 		table_size = CACHE_DEFAULT_TABLE_SIZE;
 
-	bytes = (table_size * CACHE_MAX_BUCKETS_PER * sizeof(struct bucket)) \
-		+ sizeof(struct stats) + 256;
+	/**************************************************************
+	 * The thread model takes the rwlocks unless told otherwise;
+	 * fcntl() locks don't keep the threads of a process apart.
+	 **************************************************************/
+	if (lock_impl == NULL && (flags & USE_THREAD_MODEL)) {
+		for (lock_impl = cache_lock_impls; lock_impl->name != NULL; lock_impl++) {
+			if (strcmp(lock_impl->name, "rwlock") == 0)
+				break;
+		}
+
+		if (lock_impl->name == NULL)
+			lock_impl = NULL;
+	}
+
+	if (lock_impl == NULL)
+		lock_impl = cache_lock_impls;
+
+	if ((flags & USE_THREAD_MODEL) && !lock_impl->threads) {
+		logger(L_ERR, L_FUNC, "cache lock %s doesn't work with worker threads",
+		       lock_impl->name);
+		return -1;
+	}
+
+	if (cache_init_digest() != 0)
+		return -1;
+
+	bytes = (table_size * sizeof(struct cache_group)) \
+		+ (CACHE_COUNTER_SLOTS * sizeof(struct cache_counters)) \
+		+ sizeof(struct stats) + 256 + lock_impl->bytes();
 
 
 	if ((base = cache_alloc_mm(bytes)) == NULL)
@@ -107,25 +173,52 @@ int cache_init(void) {
 	if (table_timeout == 0)
 		table_timeout = CACHE_DEFAULT_TIMEOUT;
 
+	if (soft_ttl >= table_timeout) {
+		logger(L_ERR, L_FUNC, "soft_ttl must be less than the cache timeout");
+		return -1;
+	}
+
+	/**************************************************************
+	 * A negative bucket is of no more use once both its password
+	 * digest and its failure count have gone stale.
+	 **************************************************************/
+
+	neg_timeout = neg_ttl;
+
+	if (max_failures > 0 && fail_window > neg_timeout)
+		neg_timeout = fail_window;
+
 	if (flags & VERBOSE) {
 		logger(L_DEBUG, L_FUNC, "bucket size: %d bytes",
 		       sizeof(struct bucket));
+		logger(L_DEBUG, L_FUNC, "group size : %d bytes",
+		       sizeof(struct cache_group));
 		logger(L_DEBUG, L_FUNC, "stats size : %d bytes",
 		       sizeof(struct stats));
 		logger(L_DEBUG, L_FUNC, "timeout    : %d seconds",
 		       table_timeout);
+		logger(L_DEBUG, L_FUNC, "digest     : %s",
+		       digest->name);
+		logger(L_DEBUG, L_FUNC, "soft timeout: %d seconds",
+		       soft_ttl);
+		logger(L_DEBUG, L_FUNC, "neg timeout: %d seconds",
+		       neg_ttl);
+		logger(L_DEBUG, L_FUNC, "throttling : %d failures in %d seconds",
+		       max_failures, fail_window);
 		logger(L_DEBUG, L_FUNC, "cache table: %d total bytes",
 		       bytes);
-		logger(L_DEBUG, L_FUNC, "cache table: %d slots",
+		logger(L_DEBUG, L_FUNC, "cache table: %d groups",
 		       table_size);
 		logger(L_DEBUG, L_FUNC, "cache table: %d buckets",
-		       table_size * CACHE_MAX_BUCKETS_PER);
+		       table_size * CACHE_GROUP_SLOTS);
 	} 
 
 	/**************************************************************
 	 * At the top of the region is the magic and stats struct. The
-	 * slots follow. Due to locking, the counters in the stats
-	 * struct will not be entirely accurate.
+	 * groups follow, then the per worker counters, then whatever the
+	 * slot locking needs to share. The mmap()ed region is page
+	 * aligned and the groups and counters are made of whole cache
+	 * lines, so each starts on a line of its own.
 	 **************************************************************/
 
 	memset(base, 0, bytes);
@@ -133,141 +226,221 @@ int cache_init(void) {
 	memcpy(base, cache_magic, 64);
 	table_stats = (void *)((char *)base + 64);
 	table_stats->table_size = table_size;
-	table_stats->max_buckets_per = CACHE_MAX_BUCKETS_PER;
+	table_stats->max_buckets_per = CACHE_GROUP_SLOTS;
 	table_stats->sizeof_bucket = sizeof(struct bucket);
+	table_stats->sizeof_group = sizeof(struct cache_group);
 	table_stats->timeout = table_timeout;
 	table_stats->bytes = bytes;
 
 	table = (void *)((char *)table_stats + 128);
 
+	counters = (void *)(table + table_size);
+	table_stats->counter_slots = CACHE_COUNTER_SLOTS;
+	table_stats->counters_offt = (char *)counters - (char *)base;
+
 	/**************************************************************
 	 * Last, initialize the hash table locking.
 	 **************************************************************/
 
-	if (cache_init_lock() != 0)
+	if (cache_init_lock(counters + CACHE_COUNTER_SLOTS) != 0)
 		return -1;
 
+	/**************************************************************
+	 * Bring back what we had before the restart, if we can. A
+	 * keyed digest's key is made anew at every start and never
+	 * leaves our memory, so its digests can't be kept.
+	 **************************************************************/
+
+	if (snapshot_file != NULL && digest->keyed) {
+		logger(L_ERR, L_FUNC, "no snapshot with the %s digest, it needs digest=md5", digest->name);
+
+		/* one from an earlier version holds the key */
+		unlink(snapshot_file);
+		free(snapshot_file);
+		snapshot_file = NULL;
+	}
+
+	if (snapshot_file != NULL)
+		cache_load_snapshot();
+
 	return 0;
 }	
 
 /*************************************************************
  * Here we'll take some credentials and run them through
  * the hash table. If we have a valid hit then all is good
- * return CACHE_OK. If we don't get a hit, write the entry to
- * the result pointer and expect a later call to
- * cache_commit() to flush the bucket into the table.
+ * return CACHE_OK. If the key is throttled, or the same
+ * password failed within the negative timeout, return
+ * CACHE_THROTTLED or CACHE_NEGATIVE. If we don't get a hit,
+ * write the entry to the result pointer and expect a later
+ * call to cache_commit() or cache_commit_failure() to flush
+ * the bucket into the table.
+ *
+ * A hit past the soft timeout is still good, but the first
+ * one to see it gets result->status set to CACHE_REFRESH and
+ * is expected to have the credentials verified again in the
+ * background and report with cache_refreshed().
  **************************************************************/
 int cache_lookup(const char *user, const char *realm, const char *service, const char *password, struct cache_result *result) {
 
-	int			user_length = 0;
-	int			realm_length = 0;
-	int			service_length = 0;
-	int			hash_offset;
-	unsigned char		pwd_digest[16];
-	MD5_CTX			md5_context;
+	unsigned int		group_offset = 0;
+	unsigned int		hit_offset = 0;
+	unsigned int		probe;
+	unsigned int		seq;
+	unsigned int		neg_failures = 0;
+	int			rc;
+	int			slot = -1;
+	int			neg_slot = -1;
+	int			want_neg;
+	int			pos;
+	int			neg;
+	int			tries;
+	unsigned char		read_digest[16];
+	unsigned char		neg_digest[16];
+	unsigned char		read_refreshing = 0;
 	time_t			epoch;
-	time_t			epoch_timeout;
-	struct bucket		*ref_bucket;
-	struct bucket		*low_bucket;
-	struct bucket		*high_bucket;
-	struct bucket		*read_bucket = NULL;
-	char			userrealmserv[CACHE_MAX_CREDS_LENGTH];
+	time_t			read_created = 0;
+	time_t			neg_created = 0;
+	struct cache_group	*group = NULL;
+	struct cache_group	*hit_group = NULL;
 	static char		*debug = "[login=%s] [service=%s] [realm=%s]: %s";
 
 
 	if (!(flags & CACHE_ENABLED))
 		return CACHE_FAIL;
 
-	memset((void *)result, 0, sizeof(struct cache_result));
-	result->status = CACHE_NO_FLUSH;
-	
+	if ((rc = cache_prepare(user, realm, service, password, result)) != CACHE_OK)
+		return rc;
+
+	rc = CACHE_FAIL;
+	epoch = result->bucket.created;
+
 	/**************************************************************
-	 * Initial length checks
+	 * Probe the home group and the ones after it for the key's
+	 * buckets (the negative one only when there is a use for
+	 * it). Each group is searched inside a read section: under a
+	 * read lock, or repeated if a writer got in the way (seqlock).
+	 * Only what was read in a section that completed cleanly is
+	 * used.
 	 **************************************************************/
 
-	user_length = strlen(user) + 1;
-	realm_length = strlen(realm) + 1;
-	service_length = strlen(service) + 1;
+	CACHE_COUNT(attempts);
+	want_neg = neg_timeout > 0;
 
-	if ((user_length + realm_length + service_length) > CACHE_MAX_CREDS_LENGTH) {
-		return CACHE_TOO_BIG;
-	}
+	for (probe = 0; probe < cache_probes() && (slot < 0 || (want_neg && neg_slot < 0)); probe++) {
+		group_offset = (result->hash_offset + probe) % table_size;
+		group = table + group_offset;
 
-	/**************************************************************
-	 * Any ideas on how not to call time() for every lookup?
-	 **************************************************************/
+		for (tries = 0; ; tries++) {
+			if (tries == CACHE_SEQLOCK_RETRIES ||
+			    cache_read_begin(group_offset, &seq) != 0) {
+				result->status = CACHE_NO_FLUSH;
+				CACHE_COUNT(misses);
+				CACHE_COUNT(lock_failures);
+				return CACHE_FAIL;
+			}
 
-	epoch = time(NULL);
-	epoch_timeout = epoch - table_timeout;
+			pos = slot < 0 ? cache_find(group, result->fp, 0, result->key, result->bucket.key_len) : -1;
+			neg = want_neg && neg_slot < 0 ? cache_find(group, result->fp, 1, result->key, result->bucket.key_len) : -1;
 
-	/**************************************************************
-	 * Get the offset into the hash table and the md5 sum of
-	 * the password.
-	 **************************************************************/
+			if (pos >= 0) {
+				memcpy(read_digest, group->buckets[pos].pwd_digest, 16);
+				read_created = group->buckets[pos].created;
+				read_refreshing = group->buckets[pos].refreshing;
+			}
 
-	strlcpy(userrealmserv, user, sizeof(userrealmserv));
-	strlcat(userrealmserv, realm, sizeof(userrealmserv));
-	strlcat(userrealmserv, service, sizeof(userrealmserv));
+			if (neg >= 0) {
+				memcpy(neg_digest, group->buckets[neg].pwd_digest, 16);
+				neg_created = group->buckets[neg].created;
+				neg_failures = group->buckets[neg].failures;
+			}
 
-	hash_offset = cache_pjwhash(userrealmserv);
+			if (cache_read_retry(group_offset, seq) == 0)
+				break;
+		}
 
-	_saslauthd_MD5Init(&md5_context);
-	_saslauthd_MD5Update(&md5_context, password, strlen(password));
-	_saslauthd_MD5Final(pwd_digest, &md5_context);
+		if (pos >= 0) {
+			slot = pos;
+			hit_group = group;
+			hit_offset = group_offset;
+		}
+
+		if (neg >= 0)
+			neg_slot = neg;
+	}
 
 	/**************************************************************
-	 * Loop through the bucket chain to try and find a hit.
-	 *
-	 * low_bucket = bucket at the start of the slot.
-	 *
-	 * high_bucket = last bucket in the slot.
-	 * 
-	 * read_bucket = Contains the matched bucket if found. 
-	 *               Otherwise is NULL.
-	 *
-	 * Also, lock the slot first to avoid contention in the 
-	 * bucket chain.
-	 *
+	 * Recent failures come first, a throttled key is refused
+	 * whatever the password (else the positive bucket would
+	 * still answer the guesses).
 	 **************************************************************/
 
-	table_stats->attempts++;
+	if (neg_slot >= 0) {
 
-	if (cache_get_rlock(hash_offset) != 0) {
-		table_stats->misses++;
-		table_stats->lock_failures++;
-		return CACHE_FAIL;
-	}	
+		if (max_failures > 0 && neg_failures >= max_failures &&
+		    neg_created > epoch - (time_t)fail_window) {
 
-	low_bucket = table + (CACHE_MAX_BUCKETS_PER * hash_offset);
-	high_bucket = low_bucket + CACHE_MAX_BUCKETS_PER;
+			if (flags & VERBOSE)
+				logger(L_DEBUG, L_FUNC, debug, user, realm, service, "throttled");
 
-	for (ref_bucket = low_bucket; ref_bucket < high_bucket; ref_bucket++) {
-		if (strcmp(user, ref_bucket->creds + ref_bucket->user_offt) == 0 && \
-		    strcmp (realm, ref_bucket->creds + ref_bucket->realm_offt) == 0 && \
-		    strcmp(service, ref_bucket->creds + ref_bucket->service_offt) == 0) {
-			read_bucket = ref_bucket;
-			break;
+			result->status = CACHE_NO_FLUSH;
+			CACHE_COUNT(throttled);
+			return CACHE_THROTTLED;
+		}
+
+		if (neg_ttl > 0 && neg_created > epoch - (time_t)neg_ttl &&
+		    memcmp(result->bucket.pwd_digest, neg_digest, 16) == 0) {
+
+			if (flags & VERBOSE)
+				logger(L_DEBUG, L_FUNC, debug, user, realm, service, "found with failed passwd");
+
+			result->status = CACHE_NO_FLUSH;
+			CACHE_COUNT(negative_hits);
+			return CACHE_NEGATIVE;
 		}
 	}
 
 	/**************************************************************
 	 * If we have our fish, check the password. If it's good,
-	 * release the slot (row) lock and return CACHE_OK. Else,
-	 * we'll write the entry to the result pointer. If we have a
-	 * read_bucket, then tell cache_commit() to not rescan the 
-	 * chain (CACHE_FLUSH). Else, have cache_commit() determine the
-	 * best bucket to place the new entry (CACHE_FLUSH_WITH_RESCAN).
+	 * mark the bucket referenced for the CLOCK and return
+	 * CACHE_OK, asking for a refresh if it's getting old, or for
+	 * cache_commit() to clear any failures the key had. Else,
+	 * we'll leave the entry in the result pointer for
+	 * cache_commit().
 	 **************************************************************/
 
-	if (read_bucket != NULL && read_bucket->created > epoch_timeout) {
+	if (slot >= 0 && read_created > epoch - (time_t)table_timeout) {
 
-		if (memcmp(pwd_digest, read_bucket->pwd_digest, 16) == 0) {
+		if (memcmp(result->bucket.pwd_digest, read_digest, 16) == 0) {
 
 			if (flags & VERBOSE)
 				logger(L_DEBUG, L_FUNC, debug, user, realm, service, "found with valid passwd");
 
-			cache_un_lock(hash_offset);
-			table_stats->hits++;
+			/* a lost update here only costs the bucket its second chance */
+			if (hit_group->ref[slot] == 0)
+				hit_group->ref[slot] = 1;
+
+			CACHE_COUNT(hits);
+
+			if (soft_ttl > 0 && !read_refreshing &&
+			    read_created <= epoch - (time_t)soft_ttl &&
+			    cache_claim_refresh(hit_offset, slot, result) == 0) {
+
+				if (flags & VERBOSE)
+					logger(L_DEBUG, L_FUNC, debug, user, realm, service, "refresh pending");
+
+				result->status = CACHE_REFRESH;
+				return CACHE_OK;
+			}
+
+			if (neg_slot < 0) {
+				result->status = CACHE_NO_FLUSH;
+				return CACHE_OK;
+			}
+
+			/* the credentials keep their age */
+			result->status = CACHE_FLUSH;
+			result->bucket.created = read_created;
 			return CACHE_OK;
 		}
 
@@ -284,107 +457,641 @@ int cache_lookup(const char *user, const char *realm, const char *service, const
 		result->status = CACHE_FLUSH_WITH_RESCAN;
 	}
 
-	result->hash_offset = hash_offset;
-	result->read_bucket = read_bucket;
-	
-	result->bucket.user_offt = 0;
-	result->bucket.realm_offt = user_length;
-	result->bucket.service_offt = user_length + realm_length;
+	CACHE_COUNT(misses);
+	return rc;
+}
 
-	strcpy(result->bucket.creds + result->bucket.user_offt, user);	
-	strcpy(result->bucket.creds + result->bucket.realm_offt, realm);	
-	strcpy(result->bucket.creds + result->bucket.service_offt, service);	
 
-	memcpy(result->bucket.pwd_digest, pwd_digest, 16);
-	result->bucket.created = epoch;
+/*************************************************************
+ * Fill in a result for some credentials: the key, its hash
+ * and fingerprint, and a bucket holding the digest of the
+ * password, created now. A fingerprint of 0 marks a free
+ * bucket.
+ **************************************************************/
+static int cache_prepare(const char *user, const char *realm, const char *service, const char *password, struct cache_result *result) {
+
+	unsigned int		user_length;
+	unsigned int		realm_length;
+	unsigned int		service_length;
+	unsigned int		key_length;
+	unsigned int		hash;
+
+
+	memset((void *)result, 0, sizeof(struct cache_result));
+	result->status = CACHE_NO_FLUSH;
+
+	/**************************************************************
+	 * Initial length checks
+	 **************************************************************/
+
+	user_length = strlen(user) + 1;
+	realm_length = strlen(realm) + 1;
+	service_length = strlen(service) + 1;
+	key_length = user_length + realm_length + service_length;
+
+	if (key_length > CACHE_MAX_CREDS_LENGTH) {
+		return CACHE_TOO_BIG;
+	}
+
+	memcpy(result->key, user, user_length);
+	memcpy(result->key + user_length, realm, realm_length);
+	memcpy(result->key + user_length + realm_length, service, service_length);
+
+	hash = cache_hash(result->key, key_length);
+
+	result->hash_offset = hash % table_size;
+
+	if ((result->fp = (hash * 2654435761U) >> 24) == 0)
+		result->fp = 1;
+
+	result->bucket.key_len = key_length;
+	result->bucket.user_len = user_length;
+	result->bucket.realm_len = realm_length;
+
+	digest->sum(result->key, key_length, password, result->bucket.pwd_digest);
+
+	/**************************************************************
+	 * Any ideas on how not to call time() for every lookup?
+	 **************************************************************/
+
+	result->bucket.created = time(NULL);
+
+	return CACHE_OK;
+}
+
+
+/*************************************************************
+ * Mark a bucket as being refreshed, unless someone beat us to
+ * it or it changed since we read it. Return 0 if the refresh
+ * is ours.
+ **************************************************************/
+static int cache_claim_refresh(unsigned int group_offset, int slot, struct cache_result *result) {
+
+	struct cache_group	*group = table + group_offset;
+	struct bucket		*ref_bucket = group->buckets + slot;
+	int			rc = -1;
+
+
+	if (cache_get_wlock(group_offset) != 0) {
+		CACHE_COUNT(lock_failures);
+		return -1;
+	}
+
+	if (cache_find(group, result->fp, 0, result->key, result->bucket.key_len) == slot &&
+	    !ref_bucket->refreshing &&
+	    memcmp(ref_bucket->pwd_digest, result->bucket.pwd_digest, 16) == 0) {
+		ref_bucket->refreshing = 1;
+		rc = 0;
+	}
+
+	cache_un_lock(group_offset);
+
+	return rc;
+}
+
+
+/*************************************************************
+ * The mechanism has had its say on credentials handed out for
+ * a refresh (verified is 1 if it took the password, 0 if it
+ * refused it and -1 if it couldn't tell). Good credentials
+ * start a new life, refused ones are dropped, and otherwise
+ * the bucket is left to its hard timeout.
+ **************************************************************/
+void cache_refreshed(const char *user, const char *realm, const char *service, const char *password, int verified) {
+	struct cache_result	result;
+	unsigned int		offsets[CACHE_PROBE_GROUPS];
+	unsigned int		probes;
+	unsigned int		locked;
+	unsigned int		x;
+	int			slot;
+	struct cache_group	*group;
+
+	if (!(flags & CACHE_ENABLED))
+		return;
+
+	if (cache_prepare(user, realm, service, password, &result) != CACHE_OK)
+		return;
+
+	if (verified > 0) {
+		result.status = CACHE_FLUSH_WITH_RESCAN;
+		cache_commit(&result);
+		CACHE_COUNT(refreshes);
+		return;
+	}
+
+	probes = cache_probes();
+
+	if ((locked = cache_wlock_window(result.hash_offset, offsets)) < probes)
+		goto unlock;
+
+	for (x = 0; x < probes; x++) {
+		group = table + (result.hash_offset + x) % table_size;
+
+		if ((slot = cache_find(group, result.fp, 0, result.key, result.bucket.key_len)) < 0 ||
+		    memcmp(group->buckets[slot].pwd_digest, result.bucket.pwd_digest, 16) != 0)
+			continue;
+
+		if (verified == 0) {
+			group->fp[slot] = 0;
+			CACHE_COUNT(refresh_failures);
+		} else {
+			group->buckets[slot].refreshing = 0;
+		}
+
+		break;
+	}
+
+ unlock:
+	cache_unlock_window(offsets, locked);
 
-	cache_un_lock(hash_offset);
-	table_stats->misses++;
-	return CACHE_FAIL;
+	return;
 }
 
 
 /*************************************************************
  * If it was later determined that the previous failed lookup
  * is ok, flush the result->bucket out to it's permanent home
- * in the hash table. 
+ * in the hash table. The key's failures are forgotten.
  **************************************************************/
 void cache_commit(struct cache_result *result) {
-	struct bucket           *write_bucket;
-	struct bucket		*ref_bucket;
-	struct bucket		*low_bucket;
-	struct bucket		*high_bucket;
+	unsigned int		offsets[CACHE_PROBE_GROUPS];
+	unsigned int		probes;
+	unsigned int		locked;
+	unsigned int		x;
+	int			slot;
+	time_t			epoch;
+	struct cache_group	*group;
 
 	if (!(flags & CACHE_ENABLED))
 		return;
 
-	if (result->status == CACHE_NO_FLUSH)
+	if (result->status == CACHE_NO_FLUSH || result->status == CACHE_REFRESH)
 		return;
 
-	if (cache_get_wlock(result->hash_offset) != 0) {
-		table_stats->lock_failures++;
-		return;
-	}	
+	probes = cache_probes();
 
-	if (result->status == CACHE_FLUSH) {
-		write_bucket = result->read_bucket;
-	} else {
-		/*********************************************************
-		 * CACHE_FLUSH_WITH_RESCAN is the default action to take.
-	 	 * Simply traverse the slot looking for the oldest bucket
-		 * and mark it for writing.
-	 	 **********************************************************/
-		low_bucket = table + (CACHE_MAX_BUCKETS_PER * result->hash_offset);
-		high_bucket = low_bucket + CACHE_MAX_BUCKETS_PER;
-		write_bucket = low_bucket;
-
-		for (ref_bucket = low_bucket; ref_bucket < high_bucket; ref_bucket++) {
-			if (ref_bucket->created < write_bucket->created) 
-				write_bucket = ref_bucket;
+	if ((locked = cache_wlock_window(result->hash_offset, offsets)) < probes)
+		goto unlock;
+
+	epoch = time(NULL);
+
+	/**************************************************************
+	 * A bucket already holding the key just gets the new password
+	 * digest. Otherwise take the first free (or expired) bucket
+	 * whose group has room for the key in its arena, and failing
+	 * that, evict buckets from the home group until the key fits.
+	 **************************************************************/
+	for (x = 0; x < probes; x++) {
+		group = table + (result->hash_offset + x) % table_size;
+
+		if ((slot = cache_find(group, result->fp, 1, result->key, result->bucket.key_len)) >= 0)
+			group->fp[slot] = 0;
+	}
+
+	for (x = 0; x < probes; x++) {
+		group = table + (result->hash_offset + x) % table_size;
+
+		if ((slot = cache_find(group, result->fp, 0, result->key, result->bucket.key_len)) >= 0) {
+			memcpy(group->buckets[slot].pwd_digest, result->bucket.pwd_digest, 16);
+			group->buckets[slot].created = result->bucket.created;
+			group->buckets[slot].refreshing = 0;
+			goto done;
 		}
 	}
 
-	memcpy((void *)write_bucket, (void *)&(result->bucket), sizeof(struct bucket));
+	for (x = 0; x < probes; x++) {
+		group = table + (result->hash_offset + x) % table_size;
+
+		if (cache_insert(group, result, epoch) == 0)
+			goto done;
+	}
 
+	group = table + result->hash_offset;
+
+	do {
+		if (cache_evict(group, 0) != 0) {
+			logger(L_ERR, L_FUNC, "could not make room in group: %d", result->hash_offset);
+			goto unlock;
+		}
+	} while (cache_insert(group, result, epoch) != 0);
+
+ done:
 	if (flags & VERBOSE)
 		logger(L_DEBUG, L_FUNC, "lookup committed");
 
-	cache_un_lock(result->hash_offset);
+ unlock:
+	cache_unlock_window(offsets, locked);
+
 	return;
 }
 
 
 /*************************************************************
- * Hashing function. Algorithm is an adaptation of Peter
- * Weinberger's (PJW) generic hashing algorithm, which
- * is based on Allen Holub's version. 
+ * The mechanism turned the previous failed lookup down. Count
+ * the failure in the key's negative bucket along with the
+ * password's digest. Failures only displace other negative
+ * buckets, so a flood of bad logins can't push the good
+ * credentials out of the table.
  **************************************************************/
-int cache_pjwhash(char *datum ) {
-    const int BITS_IN_int = ( sizeof(int) * CHAR_BIT );
-    const int THREE_QUARTERS = ((int) ((BITS_IN_int * 3) / 4));
-    const int ONE_EIGHTH = ((int) (BITS_IN_int / 8));
-    const int HIGH_BITS = ( ~((unsigned int)(~0) >> ONE_EIGHTH ));
-    
-    unsigned int            hash_value, i;
-    
-    for (hash_value = 0; *datum; ++datum) {
-	hash_value = (hash_value << ONE_EIGHTH) + *datum;
-	if ((i = hash_value & HIGH_BITS) != 0)
-	    hash_value = (hash_value ^ (i >> THREE_QUARTERS)) & ~HIGH_BITS;
-    }
-    
-    return (hash_value % table_size);
+void cache_commit_failure(struct cache_result *result) {
+	unsigned int		offsets[CACHE_PROBE_GROUPS];
+	unsigned int		probes;
+	unsigned int		locked;
+	unsigned int		x;
+	int			slot;
+	time_t			epoch;
+	struct bucket		*ref_bucket;
+	struct cache_group	*group;
+
+	if (!(flags & CACHE_ENABLED) || neg_timeout == 0)
+		return;
+
+	if (result->status == CACHE_NO_FLUSH)
+		return;
+
+	probes = cache_probes();
+
+	if ((locked = cache_wlock_window(result->hash_offset, offsets)) < probes)
+		goto unlock;
+
+	epoch = time(NULL);
+
+	for (x = 0; x < probes; x++) {
+		group = table + (result->hash_offset + x) % table_size;
+
+		if ((slot = cache_find(group, result->fp, 1, result->key, result->bucket.key_len)) < 0)
+			continue;
+
+		ref_bucket = group->buckets + slot;
+
+		if (ref_bucket->created > epoch - (time_t)fail_window) {
+			if (ref_bucket->failures < USHRT_MAX)
+				ref_bucket->failures++;
+		} else {
+			ref_bucket->failures = 1;
+		}
+
+		memcpy(ref_bucket->pwd_digest, result->bucket.pwd_digest, 16);
+		ref_bucket->created = epoch;
+		goto done;
+	}
+
+	result->bucket.negative = 1;
+	result->bucket.failures = 1;
+	result->bucket.created = epoch;
+
+	for (x = 0; x < probes; x++) {
+		group = table + (result->hash_offset + x) % table_size;
+
+		if (cache_insert(group, result, epoch) == 0)
+			goto done;
+	}
+
+	group = table + result->hash_offset;
+
+	do {
+		if (cache_evict(group, 1) != 0) {
+			if (flags & VERBOSE)
+				logger(L_DEBUG, L_FUNC, "no room for failure in group: %d", result->hash_offset);
+			goto unlock;
+		}
+	} while (cache_insert(group, result, epoch) != 0);
+
+ done:
+	if (flags & VERBOSE)
+		logger(L_DEBUG, L_FUNC, "failure committed");
+
+ unlock:
+	cache_unlock_window(offsets, locked);
+
+	return;
 }
 
+
+/*************************************************************
+ * Write lock every group a key with the given home may live
+ * in, in ascending order so concurrent commits can't deadlock.
+ * The offsets locked are left in offsets[]. Return how many
+ * were locked, fewer than cache_probes() on failure.
+ **************************************************************/
+static unsigned int cache_wlock_window(unsigned int hash_offset, unsigned int *offsets) {
+
+	unsigned int		probes;
+	unsigned int		locked;
+	unsigned int		x;
+	unsigned int		y;
+
+
+	probes = cache_probes();
+
+	for (x = 0; x < probes; x++) {
+		offsets[x] = (hash_offset + x) % table_size;
+
+		for (y = x; y > 0 && offsets[y] < offsets[y - 1]; y--) {
+			offsets[y] ^= offsets[y - 1];
+			offsets[y - 1] ^= offsets[y];
+			offsets[y] ^= offsets[y - 1];
+		}
+	}
+
+	for (locked = 0; locked < probes; locked++) {
+		if (cache_get_wlock(offsets[locked]) != 0) {
+			CACHE_COUNT(lock_failures);
+			break;
+		}
+	}
+
+	return locked;
+}
+
+
+/*************************************************************
+ * Release the write locks taken by cache_wlock_window().
+ **************************************************************/
+static void cache_unlock_window(unsigned int *offsets, unsigned int locked) {
+
+	while (locked > 0)
+		cache_un_lock(offsets[--locked]);
+}
+
+
+/*************************************************************
+ * Return a bitmask of the buckets in a group whose fingerprint
+ * matches, comparing all of them at once where we can.
+ **************************************************************/
+static unsigned int cache_match(const struct cache_group *group, unsigned char fp) {
+
+#if defined(__SSE2__) && CACHE_GROUP_SLOTS == 16
+	__m128i		fps;
+
+	fps = _mm_loadu_si128((const __m128i *)group->fp);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(fps, _mm_set1_epi8((char)fp)));
+#else
+	unsigned int	mask = 0;
+	int		x;
+
+	for (x = 0; x < CACHE_GROUP_SLOTS; x++) {
+		if (group->fp[x] == fp)
+			mask |= 1 << x;
+	}
+
+	return mask;
+#endif
+}
+
+
+/*************************************************************
+ * Find the (positive or negative) bucket holding a key in a
+ * group. The key offset is checked against the arena, as a
+ * seqlock reader may see a bucket halfway through an update.
+ * Return the bucket's index, -1 if it's not there.
+ **************************************************************/
+static int cache_find(const struct cache_group *group, unsigned char fp, int negative, const char *key, unsigned int key_length) {
+
+	const struct bucket	*ref_bucket;
+	unsigned int		mask;
+	int			slot;
+
+
+	for (mask = cache_match(group, fp), slot = 0; mask != 0; mask >>= 1, slot++) {
+		if (!(mask & 1))
+			continue;
+
+		ref_bucket = group->buckets + slot;
+
+		if (ref_bucket->negative == negative &&
+		    ref_bucket->key_len == key_length &&
+		    ref_bucket->key_offt + key_length <= CACHE_GROUP_ARENA &&
+		    memcmp(group->arena + ref_bucket->key_offt, key, key_length) == 0)
+			return slot;
+	}
+
+	return -1;
+}
+
+
+/*************************************************************
+ * Put a new entry in a free bucket of a group, treating the
+ * expired ones as free. Return 0 if it went in, -1 if the
+ * group is full or its arena has no room for the key. The
+ * caller holds the group's write lock.
+ **************************************************************/
+static int cache_insert(struct cache_group *group, struct cache_result *result, time_t epoch) {
+
+	struct bucket	*write_bucket;
+	int		slot = -1;
+	int		x;
+
+
+	for (x = 0; x < CACHE_GROUP_SLOTS; x++) {
+		if (group->fp[x] != 0 && cache_expired(group->buckets + x, epoch))
+			group->fp[x] = 0;
+
+		if (group->fp[x] == 0 && slot < 0)
+			slot = x;
+	}
+
+	if (slot < 0)
+		return -1;
+
+	if (group->arena_used + result->bucket.key_len > CACHE_GROUP_ARENA) {
+		cache_compact(group);
+
+		if (group->arena_used + result->bucket.key_len > CACHE_GROUP_ARENA)
+			return -1;
+	}
+
+	write_bucket = group->buckets + slot;
+
+	memcpy(group->arena + group->arena_used, result->key, result->bucket.key_len);
+	memcpy((void *)write_bucket, (void *)&(result->bucket), sizeof(struct bucket));
+	write_bucket->key_offt = group->arena_used;
+	group->arena_used += result->bucket.key_len;
+
+	group->ref[slot] = 0;
+	group->fp[slot] = result->fp;
+
+	return 0;
+}
+
+
+/*************************************************************
+ * Free one bucket of a group using the CLOCK algorithm: the
+ * hand sweeps the buckets, sparing (once) those that were hit
+ * since it last passed. With negative_only set, only negative
+ * buckets are candidates. Return 0 if a bucket was freed, -1
+ * if there was none to free. The caller holds the write lock.
+ **************************************************************/
+static int cache_evict(struct cache_group *group, int negative_only) {
+
+	int		slot;
+	int		x;
+
+
+	for (x = 0; x < 2 * CACHE_GROUP_SLOTS; x++) {
+		slot = group->hand;
+		group->hand = (slot + 1) % CACHE_GROUP_SLOTS;
+
+		if (group->fp[slot] == 0)
+			continue;
+
+		if (negative_only && !group->buckets[slot].negative)
+			continue;
+
+		if (group->ref[slot]) {
+			group->ref[slot] = 0;
+			continue;
+		}
+
+		group->fp[slot] = 0;
+		CACHE_COUNT(evictions);
+
+		if (flags & VERBOSE)
+			logger(L_DEBUG, L_FUNC, "evicted: %s", group->arena + group->buckets[slot].key_offt);
+
+		return 0;
+	}
+
+	return -1;
+}
+
+
+/*************************************************************
+ * Has a bucket outlived its timeout?
+ **************************************************************/
+static int cache_expired(const struct bucket *ref_bucket, time_t epoch) {
+
+	if (ref_bucket->negative)
+		return ref_bucket->created <= epoch - (time_t)neg_timeout;
+
+	return ref_bucket->created <= epoch - (time_t)table_timeout;
+}
+
+
+/*************************************************************
+ * Pack the keys of the buckets in use at the start of the
+ * group's arena, reclaiming the space of freed buckets. The
+ * caller holds the write lock.
+ **************************************************************/
+static void cache_compact(struct cache_group *group) {
+
+	char		arena[CACHE_GROUP_ARENA];
+	unsigned short	used = 0;
+	struct bucket	*ref_bucket;
+	int		x;
+
+
+	for (x = 0; x < CACHE_GROUP_SLOTS; x++) {
+		if (group->fp[x] == 0)
+			continue;
+
+		ref_bucket = group->buckets + x;
+		memcpy(arena + used, group->arena + ref_bucket->key_offt, ref_bucket->key_len);
+		ref_bucket->key_offt = used;
+		used += ref_bucket->key_len;
+	}
+
+	memcpy(group->arena, arena, used);
+	group->arena_used = used;
+}
+
+
+/*************************************************************
+ * The number of groups a key may live in.
+ **************************************************************/
+static unsigned int cache_probes(void) {
+
+	return table_size < CACHE_PROBE_GROUPS ? table_size : CACHE_PROBE_GROUPS;
+}
+
+
+/*************************************************************
+ * Hashing function, 32 bit FNV-1a.
+ **************************************************************/
+unsigned int cache_hash(const char *datum, unsigned int length) {
+
+	unsigned int	hash_value = 2166136261U;
+
+	while (length-- > 0) {
+		hash_value ^= (unsigned char)*datum++;
+		hash_value *= 16777619U;
+	}
+
+	return hash_value;
+}
+
+/*************************************************************
+ * Are hits past the soft timeout to be refreshed?
+ **************************************************************/
+int cache_refresh_enabled(void) {
+
+	return soft_ttl > 0;
+}
+
+
+/*************************************************************
+ * Sum up the per worker lookup counters.
+ **************************************************************/
+void cache_get_counters(struct cache_counters *sum) {
+
+	struct cache_counters	*ref;
+	int			x;
+
+	memset(sum, 0, sizeof(struct cache_counters));
+
+	for (x = 0; counters != NULL && x < CACHE_COUNTER_SLOTS; x++) {
+		ref = counters + x;
+
+		sum->hits += ref->hits;
+		sum->misses += ref->misses;
+		sum->lock_failures += ref->lock_failures;
+		sum->attempts += ref->attempts;
+		sum->evictions += ref->evictions;
+		sum->negative_hits += ref->negative_hits;
+		sum->throttled += ref->throttled;
+		sum->refreshes += ref->refreshes;
+		sum->refresh_failures += ref->refresh_failures;
+	}
+}
+
+
+/*************************************************************
+ * Count the unexpired buckets, in all and how many of them are
+ * negative, and the buckets there are. The groups are read
+ * without locking, the numbers are only a snapshot anyway.
+ **************************************************************/
+void cache_get_occupancy(unsigned int *used, unsigned int *negative, unsigned int *total) {
+
+	struct cache_group	*group;
+	time_t			epoch;
+	unsigned int		x, y;
+
+	*used = *negative = 0;
+	*total = table_size * CACHE_GROUP_SLOTS;
+	epoch = time(NULL);
+
+	for (x = 0; table != NULL && x < table_size; x++) {
+		group = table + x;
+
+		for (y = 0; y < CACHE_GROUP_SLOTS; y++) {
+			if (group->fp[y] == 0 || cache_expired(group->buckets + y, epoch))
+				continue;
+
+			(*used)++;
+
+			if (group->buckets[y].negative)
+				(*negative)++;
+		}
+	}
+}
+
+
 /*************************************************************
  * Allow someone to set the hash table size (in kilobytes).
- * Since the hash table has to be prime, this won't be exact.
+ * The table is made of whole groups, so this won't be exact.
  **************************************************************/
 void cache_set_table_size(const char *size) {
-	unsigned int	kilobytes;
-	unsigned int	bytes;
-	unsigned int	calc_bytes = 0;
-	unsigned int	calc_table_size = 1;
+	long		kilobytes;
 
 	kilobytes = strtol(size, (char **)NULL, 10);
 
@@ -394,18 +1101,10 @@ void cache_set_table_size(const char *size) {
 		exit(1);
 	}
 
-	bytes = kilobytes * 1024;
-
-	calc_table_size =
-	    bytes / (sizeof(struct bucket) * CACHE_MAX_BUCKETS_PER);
+	table_size = (kilobytes * 1024) / sizeof(struct cache_group);
 
-	do {
-	    calc_table_size = cache_get_next_prime(calc_table_size);
-	    calc_bytes = calc_table_size *
-		sizeof(struct bucket) * CACHE_MAX_BUCKETS_PER; 
-	} while (calc_bytes < bytes);
-
-	table_size = calc_table_size;
+	if (table_size == 0)
+		table_size = 1;
 
 	return;
 }
@@ -422,56 +1121,406 @@ void cache_set_timeout(const char *time) {
 		exit(1);
 	}
 
-	return;
-}
+	return;
+}
+
+
+/*************************************************************
+ * Allow someone to set one of the less common cache tunables
+ * given as name=value (-C). Currently:
+ *
+ *   lock=<impl>          slot locking implementation, see
+ *                        cache_lock_impls[]
+ *   digest=<name>        password digest, see cache_digests[]
+ *   soft_ttl=<secs>      age after which a hit gets its credentials
+ *                        verified again in the background (0: off)
+ *   snapshot=<file>      save the cache here at shutdown and load it
+ *                        back at startup, unkeyed digests only
+ *   neg_ttl=<secs>       how long a failed password is refused
+ *                        without asking the mechanism (0: off)
+ *   max_failures=<n>     refuse a key outright after n failures
+ *                        in a row (0: off) ...
+ *   fail_window=<secs>   ... each within this long of the last
+ **************************************************************/
+void cache_set_option(const char *option) {
+	char		name[32];
+	const char	*value;
+	struct lock_impl *impl;
+
+	if ((value = strchr(option, '=')) == NULL ||
+	    (size_t)(value - option) >= sizeof(name)) {
+		logger(L_ERR, L_FUNC, "cache option must be name=value: %s", option);
+		exit(1);
+	}
+
+	memcpy(name, option, value - option);
+	name[value - option] = '\0';
+	value++;
+
+	if (strcmp(name, "lock") == 0) {
+		for (impl = cache_lock_impls; impl->name != NULL; impl++) {
+			if (strcmp(value, impl->name) == 0) {
+				lock_impl = impl;
+				return;
+			}
+		}
+
+		logger(L_ERR, L_FUNC, "unknown cache lock: %s", value);
+		exit(1);
+	}
+
+	if (strcmp(name, "digest") == 0) {
+		for (digest = cache_digests; digest->name != NULL; digest++) {
+			if (strcmp(value, digest->name) == 0)
+				return;
+		}
+
+		logger(L_ERR, L_FUNC, "unknown cache digest: %s", value);
+		exit(1);
+	}
+
+	if (strcmp(name, "snapshot") == 0) {
+		if (*value != '/') {
+			logger(L_ERR, L_FUNC, "snapshot must be an absolute path: %s", value);
+			exit(1);
+		}
+
+		if ((snapshot_file = strdup(value)) == NULL) {
+			logger(L_ERR, L_FUNC, "could not allocate memory");
+			exit(1);
+		}
+
+		return;
+	}
+
+	if (strcmp(name, "soft_ttl") == 0) {
+		soft_ttl = cache_option_number(name, value);
+		return;
+	}
+
+	if (strcmp(name, "neg_ttl") == 0) {
+		neg_ttl = cache_option_number(name, value);
+		return;
+	}
+
+	if (strcmp(name, "max_failures") == 0) {
+		max_failures = cache_option_number(name, value);
+
+		if (max_failures > USHRT_MAX) {
+			logger(L_ERR, L_FUNC, "max_failures must be at most %d", USHRT_MAX);
+			exit(1);
+		}
+
+		return;
+	}
+
+	if (strcmp(name, "fail_window") == 0) {
+		if ((fail_window = cache_option_number(name, value)) == 0) {
+			logger(L_ERR, L_FUNC, "fail_window must be positive");
+			exit(1);
+		}
+
+		return;
+	}
+
+	logger(L_ERR, L_FUNC, "unknown cache option: %s", name);
+	exit(1);
+}
+
+
+/*************************************************************
+ * Parse the value of a numeric cache option.
+ **************************************************************/
+static unsigned int cache_option_number(const char *name, const char *value) {
+	char		*end;
+	long		number;
+
+	number = strtol(value, &end, 10);
+
+	if (*value == '\0' || *end != '\0' || number < 0 || number > INT_MAX) {
+		logger(L_ERR, L_FUNC, "%s must be a non negative number: %s", name, value);
+		exit(1);
+	}
+
+	return (unsigned int)number;
+}
+
+
+/*************************************************************
+ * Write the live entries out to the snapshot file, if there
+ * is to be one. Each group is copied out in a read section, so
+ * workers still winding down don't get in the way. The file is
+ * written aside and renamed over the old one.
+ **************************************************************/
+void cache_save_snapshot(void) {
+	struct cache_snapshot	*header;
+	struct cache_group	copy;
+	struct bucket		*ref_bucket;
+	unsigned char		checksum[16];
+	unsigned int		bytes;
+	unsigned int		seq;
+	unsigned int		x;
+	int			y;
+	int			tries;
+	int			file_fd;
+	int			rc;
+	char			*buf;
+	char			*records;
+	char			*tmp_file;
+	size_t			tmp_file_len;
+	time_t			epoch;
+
+
+	if (!(flags & CACHE_ENABLED) || snapshot_file == NULL || table == NULL)
+		return;
+
+	bytes = sizeof(struct cache_snapshot) + table_size * sizeof(struct cache_group);
+	tmp_file_len = strlen(snapshot_file) + sizeof(".tmp");
+
+	if ((buf = malloc(bytes)) == NULL || (tmp_file = malloc(tmp_file_len)) == NULL) {
+		logger(L_ERR, L_FUNC, "could not allocate memory");
+		free(buf);
+		return;
+	}
+
+	memset(buf, 0, sizeof(struct cache_snapshot));
+	header = (struct cache_snapshot *)buf;
+	records = buf + sizeof(struct cache_snapshot);
+	epoch = time(NULL);
+
+	for (x = 0; x < table_size; x++) {
+		for (tries = 0; tries < CACHE_SEQLOCK_RETRIES; tries++) {
+			if (cache_read_begin(x, &seq) != 0) {
+				tries = CACHE_SEQLOCK_RETRIES;
+				break;
+			}
+
+			memcpy(&copy, table + x, sizeof(copy));
+
+			if (cache_read_retry(x, seq) == 0)
+				break;
+		}
+
+		if (tries == CACHE_SEQLOCK_RETRIES) {
+			logger(L_ERR, L_FUNC, "could not read group %d, not saved", x);
+			continue;
+		}
+
+		for (y = 0; y < CACHE_GROUP_SLOTS; y++) {
+			ref_bucket = copy.buckets + y;
+
+			if (copy.fp[y] == 0 || cache_expired(ref_bucket, epoch) ||
+			    ref_bucket->key_offt + ref_bucket->key_len > CACHE_GROUP_ARENA)
+				continue;
+
+			memcpy(records + header->bytes, ref_bucket, sizeof(struct bucket));
+			((struct bucket *)(records + header->bytes))->refreshing = 0;
+			memcpy(records + header->bytes + sizeof(struct bucket),
+			       copy.arena + ref_bucket->key_offt, ref_bucket->key_len);
+
+			header->bytes += sizeof(struct bucket) + ref_bucket->key_len;
+			header->count++;
+		}
+	}
+
+	strlcpy(header->magic, CACHE_CACHE_MAGIC, sizeof(header->magic));
+	header->version = CACHE_SNAPSHOT_VERSION;
+	header->sizeof_bucket = sizeof(struct bucket);
+	strlcpy(header->digest, digest->name, sizeof(header->digest));
+
+	cache_snapshot_checksum(header, records, checksum);
+	memcpy(header->checksum, checksum, sizeof(checksum));
+
+	strlcpy(tmp_file, snapshot_file, tmp_file_len);
+	strlcat(tmp_file, ".tmp", tmp_file_len);
+
+	if ((file_fd = open(tmp_file, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR)) < 0) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "could not open snapshot file: %s", tmp_file);
+		logger(L_ERR, L_FUNC, "open: %s", strerror(rc));
+		goto done;
+	}
+
+	bytes = sizeof(struct cache_snapshot) + header->bytes;
+
+	if (tx_rec(file_fd, buf, bytes) != (ssize_t)bytes || fsync(file_fd) != 0) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "failed while writing to snapshot file: %s", tmp_file);
+		logger(L_ERR, L_FUNC, "write: %s", strerror(rc));
+		close(file_fd);
+		unlink(tmp_file);
+		goto done;
+	}
+
+	close(file_fd);
+
+	if (rename(tmp_file, snapshot_file) != 0) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "could not rename snapshot file: %s", tmp_file);
+		logger(L_ERR, L_FUNC, "rename: %s", strerror(rc));
+		unlink(tmp_file);
+		goto done;
+	}
+
+	if (flags & VERBOSE)
+		logger(L_DEBUG, L_FUNC, "saved %d entries to snapshot: %s", header->count, snapshot_file);
+
+ done:
+	memset(buf, 0, sizeof(struct cache_snapshot) + header->bytes);
+	free(buf);
+	free(tmp_file);
+
+	return;
+}
+
+
+/*************************************************************
+ * Read the snapshot file back into the (empty) table. Entries
+ * keep their age and the ones that have expired since are
+ * left out, as are those the table has no room for. Anything
+ * wrong with the file and we just start cold. The file is
+ * removed once read, a new one is written at shutdown.
+ **************************************************************/
+static void cache_load_snapshot(void) {
+	struct cache_snapshot	header;
+	struct cache_result	result;
+	struct stat		st;
+	unsigned char		checksum[16];
+	unsigned int		hash;
+	unsigned int		loaded = 0;
+	unsigned int		used;
+	unsigned int		probe;
+	unsigned int		x;
+	int			file_fd;
+	int			rc;
+	char			*records = NULL;
+	time_t			epoch;
+
+
+	if ((file_fd = open(snapshot_file, O_RDONLY)) < 0) {
+		rc = errno;
+
+		if (rc != ENOENT) {
+			logger(L_ERR, L_FUNC, "could not open snapshot file: %s", snapshot_file);
+			logger(L_ERR, L_FUNC, "open: %s", strerror(rc));
+		}
+
+		return;
+	}
+
+	if (fstat(file_fd, &st) != 0 ||
+	    rx_rec(file_fd, &header, sizeof(header)) != (ssize_t)sizeof(header)) {
+		logger(L_ERR, L_FUNC, "could not read snapshot header: %s", snapshot_file);
+		goto done;
+	}
+
+	header.magic[sizeof(header.magic) - 1] = '\0';
+	header.digest[sizeof(header.digest) - 1] = '\0';
+
+	if (strcmp(header.magic, CACHE_CACHE_MAGIC) != 0 ||
+	    header.version != CACHE_SNAPSHOT_VERSION ||
+	    header.sizeof_bucket != sizeof(struct bucket) ||
+	    (off_t)(sizeof(header) + header.bytes) != st.st_size) {
+		logger(L_ERR, L_FUNC, "snapshot is not from this version of saslauthd: %s", snapshot_file);
+		goto done;
+	}
+
+	if (strcmp(header.digest, digest->name) != 0) {
+		logger(L_ERR, L_FUNC, "snapshot was made with the %s digest, not loaded", header.digest);
+		goto done;
+	}
+
+	if ((records = malloc(header.bytes + 1)) == NULL) {
+		logger(L_ERR, L_FUNC, "could not allocate memory");
+		goto done;
+	}
+
+	if (rx_rec(file_fd, records, header.bytes) != (ssize_t)header.bytes) {
+		logger(L_ERR, L_FUNC, "could not read snapshot: %s", snapshot_file);
+		goto done;
+	}
+
+	cache_snapshot_checksum(&header, records, checksum);
+
+	if (memcmp(checksum, header.checksum, sizeof(checksum)) != 0) {
+		logger(L_ERR, L_FUNC, "snapshot checksum mismatch, not loaded: %s", snapshot_file);
+		goto done;
+	}
+
+	epoch = time(NULL);
+
+	for (x = 0, used = 0; x < header.count; x++) {
+		memset(&result, 0, sizeof(result));
 
+		if (used + sizeof(struct bucket) > header.bytes)
+			break;
 
-/*************************************************************
- * Find the next closest prime relative to the number given.
- * This is a variation of an implementation of the 
- * Sieve of Erastothenes by Frank Pilhofer,
- * http://www.fpx.de/fp/Software/Sieve.html. 
- **************************************************************/
-unsigned int cache_get_next_prime(unsigned int number) {
+		memcpy(&result.bucket, records + used, sizeof(struct bucket));
+		used += sizeof(struct bucket);
 
-#define TEST(f,x)	(*(f+((x)>>4))&(1<<(((x)&15L)>>1)))
-#define SET(f,x)        *(f+((x)>>4))|=1<<(((x)&15)>>1)
+		if (result.bucket.key_len > header.bytes - used ||
+		    result.bucket.key_len > CACHE_MAX_CREDS_LENGTH ||
+		    result.bucket.key_len == 0 ||
+		    result.bucket.user_len + result.bucket.realm_len >= result.bucket.key_len)
+			break;
 
-	unsigned char	*feld = NULL;
-	unsigned int	teste = 1;
-	unsigned int	max;
-	unsigned int	mom;
-	unsigned int	alloc;
+		memcpy(result.key, records + used, result.bucket.key_len);
+		used += result.bucket.key_len;
 
-	max = number + 20000;
+		if (cache_expired(&result.bucket, epoch))
+			continue;
 
-	feld = malloc(alloc=(((max-=10000)>>4)+1));
+		hash = cache_hash(result.key, result.bucket.key_len);
+		result.hash_offset = hash % table_size;
 
-	if (feld == NULL) {
-		logger(L_ERR, L_FUNC, "could not allocate memory");
-		exit(1);
-	}
+		if ((result.fp = (hash * 2654435761U) >> 24) == 0)
+			result.fp = 1;
 
-	memset(feld, 0, alloc);
+		result.bucket.refreshing = 0;
 
-	while ((teste += 2) < max) {
-		if (!TEST(feld, teste)) {
-			if (teste > number) {
-				free(feld);
-				return teste;
+		for (probe = 0; probe < cache_probes(); probe++) {
+			if (cache_insert(table + (result.hash_offset + probe) % table_size, &result, epoch) == 0) {
+				loaded++;
+				break;
 			}
-
-			for (mom=3*teste; mom<max; mom+=teste<<1) SET (feld, mom);
 		}
 	}
 
-	/******************************************************
-	 * A prime wasn't found in the maximum search range.
-	 * Just return the original number.
-	 ******************************************************/
-	
-	free(feld);
-	return number;
+	if (x < header.count)
+		logger(L_ERR, L_FUNC, "snapshot is corrupt after %d entries", x);
+
+	logger(L_INFO, L_FUNC, "loaded %d of %d entries from snapshot: %s", loaded, header.count, snapshot_file);
+
+ done:
+	if (records != NULL) {
+		memset(records, 0, header.bytes);
+		free(records);
+	}
+
+	memset(&header, 0, sizeof(header));
+	close(file_fd);
+	unlink(snapshot_file);
+
+	return;
+}
+
+
+/*************************************************************
+ * MD5 of a snapshot header, checksum left out, and records.
+ **************************************************************/
+static void cache_snapshot_checksum(struct cache_snapshot *header, const char *records, unsigned char *checksum) {
+	MD5_CTX			md5_context;
+	unsigned char		saved[16];
+
+	memcpy(saved, header->checksum, sizeof(saved));
+	memset(header->checksum, 0, sizeof(header->checksum));
+
+	_saslauthd_MD5Init(&md5_context);
+	_saslauthd_MD5Update(&md5_context, (unsigned char *)header, sizeof(struct cache_snapshot));
+	_saslauthd_MD5Update(&md5_context, (unsigned char *)records, header->bytes);
+	_saslauthd_MD5Final(checksum, &md5_context);
+
+	memcpy(header->checksum, saved, sizeof(saved));
 }
 
 
@@ -564,19 +1613,176 @@ void cache_cleanup_mm(void) {
 	return;
 }
 
+/*****************************************************************
+ * Password digests. The default, a keyed SipHash-2-4 (128 bit
+ * output) of the cache key and password, costs a fraction of an
+ * MD5 block, and without the key, which is made at startup and
+ * only kept in the memory of saslauthd and its children, the
+ * digests in the mmap file are worthless. Including the cache
+ * key means equal passwords don't show up as equal digests.
+ * The unkeyed MD5 of the password alone is kept for
+ * comparison.
+ ****************************************************************/
+
+typedef unsigned long long	sipword;
+
+#define SIP_ROTL(x, b)		(sipword)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIP_ROUND \
+	do { \
+		v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32); \
+		v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32); \
+	} while (0)
+
+/*************************************************************
+ * Read a little endian 64 bit word.
+ **************************************************************/
+static sipword cache_sip_word(const unsigned char *bytes) {
+
+	sipword		word = 0;
+	int		x;
+
+	for (x = 7; x >= 0; x--)
+		word = (word << 8) | bytes[x];
+
+	return word;
+}
+
+/*************************************************************
+ * SipHash-2-4 with a 128 bit output over key '\0' password.
+ **************************************************************/
+static void cache_digest_siphash(const char *key, unsigned int key_length, const char *password, unsigned char *out) {
+
+	sipword		k0 = cache_sip_word(digest_key);
+	sipword		k1 = cache_sip_word(digest_key + 8);
+	sipword		v0 = 0x736f6d6570736575ULL ^ k0;
+	sipword		v1 = 0x646f72616e646f6dULL ^ k1 ^ 0xee;
+	sipword		v2 = 0x6c7967656e657261ULL ^ k0;
+	sipword		v3 = 0x7465646279746573ULL ^ k1;
+	sipword		m = 0;
+	sipword		word;
+	sipword		length = 0;
+	const unsigned char *data = (const unsigned char *)key;
+	unsigned int	data_length = key_length;
+	int		part;
+	int		x;
+
+
+	/* the key already ends in a '\0', and the password is read up to its own */
+	for (part = 0; part < 2; part++) {
+		while (data_length >= 8 && (length & 7) == 0) {
+			word = cache_sip_word(data);
+			v3 ^= word; SIP_ROUND; SIP_ROUND; v0 ^= word;
+			data += 8;
+			data_length -= 8;
+			length += 8;
+		}
+
+		for (; data_length > 0; data++, data_length--) {
+			m |= (sipword)*data << (8 * (length & 7));
+
+			if ((++length & 7) == 0) {
+				v3 ^= m; SIP_ROUND; SIP_ROUND; v0 ^= m;
+				m = 0;
+			}
+		}
+
+		data = (const unsigned char *)password;
+		data_length = strlen(password);
+	}
+
+	m |= length << 56;
+	v3 ^= m; SIP_ROUND; SIP_ROUND; v0 ^= m;
+
+	v2 ^= 0xee;
+	SIP_ROUND; SIP_ROUND; SIP_ROUND; SIP_ROUND;
+	m = v0 ^ v1 ^ v2 ^ v3;
+
+	for (x = 0; x < 8; x++)
+		out[x] = (unsigned char)(m >> (8 * x));
+
+	v1 ^= 0xdd;
+	SIP_ROUND; SIP_ROUND; SIP_ROUND; SIP_ROUND;
+	m = v0 ^ v1 ^ v2 ^ v3;
+
+	for (x = 0; x < 8; x++)
+		out[8 + x] = (unsigned char)(m >> (8 * x));
+}
+
+/*************************************************************
+ * Plain MD5 of the password.
+ **************************************************************/
+static void cache_digest_md5(const char *key __attribute__((unused)),
+			     unsigned int key_length __attribute__((unused)),
+			     const char *password, unsigned char *out) {
+
+	MD5_CTX		md5_context;
+
+	_saslauthd_MD5Init(&md5_context);
+	_saslauthd_MD5Update(&md5_context, password, strlen(password));
+	_saslauthd_MD5Final(out, &md5_context);
+}
+
+struct cache_digest cache_digests[] = {
+	{ "siphash", 1, cache_digest_siphash },
+	{ "md5", 0, cache_digest_md5 },
+	{ NULL, 0, NULL }
+};
+
+/*************************************************************
+ * Settle on a digest and, if it is keyed, make the key.
+ **************************************************************/
+static int cache_init_digest(void) {
+	int		fd;
+	int		rc;
+
+	if (digest == NULL)
+		digest = cache_digests;
+
+	if (!digest->keyed)
+		return 0;
+
+	if ((fd = open("/dev/urandom", O_RDONLY)) < 0) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "could not open /dev/urandom");
+		logger(L_ERR, L_FUNC, "open: %s", strerror(rc));
+		return -1;
+	}
+
+	if (read(fd, digest_key, sizeof(digest_key)) != (ssize_t)sizeof(digest_key)) {
+		logger(L_ERR, L_FUNC, "could not read a digest key from /dev/urandom");
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
 /*****************************************************************
  * The following is relative to the fcntl() locking method. Probably
  * used when the Sys IV SHM Implementation is in effect.
  ****************************************************************/
 #ifdef CACHE_USE_FCNTL
 
+/*************************************************************
+ * The lock file lives outside of the shared memory segment.
+ * __FCNTL Impl__
+ **************************************************************/
+static unsigned int cache_fcntl_bytes(void) {
+	return 0;
+}
+
+
 /*************************************************************
  * Setup the locking stuff required to implement the fcntl()
  * style record locking of the hash table. Return 0 if
  * everything is peachy, otherwise -1.
  * __FCNTL Impl__
  **************************************************************/
-int cache_init_lock(void) {
+static int cache_fcntl_init(void *region __attribute__((unused))) {
 	int	rc;
 	size_t  flock_file_len;
 
@@ -608,7 +1814,7 @@ int cache_init_lock(void) {
  * the flock_file. More for correctness than anything.
  * __FCNTL Impl__
  **************************************************************/
-void cache_cleanup_lock(void) {
+static void cache_fcntl_cleanup(void) {
 
 
 	if (lock.flock_file != NULL) {
@@ -629,7 +1835,7 @@ void cache_cleanup_lock(void) {
  * This function is expected to block.
  * __FCNTL Impl__
  **************************************************************/
-int cache_get_wlock(unsigned int slot) {
+static int cache_fcntl_wlock(unsigned int slot) {
 	struct flock	lock_st;
 	int		rc;
 
@@ -664,7 +1870,7 @@ int cache_get_wlock(unsigned int slot) {
  * This function is expected to block.
  * __FCNTL Impl__
  **************************************************************/
-int cache_get_rlock(unsigned int slot) {
+static int cache_fcntl_rlock(unsigned int slot) {
 
 	struct flock	lock_st;
 	int		rc;
@@ -699,7 +1905,7 @@ int cache_get_rlock(unsigned int slot) {
  * Releases a previously acquired lock on a slot.
  * __FCNTL Impl__
  **************************************************************/
-int cache_un_lock(unsigned int slot) {
+static int cache_fcntl_unlock(unsigned int slot) {
 
 	struct flock	lock_st;
 	int		rc;
@@ -740,30 +1946,54 @@ int cache_un_lock(unsigned int slot) {
 
 #ifdef CACHE_USE_PTHREAD_RWLOCK
 
+/*************************************************************
+ * One pthread_rwlock_t for every slot (row) in the hash table.
+ * __RWLock Impl__
+ **************************************************************/
+static unsigned int cache_rwlock_bytes(void) {
+	return table_size * sizeof(pthread_rwlock_t);
+}
+
+
 /*************************************************************
  * Initialize a pthread_rwlock_t for every slot (row) in the
- * hash table. Return 0 if everything went ok, -1 if we bomb.
+ * hash table. They live in the shared memory segment, so with
+ * process shared rwlocks this works for the prefork model too.
+ * Return 0 if everything went ok, -1 if we bomb.
  * __RWLock Impl__
  **************************************************************/
-int cache_init_lock(void) {
+static int cache_rwlock_init(void *region) {
 	unsigned int		x;
 	pthread_rwlock_t	*rwlock;
+	pthread_rwlockattr_t	attr;
 
-	if (!(lock.rwlock =
-	     (pthread_rwlock_t *)malloc(sizeof(pthread_rwlock_t) * table_size))) {
-		logger(L_ERR, L_FUNC, "could not allocate memory");
+	lock.rwlock = region;
+
+	if (pthread_rwlockattr_init(&attr) != 0) {
+		logger(L_ERR, L_FUNC, "failed to initialize rwlock attributes");
 		return -1;
 	}
 
+#ifdef HAVE_PTHREAD_RWLOCK
+	if (pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) != 0) {
+		logger(L_ERR, L_FUNC, "failed to set process shared rwlock attribute");
+		pthread_rwlockattr_destroy(&attr);
+		return -1;
+	}
+#endif
+
 	for (x = 0; x < table_size; x++) {
 		rwlock = lock.rwlock + x;
 
-		if (pthread_rwlock_init(rwlock, NULL) != 0) {
+		if (pthread_rwlock_init(rwlock, &attr) != 0) {
 			logger(L_ERR, L_FUNC, "failed to initialize lock %d", x);
+			pthread_rwlockattr_destroy(&attr);
 			return -1;
 		}
 	}
 
+	pthread_rwlockattr_destroy(&attr);
+
 	if (flags & VERBOSE) 
 		logger(L_DEBUG, L_FUNC, "%d rwlocks initialized", table_size);
 
@@ -772,10 +2002,10 @@ int cache_init_lock(void) {
 
 
 /*************************************************************
- * Destroy all of the rwlocks, free the buffer.
+ * Destroy all of the rwlocks.
  * __RWLock Impl__
  **************************************************************/
-void cache_cleanup_lock(void) {
+static void cache_rwlock_cleanup(void) {
     unsigned int x;
     pthread_rwlock_t	*rwlock;
 
@@ -786,7 +2016,7 @@ void cache_cleanup_lock(void) {
 	pthread_rwlock_destroy(rwlock);
     }
     
-    free(lock.rwlock);
+    lock.rwlock = NULL;
 
     return;
 }
@@ -798,7 +2028,7 @@ void cache_cleanup_lock(void) {
  * This function is expected to block the current thread.
  * __RWLock Impl__
 **************************************************************/
-int cache_get_wlock(unsigned int slot) {
+static int cache_rwlock_wlock(unsigned int slot) {
 
 	int		rc = 0;
 
@@ -823,7 +2053,7 @@ int cache_get_wlock(unsigned int slot) {
  * This function is expected to block the current thread.
  * __RWLock Impl__
  **************************************************************/
-int cache_get_rlock(unsigned int slot) {
+static int cache_rwlock_rlock(unsigned int slot) {
 
 	int		rc = 0;
 
@@ -846,7 +2076,7 @@ int cache_get_rlock(unsigned int slot) {
  * Releases a previously acquired lock on a slot.
  * __RWLock Impl__
  **************************************************************/
-int cache_un_lock(unsigned int slot) {
+static int cache_rwlock_unlock(unsigned int slot) {
 
 	int		rc = 0;
 
@@ -866,5 +2096,263 @@ int cache_un_lock(unsigned int slot) {
 
 
 #endif  /* CACHE_USE_PTHREAD_RWLOCK */
+
+/**********************************************************************
+ * The following is relative to the seqlock method of locking slots in
+ * the hash table. Every slot has a sequence counter in the shared
+ * memory segment which is odd while a writer is updating the slot.
+ * Readers take no lock at all: they copy the slot and retry if the
+ * counter was odd or changed meanwhile. Cache hits thus cost no
+ * system calls. Writers serialize on the counter with an atomic
+ * compare and swap.
+ ***********************************************************************/
+
+#ifdef CACHE_USE_SEQLOCK
+
+/*************************************************************
+ * One sequence counter for every slot (row) in the hash table.
+ * __Seqlock Impl__
+ **************************************************************/
+static unsigned int cache_seqlock_bytes(void) {
+	return table_size * sizeof(unsigned int);
+}
+
+
+/*************************************************************
+ * The counters start out zeroed along with the rest of the
+ * shared memory segment.
+ * __Seqlock Impl__
+ **************************************************************/
+static int cache_seqlock_init(void *region) {
+
+	lock.seq = region;
+
+	if (flags & VERBOSE) 
+		logger(L_DEBUG, L_FUNC, "%d sequence counters initialized", table_size);
+
+	return 0;
+}
+
+
+/*************************************************************
+ * Nothing to clean up, the counters go away with the segment.
+ * __Seqlock Impl__
+ **************************************************************/
+static void cache_seqlock_cleanup(void) {
+
+	lock.seq = NULL;
+	return;
+}
+
+
+/*************************************************************
+ * Attempt to get a write lock on a slot by making its counter
+ * odd. Return 0 if everything went ok, return -1 if the slot
+ * stayed locked. A writer only holds the slot for the duration
+ * of a memcpy(), so that means its owner died mid-update; the
+ * slot is lost to the cache then, but lookups still work.
+ * __Seqlock Impl__
+ **************************************************************/
+static int cache_seqlock_wlock(unsigned int slot) {
+
+	unsigned int	seq;
+	int		tries;
+
+
+	if (flags & VERBOSE)
+		logger(L_DEBUG, L_FUNC, "attempting a write lock on slot: %d", slot);
+
+	for (tries = 0; tries < CACHE_SEQLOCK_RETRIES; tries++) {
+		seq = lock.seq[slot];
+
+		if (!(seq & 1) &&
+		    __sync_bool_compare_and_swap(lock.seq + slot, seq, seq + 1))
+			return 0;
+
+		sched_yield();
+	}
+
+	logger(L_ERR, L_FUNC, "could not acquire a write lock on slot: %d\n", slot);
+	return -1;
+}
+
+
+/*************************************************************
+ * Readers don't lock, see cache_seqlock_read_begin().
+ * __Seqlock Impl__
+ **************************************************************/
+static int cache_seqlock_rlock(unsigned int slot __attribute__((unused))) {
+	return 0;
+}
+
+
+/*************************************************************
+ * Releases a previously acquired write lock on a slot, making
+ * its counter even again. The atomic add is a full barrier, so
+ * the slot update is visible before the counter is.
+ * __Seqlock Impl__
+ **************************************************************/
+static int cache_seqlock_unlock(unsigned int slot) {
+
+	if (flags & VERBOSE)
+		logger(L_DEBUG, L_FUNC, "attempting to release lock on slot: %d", slot);
+
+	__sync_fetch_and_add(lock.seq + slot, 1);
+	return 0;
+}
+
+
+/*************************************************************
+ * Start a read section on a slot: wait for the writer, if
+ * any, to finish and remember the counter. Return 0 if
+ * everything went ok, -1 if we gave up.
+ * __Seqlock Impl__
+ **************************************************************/
+static int cache_seqlock_read_begin(unsigned int slot, unsigned int *seq) {
+
+	int		tries;
+
+
+	for (tries = 0; tries < CACHE_SEQLOCK_RETRIES; tries++) {
+		if (!((*seq = lock.seq[slot]) & 1)) {
+			__sync_synchronize();
+			return 0;
+		}
+
+		if (tries > 10)
+			sched_yield();
+	}
+
+	return -1;
+}
+
+
+/*************************************************************
+ * End a read section. What was read may have raced with a
+ * writer; return 1 if the counter shows that it did and the
+ * section has to be repeated, 0 if the read was consistent.
+ * __Seqlock Impl__
+ **************************************************************/
+static int cache_seqlock_read_retry(unsigned int slot, unsigned int seq) {
+
+	__sync_synchronize();
+	return lock.seq[slot] != seq;
+}
+
+
+#endif  /* CACHE_USE_SEQLOCK */
+
+
+/*************************************************************
+ * Read sections for the implementations with real reader
+ * locks: hold the read lock, never repeat.
+ **************************************************************/
+static int cache_locked_read_begin(unsigned int slot, unsigned int *seq) {
+
+	*seq = 0;
+	return lock_impl->rlock(slot);
+}
+
+static int cache_locked_read_retry(unsigned int slot, unsigned int seq __attribute__((unused))) {
+
+	lock_impl->unlock(slot);
+	return 0;
+}
+
+
+/*************************************************************
+ * The available slot locking implementations, the first one
+ * being the default.
+ **************************************************************/
+struct lock_impl cache_lock_impls[] = {
+#ifdef CACHE_USE_SEQLOCK
+	{ "seqlock", cache_seqlock_bytes, cache_seqlock_init, cache_seqlock_cleanup,
+	  cache_seqlock_wlock, cache_seqlock_rlock, cache_seqlock_unlock,
+	  cache_seqlock_read_begin, cache_seqlock_read_retry, 1 },
+#endif
+#ifdef CACHE_USE_FCNTL
+	{ "fcntl", cache_fcntl_bytes, cache_fcntl_init, cache_fcntl_cleanup,
+	  cache_fcntl_wlock, cache_fcntl_rlock, cache_fcntl_unlock,
+	  cache_locked_read_begin, cache_locked_read_retry, 0 },
+#endif
+#ifdef CACHE_USE_PTHREAD_RWLOCK
+	{ "rwlock", cache_rwlock_bytes, cache_rwlock_init, cache_rwlock_cleanup,
+	  cache_rwlock_wlock, cache_rwlock_rlock, cache_rwlock_unlock,
+	  cache_locked_read_begin, cache_locked_read_retry, 1 },
+#endif
+	{ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0 }
+};
+
+
+/*************************************************************
+ * Setup the slot locking in the given part of the shared
+ * memory segment. Return 0 if everything is peachy,
+ * otherwise -1.
+ **************************************************************/
+int cache_init_lock(void *region) {
+
+	if (flags & VERBOSE)
+		logger(L_DEBUG, L_FUNC, "cache lock   : %s", lock_impl->name);
+
+	return lock_impl->init(region);
+}
+
+
+/*************************************************************
+ * Cleanup after the slot locking implementation.
+ **************************************************************/
+void cache_cleanup_lock(void) {
+
+	if (lock_impl != NULL)
+		lock_impl->cleanup();
+
+	return;
+}
+
+
+/*************************************************************
+ * Attempt to get a write lock on a slot. Return 0 if 
+ * everything went ok, return -1 if something bad happened.
+ **************************************************************/
+int cache_get_wlock(unsigned int slot) {
+	return lock_impl->wlock(slot);
+}
+
+
+/*************************************************************
+ * Attempt to get a read lock on a slot. Return 0 if 
+ * everything went ok, return -1 if something bad happened.
+ **************************************************************/
+int cache_get_rlock(unsigned int slot) {
+	return lock_impl->rlock(slot);
+}
+
+
+/*************************************************************
+ * Releases a previously acquired lock on a slot.
+ **************************************************************/
+int cache_un_lock(unsigned int slot) {
+	return lock_impl->unlock(slot);
+}
+
+
+/*************************************************************
+ * Start a read section on a slot. Return 0 if everything
+ * went ok, return -1 if something bad happened.
+ **************************************************************/
+int cache_read_begin(unsigned int slot, unsigned int *seq) {
+	return lock_impl->read_begin(slot, seq);
+}
+
+
+/*************************************************************
+ * End a read section on a slot. Return 1 if the section has
+ * to be repeated, 0 if what was read can be used.
+ **************************************************************/
+int cache_read_retry(unsigned int slot, unsigned int seq) {
+	return lock_impl->read_retry(slot, seq);
+}
+
+
 /***************************************************************************************/
 /***************************************************************************************/
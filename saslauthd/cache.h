@@ -45,54 +45,73 @@
 
 
 /****************************************************************
-* * Plug in some autoconf magic to determine what implementation
-* * to use for the table slot (row) locking.
+* * Plug in some autoconf magic to determine what implementations
+* * are available for the table slot (row) locking. fcntl() locks
+* * are per process, so they're no good to the threaded doors IPC.
 ****************************************************************/
-#ifdef USE_DOORS
-# define CACHE_USE_PTHREAD_RWLOCK
-#else
+#ifndef USE_DOORS
 # define CACHE_USE_FCNTL
 #endif
 
+#if defined(USE_DOORS) || defined(HAVE_PTHREAD_RWLOCK)
+# define CACHE_USE_PTHREAD_RWLOCK
+#endif
 
-
-/************************************************/
-#ifdef CACHE_USE_FCNTL
-	/* FCNTL Impl */
-
-struct lock_ctl {
-	char			*flock_file;
-	int			flock_fd;
-};
-
-#endif  /* CACHE_USE_FCNTL */
-/************************************************/
-
+#ifdef HAVE_SYNC_BUILTINS
+# define CACHE_USE_SEQLOCK
+#endif
 
 
-/************************************************/
 #ifdef CACHE_USE_PTHREAD_RWLOCK
-	/* RWLock Impl */
-
 #include <pthread.h>
+#endif
 
 struct lock_ctl {
+#ifdef CACHE_USE_FCNTL
+	/* FCNTL Impl */
+	char			*flock_file;
+	int			flock_fd;
+#endif
+#ifdef CACHE_USE_PTHREAD_RWLOCK
+	/* RWLock Impl, one per slot in the shared segment */
 	pthread_rwlock_t	*rwlock;
+#endif
+#ifdef CACHE_USE_SEQLOCK
+	/* Seqlock Impl, one sequence counter per slot in the shared segment */
+	volatile unsigned int	*seq;
+#endif
 };
 
-#endif  /* CACHE_USE_PTHREAD_RWLOCK */
-/************************************************/
+/* a slot locking implementation, selected with -C lock=<name> */
+struct lock_impl {
+	const char		*name;
+	unsigned int		(*bytes)(void);       /* shared memory needed        */
+	int			(*init)(void *);      /* set up in the shared memory */
+	void			(*cleanup)(void);
+	int			(*wlock)(unsigned int);
+	int			(*rlock)(unsigned int);
+	int			(*unlock)(unsigned int);
+	int			(*read_begin)(unsigned int, unsigned int *);
+	int			(*read_retry)(unsigned int, unsigned int);
+	int			threads;              /* works between threads too   */
+};
 
 
 
 /* defaults */
 #define CACHE_DEFAULT_TIMEOUT		28800
-#define CACHE_DEFAULT_TABLE_SIZE	1711
+#define CACHE_DEFAULT_TABLE_SIZE	640	/* groups, about 1MB */
 #define CACHE_DEFAULT_FLAGS		0
-#define CACHE_MAX_BUCKETS_PER		6
+#define CACHE_DEFAULT_NEG_TTL		0	/* negative caching off */
+#define CACHE_DEFAULT_MAX_FAILURES	0	/* throttling off */
+#define CACHE_DEFAULT_FAIL_WINDOW	300
+#define CACHE_DEFAULT_SOFT_TTL		0	/* background refresh off */
 #define CACHE_MMAP_FILE			"/cache.mmap"  /* don't forget the "/" */
 #define CACHE_FLOCK_FILE		"/cache.flock" /* don't forget the "/" */
 
+/* times a seqlock reader retries a slot that is being written */
+#define CACHE_SEQLOCK_RETRIES		1000
+
 
 
 /* If debugging uncomment this for always verbose  */
@@ -100,13 +119,31 @@ struct lock_ctl {
 
 
 
+/****************************************************************
+* * The table is an array of groups, each a whole number of cache
+* * lines. A group holds CACHE_GROUP_SLOTS buckets, one fingerprint
+* * byte per bucket (0 marks a free bucket) so a lookup can check
+* * them all at once, the CLOCK reference bits and an arena for the
+* * keys ("user\0realm\0service\0") of its buckets. A key lives in
+* * its home group or in one of the next CACHE_PROBE_GROUPS - 1.
+* * The group is also the unit of locking (the "slot").
+****************************************************************/
+#define CACHE_GROUP_SLOTS		16
+#define CACHE_GROUP_ARENA		1024
+#define CACHE_PROBE_GROUPS		2
+
 /* max length for cached credential values */
-#define CACHE_MAX_CREDS_LENGTH		60
+#define CACHE_MAX_CREDS_LENGTH		CACHE_GROUP_ARENA
 
 
 
 /* magic values (must be less than 63 chars!) */
-#define CACHE_CACHE_MAGIC		"SASLAUTHD_CACHE_MAGIC"
+#define CACHE_CACHE_MAGIC		"SASLAUTHD_CACHE_MAGIC_4"
+
+
+
+/* snapshot file format, bump when struct cache_snapshot or bucket change */
+#define CACHE_SNAPSHOT_VERSION		2
 
 
 
@@ -114,6 +151,8 @@ struct lock_ctl {
 #define CACHE_OK			0
 #define CACHE_FAIL			1
 #define CACHE_TOO_BIG			2	
+#define CACHE_NEGATIVE			3	/* failed recently, same password */
+#define CACHE_THROTTLED			4	/* too many recent failures */
 
 
 
@@ -121,29 +160,103 @@ struct lock_ctl {
 #define CACHE_NO_FLUSH			0
 #define CACHE_FLUSH			1
 #define CACHE_FLUSH_WITH_RESCAN		2	
+#define CACHE_REFRESH			3	/* good, but verify it again */
 
 
 
-/* declarations */
+/****************************************************************
+* * A key has at most two buckets: the credentials that last
+* * succeeded, and a negative bucket holding the digest of the
+* * last password that failed, when it failed, and how many
+* * failures came in a row, each within the fail window of the
+* * one before.
+****************************************************************/
 struct bucket {
-        char            	creds[CACHE_MAX_CREDS_LENGTH];
-        unsigned int		user_offt;
-        unsigned int		realm_offt;
-        unsigned int		service_offt;
+        unsigned short		key_offt;	/* into the group's arena */
+        unsigned short		key_len;
+        unsigned short		user_len;	/* including the '\0' */
+        unsigned short		realm_len;	/* including the '\0' */
         unsigned char   	pwd_digest[16];
-        time_t          	created;
+        time_t          	created;	/* last failure if negative */
+        unsigned short		failures;
+        unsigned char		negative;
+        unsigned char		refreshing;	/* a refresh is under way */
 };
 
-struct stats {
+struct cache_group {
+        unsigned char		fp[CACHE_GROUP_SLOTS];
+        unsigned char		ref[CACHE_GROUP_SLOTS];
+        unsigned short		arena_used;
+        unsigned char		hand;
+        unsigned char		pad[64 - 2 * CACHE_GROUP_SLOTS - 3];
+        struct bucket		buckets[CACHE_GROUP_SLOTS];
+        char			arena[CACHE_GROUP_ARENA];
+};
+
+/****************************************************************
+* * The lookup counters are kept per worker, in CACHE_COUNTER_SLOTS
+* * sets on cache lines of their own that follow the groups, so
+* * lookups in different processes don't write to the same line.
+* * A worker uses the set of its statistics slot (see stats.h);
+* * the sets are summed up when read.
+****************************************************************/
+#define CACHE_COUNTER_SLOTS	64
+
+struct cache_counters {
         volatile unsigned int   hits;
         volatile unsigned int   misses;
         volatile unsigned int   lock_failures;
         volatile unsigned int   attempts;
+        volatile unsigned int   evictions;
+        volatile unsigned int   negative_hits;
+        volatile unsigned int   throttled;
+        volatile unsigned int   refreshes;
+        volatile unsigned int   refresh_failures;
+        unsigned int            pad[16 - 9];
+};
+
+struct stats {
         unsigned int            table_size;
         unsigned int            max_buckets_per;
         unsigned int            sizeof_bucket;
         unsigned int            bytes;
         unsigned int            timeout;
+        unsigned int            sizeof_group;
+        unsigned int            counter_slots;
+        unsigned int            counters_offt;	/* from the magic */
+};
+
+/****************************************************************
+* * How the cache turns a password into the digest it keeps.
+* * A keyed digest is computed with a random key made at startup
+* * that never leaves process memory, so the digests in the mmap
+* * file can't be attacked offline.
+****************************************************************/
+struct cache_digest {
+	const char		*name;
+	int			keyed;
+	void			(*sum)(const char *, unsigned int, const char *, unsigned char *);
+};
+
+#define CACHE_DIGEST_KEY_LENGTH		16
+
+/****************************************************************
+* * A snapshot of the live entries, written at shutdown and read
+* * back at startup. The header is followed by "bytes" worth of
+* * records, each a struct bucket and then its key. The checksum
+* * is the MD5 of the header (with a zeroed checksum) and the
+* * records. It only catches a damaged file. A keyed digest's key
+* * is never written out, so snapshots are only made with an
+* * unkeyed digest.
+****************************************************************/
+struct cache_snapshot {
+	char			magic[64];
+	unsigned int		version;
+	unsigned int		sizeof_bucket;
+	unsigned int		count;
+	unsigned int		bytes;
+	char			digest[16];
+	unsigned char		checksum[16];
 };
 
 struct mm_ctl {
@@ -154,8 +267,9 @@ struct mm_ctl {
 
 struct cache_result {
 	struct bucket		bucket;
-	struct bucket   	*read_bucket;
+	char			key[CACHE_MAX_CREDS_LENGTH];
 	unsigned int		hash_offset;
+	unsigned char		fp;
 	int			status;
 };
 
@@ -164,17 +278,26 @@ struct cache_result {
 extern int cache_init(void);
 extern int cache_lookup(const char *, const char *, const char *, const char *, struct cache_result *);
 extern void cache_commit(struct cache_result *);
-extern int cache_pjwhash(char *);
+extern void cache_commit_failure(struct cache_result *);
+extern void cache_refreshed(const char *, const char *, const char *, const char *, int);
+extern int cache_refresh_enabled(void);
+extern void cache_save_snapshot(void);
+extern void cache_get_counters(struct cache_counters *);
+extern void cache_get_occupancy(unsigned int *, unsigned int *, unsigned int *);
+extern unsigned int cache_hash(const char *, unsigned int);
 extern void cache_set_table_size(const char *);
 extern void cache_set_timeout(const char *);
-extern unsigned int cache_get_next_prime(unsigned int);
+extern void cache_set_option(const char *);
 extern void *cache_alloc_mm(unsigned int);
 extern void cache_cleanup_mm(void);
 extern void cache_cleanup_lock(void);
-extern int cache_init_lock(void);
+extern int cache_init_lock(void *);
 extern int cache_get_wlock(unsigned int);
 extern int cache_get_rlock(unsigned int);
 extern int cache_un_lock(unsigned int);
+extern int cache_read_begin(unsigned int, unsigned int *);
+extern int cache_read_retry(unsigned int, unsigned int);
+extern struct lock_impl cache_lock_impls[];
+extern struct cache_digest cache_digests[];
 
 #endif  /* _CACHE_H */
-
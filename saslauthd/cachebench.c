@@ -0,0 +1,275 @@
+/* cachebench.c: saslauthd credential cache benchmark
+ */
+/* 
+ * Copyright (c) 1998-2003 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer. 
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any other legal
+ *    details, please contact  
+ *      Office of Technology Transfer
+ *      Carnegie Mellon University
+ *      5000 Forbes Avenue
+ *      Pittsburgh, PA  15213-3890
+ *      (412) 268-4387, fax: (412) 268-7395
+ *      tech-transfer@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Measures cache_lookup() hits per second with several processes
+ * sharing the cache, as saslauthd's prefork workers do, once for
+ * each slot locking implementation and password digest (or the
+ * ones given with -C).
+ * A percentage of the lookups (-w) can be made with a wrong
+ * password, which makes them commit and thus take write locks.
+ */
+
+#include <saslauthd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#include "globals.h"
+#include "utils.h"
+#include "cache.h"
+#include "stats.h"
+
+/* make utils.c and cache.c happy */
+int flags = LOG_USE_STDERR | CACHE_ENABLED;
+char *run_path = NULL;
+
+int num_procs = 8;
+static int num_users = 1000;
+static long iterations = 1000000;
+static int write_pct = 0;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+	    "%s: usage: %s [-C lock=<impl>] [-C digest=<name>]\n"
+	    "              [-n procs] [-u users]\n"
+	    "              [-i lookups per proc] [-w percent wrong passwords]\n"
+	    "              [-s cache kilobytes]\n",
+	    prog, prog);
+    exit(1);
+}
+
+static void make_user(int n, char *buf, size_t len)
+{
+    snprintf(buf, len, "user%d", n);
+}
+
+/* lookups in one worker, returns the number of hits */
+static long run_worker(int seed)
+{
+    struct cache_result result;
+    char user[32];
+    long hits = 0;
+    long i;
+    int n;
+
+    srandom(seed);
+
+    for (i = 0; i < iterations; i++) {
+	n = random() % num_users;
+	make_user(n, user, sizeof(user));
+
+	if (write_pct > 0 && random() % 100 < write_pct) {
+	    /* a failed login followed by a good one: two commits */
+	    if (cache_lookup(user, "realm", "imap", "wrong", &result) != CACHE_OK)
+		cache_commit(&result);
+	    if (cache_lookup(user, "realm", "imap", "secret", &result) != CACHE_OK)
+		cache_commit(&result);
+	    continue;
+	}
+
+	if (cache_lookup(user, "realm", "imap", "secret", &result) == CACHE_OK)
+	    hits++;
+	else
+	    cache_commit(&result);
+    }
+
+    return hits;
+}
+
+/* one full run against a fresh cache, in a child of ours */
+static int run_bench(const char *impl, const char *digest)
+{
+    char option[64];
+    char label[64];
+    char dir[] = "/tmp/cachebench.XXXXXX";
+    char user[32];
+    struct cache_result result;
+    struct timeval start, end;
+    int fds[2];
+    long hits, total = 0;
+    double secs;
+    pid_t pid;
+    int status;
+    int x;
+
+    if ((run_path = mkdtemp(dir)) == NULL) {
+	perror("mkdtemp");
+	return -1;
+    }
+
+    snprintf(option, sizeof(option), "lock=%s", impl);
+    cache_set_option(option);
+    snprintf(option, sizeof(option), "digest=%s", digest);
+    cache_set_option(option);
+
+    if (cache_init() != 0)
+	return -1;
+
+    /* warm the cache */
+    for (x = 0; x < num_users; x++) {
+	make_user(x, user, sizeof(user));
+	if (cache_lookup(user, "realm", "imap", "secret", &result) != CACHE_OK)
+	    cache_commit(&result);
+    }
+
+    if (pipe(fds) == -1) {
+	perror("pipe");
+	return -1;
+    }
+
+    gettimeofday(&start, NULL);
+
+    for (x = 0; x < num_procs; x++) {
+	if ((pid = fork()) == -1) {
+	    perror("fork");
+	    return -1;
+	}
+
+	if (pid == 0) {
+	    stats_fork();
+	    close(fds[0]);
+	    hits = run_worker(x + 1);
+	    if (write(fds[1], &hits, sizeof(hits)) != sizeof(hits))
+		exit(1);
+	    exit(0);
+	}
+    }
+
+    close(fds[1]);
+
+    while (read(fds[0], &hits, sizeof(hits)) == sizeof(hits))
+	total += hits;
+
+    while (wait(&status) > 0)
+	;
+
+    gettimeofday(&end, NULL);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+
+    snprintf(label, sizeof(label), "%s/%s", impl, digest);
+    printf("%-16s %3d procs %10ld lookups %10ld hits %8.3f s %12.0f hits/s\n",
+	   label, num_procs, iterations * num_procs, total, secs, total / secs);
+
+    cache_cleanup_lock();
+    cache_cleanup_mm();
+    rmdir(dir);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *impl = NULL;
+    const char *digest = NULL;
+    struct lock_impl *ref;
+    struct cache_digest *dref;
+    pid_t pid;
+    int status;
+    int c;
+
+    while ((c = getopt(argc, argv, "C:n:u:i:w:s:")) != EOF)
+	switch (c) {
+	case 'C':
+	    if (strncmp(optarg, "lock=", 5) == 0)
+		impl = optarg + 5;
+	    else if (strncmp(optarg, "digest=", 7) == 0)
+		digest = optarg + 7;
+	    else
+		usage(argv[0]);
+	    break;
+	case 'n':
+	    num_procs = atoi(optarg);
+	    break;
+	case 'u':
+	    num_users = atoi(optarg);
+	    break;
+	case 'i':
+	    iterations = atol(optarg);
+	    break;
+	case 'w':
+	    write_pct = atoi(optarg);
+	    break;
+	case 's':
+	    cache_set_table_size(optarg);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+
+    if (num_procs <= 0 || num_users <= 0 || iterations <= 0 ||
+	write_pct < 0 || write_pct > 100)
+	usage(argv[0]);
+
+    /* every combination gets its own process, cache.c isn't reentrant */
+    for (ref = cache_lock_impls; ref->name != NULL; ref++) {
+	if (impl != NULL && strcmp(impl, ref->name) != 0)
+	    continue;
+
+	for (dref = cache_digests; dref->name != NULL; dref++) {
+	    if (digest != NULL && strcmp(digest, dref->name) != 0)
+		continue;
+
+	    fflush(stdout);
+
+	    if ((pid = fork()) == 0)
+		exit(run_bench(ref->name, dref->name) == 0 ? 0 : 1);
+
+	    if (pid == -1 || waitpid(pid, &status, 0) == -1 ||
+		!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s/%s: benchmark failed\n", ref->name, dref->name);
+		return 1;
+	    }
+	}
+    }
+
+    return 0;
+}
@@ -0,0 +1,116 @@
+/* connpool.c: connections kept open to a remote server
+ */
+/* 
+ * Copyright (c) 1998-2003 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer. 
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any other legal
+ *    details, please contact  
+ *      Office of Technology Transfer
+ *      Carnegie Mellon University
+ *      5000 Forbes Avenue
+ *      Pittsburgh, PA  15213-3890
+ *      (412) 268-4387, fax: (412) 268-7395
+ *      tech-transfer@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The choice of a connection, shared by the mechanisms that keep a
+ * pool of them to their server (rimap, httpform).  The mechanisms
+ * lock their pool around these, open and greet the connections,
+ * and pipeline their requests on them their own way.
+ */
+
+#include <saslauthd.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "connpool.h"
+
+/*************************************************************
+ * Pick one of the n connections at conns (size bytes each) to
+ * send a request on: an open one with fewer than pipeline
+ * requests on it, the least busy first, or else one to (re)open,
+ * marked opening, which the caller then opens.  Connections taken
+ * out of service, or idle for more than idle seconds (the server
+ * may have dropped them), are closed with drop() on the way.
+ * Returns NULL if there is none, for the caller to wait for one
+ * to be put back.  Called with the pool locked.
+ **************************************************************/
+pool_conn *pool_get(void *conns, size_t size, int n, int pipeline,
+		    int idle, void (*drop)(pool_conn *)) {
+
+	pool_conn	*c, *best = NULL, *spare = NULL;
+	time_t		now = time(NULL);
+	int		i;
+
+	for (i = 0; i < n; i++) {
+		c = (pool_conn *)((char *)conns + i * size);
+
+		if (c->opening || c->reading || c->inflight)
+			;
+		else if (c->state == POOL_DONE)
+			drop(c);
+		else if ((c->state == POOL_READY || c->state == POOL_OPENING) &&
+			 now - c->last_used > idle)
+			drop(c);
+
+		if (c->state == POOL_READY && !c->opening &&
+		    c->inflight < pipeline &&
+		    (!best || c->inflight < best->inflight))
+			best = c;
+		/* rather one already connecting than a closed one */
+		if ((c->state == POOL_CLOSED || c->state == POOL_OPENING) &&
+		    !c->opening && (!spare || c->state == POOL_OPENING))
+			spare = c;
+	}
+
+	/* a new connection rather than waiting behind a busy one */
+	if (best && (best->inflight == 0 || !spare))
+		return best;
+
+	if (spare)
+		spare->opening = 1;
+
+	return spare;
+}
+
+
+/*************************************************************
+ * Hand back a connection a request was answered on.  Returns 1
+ * if it is out of service and this was the last request on it,
+ * for the caller to close it.  Called with the pool locked.
+ **************************************************************/
+int pool_put(pool_conn *c) {
+
+	c->inflight--;
+	c->last_used = time(NULL);
+
+	return c->state == POOL_DONE && !c->inflight && !c->reading;
+}
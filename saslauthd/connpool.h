@@ -0,0 +1,74 @@
+/* connpool.h: connections kept open to a remote server
+ */
+/* 
+ * Copyright (c) 1998-2003 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer. 
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any other legal
+ *    details, please contact  
+ *      Office of Technology Transfer
+ *      Carnegie Mellon University
+ *      5000 Forbes Avenue
+ *      Pittsburgh, PA  15213-3890
+ *      (412) 268-4387, fax: (412) 268-7395
+ *      tech-transfer@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _CONNPOOL_H
+#define _CONNPOOL_H
+
+#include "saslauthd.h"
+
+#include <sys/types.h>
+#include <time.h>
+
+/* the states of a pooled connection */
+#define POOL_CLOSED	0
+#define POOL_OPENING	1		/* being made, takes no requests yet */
+#define POOL_READY	2		/* takes requests */
+#define POOL_DONE	3		/* closing or broken, takes none */
+
+/****************************************************************
+* * What the pool needs to know of a connection. It is the first
+* * member of the mechanism's own connection structure (rimap_conn,
+* * http_conn), which holds the socket and the protocol's state.
+****************************************************************/
+typedef struct pool_conn {
+    int		state;			/* POOL_* */
+    int		opening;		/* a thread is opening it */
+    int		reading;		/* a thread is reading from it */
+    int		inflight;		/* requests sent, not yet taken */
+    time_t	last_used;
+} pool_conn;
+
+/* connpool.c */
+extern pool_conn	*pool_get(void *, size_t, int, int, int, void (*)(pool_conn *));
+extern int		pool_put(pool_conn *);
+
+#endif  /* _CONNPOOL_H */
@@ -48,9 +48,13 @@ extern int              g_argc;
 extern char             **g_argv;
 extern int              flags;
 extern int              num_procs;
+extern int              num_threads;
+extern int              *cpu_list;
+extern int              num_cpus;
 extern char             *mech_option;
 extern char             *run_path;
 extern authmech_t       *auth_mech;
+extern int              stop_fd;
 
 
 /* flags bits */
@@ -63,6 +67,8 @@ extern authmech_t       *auth_mech;
 #define CACHE_ENABLED           (1 << 7)
 #define USE_PROCESS_MODEL       (1 << 8)
 #define CONCAT_LOGIN_REALM      (1 << 9)
+#define USE_EVENT_MODEL         (1 << 10)
+#define USE_THREAD_MODEL        (1 << 11)
 
 
 #endif  /* _GLOBALS_H */
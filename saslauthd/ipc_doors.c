@@ -66,8 +66,10 @@
 #include <string.h>
 #include <unistd.h>
 #include <stropts.h>
+#include <poll.h>
 
 #include "globals.h"
+#include "stats.h"
 #include "utils.h"
  
 
@@ -76,6 +78,7 @@
  *****************************************/
 static void	do_request(void *, char *, size_t, door_desc_t *, uint_t);
 static void	send_no(char *);
+static void	send_stats(void);
 static void	need_thread(door_info_t*);
 static void	*server_thread(void *);
 
@@ -87,11 +90,15 @@ static int			door_fd;     /* Door file descriptor         */
 static pthread_attr_t thread_attr;	     /* Thread attributes            */
 static int			num_thr;     /* Number of threads            */
 static pthread_mutex_t		num_lock;    /* Lock for update              */
+static int			num_busy;    /* Threads in do_auth()         */
+static int			stopping;    /* Door revoked, no new ones    */
+static pthread_cond_t		idle_cond;   /* num_busy went to 0           */
 
 /****************************************
  * flags       	global from saslauthd-main.c
  * run_path    	global from saslauthd-main.c
  * num_procs   	global from saslauthd-main.c
+ * stop_fd     	global from saslauthd-main.c
  * detach_tty()	function from saslauthd-main.c
  * logger()		function from utils.c
  *****************************************/
@@ -160,12 +167,14 @@ void ipc_init() {
 
 	/**************************************************************
 	 * The doors api will handle threads for us, clear the process 
-	 * model global flag.
+	 * model global flag. main() has set the thread model one
+	 * (which serializes the MECH_NOT_THREAD_SAFE mechanisms).
 	 **************************************************************/
 	flags &= ~USE_PROCESS_MODEL;
 
  	/* Initialize mutex */
 	pthread_mutex_init(&num_lock, NULL);
+	pthread_cond_init(&idle_cond, NULL);
 
 	/* Initialize thread attributes */
 	pthread_attr_init(&thread_attr);
@@ -178,14 +187,29 @@ void ipc_init() {
 
 /*************************************************************
  * Main IPC loop. Sit idle waiting for a door request. All
- * request get routed to do_request() via the doors api.
+ * request get routed to do_request() via the doors api. Once
+ * stop_fd says so, close the door and wait for the requests
+ * in do_auth() to finish, they may be updating the cache.
  *
  * __Required Function__
  **************************************************************/
 void ipc_loop() {
-	while(1) {
-		pause();
-	}
+	struct pollfd	pfd;
+
+	pfd.fd = stop_fd;
+	pfd.events = POLLIN;
+
+	do {
+		pfd.revents = 0;
+	} while (poll(&pfd, 1, -1) != 1);
+
+	door_revoke(door_fd);
+
+	pthread_mutex_lock(&num_lock);
+	stopping = 1;
+	while (num_busy > 0)
+		pthread_cond_wait(&idle_cond, &num_lock);
+	pthread_mutex_unlock(&num_lock);
 
 	return;
 }
@@ -233,6 +257,11 @@ void do_request(void *cookie, char *data, size_t datasize, door_desc_t *dp, size
 	count = ntohs(count);
 	data += sizeof(unsigned short);
 
+	if (count == PROTO_STATS_MARKER) {
+		send_stats();
+		return;
+	}
+
 	if (count > MAX_REQ_LEN || data + count > dataend) {
 		logger(L_ERR, L_FUNC, "login exceeds MAX_REQ_LEN: %d",
 		       MAX_REQ_LEN);
@@ -311,9 +340,25 @@ void do_request(void *cookie, char *data, size_t datasize, door_desc_t *dp, size
 
 	/**************************************************************
 	 * Get the mechanism response from do_auth() and send it back.
+	 * Nothing new starts once we're stopping, see ipc_loop().
 	 **************************************************************/
+	pthread_mutex_lock(&num_lock);
+	if (stopping) {
+		pthread_mutex_unlock(&num_lock);
+		memset(password, 0, strlen(password));
+		send_no("saslauthd is stopping");
+		return;
+	}
+	num_busy++;
+	pthread_mutex_unlock(&num_lock);
+
 	response = do_auth(login, password, service, realm);
 
+	pthread_mutex_lock(&num_lock);
+	if (--num_busy == 0)
+		pthread_cond_broadcast(&idle_cond);
+	pthread_mutex_unlock(&num_lock);
+
 	memset(password, 0, strlen(password));
 
 	if (response == NULL) {
@@ -388,4 +433,21 @@ void send_no(char *mesg) {
 	return;	
 }
 
+/*************************************************************
+ * Send the statistics report (see stats.c) back through the
+ * door. It's built on the stack, door_return() doesn't come
+ * back to free anything.
+ **************************************************************/
+void send_stats(void) {
+	char		buff[STATS_REPORT_MAX];
+	size_t		len;
+
+	len = stats_report(buff, sizeof(buff), auth_mech->name);
+
+	if(door_return(buff, len, NULL, 0) < 0)
+	    logger(L_ERR, L_FUNC, "door_return: %s", strerror(errno));
+
+	return;	
+}
+
 #endif /* USE_DOORS_IPC */
@@ -40,6 +40,15 @@
  *
  ********************************************************************************/
 
+/* pthread_setaffinity_np() and the CPU_* macros. glibc's socket
+ * calls then take transparent unions, so the socket header has to
+ * be seen before saslauthd.h may define __attribute__ away. */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+
 /****************************************
  * enable/disable ifdef
 *****************************************/
@@ -61,17 +70,45 @@
 #include <string.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <signal.h>
+#include <poll.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+/* saslauthd.h defines __attribute__ away on compilers that failed the
+ * configure check, which would silently drop the packing of struct
+ * epoll_event on x86_64. */
+# undef __attribute__
+# include <sys/epoll.h>
+#endif
+
+#ifdef USE_THREADS
+# include <pthread.h>
+# include <sched.h>
+#endif
 
 #include "globals.h"
+#include "stats.h"
 #include "utils.h"
 
 /****************************************
  * declarations/protos
  *****************************************/
-static void	do_request(int);
+static int	do_request(int);
+static int	do_request_v2(int);
+static int	do_request_stats(int);
+static int	rx_request(int, unsigned short, char *, char *, char *, char *);
+static int	tx_response(int, unsigned int *, char *);
+static char	*auth_request(char *, char *, char *, char *);
 static void	send_no(int, char *);
 static int	rel_accept_lock();
 static int	get_accept_lock();
+static int	accept_conn(struct sockaddr_un *, SALEN_TYPE *);
+#ifdef USE_THREADS
+static void	th_loop();
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+static void	ev_loop();
+#endif
 
 /****************************************
  * module globals
@@ -88,6 +125,7 @@ static char			*accept_file;/* path to the accept() lock file     */
  * flags       	global from saslauthd-main.c
  * run_path    	global from saslauthd-main.c
  * num_procs   	global from saslauthd-main.c
+ * stop_fd     	global from saslauthd-main.c
  * detach_tty()	function from saslauthd-main.c
  * rx_rec()		function from utils.c
  * tx_rec()		function from utils.c
@@ -112,6 +150,19 @@ void ipc_init() {
 	 **********************************************************/
 	if (num_procs == 0) 
 		flags &= ~USE_ACCEPT_LOCK;
+
+	/*********************************************************
+	 * In the event-driven model only one process ever calls
+	 * accept(), so the accept lock isn't needed either.
+	 **********************************************************/
+#ifndef HAVE_SYS_EPOLL_H
+	if (flags & USE_EVENT_MODEL) {
+		logger(L_ERR, L_FUNC, "event-driven mode is not supported on this platform");
+		flags &= ~USE_EVENT_MODEL;
+	}
+#endif
+	if (flags & USE_EVENT_MODEL)
+		flags &= ~USE_ACCEPT_LOCK;
 	
 	if (flags & USE_ACCEPT_LOCK) {
 		size_t accept_file_len;
@@ -200,8 +251,10 @@ void ipc_init() {
 	 * Ok boys... Let's procreate... If necessary of course...
 	 * Num_procs == 0 means we're running one shot per process. In
 	 * that case, we'll handle forking on a per connection basis.
+	 * The event-driven model forks its own workers in ev_loop(),
+	 * the thread model starts its threads in th_loop().
 	 **************************************************************/
-	if (num_procs != 0)
+	if (num_procs != 0 && !(flags & (USE_EVENT_MODEL|USE_THREAD_MODEL)))
 		flags |= USE_PROCESS_MODEL;
 
 	return;
@@ -215,9 +268,35 @@ void ipc_init() {
  **************************************************************/
 void ipc_loop() {
 
-	int		rc;
 	int		conn_fd;
+	int		fl;
+
+
+	/**************************************************************
+	 * The listening socket is polled along with stop_fd, so it has
+	 * to be non-blocking: a connection another worker takes first
+	 * mustn't leave us sitting in accept() past a stop.
+	 **************************************************************/
+	if ((fl = fcntl(sock_fd, F_GETFL, 0)) == -1 ||
+	    fcntl(sock_fd, F_SETFL, fl | O_NONBLOCK) == -1) {
+		logger(L_ERR, L_FUNC, "could not set non-blocking mode");
+		logger(L_ERR, L_FUNC, "fcntl: %s", strerror(errno));
+		exit(1);
+	}
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (flags & USE_EVENT_MODEL) {
+		ev_loop();
+		return;
+	}
+#endif
 
+#ifdef USE_THREADS
+	if (flags & USE_THREAD_MODEL) {
+		th_loop();
+		return;
+	}
+#endif
 
 	while(1) {
 
@@ -228,23 +307,22 @@ void ipc_loop() {
 		 * nap and go to the top of the loop. (or should we just die?)
 		 *************************************************************/
 		if (get_accept_lock() != 0) {
+			if (stop_requested())
+				break;
+
 			sleep(5);
 			continue;
 		}
 
-        	conn_fd = accept(sock_fd, (struct sockaddr *)&client, &len);
-		rc = errno;
+		conn_fd = accept_conn(&client, &len);
 
 		rel_accept_lock();
 
-		if (conn_fd == -1) {
-			if (rc != EINTR) {
-				logger(L_ERR, L_FUNC, "socket accept failure");
-				logger(L_ERR, L_FUNC, "accept: %s", strerror(rc));
-				sleep(5);
-			}
+		if (conn_fd == -2)
+			break;
+
+		if (conn_fd == -1)
 			continue;
-		}
 
 		/**************************************************************
 		 * If we're running one shot, drop off a kid to handle the
@@ -282,6 +360,63 @@ void ipc_loop() {
 }
 
 
+/*************************************************************
+ * Wait for a connection on the listening socket, or for the
+ * stop pipe. Return the connection, -1 if there was nothing to
+ * accept after all, or -2 if we are to stop.
+ **************************************************************/
+int accept_conn(struct sockaddr_un *from, SALEN_TYPE *from_len) {
+
+	struct pollfd	pfd[2];
+	int		conn_fd;
+	int		fl;
+	int		rc;
+
+
+	pfd[0].fd = sock_fd;
+	pfd[0].events = POLLIN;
+	pfd[0].revents = 0;
+	pfd[1].fd = stop_fd;
+	pfd[1].events = POLLIN;
+	pfd[1].revents = 0;
+
+	if (poll(pfd, 2, -1) == -1) {
+		rc = errno;
+
+		if (rc != EINTR) {
+			logger(L_ERR, L_FUNC, "poll: %s", strerror(rc));
+			sleep(5);
+		}
+
+		return stop_requested() ? -2 : -1;
+	}
+
+	if (pfd[1].revents != 0)
+		return -2;
+
+	conn_fd = accept(sock_fd, (struct sockaddr *)from, from_len);
+
+	if (conn_fd == -1) {
+		rc = errno;
+
+		if (rc != EINTR && rc != EAGAIN && rc != EWOULDBLOCK &&
+		    rc != ECONNABORTED) {
+			logger(L_ERR, L_FUNC, "socket accept failure");
+			logger(L_ERR, L_FUNC, "accept: %s", strerror(rc));
+			sleep(5);
+		}
+
+		return -1;
+	}
+
+	/* some systems pass O_NONBLOCK on, the requests want blocking I/O */
+	if ((fl = fcntl(conn_fd, F_GETFL, 0)) != -1 && (fl & O_NONBLOCK))
+		fcntl(conn_fd, F_SETFL, fl & ~O_NONBLOCK);
+
+	return conn_fd;
+}
+
+
 /*************************************************************
  * General cleanup. Unlock, close, and unlink our files.
  *
@@ -318,12 +453,15 @@ void ipc_cleanup() {
 /*************************************************************
  * Handle the comms on the socket, pass the request off to
  * do_auth() back in saslauthd-main.c, then transmit the
- * result back out on the socket.
+ * result back out on the socket. A client that opens with
+ * PROTO_V2_MARKER gets a persistent connection handled by
+ * do_request_v2(), one that opens with PROTO_STATS_MARKER the
+ * statistics. Return 0 if a response was sent, -1 if the
+ * request couldn't be read.
  **************************************************************/
-void do_request(int conn_fd) {
+int do_request(int conn_fd) {
 
 	unsigned short		count;                     /* input/output data byte count           */
-	unsigned short		ncount;                    /* input/output data byte count, network  */ 
 	char			*response;                 /* response to send to the client         */
 	char			login[MAX_REQ_LEN + 1];    /* account name to authenticate           */
 	char			password[MAX_REQ_LEN + 1]; /* password for authentication            */
@@ -336,121 +474,248 @@ void do_request(int conn_fd) {
 	 * service name and user realm as counted length strings.
 	 * We read in each string, then dispatch the data.
 	 **************************************************************/
-
-	/* login id */
 	if (rx_rec(conn_fd, (void *)&count, (size_t)sizeof(count)) != (ssize_t)sizeof(count)) 
-		return;
+		return -1;
 
 	count = ntohs(count);
 
-	if (count > MAX_REQ_LEN) {
-		logger(L_ERR, L_FUNC, "login exceeded MAX_REQ_LEN: %d", MAX_REQ_LEN);
-		send_no(conn_fd, "");
-		return;
-	}	
+	if (count == PROTO_V2_MARKER)
+		return do_request_v2(conn_fd);
 
-	if (rx_rec(conn_fd, (void *)login, (size_t)count) != (ssize_t)count) 
-		return;
-	
-	login[count] = '\0';
+	if (count == PROTO_STATS_MARKER)
+		return do_request_stats(conn_fd);
 
-	/* password */
-	if (rx_rec(conn_fd, (void *)&count, (size_t)sizeof(count)) != (ssize_t)sizeof(count)) 
-		return;
+	if (rx_request(conn_fd, count, login, password, service, realm) != 0)
+		return -1;
 
-	count = ntohs(count);
+	/**************************************************************
+	 * Get the mechanism response and send it back.
+	 **************************************************************/
+	if ((response = auth_request(login, password, service, realm)) == NULL) {
+		send_no(conn_fd, "could not allocate memory");
+		return 0;
+	}
 
-	if (count > MAX_REQ_LEN) {
-		logger(L_ERR, L_FUNC, "password exceeded MAX_REQ_LEN: %d", MAX_REQ_LEN);
-		send_no(conn_fd, "");
-		return;
-	}	
+	tx_response(conn_fd, NULL, response);
+	free(response);
 
-	if (rx_rec(conn_fd, (void *)password, (size_t)count) != (ssize_t)count) 
-		return;
-		
-	password[count] = '\0';
+	return 0;
+}
 
-	/* service */
-	if (rx_rec(conn_fd, (void *)&count, (size_t)sizeof(count)) != (ssize_t)sizeof(count)) 
-		return;
 
-	count = ntohs(count);
+/*************************************************************
+ * Serve a protocol version 2 connection. The client sends the
+ * version it speaks, which we acknowledge with "OK <version>".
+ * After that every request and response is prefixed with a
+ * 32 bit request id. Requests are answered in order here; the
+ * event model may answer them out of order. The connection is
+ * dropped after PROTO_V2_IDLE_TIMEOUT idle seconds or after
+ * PROTO_V2_MAX_REQUESTS requests, so a pooled client can't tie
+ * up a worker process or thread for good; clients reconnect.
+ * It is also dropped between requests when saslauthd stops.
+ **************************************************************/
+int do_request_v2(int conn_fd) {
 
-	if (count > MAX_REQ_LEN) {
-		logger(L_ERR, L_FUNC, "service exceeded MAX_REQ_LEN: %d", MAX_REQ_LEN);
-		send_no(conn_fd, "");
-		return;
-	}	
+	unsigned short		version;                   /* protocol version the client speaks     */
+	unsigned short		count;                     /* input/output data byte count           */
+	unsigned int		id;                        /* request id, network byte order         */
+	char			*response;                 /* response to send to the client         */
+	char			buff[32];                  /* handshake response                     */
+	char			login[MAX_REQ_LEN + 1];    /* account name to authenticate           */
+	char			password[MAX_REQ_LEN + 1]; /* password for authentication            */
+	char			service[MAX_REQ_LEN + 1];  /* service name for authentication        */
+	char			realm[MAX_REQ_LEN + 1];    /* user realm for authentication          */
+	struct pollfd		pfd[2];                    /* the connection and stop_fd             */
+	int			served = 0;                /* requests answered on this connection   */
 
-	if (rx_rec(conn_fd, (void *)service, (size_t)count) != (ssize_t)count) 
-		return;
 
-	service[count] = '\0';
+	if (rx_rec(conn_fd, (void *)&version, (size_t)sizeof(version)) != (ssize_t)sizeof(version)) 
+		return -1;
 
-	/* realm */
-	if (rx_rec(conn_fd, (void *)&count, (size_t)sizeof(count)) != (ssize_t)sizeof(count)) 
-		return;
+	if (ntohs(version) < PROTO_VERSION) {
+		logger(L_ERR, L_FUNC, "unsupported protocol version: %d", ntohs(version));
+		send_no(conn_fd, "unsupported protocol version");
+		return -1;
+	}
 
-	count = ntohs(count);
+	snprintf(buff, sizeof(buff), "OK %d", PROTO_VERSION);
 
-	if (count > MAX_REQ_LEN) {
-		logger(L_ERR, L_FUNC, "realm exceeded MAX_REQ_LEN: %d", MAX_REQ_LEN);
-		send_no(conn_fd, "");
-		return;
-	}	
+	if (tx_response(conn_fd, NULL, buff) != 0)
+		return -1;
 
-	if (rx_rec(conn_fd, (void *)realm, (size_t)count) != (ssize_t)count) 
-		return;
+	while (1) {
+		pfd[0].fd = conn_fd;
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+		pfd[1].fd = stop_fd;
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+
+		if (poll(pfd, 2, PROTO_V2_IDLE_TIMEOUT * 1000) <= 0 ||
+		    pfd[1].revents != 0)
+			return 0;
+
+		if (rx_rec(conn_fd, (void *)&id, (size_t)sizeof(id)) != (ssize_t)sizeof(id)) 
+			return 0;
+
+		if (rx_rec(conn_fd, (void *)&count, (size_t)sizeof(count)) != (ssize_t)sizeof(count)) 
+			return -1;
+
+		if (rx_request(conn_fd, ntohs(count), login, password, service, realm) != 0)
+			return -1;
+
+		if ((response = auth_request(login, password, service, realm)) == NULL)
+			return -1;
+
+		if (tx_response(conn_fd, &id, response) != 0) {
+			free(response);
+			return -1;
+		}
+
+		free(response);
+
+		/* let the worker go back to accept() now and then */
+		if (++served >= PROTO_V2_MAX_REQUESTS)
+			return 0;
+	}
+}
+
+
+/*************************************************************
+ * Answer a statistics query with the report from stats.c, as
+ * a single counted length string. The connection is closed
+ * after it. Return 0 if the report was sent, -1 otherwise.
+ **************************************************************/
+int do_request_stats(int conn_fd) {
+
+	char			*report;                   /* the statistics                         */
+	int			rc;
+
+
+	if ((report = malloc(STATS_REPORT_MAX)) == NULL) {
+		send_no(conn_fd, "could not allocate memory");
+		return 0;
+	}
+
+	stats_report(report, STATS_REPORT_MAX, auth_mech->name);
+	rc = tx_response(conn_fd, NULL, report);
+	free(report);
+
+	return rc;
+}
+
+
+/*************************************************************
+ * Read the rest of a request: the login id (whose count the
+ * caller already read), password, service name and realm.
+ * Return 0 if everything went ok, -1 otherwise.
+ **************************************************************/
+int rx_request(int conn_fd, unsigned short count, char *login, char *password,
+	       char *service, char *realm) {
+
+	static const char	*names[] = { "login", "password", "service", "realm" };
+	char			*fields[4];
+	int			x;
+
+
+	fields[0] = login;
+	fields[1] = password;
+	fields[2] = service;
+	fields[3] = realm;
+
+	for (x = 0; x < 4; x++) {
+		if (x > 0) {
+			if (rx_rec(conn_fd, (void *)&count, (size_t)sizeof(count)) != (ssize_t)sizeof(count)) 
+				return -1;
+
+			count = ntohs(count);
+		}
+
+		if (count > MAX_REQ_LEN) {
+			logger(L_ERR, L_FUNC, "%s exceeded MAX_REQ_LEN: %d", names[x], MAX_REQ_LEN);
+			send_no(conn_fd, "");
+			return -1;
+		}	
+
+		if (rx_rec(conn_fd, (void *)fields[x], (size_t)count) != (ssize_t)count) 
+			return -1;
+
+		fields[x][count] = '\0';
+	}
+
+	return 0;
+}
+
+
+/*************************************************************
+ * Send a response as a counted length string, prefixed with
+ * the request id if there is one. Return 0 if everything went
+ * ok, -1 otherwise.
+ **************************************************************/
+int tx_response(int conn_fd, unsigned int *id, char *response) {
+
+	unsigned short		ncount;
+	struct iovec		iov[3];
+	int			iovcnt = 0;
+	int			total;
+
+
+	ncount = htons(strlen(response));
+
+	if (id != NULL) {
+		iov[iovcnt].iov_base = (void *)id;
+		iov[iovcnt++].iov_len = sizeof(*id);
+	}
+
+	iov[iovcnt].iov_base = (void *)&ncount;
+	iov[iovcnt++].iov_len = sizeof(ncount);
+	iov[iovcnt].iov_base = (void *)response;
+	iov[iovcnt++].iov_len = strlen(response);
+
+	total = (id ? sizeof(*id) : 0) + sizeof(ncount) + strlen(response);
+
+	if (retry_writev(conn_fd, iov, iovcnt) != total)
+		return -1;
+
+	if (flags & VERBOSE)
+		logger(L_DEBUG, L_FUNC, "response: %s", response);
+
+	return 0;
+}
+
+
+/*************************************************************
+ * Validate a decoded request and run it through do_auth().
+ * The password buffer is wiped before we return. Returns a
+ * malloc()ed response that the caller must free, or NULL if
+ * we ran out of memory.
+ **************************************************************/
+char *auth_request(char *login, char *password, char *service, char *realm) {
+
+	char			*response;
 
-	realm[count] = '\0';
 
 	/**************************************************************
  	 * We don't allow NULL passwords or login names
 	 **************************************************************/
 	if (*login == '\0') {
 		logger(L_ERR, L_FUNC, "NULL login received");
-		send_no(conn_fd, "NULL login received");
-		return;
+		return strdup("NO NULL login received");
 	}	
 	
 	if (*password == '\0') {
 		logger(L_ERR, L_FUNC, "NULL password received");
-		send_no(conn_fd, "NULL password received");
-		return;
+		return strdup("NO NULL password received");
 	}	
 
-	/**************************************************************
-	 * Get the mechanism response from do_auth() and send it back.
-	 **************************************************************/
 	response = do_auth(login, password, service, realm);
 
 	memset(password, 0, strlen(password));
 
-	if (response == NULL) {
-		send_no(conn_fd, "NULL response from mechanism");
-		return;
-	}	
-
-	count = strlen(response);
-	ncount = htons(count);
-
-	if (tx_rec(conn_fd, (void *)&ncount, (size_t)sizeof(ncount)) != (ssize_t)sizeof(ncount)) {
-		free(response);
-		return;
-	}
-
-	if (tx_rec(conn_fd, (void *)response, (size_t)count) != (ssize_t)sizeof(count)) {
-		free(response);
-		return;
-	}
-
-	if (flags & VERBOSE)
-		logger(L_DEBUG, L_FUNC, "response: %s", response);
-
-	free(response);
+	if (response == NULL)
+		return strdup("NO NULL response from mechanism");
 
-	return;
+	return response;
 }
 
 
@@ -566,5 +831,1223 @@ int rel_accept_lock() {
 }
 
 
+#ifdef USE_THREADS
+/*****************************************************************
+ * Thread model.
+ *
+ * A single process runs num_threads worker threads, each doing
+ * what a prefork worker process does: accept() a connection on
+ * the shared socket and serve it with do_request(). accept()
+ * needs no lock between threads. The main thread is worker 0
+ * and the only one with signals unblocked, so the signal
+ * handlers run there as they would in the master process.
+ * Mechanisms flagged MECH_NOT_THREAD_SAFE are serialized in
+ * do_auth(), everything else (the cache in particular) runs in
+ * parallel. With -A the threads are bound to CPUs, round robin.
+ *****************************************************************/
+
+static void	*th_worker(void *);
+static void	th_serve(int);
+static void	th_set_affinity(int);
+
+
+/*************************************************************
+ * Start the worker threads, then become worker 0. Once we're
+ * told to stop, wait for the others to finish their requests.
+ **************************************************************/
+void th_loop() {
+
+	pthread_t	*tids;
+	sigset_t	all, old;
+	int		x, rc;
+
+
+	if (flags & VERBOSE)
+		logger(L_DEBUG, L_FUNC, "using thread model: %d threads", num_threads);
+
+	if ((tids = calloc(num_threads, sizeof(pthread_t))) == NULL) {
+		logger(L_ERR, L_FUNC, "could not allocate memory");
+		exit(1);
+	}
+
+	/* the new threads inherit the blocked signals */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	for (x = 1; x < num_threads; x++) {
+		if ((rc = pthread_create(&tids[x], NULL, th_worker, (void *)(long)x)) != 0) {
+			logger(L_ERR, L_FUNC, "could not create worker thread");
+			logger(L_ERR, L_FUNC, "pthread_create: %s", strerror(rc));
+			exit(1);
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	th_serve(0);
+
+	for (x = 1; x < num_threads; x++)
+		pthread_join(tids[x], NULL);
+
+	free(tids);
+}
+
+
+/*************************************************************
+ * Thread start routine.
+ **************************************************************/
+void *th_worker(void *arg) {
+
+	th_serve((int)(long)arg);
+	return NULL;
+}
+
+
+/*************************************************************
+ * Worker thread n's loop, see ipc_loop(). The client address
+ * is kept on the stack, the module globals are shared. Returns
+ * when saslauthd stops.
+ **************************************************************/
+void th_serve(int n) {
+
+	int			conn_fd;
+	struct sockaddr_un	th_client;
+	SALEN_TYPE		th_len;
+
+
+	stats_thread(n);
+	th_set_affinity(n);
+
+	while (1) {
+		th_len = sizeof(th_client);
+
+		conn_fd = accept_conn(&th_client, &th_len);
+
+		if (conn_fd == -2)
+			break;
+
+		if (conn_fd == -1)
+			continue;
+
+		do_request(conn_fd);
+		close(conn_fd);
+	}
+}
+
+
+/*************************************************************
+ * Bind worker thread n to its CPU, if we were given a list.
+ * Failing that isn't fatal, the thread just floats.
+ **************************************************************/
+void th_set_affinity(int n) {
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	cpu_set_t	cpus;
+	int		cpu;
+	int		rc;
+
+
+	if (num_cpus == 0)
+		return;
+
+	cpu = cpu_list[n % num_cpus];
+
+	if (cpu >= CPU_SETSIZE) {
+		logger(L_ERR, L_FUNC, "cpu %d out of range, thread %d not bound", cpu, n);
+		return;
+	}
+
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+
+	if ((rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) != 0) {
+		logger(L_ERR, L_FUNC, "could not bind thread %d to cpu %d", n, cpu);
+		logger(L_ERR, L_FUNC, "pthread_setaffinity_np: %s", strerror(rc));
+		return;
+	}
+
+	if (flags & VERBOSE)
+		logger(L_DEBUG, L_FUNC, "thread %d bound to cpu %d", n, cpu);
+#endif
+}
+
+#endif /* USE_THREADS */
+
+
+#ifdef HAVE_SYS_EPOLL_H
+/*****************************************************************
+ * Event-driven (epoll) connection handling.
+ *
+ * One process owns the listening socket and every client
+ * connection. Client sockets are non-blocking and stay open
+ * across requests; once a complete request has been buffered it
+ * becomes a job that is handed, byte for byte, to an idle worker
+ * process over a socketpair. Workers simply run do_request() in a
+ * loop, so the wire format between the event loop and a worker is
+ * the plain one the clients speak. Jobs are queued when all the
+ * workers are busy. With -n 0 the requests are processed inline.
+ *
+ * Plain connections have at most one request in flight so their
+ * responses stay in order. Protocol version 2 connections tag
+ * each request with an id and may have up to EV_MAX_INFLIGHT of
+ * them spread across the workers.
+ *****************************************************************/
+
+/* largest possible request: four counted length strings */
+#define EV_MAX_REQUEST		(4 * (sizeof(unsigned short) + MAX_REQ_LEN))
+
+/* client input buffer, enough for a few pipelined requests */
+#define EV_CONN_BUFSIZE		(4 * (sizeof(unsigned int) + EV_MAX_REQUEST))
+
+/* largest possible response: one counted length string */
+#define EV_MAX_RESPONSE		(sizeof(unsigned short) + 65535)
+
+/* requests a v2 connection may have outstanding */
+#define EV_MAX_INFLIGHT		64
+
+#define EV_MAX_EVENTS		256
+
+/* handle types, stored first in every epoll registered struct */
+#define EV_LISTENER		1
+#define EV_CLIENT		2
+#define EV_WORKER		3
+#define EV_STOP			4
+
+/* client protocol, known after the first bytes */
+#define EV_PROTO_UNKNOWN	0
+#define EV_PROTO_V1		1
+#define EV_PROTO_V2		2
+
+struct ev_conn {
+	int			type;        /* EV_CLIENT                          */
+	int			fd;          /* client socket, -1 once closed      */
+	int			proto;       /* EV_PROTO_*                         */
+	char			in[EV_CONN_BUFSIZE];
+	size_t			in_len;      /* bytes buffered in in[]             */
+	char			*out;        /* pending response bytes             */
+	size_t			out_len;
+	size_t			out_off;
+	unsigned int		events;      /* currently registered events        */
+	int			inflight;    /* jobs queued or at a worker         */
+	int			closing;     /* close once out[] has drained       */
+	struct ev_conn		*prev;
+	struct ev_conn		*next;
+};
+
+struct ev_job {
+	struct ev_conn		*conn;
+	unsigned int		id;          /* v2 request id, network byte order  */
+	size_t			len;
+	char			frame[EV_MAX_REQUEST];
+	struct ev_job		*next;
+};
+
+struct ev_worker {
+	int			type;        /* EV_WORKER                          */
+	int			fd;          /* our end of the socketpair          */
+	pid_t			pid;
+	struct ev_job		*job;        /* job served, NULL if idle           */
+	char			*in;         /* response being read, EV_MAX_RESPONSE */
+	size_t			in_len;
+};
+
+static int		ev_fd = -1;          /* the epoll descriptor               */
+static int		ev_listener = EV_LISTENER;
+static int		ev_stop = EV_STOP;
+static struct ev_worker	*ev_workers;
+static int		ev_num_workers;
+static struct ev_conn	*ev_conns;           /* all open client connections        */
+static struct ev_conn	*ev_dead;            /* closed, freed by ev_reap()         */
+static struct ev_job	*ev_pending_head;    /* jobs waiting for a worker          */
+static struct ev_job	*ev_pending_tail;
+static long		ev_pending_count;    /* length of the above, for stats     */
+
+static int	ev_set_nonblock(int);
+static int	ev_spawn_worker(struct ev_worker *);
+static void	ev_accept();
+static void	ev_conn_read(struct ev_conn *);
+static void	ev_conn_write(struct ev_conn *);
+static void	ev_conn_update(struct ev_conn *);
+static void	ev_conn_close(struct ev_conn *);
+static void	ev_conn_consume(struct ev_conn *, size_t);
+static void	ev_reap();
+static void	ev_conn_next(struct ev_conn *);
+static int	ev_queue_response(struct ev_conn *, unsigned int *, const char *, size_t);
+static int	ev_queue_counted(struct ev_conn *, unsigned int *, const char *);
+static int	ev_queue_no(struct ev_conn *, unsigned int *, const char *);
+static int	ev_queue_stats(struct ev_conn *);
+static void	ev_dispatch();
+static void	ev_worker_read(struct ev_worker *);
+static void	ev_worker_failed(struct ev_worker *);
+static ssize_t	ev_frame_len(const char *, size_t);
+static void	ev_run_inline(struct ev_conn *, unsigned int *, const char *);
+
+
+/*************************************************************
+ * The event loop proper. Fork the workers, then multiplex the
+ * listening socket, the clients and the workers until stop_fd
+ * says we're done. The workers then see EOF once they have
+ * finished their requests; server_exit() waits for them.
+ **************************************************************/
+void ev_loop() {
+
+	struct epoll_event	ev;
+	struct epoll_event	events[EV_MAX_EVENTS];
+	int			nfds;
+	int			x;
+	int			rc;
+	int			*handle;
+	int			stopping = 0;
+
+
+	if ((ev_fd = epoll_create(EV_MAX_EVENTS)) == -1) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "could not create epoll descriptor");
+		logger(L_ERR, L_FUNC, "epoll_create: %s", strerror(rc));
+		exit(1);
+	}
+
+	if (ev_set_nonblock(sock_fd) != 0)
+		exit(1);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &ev_listener;
+
+	if (epoll_ctl(ev_fd, EPOLL_CTL_ADD, sock_fd, &ev) == -1) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "could not register listening socket");
+		logger(L_ERR, L_FUNC, "epoll_ctl: %s", strerror(rc));
+		exit(1);
+	}
+
+	ev.data.ptr = &ev_stop;
+
+	if (epoll_ctl(ev_fd, EPOLL_CTL_ADD, stop_fd, &ev) == -1) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "could not register the stop pipe");
+		logger(L_ERR, L_FUNC, "epoll_ctl: %s", strerror(rc));
+		exit(1);
+	}
+
+	/**************************************************************
+	 * num_procs worker processes, or none at all if we're asked to
+	 * run one shot. In that case requests are processed inline.
+	 **************************************************************/
+	ev_num_workers = num_procs;
+
+	if (ev_num_workers > 0) {
+		if ((ev_workers = calloc(ev_num_workers, sizeof(struct ev_worker))) == NULL) {
+			logger(L_ERR, L_FUNC, "could not allocate memory");
+			exit(1);
+		}
+
+		for (x = 0; x < ev_num_workers; x++)
+			ev_workers[x].fd = -1;
+
+		for (x = 0; x < ev_num_workers; x++) {
+			if (ev_spawn_worker(ev_workers + x) != 0)
+				exit(1);
+		}
+	}
+
+	if (flags & VERBOSE)
+		logger(L_DEBUG, L_FUNC, "using event model with %d workers", ev_num_workers);
+
+	while (!stopping) {
+		nfds = epoll_wait(ev_fd, events, EV_MAX_EVENTS, -1);
+
+		if (nfds == -1) {
+			rc = errno;
+
+			if (rc == EINTR)
+				continue;
+
+			logger(L_ERR, L_FUNC, "epoll_wait: %s", strerror(rc));
+			sleep(5);
+			continue;
+		}
+
+		for (x = 0; x < nfds; x++) {
+			handle = events[x].data.ptr;
+
+			switch (*handle) {
+			case EV_STOP:
+				stopping = 1;
+				break;
+
+			case EV_LISTENER:
+				ev_accept();
+				break;
+
+			case EV_WORKER:
+				ev_worker_read((struct ev_worker *)handle);
+				break;
+
+			case EV_CLIENT: {
+				struct ev_conn *conn = (struct ev_conn *)handle;
+
+				if (conn->fd == -1)
+					break;
+
+				if (events[x].events & EPOLLOUT)
+					ev_conn_write(conn);
+
+				if (conn->fd != -1 &&
+				    (events[x].events & (EPOLLIN|EPOLLHUP|EPOLLERR)))
+					ev_conn_read(conn);
+
+				break;
+			}
+			}
+		}
+
+		ev_dispatch();
+		ev_reap();
+	}
+
+	for (x = 0; x < ev_num_workers; x++) {
+		if (ev_workers[x].fd != -1)
+			close(ev_workers[x].fd);
+	}
+}
+
+
+/*************************************************************
+ * Put a descriptor in non-blocking mode. Return 0 on success,
+ * -1 on failure.
+ **************************************************************/
+int ev_set_nonblock(int fd) {
+
+	int		fl;
+	int		rc;
+
+
+	if ((fl = fcntl(fd, F_GETFL, 0)) == -1 ||
+	    fcntl(fd, F_SETFL, fl | O_NONBLOCK) == -1) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "could not set non-blocking mode");
+		logger(L_ERR, L_FUNC, "fcntl: %s", strerror(rc));
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*************************************************************
+ * Fork a worker process connected to us through a socketpair.
+ * The child never returns from here. Return 0 in the parent if
+ * everything went ok, -1 otherwise.
+ **************************************************************/
+int ev_spawn_worker(struct ev_worker *worker) {
+
+	int			sv[2];
+	int			rc;
+	struct ev_conn		*conn;
+	struct epoll_event	ev;
+
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "could not create worker socketpair");
+		logger(L_ERR, L_FUNC, "socketpair: %s", strerror(rc));
+		return -1;
+	}
+
+	if ((worker->pid = have_baby()) == 0) {
+		/**************************************************************
+		 * Child. Drop everything that belongs to the event loop,
+		 * especially the client sockets, otherwise they wouldn't see
+		 * EOF when the loop closes them.
+		 **************************************************************/
+		close(sv[0]);
+		close(sock_fd);
+		close(ev_fd);
+
+		for (conn = ev_conns; conn != NULL; conn = conn->next)
+			close(conn->fd);
+
+		for (rc = 0; rc < ev_num_workers; rc++) {
+			if (ev_workers[rc].fd != -1)
+				close(ev_workers[rc].fd);
+		}
+
+		while (do_request(sv[1]) == 0)
+			;
+
+		exit(0);
+	}
+
+	close(sv[1]);
+
+	worker->type = EV_WORKER;
+	worker->fd = sv[0];
+	worker->job = NULL;
+	worker->in_len = 0;
+
+	if (worker->in == NULL && (worker->in = malloc(EV_MAX_RESPONSE)) == NULL) {
+		logger(L_ERR, L_FUNC, "could not allocate memory");
+		close(worker->fd);
+		worker->fd = -1;
+		return -1;
+	}
+
+	if (ev_set_nonblock(worker->fd) != 0) {
+		close(worker->fd);
+		worker->fd = -1;
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = worker;
+
+	if (epoll_ctl(ev_fd, EPOLL_CTL_ADD, worker->fd, &ev) == -1) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "could not register worker");
+		logger(L_ERR, L_FUNC, "epoll_ctl: %s", strerror(rc));
+		close(worker->fd);
+		worker->fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*************************************************************
+ * Accept every pending connection on the listening socket.
+ **************************************************************/
+void ev_accept() {
+
+	int			conn_fd;
+	int			rc;
+	struct ev_conn		*conn;
+	struct epoll_event	ev;
+
+
+	while (1) {
+		len = sizeof(client);
+
+		if ((conn_fd = accept(sock_fd, (struct sockaddr *)&client, &len)) == -1) {
+			rc = errno;
+
+			if (rc == EINTR)
+				continue;
+
+			if (rc != EAGAIN && rc != EWOULDBLOCK) {
+				logger(L_ERR, L_FUNC, "socket accept failure");
+				logger(L_ERR, L_FUNC, "accept: %s", strerror(rc));
+			}
+
+			return;
+		}
+
+		if (ev_set_nonblock(conn_fd) != 0) {
+			close(conn_fd);
+			continue;
+		}
+
+		if ((conn = calloc(1, sizeof(struct ev_conn))) == NULL) {
+			logger(L_ERR, L_FUNC, "could not allocate memory");
+			close(conn_fd);
+			continue;
+		}
+
+		conn->type = EV_CLIENT;
+		conn->fd = conn_fd;
+		conn->proto = EV_PROTO_UNKNOWN;
+		conn->events = EPOLLIN;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = conn->events;
+		ev.data.ptr = conn;
+
+		if (epoll_ctl(ev_fd, EPOLL_CTL_ADD, conn_fd, &ev) == -1) {
+			rc = errno;
+			logger(L_ERR, L_FUNC, "could not register client");
+			logger(L_ERR, L_FUNC, "epoll_ctl: %s", strerror(rc));
+			close(conn_fd);
+			free(conn);
+			continue;
+		}
+
+		conn->next = ev_conns;
+		if (ev_conns != NULL)
+			ev_conns->prev = conn;
+		ev_conns = conn;
+	}
+}
+
+
+/*************************************************************
+ * Pull whatever the client sent us into its buffer and see if
+ * complete requests are there.
+ **************************************************************/
+void ev_conn_read(struct ev_conn *conn) {
+
+	ssize_t		n;
+	int		rc;
+
+
+	while (conn->in_len < sizeof(conn->in)) {
+		n = read(conn->fd, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len);
+
+		if (n > 0) {
+			conn->in_len += n;
+			continue;
+		}
+
+		if (n == 0) {
+			ev_conn_close(conn);
+			return;
+		}
+
+		rc = errno;
+
+		if (rc == EINTR)
+			continue;
+
+		if (rc == EAGAIN || rc == EWOULDBLOCK)
+			break;
+
+		if (flags & VERBOSE)
+			logger(L_DEBUG, L_FUNC, "read: %s", strerror(rc));
+
+		ev_conn_close(conn);
+		return;
+	}
+
+	ev_conn_next(conn);
+}
+
+
+/*************************************************************
+ * Turn the complete requests at the head of the client's input
+ * buffer into jobs, as long as the client may have more of them
+ * in flight. The first bytes on a connection tell us whether the
+ * client speaks protocol version 2.
+ **************************************************************/
+void ev_conn_next(struct ev_conn *conn) {
+
+	unsigned short	count;
+	unsigned int	id;
+	unsigned int	*idp;
+	ssize_t		frame_len;
+	size_t		off;
+	char		buff[32];
+	struct ev_job	*job;
+
+
+	while (conn->fd != -1 && !conn->closing &&
+	       conn->inflight < (conn->proto == EV_PROTO_V2 ? EV_MAX_INFLIGHT : 1)) {
+
+		/**************************************************************
+		 * Protocol detection and handshake, see do_request_v2().
+		 **************************************************************/
+		if (conn->proto == EV_PROTO_UNKNOWN) {
+			if (conn->in_len < sizeof(count))
+				break;
+
+			memcpy(&count, conn->in, sizeof(count));
+
+			if (ntohs(count) == PROTO_STATS_MARKER) {
+				ev_conn_consume(conn, sizeof(count));
+				conn->closing = 1;
+				ev_queue_stats(conn);
+				return;
+			}
+
+			if (ntohs(count) != PROTO_V2_MARKER) {
+				conn->proto = EV_PROTO_V1;
+				continue;
+			}
+
+			if (conn->in_len < 2 * sizeof(count))
+				break;
+
+			memcpy(&count, conn->in + sizeof(count), sizeof(count));
+			ev_conn_consume(conn, 2 * sizeof(count));
+
+			if (ntohs(count) < PROTO_VERSION) {
+				logger(L_ERR, L_FUNC, "unsupported protocol version: %d", ntohs(count));
+				conn->closing = 1;
+				ev_queue_no(conn, NULL, "unsupported protocol version");
+				return;
+			}
+
+			conn->proto = EV_PROTO_V2;
+			snprintf(buff, sizeof(buff), "OK %d", PROTO_VERSION);
+
+			if (ev_queue_counted(conn, NULL, buff) != 0)
+				return;
+
+			continue;
+		}
+
+		off = 0;
+		idp = NULL;
+
+		if (conn->proto == EV_PROTO_V2) {
+			if (conn->in_len < sizeof(id))
+				break;
+
+			memcpy(&id, conn->in, sizeof(id));
+			off = sizeof(id);
+			idp = &id;
+		}
+
+		frame_len = ev_frame_len(conn->in + off, conn->in_len - off);
+
+		if (frame_len == 0)
+			break;
+
+		if (frame_len < 0) {
+			logger(L_ERR, L_FUNC, "request field exceeded MAX_REQ_LEN: %d", MAX_REQ_LEN);
+			conn->closing = 1;
+			conn->in_len = 0;
+			ev_queue_no(conn, idp, "");
+			return;
+		}
+
+		/**************************************************************
+		 * Without workers, answer the request right away.
+		 **************************************************************/
+		if (ev_num_workers == 0) {
+			ev_run_inline(conn, idp, conn->in + off);
+			ev_conn_consume(conn, off + frame_len);
+			continue;
+		}
+
+		if ((job = malloc(sizeof(struct ev_job))) == NULL) {
+			logger(L_ERR, L_FUNC, "could not allocate memory");
+			ev_conn_consume(conn, off + frame_len);
+
+			if (ev_queue_no(conn, idp, "could not allocate memory") != 0)
+				return;
+
+			continue;
+		}
+
+		job->conn = conn;
+		job->id = id;
+		job->len = frame_len;
+		job->next = NULL;
+		memcpy(job->frame, conn->in + off, frame_len);
+		ev_conn_consume(conn, off + frame_len);
+
+		if (ev_pending_tail != NULL)
+			ev_pending_tail->next = job;
+		else
+			ev_pending_head = job;
+
+		ev_pending_tail = job;
+		stats_set_queued(++ev_pending_count);
+		conn->inflight++;
+	}
+
+	ev_conn_update(conn);
+}
+
+
+/*************************************************************
+ * Drop bytes from the head of the client's input buffer,
+ * wiping them since they may hold a password.
+ **************************************************************/
+void ev_conn_consume(struct ev_conn *conn, size_t bytes) {
+
+	memset(conn->in, 0, bytes);
+	conn->in_len -= bytes;
+	memmove(conn->in, conn->in + bytes, conn->in_len);
+	memset(conn->in + conn->in_len, 0, bytes);
+}
+
+
+/*************************************************************
+ * Decode and process a request in this process. Used when
+ * there are no workers.
+ **************************************************************/
+void ev_run_inline(struct ev_conn *conn, unsigned int *id, const char *frame) {
+
+	char		fields[4][MAX_REQ_LEN + 1];
+	char		*response;
+	unsigned short	count;
+	size_t		off = 0;
+	int		x;
+
+
+	for (x = 0; x < 4; x++) {
+		memcpy(&count, frame + off, sizeof(count));
+		count = ntohs(count);
+		off += sizeof(count);
+
+		memcpy(fields[x], frame + off, count);
+		fields[x][count] = '\0';
+		off += count;
+	}
+
+	response = auth_request(fields[0], fields[1], fields[2], fields[3]);
+
+	if (response == NULL) {
+		ev_queue_no(conn, id, "could not allocate memory");
+		return;
+	}
+
+	if (flags & VERBOSE)
+		logger(L_DEBUG, L_FUNC, "response: %s", response);
+
+	ev_queue_counted(conn, id, response);
+	free(response);
+}
+
+
+/*************************************************************
+ * Hand queued jobs off to idle workers.
+ **************************************************************/
+void ev_dispatch() {
+
+	int		x;
+	ssize_t		rc;
+	struct ev_job	*job;
+	struct ev_conn	*conn;
+	struct ev_worker *worker;
+
+
+	for (x = 0; x < ev_num_workers && ev_pending_head != NULL; x++) {
+		worker = ev_workers + x;
+
+		if (worker->job != NULL || worker->fd == -1)
+			continue;
+
+		job = ev_pending_head;
+		ev_pending_head = job->next;
+		if (ev_pending_head == NULL)
+			ev_pending_tail = NULL;
+		job->next = NULL;
+		stats_set_queued(--ev_pending_count);
+
+		/**************************************************************
+		 * The worker is idle, so its socket buffer is empty and a
+		 * single request always fits. A short write means the worker
+		 * went away.
+		 **************************************************************/
+		rc = tx_rec(worker->fd, job->frame, job->len);
+		memset(job->frame, 0, job->len);
+
+		if (rc != (ssize_t)job->len) {
+			conn = job->conn;
+			conn->inflight--;
+
+			if (ev_queue_no(conn, conn->proto == EV_PROTO_V2 ? &job->id : NULL,
+					"worker failure") == 0)
+				ev_conn_next(conn);
+
+			free(job);
+			ev_worker_failed(worker);
+			continue;
+		}
+
+		worker->job = job;
+	}
+}
+
+
+/*************************************************************
+ * Read a (partial) response from a worker. Once it's complete,
+ * queue it on the client and look for the client's next request.
+ **************************************************************/
+void ev_worker_read(struct ev_worker *worker) {
+
+	ssize_t		n;
+	int		rc;
+	unsigned short	count;
+	struct ev_job	*job;
+	struct ev_conn	*conn;
+
+
+	while (1) {
+		n = read(worker->fd, worker->in + worker->in_len,
+			 EV_MAX_RESPONSE - worker->in_len);
+
+		if (n == 0) {
+			ev_worker_failed(worker);
+			return;
+		}
+
+		if (n < 0) {
+			rc = errno;
+
+			if (rc == EINTR)
+				continue;
+
+			if (rc == EAGAIN || rc == EWOULDBLOCK)
+				return;
+
+			logger(L_ERR, L_FUNC, "read: %s", strerror(rc));
+			ev_worker_failed(worker);
+			return;
+		}
+
+		worker->in_len += n;
+
+		if (worker->in_len < sizeof(count))
+			continue;
+
+		memcpy(&count, worker->in, sizeof(count));
+
+		if (worker->in_len < sizeof(count) + ntohs(count))
+			continue;
+
+		break;
+	}
+
+	/**************************************************************
+	 * Response complete. The client may have hung up in the
+	 * meantime, in which case the response is simply dropped.
+	 **************************************************************/
+	job = worker->job;
+	worker->job = NULL;
+
+	if (job != NULL) {
+		conn = job->conn;
+		conn->inflight--;
+
+		if (conn->fd != -1 &&
+		    ev_queue_response(conn, conn->proto == EV_PROTO_V2 ? &job->id : NULL,
+				      worker->in, worker->in_len) == 0)
+			ev_conn_next(conn);
+
+		free(job);
+	}
+
+	worker->in_len = 0;
+}
+
+
+/*************************************************************
+ * A worker died or stopped talking to us. Fail the request it
+ * was serving and replace it.
+ **************************************************************/
+void ev_worker_failed(struct ev_worker *worker) {
+
+	struct ev_job	*job;
+	struct ev_conn	*conn;
+
+
+	logger(L_ERR, L_FUNC, "worker %lu failed, restarting", (unsigned long)worker->pid);
+
+	epoll_ctl(ev_fd, EPOLL_CTL_DEL, worker->fd, NULL);
+	close(worker->fd);
+	worker->fd = -1;
+	worker->in_len = 0;
+
+	if ((job = worker->job) != NULL) {
+		worker->job = NULL;
+		conn = job->conn;
+		conn->inflight--;
+
+		if (conn->fd != -1 &&
+		    ev_queue_no(conn, conn->proto == EV_PROTO_V2 ? &job->id : NULL,
+				"worker failure") == 0)
+			ev_conn_next(conn);
+
+		free(job);
+	}
+
+	kill(worker->pid, SIGTERM);
+
+	if (ev_spawn_worker(worker) != 0)
+		logger(L_ERR, L_FUNC, "could not restart worker");
+}
+
+
+/*************************************************************
+ * Append data to a client's output, prefixed with the request
+ * id if there is one. Return 0 on success, -1 if we're out of
+ * memory or the client went away.
+ **************************************************************/
+int ev_queue_response(struct ev_conn *conn, unsigned int *id, const char *data, size_t data_len) {
+
+	char		*out;
+	size_t		id_len;
+
+
+	id_len = id ? sizeof(*id) : 0;
+
+	if ((out = realloc(conn->out, conn->out_len + id_len + data_len)) == NULL) {
+		logger(L_ERR, L_FUNC, "could not allocate memory");
+		ev_conn_close(conn);
+		return -1;
+	}
+
+	if (id != NULL)
+		memcpy(out + conn->out_len, id, id_len);
+
+	memcpy(out + conn->out_len + id_len, data, data_len);
+	conn->out = out;
+	conn->out_len += id_len + data_len;
+
+	ev_conn_write(conn);
+
+	return conn->fd == -1 ? -1 : 0;
+}
+
+
+/*************************************************************
+ * Queue a response string as a counted length string.
+ **************************************************************/
+int ev_queue_counted(struct ev_conn *conn, unsigned int *id, const char *response) {
+
+	char		buff[sizeof(unsigned short) + 1024];
+	unsigned short	count;
+
+
+	count = strlen(response);
+
+	if (count > sizeof(buff) - sizeof(count))
+		count = sizeof(buff) - sizeof(count);
+
+	memcpy(buff + sizeof(count), response, count);
+	count = htons(count);
+	memcpy(buff, &count, sizeof(count));
+
+	return ev_queue_response(conn, id, buff, sizeof(count) + ntohs(count));
+}
+
+
+/*************************************************************
+ * Queue a "NO" response on a client. See send_no().
+ **************************************************************/
+int ev_queue_no(struct ev_conn *conn, unsigned int *id, const char *mesg) {
+
+	char		buff[1024];
+
+
+	strlcpy(buff, "NO ", sizeof(buff));
+	strlcat(buff, mesg, sizeof(buff));
+
+	if (flags & VERBOSE)
+		logger(L_DEBUG, L_FUNC, "response: %s", buff);
+
+	return ev_queue_counted(conn, id, buff);
+}
+
+
+/*************************************************************
+ * Queue the statistics report, see do_request_stats().
+ **************************************************************/
+int ev_queue_stats(struct ev_conn *conn) {
+
+	char		*buff;
+	unsigned short	count;
+	int		rc;
+
+
+	if ((buff = malloc(sizeof(count) + STATS_REPORT_MAX)) == NULL)
+		return ev_queue_no(conn, NULL, "could not allocate memory");
+
+	count = htons(stats_report(buff + sizeof(count), STATS_REPORT_MAX, auth_mech->name));
+	memcpy(buff, &count, sizeof(count));
+
+	rc = ev_queue_response(conn, NULL, buff, sizeof(count) + ntohs(count));
+	free(buff);
+
+	return rc;
+}
+
+
+/*************************************************************
+ * Write out as much of a client's pending output as the
+ * socket takes.
+ **************************************************************/
+void ev_conn_write(struct ev_conn *conn) {
+
+	ssize_t		n;
+	int		rc;
+
+
+	while (conn->fd != -1 && conn->out_off < conn->out_len) {
+		n = write(conn->fd, conn->out + conn->out_off, conn->out_len - conn->out_off);
+
+		if (n < 0) {
+			rc = errno;
+
+			if (rc == EINTR)
+				continue;
+
+			if (rc == EAGAIN || rc == EWOULDBLOCK)
+				break;
+
+			ev_conn_close(conn);
+			return;
+		}
+
+		conn->out_off += n;
+	}
+
+	if (conn->fd == -1)
+		return;
+
+	if (conn->out_off == conn->out_len) {
+		conn->out_off = 0;
+		conn->out_len = 0;
+
+		if (conn->closing) {
+			ev_conn_close(conn);
+			return;
+		}
+	}
+
+	ev_conn_update(conn);
+}
+
+
+/*************************************************************
+ * Keep the registered events in line with the client's state:
+ * don't read while the client has all the requests in flight
+ * it may have, wait for EPOLLOUT while output is pending.
+ **************************************************************/
+void ev_conn_update(struct ev_conn *conn) {
+
+	struct epoll_event	ev;
+	unsigned int		want = 0;
+
+
+	if (conn->fd == -1)
+		return;
+
+	if (!conn->closing && conn->in_len < sizeof(conn->in) &&
+	    conn->inflight < (conn->proto == EV_PROTO_V2 ? EV_MAX_INFLIGHT : 1))
+		want |= EPOLLIN;
+
+	if (conn->out_len > conn->out_off)
+		want |= EPOLLOUT;
+
+	if (want == conn->events)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = want;
+	ev.data.ptr = conn;
+
+	if (epoll_ctl(ev_fd, EPOLL_CTL_MOD, conn->fd, &ev) == 0)
+		conn->events = want;
+}
+
+
+/*************************************************************
+ * Close a client connection and drop its queued jobs. The
+ * struct itself is only freed by ev_reap(), once no event or
+ * worker refers to it anymore.
+ **************************************************************/
+void ev_conn_close(struct ev_conn *conn) {
+
+	struct ev_job	*job;
+	struct ev_job	**ref;
+
+
+	if (conn->fd == -1)
+		return;
+
+	close(conn->fd);
+	conn->fd = -1;
+
+	memset(conn->in, 0, conn->in_len);
+	conn->in_len = 0;
+
+	if (conn->prev != NULL)
+		conn->prev->next = conn->next;
+	else
+		ev_conns = conn->next;
+
+	if (conn->next != NULL)
+		conn->next->prev = conn->prev;
+
+	ev_pending_tail = NULL;
+	ref = &ev_pending_head;
+
+	while ((job = *ref) != NULL) {
+		if (job->conn == conn) {
+			*ref = job->next;
+			conn->inflight--;
+			stats_set_queued(--ev_pending_count);
+			memset(job->frame, 0, job->len);
+			free(job);
+			continue;
+		}
+
+		ev_pending_tail = job;
+		ref = &job->next;
+	}
+
+	conn->prev = NULL;
+	conn->next = ev_dead;
+	ev_dead = conn;
+}
+
+
+/*************************************************************
+ * Free the closed connections that no worker is serving.
+ **************************************************************/
+void ev_reap() {
+
+	struct ev_conn	*conn;
+	struct ev_conn	*keep = NULL;
+
+
+	while ((conn = ev_dead) != NULL) {
+		ev_dead = conn->next;
+
+		if (conn->inflight > 0) {
+			conn->next = keep;
+			keep = conn;
+			continue;
+		}
+
+		free(conn->out);
+		free(conn);
+	}
+
+	ev_dead = keep;
+}
+
+
+/*************************************************************
+ * Return the length of the complete request at the head of
+ * buf, 0 if more data is needed or -1 if one of the counted
+ * length strings exceeds MAX_REQ_LEN.
+ **************************************************************/
+ssize_t ev_frame_len(const char *buf, size_t buf_len) {
+
+	unsigned short	count;
+	size_t		off = 0;
+	int		x;
+
+
+	for (x = 0; x < 4; x++) {
+		if (buf_len - off < sizeof(count))
+			return 0;
+
+		memcpy(&count, buf + off, sizeof(count));
+		count = ntohs(count);
+
+		if (count > MAX_REQ_LEN)
+			return -1;
+
+		off += sizeof(count);
+
+		if (buf_len - off < count)
+			return 0;
+
+		off += count;
+	}
+
+	return (ssize_t)off;
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
+
+
 
 #endif /* USE_UNIX_IPC */
@@ -0,0 +1,366 @@
+/* krb5bench.c: saslauthd auth_krb5 benchmark
+ */
+/* 
+ * Copyright (c) 1998-2003 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer. 
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any other legal
+ *    details, please contact  
+ *      Office of Technology Transfer
+ *      Carnegie Mellon University
+ *      5000 Forbes Avenue
+ *      Pittsburgh, PA  15213-3890
+ *      (412) 268-4387, fax: (412) 268-7395
+ *      tech-transfer@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Measures auth_krb5() calls per second the way a saslauthd worker
+ * makes them, one after the other with the krb5 context, keytab and
+ * verify principal kept between calls, and for comparison the cost
+ * of setting those up for every call as auth_krb5() used to.
+ *
+ * With -k a stand-in KDC is started on a local UDP port and a
+ * krb5.conf pointing at it is used: it answers every request with
+ * KDC_ERR_C_PRINCIPAL_UNKNOWN, so each call makes a real round trip
+ * and fails without a KDC or keytab being set up.  Against a real
+ * KDC give a user and password that can log in (-u, -p, -r) and
+ * saslauthd's configuration file with -O.
+ */
+
+#include <saslauthd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef AUTH_KRB5
+# include <krb5.h>
+#endif
+
+#include "mechanisms.h"
+#include "globals.h"
+#include "utils.h"
+#include "auth_krb5.h"
+
+/* make utils.c and auth_krb5.c happy */
+int flags = LOG_USE_STDERR;
+char *mech_option = NULL;
+
+static long iterations = 1000;
+static const char *user = "bench";
+static const char *password = "secret";
+static const char *service = "imap";
+static const char *realm = "";
+
+#define BENCH_REALM "BENCH.TEST"
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+	    "%s: usage: %s [-k] [-n calls] [-u user] [-p password]\n"
+	    "              [-s service] [-r realm] [-O config file]\n",
+	    prog, prog);
+    exit(1);
+}
+
+static double elapsed_us(struct timeval *start, struct timeval *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e6 +
+	(end->tv_usec - start->tv_usec);
+}
+
+#ifdef AUTH_KRB5
+
+/* DER tag, length and body at out; returns the length of it all */
+static int der(unsigned char *out, int tag, const unsigned char *body, int len)
+{
+    int n = 0;
+
+    out[n++] = tag;
+    if (len >= 128)
+	out[n++] = 0x81;
+    out[n++] = len;
+    memmove(out + n, body, len);
+
+    return n + len;
+}
+
+/* an [n] INTEGER field */
+static int der_int(unsigned char *out, int field, long value)
+{
+    unsigned char num[8], body[16];
+    int n = 0, len;
+
+    /* big-endian, shortest form, positive */
+    do {
+	num[sizeof(num) - ++n] = value & 0xff;
+	value >>= 8;
+    } while (value);
+    if (num[sizeof(num) - n] & 0x80)
+	num[sizeof(num) - ++n] = 0;
+
+    len = der(body, 0x02, num + sizeof(num) - n, n);
+    return der(out, 0xa0 + field, body, len);
+}
+
+/* an [n] field of a string of the given tag */
+static int der_str(unsigned char *out, int field, int tag, const char *s)
+{
+    unsigned char body[128];
+    int len;
+
+    len = der(body, tag, (const unsigned char *)s, strlen(s));
+    return der(out, 0xa0 + field, body, len);
+}
+
+/* KRB-ERROR KDC_ERR_C_PRINCIPAL_UNKNOWN from realm BENCH_REALM */
+static int krb_error(unsigned char *out)
+{
+    unsigned char seq[512], body[512], names[128], strs[128], pn[160];
+    char stime[32];
+    time_t now = time(NULL);
+    int len = 0, n;
+
+    strftime(stime, sizeof(stime), "%Y%m%d%H%M%SZ", gmtime(&now));
+
+    len += der_int(seq + len, 0, 5);		/* pvno */
+    len += der_int(seq + len, 1, 30);		/* msg-type */
+    len += der_str(seq + len, 4, 0x18, stime);	/* stime */
+    len += der_int(seq + len, 5, 0);		/* susec */
+    len += der_int(seq + len, 6, 6);		/* error-code */
+    len += der_str(seq + len, 9, 0x1b, BENCH_REALM);
+
+    /* sname: NT-SRV-INST krbtgt/BENCH_REALM */
+    n = der(names, 0x1b, (const unsigned char *)"krbtgt", 6);
+    n += der(names + n, 0x1b, (const unsigned char *)BENCH_REALM,
+	     strlen(BENCH_REALM));
+    n = der(strs, 0x30, names, n);
+    {
+	int pl = der_int(pn, 0, 2);
+
+	pl += der(pn + pl, 0xa1, strs, n);
+	n = der(body, 0x30, pn, pl);
+	len += der(seq + len, 0xaa, body, n);
+    }
+
+    n = der(body, 0x30, seq, len);
+    return der(out, 0x7e, body, n);
+}
+
+/* the stand-in KDC: answers every datagram until killed */
+static void kdc_loop(int sock)
+{
+    unsigned char req[4096], rep[1024];
+    struct sockaddr_in from;
+    socklen_t fromlen;
+    ssize_t n;
+
+    for (;;) {
+	fromlen = sizeof(from);
+	n = recvfrom(sock, req, sizeof(req), 0,
+		     (struct sockaddr *)&from, &fromlen);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    exit(1);
+	}
+	sendto(sock, rep, krb_error(rep), 0, (struct sockaddr *)&from, fromlen);
+    }
+}
+
+/* starts the stand-in KDC and points KRB5_CONFIG at it */
+static pid_t start_kdc(char *conf, size_t conflen)
+{
+    struct sockaddr_in sin;
+    socklen_t sinlen = sizeof(sin);
+    FILE *f;
+    pid_t pid;
+    int sock, fd;
+
+    if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+	perror("socket");
+	exit(1);
+    }
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(sock, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+	getsockname(sock, (struct sockaddr *)&sin, &sinlen) < 0) {
+	perror("bind");
+	exit(1);
+    }
+
+    if ((pid = fork()) < 0) {
+	perror("fork");
+	exit(1);
+    }
+    if (pid == 0)
+	kdc_loop(sock);
+    close(sock);
+
+    snprintf(conf, conflen, "/tmp/krb5bench.XXXXXX");
+    if ((fd = mkstemp(conf)) < 0 || !(f = fdopen(fd, "w"))) {
+	perror(conf);
+	kill(pid, SIGTERM);
+	exit(1);
+    }
+    fprintf(f,
+	    "[libdefaults]\n"
+	    "\tdefault_realm = %s\n"
+	    "\tdns_lookup_kdc = false\n"
+	    "\tdns_lookup_realm = false\n"
+	    "\tdns_canonicalize_hostname = false\n"
+	    "\trdns = false\n"
+	    "[realms]\n"
+	    "\t%s = {\n"
+	    "\t\tkdc = 127.0.0.1:%d\n"
+	    "\t}\n",
+	    BENCH_REALM, BENCH_REALM, ntohs(sin.sin_port));
+    fclose(f);
+
+    setenv("KRB5_CONFIG", conf, 1);
+    return pid;
+}
+
+/* what auth_krb5() used to set up and throw away on every call */
+static void setup_per_call(void)
+{
+    krb5_context context;
+    krb5_keytab keytab;
+    krb5_principal server;
+
+    if (krb5_init_context(&context))
+	return;
+    if (krb5_kt_default(context, &keytab) == 0)
+	krb5_kt_close(context, keytab);
+    if (krb5_sname_to_principal(context, NULL, "host",
+				KRB5_NT_SRV_HST, &server) == 0)
+	krb5_free_principal(context, server);
+    krb5_free_context(context);
+}
+
+#endif /* AUTH_KRB5 */
+
+int main(int argc, char *argv[])
+{
+    struct timeval start, end;
+    char conf[64];
+    pid_t kdc = 0;
+    int standin = 0;
+    char *reply;
+    long i, ok = 0;
+    double us;
+    int c;
+
+    while ((c = getopt(argc, argv, "kn:u:p:s:r:O:")) != -1) {
+	switch (c) {
+	case 'k':
+	    standin = 1;
+	    break;
+	case 'n':
+	    iterations = atol(optarg);
+	    break;
+	case 'u':
+	    user = optarg;
+	    break;
+	case 'p':
+	    password = optarg;
+	    break;
+	case 's':
+	    service = optarg;
+	    break;
+	case 'r':
+	    realm = optarg;
+	    break;
+	case 'O':
+	    mech_option = optarg;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (optind != argc || iterations <= 0)
+	usage(argv[0]);
+
+#ifndef AUTH_KRB5
+    fprintf(stderr, "%s: saslauthd was built without krb5\n", argv[0]);
+    exit(1);
+#else
+    if (standin)
+	kdc = start_kdc(conf, sizeof(conf));
+
+    if (auth_krb5_init() != 0) {
+	fprintf(stderr, "%s: auth_krb5_init failed\n", argv[0]);
+	exit(1);
+    }
+
+    /* the first call sets the context up */
+    free(auth_krb5(user, password, service, realm));
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < iterations; i++) {
+	reply = auth_krb5(user, password, service, realm);
+	if (reply && !strncmp(reply, "OK", 2))
+	    ok++;
+	free(reply);
+    }
+    gettimeofday(&end, NULL);
+    us = elapsed_us(&start, &end);
+    printf("auth_krb5:       %ld calls (%ld OK), %.1f us/call, %.0f calls/s\n",
+	   iterations, ok, us / iterations, iterations * 1e6 / us);
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < iterations; i++)
+	setup_per_call();
+    gettimeofday(&end, NULL);
+    us = elapsed_us(&start, &end);
+    printf("per call setup:  %.1f us/call saved by keeping the context\n",
+	   us / iterations);
+
+    if (kdc) {
+	kill(kdc, SIGTERM);
+	waitpid(kdc, NULL, 0);
+	unlink(conf);
+    }
+
+    return 0;
+#endif
+}
@@ -59,6 +59,87 @@
 #include <lber.h>
 #include <sasl.h>
 #include "lak.h"
+#include "stats.h"
+#include "globals.h"
+
+#ifdef HAVE_PTHREAD_RWLOCK
+#include <pthread.h>
+#endif
+
+/*
+ * Every worker keeps a pool of ldap connections.  A request checks
+ * one out for the whole search-then-bind exchange and hands it back
+ * still bound, so the next request on it skips the connect and, for
+ * the search, the service bind.  Under the threaded worker model
+ * several requests have their binds in flight at once, one per
+ * connection; a request that finds every connection busy waits for
+ * one to be returned.
+ *
+ * With ldap_async the searches are not made on the pooled connections
+ * at all but on one more, shared, that stays bound as the service user:
+ * every request sends its search there and waits for its own message
+ * id only, so the searches of all the worker's threads are in flight
+ * on it together, and the pooled connections only do the user binds.
+ */
+/*
+ * A login's DN, and whether it passed the group check, hardly ever
+ * change, so with ldap_dn_cache_ttl set they are remembered for that
+ * many seconds, keyed by login, realm and service: a repeat login in
+ * bind mode is then just the bind.  The cache is direct mapped, a
+ * login evicts whatever hashed to its slot before.  Only DNs that a
+ * bind succeeded with and passed group checks are stored, and a
+ * failed bind with a cached DN forgets it.
+ */
+typedef struct lak_dn_entry {
+	unsigned int hash;
+	time_t       expires;
+	int          group_ok;
+	char         user[LAK_BUF_LEN];
+	char         service[LAK_BUF_LEN];
+	char         realm[LAK_BUF_LEN];
+	char         dn[LAK_DN_LEN];
+} LAK_DN_ENTRY;
+
+/*
+ * The servers of ldap_servers are not handed to libldap as one list,
+ * which would always try them in order, but tracked one by one: the
+ * latency of their binds and searches as a moving average, their
+ * errors, and a circuit breaker that takes a server out for
+ * ldap_server_retry seconds after ldap_server_failures errors in a
+ * row.  A new connection goes to the fastest server in service, and
+ * a pooled one moves when its server turns out twice as slow as
+ * another.  Servers the worker is not using are probed (a root DSE
+ * read on a connection of their own) every ldap_server_retry seconds
+ * to keep their average current, and a server whose time out is over
+ * is probed before it is taken back.
+ */
+typedef struct lak_server {
+	char          url[LAK_URL_LEN];
+	double        ewma_us;	/* moving average latency */
+	unsigned long samples;
+	unsigned long errors;
+	int           failures;	/* errors in a row */
+	time_t        open_until;	/* out of service until, 0 if in */
+	time_t        last_sample;
+} LAK_SERVER;
+
+/* weight of the newest sample in the moving average */
+#define LAK_EWMA_WEIGHT 0.2
+
+typedef struct lak_pool {
+#ifdef HAVE_PTHREAD_RWLOCK
+	pthread_mutex_t  lock;
+	pthread_cond_t   cond;
+	pthread_rwlock_t shared_lock;
+	pthread_mutex_t  dn_lock;
+#endif
+	int  size;
+	LAK *conns;
+	LAK  shared;
+	LAK_DN_ENTRY *dn_cache;
+	int  nservers;
+	LAK_SERVER *servers;
+} LAK_POOL;
 
 typedef struct lak_auth_method {
 	int method;
@@ -84,9 +165,30 @@ static int lak_config(const char *, LAK_CONF **);
 static int lak_escape(const char *, const unsigned int, char **);
 static int lak_tokenize_domains(const char *, int, char **);
 static int lak_expand_tokens(const char *, const char *, const char *, const char *, const char *, char **);
+static void lak_set_global_options(const LAK_CONF *);
 static int lak_connect(LAK *);
 static int lak_bind(LAK *, LAK_USER *);
 static void lak_unbind(LAK *);
+static LAK *lak_pool_get(LAK_POOL *);
+static void lak_pool_put(LAK *);
+static void lak_keepalive(LAK *);
+static int lak_servers_init(LAK_POOL *, const char *);
+static int lak_server_pick(LAK *);
+static int lak_server_probe(LAK *, int);
+static void lak_server_check(LAK *);
+static int lak_server_error(int);
+static void lak_server_done(LAK *, int, struct timeval *);
+static LAK *lak_shared_get(LAK_POOL *, int *);
+static void lak_shared_put(LAK_POOL *, LDAP *);
+static int lak_result(LDAP *, int, struct timeval *, LDAPMessage **);
+static int lak_search_st(LAK *, const char *, int, const char *, const char **, LDAPMessage **);
+static int lak_simple_bind(LAK *, LAK_USER *);
+static LAK_DN_ENTRY *lak_dn_cache_slot(LAK_POOL *, const char *, const char *, const char *, int);
+static int lak_dn_cache_get(LAK *, const char *, const char *, const char *, char *, int *);
+static void lak_dn_cache_put(LAK *, const char *, const char *, const char *, const char *, int);
+static void lak_dn_cache_drop(LAK *, const char *, const char *, const char *);
+static int lak_group_check(LAK *, const char *, const char *, const char *, const char *);
+static int lak_search(LAK *, const char *, const char *, const char *, const char **, LAK_RESULT **);
 static int lak_auth_custom(LAK *, const char *, const char *, const char *, const char *);
 static int lak_auth_bind(LAK *, const char *, const char *, const char *, const char *);
 static int lak_auth_fastbind(LAK *, const char *, const char *, const char *, const char *);
@@ -311,6 +413,40 @@ static int lak_config_read(
 
 		else if (!strcasecmp(key, "ldap_debug"))
 			conf->debug = lak_config_int(p);
+
+		else if (!strcasecmp(key, "ldap_pool_size"))
+			conf->pool_size = lak_config_int(p);
+
+		else if (!strcasecmp(key, "ldap_pool_keepalive"))
+			conf->pool_keepalive = lak_config_int(p);
+
+		else if (!strcasecmp(key, "ldap_async"))
+			conf->async = lak_config_switch(p);
+
+		else if (!strcasecmp(key, "ldap_dn_cache_ttl"))
+			conf->dn_cache_ttl = lak_config_int(p);
+
+		else if (!strcasecmp(key, "ldap_dn_cache_size"))
+			conf->dn_cache_size = lak_config_int(p);
+
+		else if (!strcasecmp(key, "ldap_server_failures"))
+			conf->server_failures = lak_config_int(p);
+
+		else if (!strcasecmp(key, "ldap_server_retry"))
+			conf->server_retry = lak_config_int(p);
+	}
+
+	if (conf->dn_cache_size < 1)
+		conf->dn_cache_size = 1;
+
+	if (conf->server_failures < 1)
+		conf->server_failures = 1;
+
+	if (conf->pool_size < 1)
+		conf->pool_size = 1;
+	else if (conf->pool_size > LAK_POOL_MAX) {
+		syslog(LOG_WARNING|LOG_AUTH, "ldap_pool_size %d too large, using %d.", conf->pool_size, LAK_POOL_MAX);
+		conf->pool_size = LAK_POOL_MAX;
 	}
 
 	if (conf->version != LDAP_VERSION3 && 
@@ -388,6 +524,13 @@ static int lak_config(
 	conf->restart = 1;
 	conf->start_tls = 0;
 	conf->use_sasl = 0;
+	conf->pool_size = 1;
+	conf->pool_keepalive = 60;
+	conf->async = 0;
+	conf->dn_cache_ttl = 0;
+	conf->dn_cache_size = 1024;
+	conf->server_failures = 3;
+	conf->server_retry = 30;
 
 	strlcpy(conf->path, configfile, LAK_PATH_LEN);
 
@@ -397,6 +540,15 @@ static int lak_config(
 		return rc;
 	}
 
+#ifndef HAVE_LDAP_THREAD_SAFE
+	/* The searches of all the threads share one LDAP handle with
+	   ldap_async, libldap has to be built for that. */
+	if (conf->async) {
+		syslog(LOG_WARNING|LOG_AUTH, "ldap_async needs a thread safe libldap (libldap_r), ignored.");
+		conf->async = 0;
+	}
+#endif
+
 	*ret = conf;
 	return LAK_OK;
 }
@@ -700,8 +852,10 @@ int lak_init(
 	const char *configfile, 
 	LAK **ret) 
 {
+	LAK_CONF *conf;
+	LAK_POOL *pool;
 	LAK *lak;
-	int rc;
+	int rc, i;
 
 	lak = *ret;
 
@@ -709,41 +863,105 @@ int lak_init(
 		return LAK_OK;
 	}
 
-	lak = (LAK *)malloc(sizeof(LAK));
-	if (lak == NULL)
+	rc = lak_config(configfile, &conf);
+	if (rc != LAK_OK)
+		return rc;
+
+	pool = (LAK_POOL *)malloc(sizeof(LAK_POOL));
+	if (pool == NULL) {
+		lak_config_free(conf);
 		return LAK_NOMEM;
+	}
 
-	lak->status=LAK_NOT_BOUND;
-	lak->ld=NULL;
-	lak->conf=NULL;
-	lak->user=NULL;
+	pool->size = conf->pool_size;
+	pool->conns = (LAK *)malloc(pool->size * sizeof(LAK));
+	if (pool->conns == NULL) {
+		free(pool);
+		lak_config_free(conf);
+		return LAK_NOMEM;
+	}
 
-	rc = lak_config(configfile, &lak->conf);
-	if (rc != LAK_OK) {
-		free(lak);
-		return rc;
+	if (lak_servers_init(pool, conf->servers) != LAK_OK) {
+		free(pool->conns);
+		free(pool);
+		lak_config_free(conf);
+		return LAK_NOMEM;
+	}
+
+	pool->dn_cache = NULL;
+	if (conf->dn_cache_ttl > 0) {
+		pool->dn_cache = (LAK_DN_ENTRY *)calloc(conf->dn_cache_size, sizeof(LAK_DN_ENTRY));
+		if (pool->dn_cache == NULL) {
+			free(pool->servers);
+			free(pool->conns);
+			free(pool);
+			lak_config_free(conf);
+			return LAK_NOMEM;
+		}
 	}
 
+	for (i = 0; i <= pool->size; i++) {
+		lak = (i < pool->size) ? &pool->conns[i] : &pool->shared;
+		lak->status=LAK_NOT_BOUND;
+		lak->ld=NULL;
+		lak->conf=conf;
+		lak->user=NULL;
+		lak->in_use=0;
+		lak->failures=0;
+		lak->last_used=0;
+		lak->pool=pool;
+		lak->server=-1;
+		lak->avoid=-1;
+	}
+
+#ifdef HAVE_PTHREAD_RWLOCK
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pthread_rwlock_init(&pool->shared_lock, NULL);
+	pthread_mutex_init(&pool->dn_lock, NULL);
+#endif
+
+	lak_set_global_options(conf);
+
 #ifdef HAVE_OPENSSL
 	OpenSSL_add_all_digests();
 #endif
 
-	*ret=lak;
+	*ret=pool->conns;
 	return LAK_OK;
 }
 
 void lak_close(
 	LAK *lak) 
 {
+	LAK_POOL *pool;
+	LAK_CONF *conf;
+	int i;
 
 	if (lak == NULL)
 		return;
 
-	lak_config_free(lak->conf);
+	pool = lak->pool;
+	conf = lak->conf;
 
-	lak_unbind(lak);
+	for (i = 0; i < pool->size; i++)
+		lak_unbind(&pool->conns[i]);
+	lak_unbind(&pool->shared);
 
-	free(lak);
+#ifdef HAVE_PTHREAD_RWLOCK
+	pthread_mutex_destroy(&pool->dn_lock);
+	pthread_rwlock_destroy(&pool->shared_lock);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+#endif
+
+	if (pool->dn_cache)
+		free(pool->dn_cache);
+	free(pool->servers);
+	free(pool->conns);
+	free(pool);
+
+	lak_config_free(conf);
 
 #ifdef HAVE_OPENSSL
 	EVP_cleanup();
@@ -752,65 +970,80 @@ void lak_close(
 	return;
 }
 
-static int lak_connect(
-	LAK *lak)
+/*
+ * The TLS and debug settings are library wide, so they are set once
+ * for the whole pool rather than on every (re)connect.
+ */
+static void lak_set_global_options(
+	const LAK_CONF *conf)
 {
-	int rc = 0;
-	char *p = NULL;
+	int rc;
 
-	if (ISSET(lak->conf->tls_cacert_file)) {
-		rc = ldap_set_option (NULL, LDAP_OPT_X_TLS_CACERTFILE, lak->conf->tls_cacert_file);
+	if (ISSET(conf->tls_cacert_file)) {
+		rc = ldap_set_option (NULL, LDAP_OPT_X_TLS_CACERTFILE, conf->tls_cacert_file);
 		if (rc != LDAP_SUCCESS) {
 			syslog (LOG_WARNING|LOG_AUTH, "Unable to set LDAP_OPT_X_TLS_CACERTFILE (%s).", ldap_err2string (rc));
 		}
 	}
 
-	if (ISSET(lak->conf->tls_cacert_dir)) {
-		rc = ldap_set_option (NULL, LDAP_OPT_X_TLS_CACERTDIR, lak->conf->tls_cacert_dir);
+	if (ISSET(conf->tls_cacert_dir)) {
+		rc = ldap_set_option (NULL, LDAP_OPT_X_TLS_CACERTDIR, conf->tls_cacert_dir);
 		if (rc != LDAP_SUCCESS) {
 			syslog (LOG_WARNING|LOG_AUTH, "Unable to set LDAP_OPT_X_TLS_CACERTDIR (%s).", ldap_err2string (rc));
 		}
 	}
 
-	if (lak->conf->tls_check_peer != 0) {
-		rc = ldap_set_option(NULL, LDAP_OPT_X_TLS_REQUIRE_CERT, &lak->conf->tls_check_peer);
+	if (conf->tls_check_peer != 0) {
+		rc = ldap_set_option(NULL, LDAP_OPT_X_TLS_REQUIRE_CERT, &conf->tls_check_peer);
 		if (rc != LDAP_SUCCESS) {
 			syslog (LOG_WARNING|LOG_AUTH, "Unable to set LDAP_OPT_X_TLS_REQUIRE_CERT (%s).", ldap_err2string (rc));
 		}
 	}
 
-	if (ISSET(lak->conf->tls_ciphers)) {
+	if (ISSET(conf->tls_ciphers)) {
 		/* set cipher suite, certificate and private key: */
-		rc = ldap_set_option(NULL, LDAP_OPT_X_TLS_CIPHER_SUITE, lak->conf->tls_ciphers);
+		rc = ldap_set_option(NULL, LDAP_OPT_X_TLS_CIPHER_SUITE, conf->tls_ciphers);
 		if (rc != LDAP_SUCCESS) {
 			syslog (LOG_WARNING|LOG_AUTH, "Unable to set LDAP_OPT_X_TLS_CIPHER_SUITE (%s).", ldap_err2string (rc));
 		}
 	}
 
-	if (ISSET(lak->conf->tls_cert)) {
-		rc = ldap_set_option(NULL, LDAP_OPT_X_TLS_CERTFILE, lak->conf->tls_cert);
+	if (ISSET(conf->tls_cert)) {
+		rc = ldap_set_option(NULL, LDAP_OPT_X_TLS_CERTFILE, conf->tls_cert);
 		if (rc != LDAP_SUCCESS) {
 			syslog (LOG_WARNING|LOG_AUTH, "Unable to set LDAP_OPT_X_TLS_CERTFILE (%s).", ldap_err2string (rc));
 		}
 	}
 
-	if (ISSET(lak->conf->tls_key)) {
-		rc = ldap_set_option(NULL, LDAP_OPT_X_TLS_KEYFILE, lak->conf->tls_key);
+	if (ISSET(conf->tls_key)) {
+		rc = ldap_set_option(NULL, LDAP_OPT_X_TLS_KEYFILE, conf->tls_key);
 		if (rc != LDAP_SUCCESS) {
 			syslog (LOG_WARNING|LOG_AUTH, "Unable to set LDAP_OPT_X_TLS_KEYFILE (%s).", ldap_err2string (rc));
 		}
 	}
 
-	rc = ldap_initialize(&lak->ld, lak->conf->servers);
-	if (rc != LDAP_SUCCESS) {
-		syslog(LOG_ERR|LOG_AUTH, "ldap_initialize failed (%s)", lak->conf->servers);
-		return LAK_CONNECT_FAIL;
+	if (conf->debug) {
+		rc = ldap_set_option(NULL, LDAP_OPT_DEBUG_LEVEL, &(conf->debug));
+		if (rc != LDAP_OPT_SUCCESS)
+			syslog(LOG_WARNING|LOG_AUTH, "Unable to set LDAP_OPT_DEBUG_LEVEL %x.", conf->debug);
 	}
+}
 
-	if (lak->conf->debug) {
-		rc = ldap_set_option(NULL, LDAP_OPT_DEBUG_LEVEL, &(lak->conf->debug));
-		if (rc != LDAP_OPT_SUCCESS)
-			syslog(LOG_WARNING|LOG_AUTH, "Unable to set LDAP_OPT_DEBUG_LEVEL %x.", lak->conf->debug);
+static int lak_connect(
+	LAK *lak)
+{
+	int rc = 0;
+	char *p = NULL;
+	struct timeval start;
+
+	lak->server = lak_server_pick(lak);
+
+	gettimeofday(&start, NULL);
+
+	rc = ldap_initialize(&lak->ld, lak->pool->servers[lak->server].url);
+	if (rc != LDAP_SUCCESS) {
+		syslog(LOG_ERR|LOG_AUTH, "ldap_initialize failed (%s)", lak->pool->servers[lak->server].url);
+		return LAK_CONNECT_FAIL;
 	}
 
 	rc = ldap_set_option(lak->ld, LDAP_OPT_PROTOCOL_VERSION, &(lak->conf->version));
@@ -857,9 +1090,18 @@ static int lak_connect(
 		syslog(LOG_WARNING|LOG_AUTH, "Unable to set LDAP_OPT_RESTART.");
 	}
 
+#ifdef LDAP_OPT_X_KEEPALIVE_IDLE
+	if (lak->conf->pool_keepalive > 0) {
+		rc = ldap_set_option(lak->ld, LDAP_OPT_X_KEEPALIVE_IDLE, &(lak->conf->pool_keepalive));
+		if (rc != LDAP_OPT_SUCCESS)
+			syslog(LOG_WARNING|LOG_AUTH, "Unable to set LDAP_OPT_X_KEEPALIVE_IDLE %d.", lak->conf->pool_keepalive);
+	}
+#endif
+
 	if (lak->conf->start_tls) {
 
 		rc = ldap_start_tls_s(lak->ld, NULL, NULL);
+		lak_server_done(lak, rc, &start);
 		if (rc != LDAP_SUCCESS) {
 			syslog(LOG_ERR|LOG_AUTH, "start tls failed (%s).", ldap_err2string(rc));
 			lak_unbind(lak);
@@ -891,6 +1133,7 @@ static int lak_connect(
 		}
 	}
 
+	stats_phase(STATS_PHASE_CONNECT, &start);
 
 	return LAK_OK;
 }
@@ -1036,6 +1279,7 @@ static int lak_bind(
 	LAK_USER *user)
 {
 	int rc;
+	struct timeval start;
 
 	if (user == NULL)  // Sanity Check
 		return LAK_FAIL;
@@ -1061,6 +1305,8 @@ static int lak_bind(
 			return rc;
 	}
 
+	gettimeofday(&start, NULL);
+
 	if (lak->conf->use_sasl)
 		rc = ldap_sasl_interactive_bind_s(
 			lak->ld, 
@@ -1071,9 +1317,14 @@ static int lak_bind(
 			LDAP_SASL_QUIET, 
 			lak_sasl_interact, 
 			user);
+	else if (lak->conf->async)
+		rc = lak_simple_bind(lak, user);
 	else
 		rc = ldap_simple_bind_s(lak->ld, user->bind_dn, user->password);
 
+	stats_phase(STATS_PHASE_BIND, &start);
+	lak_server_done(lak, rc, &start);
+
 	switch (rc) {
 		case LDAP_SUCCESS:
 			break;
@@ -1119,6 +1370,573 @@ static void lak_unbind(
 	return;
 }
 
+/*
+ * lak_pool_get - check out a connection, preferring one that is
+ * still bound and has not been failing.
+ */
+static LAK *lak_pool_get(
+	LAK_POOL *pool)
+{
+	LAK *lak, *best = NULL;
+	int i;
+
+#ifdef HAVE_PTHREAD_RWLOCK
+	pthread_mutex_lock(&pool->lock);
+#endif
+
+	for (;;) {
+		for (i = 0; i < pool->size; i++) {
+			lak = &pool->conns[i];
+			if (lak->in_use)
+				continue;
+			if (best == NULL ||
+			    (lak->status == LAK_BOUND && best->status != LAK_BOUND) ||
+			    (lak->status == best->status && lak->failures < best->failures))
+				best = lak;
+		}
+
+		if (best != NULL)
+			break;
+
+#ifdef HAVE_PTHREAD_RWLOCK
+		pthread_cond_wait(&pool->cond, &pool->lock);
+#else
+		break;
+#endif
+	}
+
+	if (best != NULL)
+		best->in_use = 1;
+
+#ifdef HAVE_PTHREAD_RWLOCK
+	pthread_mutex_unlock(&pool->lock);
+#endif
+
+	if (best == NULL) {
+		syslog(LOG_ERR|LOG_AUTH, "No free ldap connection in the pool.");
+		return NULL;
+	}
+
+	lak_keepalive(best);
+	lak_server_check(best);
+
+	return best;
+}
+
+static void lak_pool_put(
+	LAK *lak)
+{
+	LAK_POOL *pool = lak->pool;
+
+	lak->last_used = time(NULL);
+
+#ifdef HAVE_PTHREAD_RWLOCK
+	pthread_mutex_lock(&pool->lock);
+#endif
+
+	lak->in_use = 0;
+
+#ifdef HAVE_PTHREAD_RWLOCK
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+#endif
+
+	return;
+}
+
+/*
+ * lak_keepalive - before reusing a connection that sat idle for
+ * ldap_pool_keepalive seconds, read the root DSE to make sure the
+ * server (or a firewall on the way) did not drop it meanwhile.  Only
+ * a transport error counts; a server refusing the read is still up.
+ */
+static void lak_keepalive(
+	LAK *lak)
+{
+	LDAPMessage *res = NULL;
+	const char *attrs[] = { "1.1", NULL };
+	int rc;
+
+	if (lak->status != LAK_BOUND ||
+	    lak->conf->pool_keepalive <= 0 ||
+	    time(NULL) - lak->last_used < lak->conf->pool_keepalive)
+		return;
+
+	rc = ldap_search_st(lak->ld, "", LDAP_SCOPE_BASE, "(objectClass=*)", (char **) attrs, 0, &(lak->conf->timeout), &res);
+	if (res)
+		ldap_msgfree(res);
+
+	switch (rc) {
+		case LDAP_SERVER_DOWN:
+		case LDAP_CONNECT_ERROR:
+		case LDAP_TIMEOUT:
+			syslog(LOG_DEBUG|LOG_AUTH, "Idle ldap connection lost (%s), reconnecting.", ldap_err2string(rc));
+			lak->failures++;
+			lak_unbind(lak);
+			break;
+		default:
+			break;
+	}
+
+	return;
+}
+
+/*
+ * lak_servers_init - split ldap_servers into the server table
+ */
+static int lak_servers_init(
+	LAK_POOL *pool,
+	const char *servers)
+{
+	char buf[LAK_URL_LEN];
+	char *url, *last = NULL;
+	int n = 0;
+
+	strlcpy(buf, servers, LAK_URL_LEN);
+	for (url = strtok_r(buf, " \t,", &last); url != NULL; url = strtok_r(NULL, " \t,", &last))
+		n++;
+
+	pool->servers = (LAK_SERVER *)calloc(n ? n : 1, sizeof(LAK_SERVER));
+	if (pool->servers == NULL)
+		return LAK_NOMEM;
+
+	pool->nservers = 0;
+	strlcpy(buf, servers, LAK_URL_LEN);
+	for (url = strtok_r(buf, " \t,", &last); url != NULL; url = strtok_r(NULL, " \t,", &last))
+		strlcpy(pool->servers[pool->nservers++].url, url, LAK_URL_LEN);
+
+	/* let libldap make what it can of it */
+	if (pool->nservers == 0)
+		strlcpy(pool->servers[pool->nservers++].url, servers, LAK_URL_LEN);
+
+	return LAK_OK;
+}
+
+/*
+ * lak_server_pick - the server for a new connection: the fastest in
+ * service, any server due back being probed first.  If all are out,
+ * the one due back first.  The server the connection just failed on
+ * (lak->avoid) is only taken if no other is in service.
+ */
+static int lak_server_pick(
+	LAK *lak)
+{
+	LAK_POOL *pool = lak->pool;
+	LAK_SERVER *sv;
+	time_t now;
+	int i, best, probe, fallback, avoid;
+
+	avoid = lak->avoid;
+	lak->avoid = -1;
+
+	if (pool->nservers == 1)
+		return 0;
+
+	for (;;) {
+		best = probe = fallback = -1;
+		now = time(NULL);
+
+#ifdef HAVE_PTHREAD_RWLOCK
+		pthread_mutex_lock(&pool->lock);
+#endif
+		for (i = 0; i < pool->nservers; i++) {
+			sv = &pool->servers[i];
+			if (sv->open_until > now) {
+				if (fallback < 0 || sv->open_until < pool->servers[fallback].open_until)
+					fallback = i;
+			} else if (sv->open_until != 0) {
+				if (probe < 0)
+					probe = i;
+			} else if (best < 0 || best == avoid ||
+			           (i != avoid && sv->ewma_us < pool->servers[best].ewma_us)) {
+				best = i;
+			}
+		}
+
+		/* one probe at a time: keep it out while it is probed */
+		if (probe >= 0)
+			pool->servers[probe].open_until = now + lak->conf->server_retry;
+#ifdef HAVE_PTHREAD_RWLOCK
+		pthread_mutex_unlock(&pool->lock);
+#endif
+
+		if (probe < 0)
+			break;
+
+		lak_server_probe(lak, probe);
+	}
+
+	if (best < 0) {
+		best = fallback;
+		syslog(LOG_WARNING|LOG_AUTH, "All ldap servers are failing, trying %s.", pool->servers[best].url);
+	} else if (flags & VERBOSE) {
+		sv = &pool->servers[best];
+		syslog(LOG_DEBUG|LOG_AUTH, "lak: connecting to %s (%.0fus average over %lu, %lu errors)",
+		       sv->url, sv->ewma_us, sv->samples, sv->errors);
+	}
+
+	return best;
+}
+
+/*
+ * lak_server_probe - read the root DSE of server i on a connection
+ * of its own, to measure it or to see if it is back
+ */
+static int lak_server_probe(
+	LAK *lak,
+	int i)
+{
+	LAK_POOL *pool = lak->pool;
+	LAK_SERVER *sv = &pool->servers[i];
+	LDAP *ld = NULL;
+	LDAPMessage *res = NULL;
+	const char *attrs[] = { "1.1", NULL };
+	struct timeval start, now;
+	double us;
+	int rc, back = 0;
+
+	gettimeofday(&start, NULL);
+
+	rc = ldap_initialize(&ld, sv->url);
+	if (rc == LDAP_SUCCESS) {
+		ldap_set_option(ld, LDAP_OPT_PROTOCOL_VERSION, &(lak->conf->version));
+		ldap_set_option(ld, LDAP_OPT_NETWORK_TIMEOUT, &(lak->conf->timeout));
+		rc = ldap_search_st(ld, "", LDAP_SCOPE_BASE, "(objectClass=*)", (char **) attrs, 0, &(lak->conf->timeout), &res);
+	} else
+		rc = LDAP_CONNECT_ERROR;
+
+	if (res)
+		ldap_msgfree(res);
+	if (ld)
+		ldap_unbind(ld);
+
+	gettimeofday(&now, NULL);
+	us = (now.tv_sec - start.tv_sec) * 1000000.0 + (now.tv_usec - start.tv_usec);
+
+#ifdef HAVE_PTHREAD_RWLOCK
+	pthread_mutex_lock(&pool->lock);
+#endif
+	if (lak_server_error(rc)) {
+		sv->errors++;
+		if (++sv->failures >= lak->conf->server_failures ||
+		    sv->open_until != 0)
+			sv->open_until = now.tv_sec + lak->conf->server_retry;
+	} else {
+		if (sv->open_until != 0) {
+			/* back, start its average over */
+			sv->open_until = 0;
+			sv->samples = 0;
+			back = 1;
+		}
+		sv->ewma_us = sv->samples ? sv->ewma_us + LAK_EWMA_WEIGHT * (us - sv->ewma_us) : us;
+		sv->samples++;
+		sv->failures = 0;
+	}
+	sv->last_sample = now.tv_sec;
+#ifdef HAVE_PTHREAD_RWLOCK
+	pthread_mutex_unlock(&pool->lock);
+#endif
+
+	if (flags & VERBOSE)
+		syslog(LOG_DEBUG|LOG_AUTH, "lak: probe of %s took %.0fus (%s), average now %.0fus",
+		       sv->url, us, ldap_err2string(rc), sv->ewma_us);
+
+	if (back)
+		syslog(LOG_INFO|LOG_AUTH, "ldap server %s is back in service.", sv->url);
+
+	return lak_server_error(rc) ? LAK_FAIL : LAK_OK;
+}
+
+/*
+ * lak_server_check - before a bound connection is reused, measure
+ * one of the other servers in service if it went unmeasured for
+ * ldap_server_retry seconds, and move the connection off its server
+ * if that is out of service or takes twice as long as another.
+ */
+static void lak_server_check(
+	LAK *lak)
+{
+	LAK_POOL *pool = lak->pool;
+	LAK_SERVER *sv, *cur;
+	time_t now;
+	int i, stale = -1, move = 0;
+
+	if (pool->nservers < 2 ||
+	    lak->status != LAK_BOUND ||
+	    lak->server < 0)
+		return;
+
+	now = time(NULL);
+
+#ifdef HAVE_PTHREAD_RWLOCK
+	pthread_mutex_lock(&pool->lock);
+#endif
+	for (i = 0; i < pool->nservers; i++) {
+		sv = &pool->servers[i];
+		if (i != lak->server &&
+		    sv->open_until == 0 &&
+		    sv->last_sample + lak->conf->server_retry <= now) {
+			/* claimed, no one else probes it meanwhile */
+			sv->last_sample = now;
+			stale = i;
+			break;
+		}
+	}
+#ifdef HAVE_PTHREAD_RWLOCK
+	pthread_mutex_unlock(&pool->lock);
+#endif
+
+	if (stale >= 0)
+		lak_server_probe(lak, stale);
+
+#ifdef HAVE_PTHREAD_RWLOCK
+	pthread_mutex_lock(&pool->lock);
+#endif
+	cur = &pool->servers[lak->server];
+	if (cur->open_until != 0)
+		move = 1;
+	for (i = 0; !move && i < pool->nservers; i++) {
+		sv = &pool->servers[i];
+		if (i != lak->server &&
+		    sv->open_until == 0 &&
+		    sv->samples > 0 &&
+		    sv->ewma_us * 2 < cur->ewma_us)
+			move = 1;
+	}
+#ifdef HAVE_PTHREAD_RWLOCK
+	pthread_mutex_unlock(&pool->lock);
+#endif
+
+	if (move) {
+		if (flags & VERBOSE)
+			syslog(LOG_DEBUG|LOG_AUTH, "lak: leaving ldap server %s (%.0fus average)", cur->url, cur->ewma_us);
+		lak_unbind(lak);
+	}
+}
+
+/*
+ * lak_server_error - whether an ldap result code means the server is
+ * unreachable or unwell, rather than that it answered
+ */
+static int lak_server_error(
+	int rc)
+{
+	switch (rc) {
+		case LDAP_SERVER_DOWN:
+		case LDAP_CONNECT_ERROR:
+		case LDAP_TIMEOUT:
+		case LDAP_BUSY:
+		case LDAP_UNAVAILABLE:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/*
+ * lak_server_done - account an operation, begun at start with result
+ * rc, to the server of the connection
+ */
+static void lak_server_done(
+	LAK *lak,
+	int rc,
+	struct timeval *start)
+{
+	LAK_POOL *pool = lak->pool;
+	LAK_SERVER *sv;
+	struct timeval now;
+	double us;
+
+	if (lak->server < 0)
+		return;
+
+	gettimeofday(&now, NULL);
+	us = (now.tv_sec - start->tv_sec) * 1000000.0 + (now.tv_usec - start->tv_usec);
+	sv = &pool->servers[lak->server];
+
+#ifdef HAVE_PTHREAD_RWLOCK
+	pthread_mutex_lock(&pool->lock);
+#endif
+	if (!lak_server_error(rc)) {
+		sv->ewma_us = sv->samples ? sv->ewma_us + LAK_EWMA_WEIGHT * (us - sv->ewma_us) : us;
+		sv->samples++;
+		sv->failures = 0;
+		sv->last_sample = now.tv_sec;
+	} else {
+		sv->errors++;
+		if (++sv->failures >= lak->conf->server_failures &&
+		    sv->open_until == 0 &&
+		    pool->nservers > 1) {
+			sv->open_until = now.tv_sec + lak->conf->server_retry;
+			syslog(LOG_WARNING|LOG_AUTH, "ldap server %s failed %d times in a row (%s), out of service for %d seconds.",
+			       sv->url, sv->failures, ldap_err2string(rc), lak->conf->server_retry);
+		}
+	}
+#ifdef HAVE_PTHREAD_RWLOCK
+	pthread_mutex_unlock(&pool->lock);
+#endif
+
+	if (flags & VERBOSE)
+		syslog(LOG_DEBUG|LOG_AUTH, "lak: %s took %.0fus (%s), average now %.0fus",
+		       sv->url, us, ldap_err2string(rc), sv->ewma_us);
+}
+
+/*
+ * lak_shared_get - the shared search connection (ldap_async), bound as
+ * the service user and read locked: it is only reconnected or rebound
+ * once no request has an operation in flight on it.
+ */
+static LAK *lak_shared_get(
+	LAK_POOL *pool,
+	int *ret)
+{
+	LAK *lak = &pool->shared;
+	LAK_USER *lu = NULL;
+	int rc;
+
+	for (;;) {
+#ifdef HAVE_PTHREAD_RWLOCK
+		pthread_rwlock_rdlock(&pool->shared_lock);
+#endif
+		if (lak->status == LAK_BOUND)
+			return lak;
+#ifdef HAVE_PTHREAD_RWLOCK
+		pthread_rwlock_unlock(&pool->shared_lock);
+		pthread_rwlock_wrlock(&pool->shared_lock);
+#endif
+		rc = LAK_OK;
+		if (lak->status != LAK_BOUND) {
+			rc = lak_user(
+				lak->conf->bind_dn,
+				lak->conf->id,
+				lak->conf->authz_id,
+				lak->conf->mech,
+				lak->conf->realm,
+				lak->conf->password,
+				&lu);
+			if (rc == LAK_OK)
+				rc = lak_bind(lak, lu);
+			if (lu) {
+				lak_user_free(lu);
+				lu = NULL;
+			}
+		}
+#ifdef HAVE_PTHREAD_RWLOCK
+		pthread_rwlock_unlock(&pool->shared_lock);
+#endif
+		if (rc != LAK_OK) {
+			*ret = rc;
+			return NULL;
+		}
+	}
+}
+
+/*
+ * lak_shared_put - give the shared connection back; lost is its handle
+ * if the request's operation failed on it.  The readers only ever see
+ * its status, it is changed under the write lock, and only if no other
+ * request has reconnected it since.
+ */
+static void lak_shared_put(
+	LAK_POOL *pool,
+	LDAP *lost)
+{
+#ifdef HAVE_PTHREAD_RWLOCK
+	pthread_rwlock_unlock(&pool->shared_lock);
+	if (lost == NULL)
+		return;
+	pthread_rwlock_wrlock(&pool->shared_lock);
+#endif
+	if (lost != NULL && pool->shared.ld == lost) {
+		pool->shared.status = LAK_NOT_BOUND;
+		pool->shared.avoid = pool->shared.server;
+	}
+#ifdef HAVE_PTHREAD_RWLOCK
+	pthread_rwlock_unlock(&pool->shared_lock);
+#endif
+	return;
+}
+
+/*
+ * lak_result - wait for the outcome of operation msgid, leaving the
+ * replies to other operations in flight on the connection alone.
+ * Returns the ldap result code.
+ */
+static int lak_result(
+	LDAP *ld,
+	int msgid,
+	struct timeval *timeout,
+	LDAPMessage **res)
+{
+	struct timeval tv = *timeout;
+	int rc, err = LDAP_OTHER;
+
+	rc = ldap_result(ld, msgid, LDAP_MSG_ALL, &tv, res);
+	if (rc == 0) {
+		ldap_abandon_ext(ld, msgid, NULL, NULL);
+		return LDAP_TIMEOUT;
+	}
+	if (rc == -1) {
+		ldap_get_option(ld, LDAP_OPT_RESULT_CODE, &err);
+		return err;
+	}
+
+	rc = ldap_parse_result(ld, *res, &err, NULL, NULL, NULL, NULL, 0);
+	if (rc != LDAP_SUCCESS)
+		return rc;
+
+	return err;
+}
+
+/*
+ * lak_search_st - ldap_search_st(), or with ldap_async the same as
+ * ldap_search_ext() and a wait for its message id
+ */
+static int lak_search_st(
+	LAK *lak,
+	const char *base,
+	int scope,
+	const char *filter,
+	const char **attrs,
+	LDAPMessage **res)
+{
+	int rc, msgid;
+
+	if (!lak->conf->async)
+		return ldap_search_st(lak->ld, base, scope, filter, (char **) attrs, 0, &(lak->conf->timeout), res);
+
+	rc = ldap_search_ext(lak->ld, base, scope, filter, (char **) attrs, 0, NULL, NULL, &(lak->conf->timeout), lak->conf->size_limit, &msgid);
+	if (rc != LDAP_SUCCESS)
+		return rc;
+
+	return lak_result(lak->ld, msgid, &(lak->conf->timeout), res);
+}
+
+/*
+ * lak_simple_bind - ldap_simple_bind_s() by message id
+ */
+static int lak_simple_bind(
+	LAK *lak,
+	LAK_USER *user)
+{
+	LDAPMessage *res = NULL;
+	struct berval cred;
+	int rc, msgid;
+
+	cred.bv_val = user->password;
+	cred.bv_len = strlen(user->password);
+
+	rc = ldap_sasl_bind(lak->ld, user->bind_dn, LDAP_SASL_SIMPLE, &cred, NULL, NULL, &msgid);
+	if (rc != LDAP_SUCCESS)
+		return rc;
+
+	rc = lak_result(lak->ld, msgid, &(lak->conf->timeout), &res);
+	if (res)
+		ldap_msgfree(res);
+
+	return rc;
+}
+
 /* 
  * lak_retrieve - retrieve user@realm values specified by 'attrs'
  */
@@ -1129,6 +1947,38 @@ int lak_retrieve(
 	const char *realm, 
 	const char **attrs, 
 	LAK_RESULT **ret)
+{
+	LAK *conn;
+	int rc;
+
+	*ret = NULL;
+
+	if (lak == NULL) {
+		syslog(LOG_ERR|LOG_AUTH, "lak_init did not run.");
+		return LAK_FAIL;
+	}
+
+	conn = lak_pool_get(lak->pool);
+	if (conn == NULL)
+		return LAK_FAIL;
+
+	rc = lak_search(conn, user, service, realm, attrs, ret);
+
+	lak_pool_put(conn);
+
+	return rc;
+}
+
+/* 
+ * lak_search - lak_retrieve on a connection already checked out
+ */
+static int lak_search(
+	LAK *lak, 
+	const char *user, 
+	const char *service, 
+	const char *realm, 
+	const char **attrs, 
+	LAK_RESULT **ret)
 {
 	int rc = 0, i;
 	char *filter = NULL;
@@ -1138,6 +1988,9 @@ int lak_retrieve(
 	BerElement *ber = NULL;
 	char *attr = NULL, **vals = NULL, *dn = NULL;
 	LAK_USER *lu = NULL;
+	LAK *svc = NULL;
+	LDAP *lost = NULL;
+	struct timeval start;
     
 	*ret = NULL;
 
@@ -1152,20 +2005,28 @@ int lak_retrieve(
 	if (EMPTY(realm))
 		realm = lak->conf->default_realm;
 
-	rc = lak_user(	
-		lak->conf->bind_dn,
-		lak->conf->id,
-		lak->conf->authz_id,
-		lak->conf->mech,
-		lak->conf->realm,
-		lak->conf->password,
-		&lu);
-	if (rc != LAK_OK)
-		return rc;
+	if (lak->conf->async) {
+		svc = lak_shared_get(lak->pool, &rc);
+		if (svc == NULL)
+			return rc;
+	} else {
+		rc = lak_user(	
+			lak->conf->bind_dn,
+			lak->conf->id,
+			lak->conf->authz_id,
+			lak->conf->mech,
+			lak->conf->realm,
+			lak->conf->password,
+			&lu);
+		if (rc != LAK_OK)
+			return rc;
 
-	rc = lak_bind(lak, lu);
-	if (rc != LAK_OK)
-		goto done;
+		rc = lak_bind(lak, lu);
+		if (rc != LAK_OK)
+			goto done;
+
+		svc = lak;
+	}
 
 	rc = lak_expand_tokens(lak->conf->filter, user, service, realm, NULL, &filter);
 	if (rc != LAK_OK)
@@ -1175,7 +2036,10 @@ int lak_retrieve(
 	if (rc != LAK_OK)
         goto done;
 
-	rc = ldap_search_st(lak->ld, search_base, lak->conf->scope, filter, (char **) attrs, 0, &(lak->conf->timeout), &res);
+	gettimeofday(&start, NULL);
+	rc = lak_search_st(svc, search_base, lak->conf->scope, filter, attrs, &res);
+	stats_phase(STATS_PHASE_SEARCH, &start);
+	lak_server_done(svc, rc, &start);
 	switch (rc) {
 		case LDAP_SUCCESS:
 		case LDAP_NO_SUCH_OBJECT:
@@ -1194,11 +2058,14 @@ int lak_retrieve(
 		default:
 			syslog(LOG_ERR|LOG_AUTH, "user ldap_search_st() failed: %s", ldap_err2string(rc));
             rc = LAK_RETRY;
-			lak->status = LAK_NOT_BOUND;
+			if (svc == lak)
+				svc->status = LAK_NOT_BOUND;
+			else
+				lost = svc->ld;
 			goto done;
 	}
 
-    i = ldap_count_entries(lak->ld, res);
+    i = ldap_count_entries(svc->ld, res);
     if (i != 1) {
         if (i == 0)
 			syslog(LOG_DEBUG|LOG_AUTH, "Entry not found (%s).", filter);
@@ -1210,11 +2077,11 @@ int lak_retrieve(
 	
     rc = LAK_FAIL;
 
-	if ((entry = ldap_first_entry(lak->ld, res)) != NULL)  {
+	if ((entry = ldap_first_entry(svc->ld, res)) != NULL)  {
         for (i=0; attrs[i] != NULL; i++) {
             
             if (!strcmp(attrs[i], dn_attr)) {
-                dn = ldap_get_dn(lak->ld, entry);
+                dn = ldap_get_dn(svc->ld, entry);
                 if (dn == NULL)
                     goto done;
 
@@ -1227,10 +2094,10 @@ int lak_retrieve(
             }
         }
 
-        for (attr = ldap_first_attribute(lak->ld, entry, &ber); attr != NULL; 
-            attr = ldap_next_attribute(lak->ld, entry, ber)) {
+        for (attr = ldap_first_attribute(svc->ld, entry, &ber); attr != NULL; 
+            attr = ldap_next_attribute(svc->ld, entry, ber)) {
 
-            vals = ldap_get_values(lak->ld, entry, attr);
+            vals = ldap_get_values(svc->ld, entry, attr);
             if (vals == NULL)
                 continue;
 
@@ -1267,6 +2134,192 @@ done:;
 		free(search_base);
 	if (lu)
 		lak_user_free(lu);
+	if (svc && svc != lak)
+		lak_shared_put(lak->pool, lost);
+
+	return rc;
+}
+
+/*
+ * lak_dn_cache_slot - the slot of user/service/realm, or NULL if
+ * they do not fit one.  With match set, NULL unless it holds them.
+ */
+static LAK_DN_ENTRY *lak_dn_cache_slot(
+	LAK_POOL *pool,
+	const char *user,
+	const char *service,
+	const char *realm,
+	int match)
+{
+	LAK_DN_ENTRY *e;
+	const char *key[3];
+	const unsigned char *p;
+	unsigned int hash = 2166136261U;
+	int i;
+
+	key[0] = user;
+	key[1] = service ? service : "";
+	key[2] = realm ? realm : "";
+
+	for (i = 0; i < 3; i++) {
+		if (strlen(key[i]) >= LAK_BUF_LEN)
+			return NULL;
+		/* FNV-1a, the terminating NULs included */
+		p = (const unsigned char *)key[i];
+		do {
+			hash ^= *p;
+			hash *= 16777619U;
+		} while (*p++);
+	}
+
+	e = &pool->dn_cache[hash % pool->conns[0].conf->dn_cache_size];
+
+	if (match &&
+	    (e->hash != hash ||
+	     strcmp(e->user, key[0]) ||
+	     strcmp(e->service, key[1]) ||
+	     strcmp(e->realm, key[2])))
+		return NULL;
+
+	if (!match) {
+		e->hash = hash;
+		strlcpy(e->user, key[0], LAK_BUF_LEN);
+		strlcpy(e->service, key[1], LAK_BUF_LEN);
+		strlcpy(e->realm, key[2], LAK_BUF_LEN);
+	}
+
+	return e;
+}
+
+/*
+ * lak_dn_cache_get - copy the cached DN (empty if only the group
+ * check was cached) into dn, LAK_DN_LEN long, and whether the group
+ * check passed into group_ok.  LAK_FAIL if nothing is cached.
+ */
+static int lak_dn_cache_get(
+	LAK *lak,
+	const char *user,
+	const char *service,
+	const char *realm,
+	char *dn,
+	int *group_ok)
+{
+	LAK_POOL *pool = lak->pool;
+	LAK_DN_ENTRY *e;
+	int rc = LAK_FAIL;
+
+	if (pool->dn_cache == NULL)
+		return LAK_FAIL;
+
+#ifdef HAVE_PTHREAD_RWLOCK
+	pthread_mutex_lock(&pool->dn_lock);
+#endif
+	e = lak_dn_cache_slot(pool, user, service, realm, 1);
+	if (e != NULL &&
+	    e->expires > time(NULL)) {
+		strlcpy(dn, e->dn, LAK_DN_LEN);
+		*group_ok = e->group_ok;
+		rc = LAK_OK;
+	}
+#ifdef HAVE_PTHREAD_RWLOCK
+	pthread_mutex_unlock(&pool->dn_lock);
+#endif
+
+	return rc;
+}
+
+/*
+ * lak_dn_cache_put - remember dn (if not NULL) and that the group
+ * check passed (if group_ok), keeping what the slot already holds
+ * for the same login otherwise.
+ */
+static void lak_dn_cache_put(
+	LAK *lak,
+	const char *user,
+	const char *service,
+	const char *realm,
+	const char *dn,
+	int group_ok)
+{
+	LAK_POOL *pool = lak->pool;
+	LAK_DN_ENTRY *e;
+	time_t now;
+
+	if (pool->dn_cache == NULL ||
+	    (dn != NULL && strlen(dn) >= LAK_DN_LEN))
+		return;
+
+	now = time(NULL);
+
+#ifdef HAVE_PTHREAD_RWLOCK
+	pthread_mutex_lock(&pool->dn_lock);
+#endif
+	e = lak_dn_cache_slot(pool, user, service, realm, 1);
+	if (e == NULL || e->expires <= now) {
+		e = lak_dn_cache_slot(pool, user, service, realm, 0);
+		if (e != NULL) {
+			e->dn[0] = '\0';
+			e->group_ok = 0;
+			e->expires = now + lak->conf->dn_cache_ttl;
+		}
+	}
+	if (e != NULL) {
+		if (dn != NULL)
+			strlcpy(e->dn, dn, LAK_DN_LEN);
+		if (group_ok)
+			e->group_ok = 1;
+	}
+#ifdef HAVE_PTHREAD_RWLOCK
+	pthread_mutex_unlock(&pool->dn_lock);
+#endif
+}
+
+static void lak_dn_cache_drop(
+	LAK *lak,
+	const char *user,
+	const char *service,
+	const char *realm)
+{
+	LAK_POOL *pool = lak->pool;
+	LAK_DN_ENTRY *e;
+
+	if (pool->dn_cache == NULL)
+		return;
+
+#ifdef HAVE_PTHREAD_RWLOCK
+	pthread_mutex_lock(&pool->dn_lock);
+#endif
+	e = lak_dn_cache_slot(pool, user, service, realm, 1);
+	if (e != NULL)
+		e->expires = 0;
+#ifdef HAVE_PTHREAD_RWLOCK
+	pthread_mutex_unlock(&pool->dn_lock);
+#endif
+}
+
+/*
+ * lak_group_check - lak_group_member() unless the login passed it
+ * within ldap_dn_cache_ttl seconds.  Failures are not cached, they
+ * may be transient.
+ */
+static int lak_group_check(
+	LAK *lak,
+	const char *user,
+	const char *service,
+	const char *realm,
+	const char *dn)
+{
+	char cached[LAK_DN_LEN];
+	int group_ok = 0;
+	int rc;
+
+	if (lak_dn_cache_get(lak, user, service, realm, cached, &group_ok) == LAK_OK &&
+	    group_ok)
+		return LAK_OK;
+
+	rc = lak_group_member(lak, user, service, realm, dn);
+	if (rc == LAK_OK)
+		lak_dn_cache_put(lak, user, service, realm, NULL, 1);
 
 	return rc;
 }
@@ -1286,9 +2339,14 @@ static int lak_group_member(
     LAK_RESULT *lres = NULL;
     const char *attrs[] = { dn_attr, NULL };
     const char *group_attrs[] = {"1.1", NULL};
+	LAK *svc = lak;
+	LDAP *lost = NULL;
+	struct timeval start;
 
 	LDAPMessage *res = NULL;
 
+	gettimeofday(&start, NULL);
+
     user_dn = (char *)dn;
 
     if (EMPTY(user_dn)) {
@@ -1310,7 +2368,7 @@ static int lak_group_member(
 
         } else {
             
-            rc = lak_retrieve(lak, user, service, realm, attrs, &lres);
+            rc = lak_search(lak, user, service, realm, attrs, &lres);
             if (rc != LAK_OK)
                 goto done;
 
@@ -1318,13 +2376,23 @@ static int lak_group_member(
         }
     }
 
+    /* With ldap_async the custom method never binds its connection:
+       check as the service user on the shared one, as it would have
+       been on the connection the search had bound. */
+    if (lak->conf->async &&
+        lak->status != LAK_BOUND) {
+        svc = lak_shared_get(lak->pool, &rc);
+        if (svc == NULL)
+            goto done;
+    }
+
     if (lak->conf->group_match_method == LAK_GROUP_MATCH_METHOD_ATTR) {
 
             rc = lak_expand_tokens(lak->conf->group_dn, user, service, realm, NULL, &group_dn);
             if (rc != LAK_OK)
                 goto done;
 
-            rc = ((ldap_compare_s(lak->ld, group_dn, lak->conf->group_attr, user_dn)) == LDAP_COMPARE_TRUE ? 
+            rc = ((ldap_compare_s(svc->ld, group_dn, lak->conf->group_attr, user_dn)) == LDAP_COMPARE_TRUE ? 
                      LAK_OK : LAK_NOT_GROUP_MEMBER);
 
     } else if (lak->conf->group_match_method == LAK_GROUP_MATCH_METHOD_FILTER) {
@@ -1337,7 +2405,7 @@ static int lak_group_member(
         if (rc != LAK_OK)
             goto done;
 
-        rc = ldap_search_st(lak->ld, group_search_base, lak->conf->group_scope, group_filter, (char **) group_attrs, 0, &(lak->conf->timeout), &res);
+        rc = lak_search_st(svc, group_search_base, lak->conf->group_scope, group_filter, group_attrs, &res);
         switch (rc) {
             case LDAP_SUCCESS:
             case LDAP_NO_SUCH_OBJECT:
@@ -1354,11 +2422,14 @@ static int lak_group_member(
             default:
                 syslog(LOG_ERR|LOG_AUTH, "group ldap_search_st() failed: %s", ldap_err2string(rc));
                 rc = LAK_RETRY;
-                lak->status = LAK_NOT_BOUND;
+                if (svc == lak)
+                    svc->status = LAK_NOT_BOUND;
+                else
+                    lost = svc->ld;
                 goto done;
         }
 
-        rc = ( (ldap_count_entries(lak->ld, res) >= 1) ? LAK_OK : LAK_NOT_GROUP_MEMBER );
+        rc = ( (ldap_count_entries(svc->ld, res) >= 1) ? LAK_OK : LAK_NOT_GROUP_MEMBER );
 
     } else {
 
@@ -1380,6 +2451,10 @@ done:;
         lak_result_free(lres);
     if (dn_bv)
         ber_bvfree(dn_bv);
+	if (svc != lak)
+		lak_shared_put(lak->pool, lost);
+
+	stats_phase(STATS_PHASE_GROUP, &start);
 
 	return rc;
 }
@@ -1395,7 +2470,7 @@ static int lak_auth_custom(
 	int rc;
 	const char *attrs[] = { lak->conf->password_attr, NULL};
 
-	rc = lak_retrieve(lak, user, service, realm, attrs, &lres);
+	rc = lak_search(lak, user, service, realm, attrs, &lres);
 	if (rc != LAK_OK)
 		return rc;
 
@@ -1404,7 +2479,7 @@ static int lak_auth_custom(
 	if ( rc == LAK_OK &&
 	    (ISSET(lak->conf->group_dn) ||
          ISSET(lak->conf->group_filter)) )
-        rc = lak_group_member(lak, user, service, realm, NULL);
+        rc = lak_group_check(lak, user, service, realm, NULL);
 	
 	lak_result_free(lres);
 
@@ -1422,13 +2497,24 @@ static int lak_auth_bind(
 	LAK_RESULT *dn = NULL;
 	int rc;
 	const char *attrs[] = {dn_attr, NULL};
+	char cached[LAK_DN_LEN];
+	const char *user_dn;
+	int group_ok = 0;
 
-	rc = lak_retrieve(lak, user, service, realm, attrs, &dn);
-	if (rc != LAK_OK)
-		goto done;
+	if (lak_dn_cache_get(lak, user, service, realm, cached, &group_ok) == LAK_OK &&
+	    ISSET(cached)) {
+		user_dn = cached;
+	} else {
+		rc = lak_search(lak, user, service, realm, attrs, &dn);
+		if (rc != LAK_OK)
+			goto done;
+
+		user_dn = dn->value;
+		group_ok = 0;
+	}
 
 	rc = lak_user(	
-		dn->value,
+		user_dn,
 		NULL,
 		NULL,
 		NULL,
@@ -1439,11 +2525,20 @@ static int lak_auth_bind(
 		goto done;
 
 	rc = lak_bind(lak, lu);
+	if (rc != LAK_OK) {
+		/* the entry may have moved */
+		if (dn == NULL)
+			lak_dn_cache_drop(lak, user, service, realm);
+		goto done;
+	}
 
-	if ( rc == LAK_OK &&
+	if (dn != NULL)
+		lak_dn_cache_put(lak, user, service, realm, user_dn, 0);
+
+	if ( !group_ok &&
 	    (ISSET(lak->conf->group_dn) ||
          ISSET(lak->conf->group_filter)) )
-		rc = lak_group_member(lak, user, service, realm, dn->value);
+		rc = lak_group_check(lak, user, service, realm, user_dn);
 
 done:;
 	if (lu)
@@ -1498,7 +2593,7 @@ static int lak_auth_fastbind(
 	if ( rc == LAK_OK &&
 	    (ISSET(lak->conf->group_dn) ||
          ISSET(lak->conf->group_filter)) )
-            rc = lak_group_member(lak, user, service, realm, dn);
+            rc = lak_group_check(lak, user, service, realm, dn);
 
 done:;
 	if (lu)
@@ -1516,6 +2611,7 @@ int lak_authenticate(
 	const char *realm,
 	const char *password) 
 {
+	LAK *conn;
 	int i;
 	int rc;
     int retry = 2;
@@ -1532,39 +2628,57 @@ int lak_authenticate(
 		realm = lak->conf->default_realm;
 
 	for (i = 0; authenticator[i].method != -1; i++) {
-		if (authenticator[i].method == lak->conf->auth_method) {
-			if (authenticator[i].check) {
-                for (;retry > 0; retry--) {
-                    rc = (authenticator[i].check)(lak, user, service, realm, password);
-                    switch(rc) {
-                        case LAK_OK:
-                            return LAK_OK;
-                        case LAK_RETRY:
-                            if (retry > 1) {
-                                syslog(LOG_INFO|LOG_AUTH, "Retrying authentication");
-                                break;
-                            }
-                        default:
-                            syslog(
-                                LOG_DEBUG|LOG_AUTH, 
-                                "Authentication failed for %s%s%s: %s (%d)", 
-                                user, 
-                                (ISSET(realm) ? "/" : ""), 
-                                (ISSET(realm) ? realm : ""), 
-                                lak_error(rc), 
-                                rc);
-                            return LAK_FAIL;
-                    }
-                }
-            }
+		if (authenticator[i].method == lak->conf->auth_method)
 			break;
-		}
 	}
 
-    /* Should not get here */
-    syslog(LOG_DEBUG|LOG_AUTH, "Authentication method not setup properly (%d)", lak->conf->auth_method);
+	if (!authenticator[i].check) {
+		/* Should not get here */
+		syslog(LOG_DEBUG|LOG_AUTH, "Authentication method not setup properly (%d)", lak->conf->auth_method);
+		return LAK_FAIL;
+	}
 
-	return LAK_FAIL;
+	conn = lak_pool_get(lak->pool);
+	if (conn == NULL)
+		return LAK_FAIL;
+
+    for (;retry > 0; retry--) {
+        rc = (authenticator[i].check)(conn, user, service, realm, password);
+        if (rc == LAK_RETRY ||
+            rc == LAK_CONNECT_FAIL)
+            conn->failures++;
+        else
+            conn->failures = 0;
+
+        if (rc == LAK_OK)
+            break;
+
+        /* a broken connection: once more, on another server if
+           there is one in service */
+        if ((rc == LAK_RETRY ||
+             (rc == LAK_CONNECT_FAIL && lak->pool->nservers > 1)) &&
+            retry > 1) {
+            if (conn->status != LAK_BOUND)
+                conn->avoid = conn->server;
+            syslog(LOG_INFO|LOG_AUTH, "Retrying authentication");
+            continue;
+        }
+
+        syslog(
+            LOG_DEBUG|LOG_AUTH, 
+            "Authentication failed for %s%s%s: %s (%d)", 
+            user, 
+            (ISSET(realm) ? "/" : ""), 
+            (ISSET(realm) ? realm : ""), 
+            lak_error(rc), 
+            rc);
+        rc = LAK_FAIL;
+        break;
+    }
+
+	lak_pool_put(conn);
+
+	return rc;
 }
 
 char *lak_error(
@@ -1773,15 +2887,28 @@ static int lak_check_crypt(
 	void *rock __attribute__((unused))) 
 {
 	char *cred;
+	int rc;
+#ifdef HAVE_PTHREAD_RWLOCK
+	/* crypt() returns a static buffer */
+	static pthread_mutex_t crypt_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 	if (strlen(hash) < 2 )
 		return LAK_INVALID_PASSWORD;
 
+#ifdef HAVE_PTHREAD_RWLOCK
+	pthread_mutex_lock(&crypt_lock);
+#endif
 	cred = crypt(passwd, hash);
 	if (EMPTY(cred))
-		return LAK_INVALID_PASSWORD;
+		rc = LAK_INVALID_PASSWORD;
+	else
+		rc = strcmp(hash, cred) ? LAK_INVALID_PASSWORD : LAK_OK;
+#ifdef HAVE_PTHREAD_RWLOCK
+	pthread_mutex_unlock(&crypt_lock);
+#endif
 
-	return strcmp(hash, cred) ? LAK_INVALID_PASSWORD : LAK_OK;
+	return rc;
 }
 
 #endif /* AUTH_LDAP */
@@ -66,6 +66,7 @@
 #define LAK_DN_LEN 512
 #define LAK_PATH_LEN 1024
 #define LAK_URL_LEN LAK_PATH_LEN
+#define LAK_POOL_MAX 64
 
 typedef struct lak_conf {
     char   path[LAK_PATH_LEN];
@@ -105,6 +106,13 @@ typedef struct lak_conf {
     char   tls_cert[LAK_PATH_LEN];
     char   tls_key[LAK_PATH_LEN];
     int    debug;
+    int    pool_size;
+    int    pool_keepalive;
+    int    async;
+    int    dn_cache_ttl;
+    int    dn_cache_size;
+    int    server_failures;
+    int    server_retry;
 } LAK_CONF;
 
 typedef struct lak_user {
@@ -122,6 +130,12 @@ typedef struct lak {
     char      status;
     LAK_USER *user;
     LAK_CONF *conf;
+    int       in_use;
+    int       failures;
+    time_t    last_used;
+    int       server;
+    int       avoid;
+    struct lak_pool *pool;
 } LAK;
 
 typedef struct lak_result {
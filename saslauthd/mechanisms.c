@@ -62,37 +62,69 @@
 #endif
 /* END PUBLIC DEPENDENCIES */
 
+/*
+ * MECH_NOT_THREAD_SAFE marks the mechanisms that use non reentrant
+ * library calls (getpwnam(), getspnam(), crypt(), the kerberos 4
+ * library's ticket file), time out network I/O with the process
+ * wide alarm(), or keep state of their own between requests (the
+ * sasldb handle).  The thread models run them one request at a
+ * time.  ldap, rimap and httpform share their connection pools
+ * between the threads and kerberos5 keeps a krb5 context per thread
+ * (where the compiler has __thread), so they are left concurrent, as
+ * is shadow where it has crypt_r() and getspnam_r().  ldap only is
+ * if libldap itself is thread safe (libldap_r before OpenLDAP 2.5).
+ */
 authmech_t mechanisms[] =
 {
 #ifdef AUTH_SASLDB
-    {	"sasldb",	0,			auth_sasldb },
+    {	"sasldb",	0,			auth_sasldb,	MECH_NOT_THREAD_SAFE },
 #endif /* AUTH_SASLDB */
 #ifdef AUTH_DCE
-    {	"dce",		0,			auth_dce },
+    {	"dce",		0,			auth_dce,	MECH_NOT_THREAD_SAFE },
 #endif /* AUTH_DCE */
-    {	"getpwent",	0,			auth_getpwent },
+    {	"getpwent",	0,			auth_getpwent,	MECH_NOT_THREAD_SAFE },
 #ifdef AUTH_KRB4
-    {	"kerberos4",	auth_krb4_init,		auth_krb4 },
+    {	"kerberos4",	auth_krb4_init,		auth_krb4,	MECH_NOT_THREAD_SAFE },
 #endif /* AUTH_KRB4 */
 #ifdef AUTH_KRB5
-    {	"kerberos5",	auth_krb5_init,		auth_krb5 },
+#ifdef HAVE_THREAD_LOCAL
+    {	"kerberos5",	auth_krb5_init,		auth_krb5,	0 },
+#else
+    {	"kerberos5",	auth_krb5_init,		auth_krb5,	MECH_NOT_THREAD_SAFE },
+#endif
 #endif /* AUTH_KRB5 */
 #ifdef AUTH_PAM
-    {	"pam",		0,			auth_pam },
+    {	"pam",		auth_pam_init,		auth_pam,	0 },
 #endif /* AUTH_PAM */
-    {	"rimap",	auth_rimap_init,	auth_rimap },
+#ifdef HAVE_PTHREAD_RWLOCK
+    {	"rimap",	auth_rimap_init,	auth_rimap,	0 },
+#else
+    {	"rimap",	auth_rimap_init,	auth_rimap,	MECH_NOT_THREAD_SAFE },
+#endif
 #ifdef AUTH_SHADOW
-    {	"shadow",	0,			auth_shadow },
+#if defined(HAVE_CRYPT_R) && defined(HAVE_THREAD_LOCAL) && defined(GETXXNAM_R_5ARG)
+    {	"shadow",	auth_shadow_init,	auth_shadow,	0 },
+#else
+    {	"shadow",	auth_shadow_init,	auth_shadow,	MECH_NOT_THREAD_SAFE },
+#endif
 #endif /* AUTH_SHADOW */
 #ifdef AUTH_SIA
-    {   "sia",		0,			auth_sia },
+    {   "sia",		0,			auth_sia,	MECH_NOT_THREAD_SAFE },
 #endif /* AUTH_SIA */
 #ifdef AUTH_LDAP
-    {   "ldap",		auth_ldap_init,		auth_ldap },
+#if defined(HAVE_LDAP_THREAD_SAFE) && defined(HAVE_PTHREAD_RWLOCK)
+    {   "ldap",		auth_ldap_init,		auth_ldap,	0 },
+#else
+    {   "ldap",		auth_ldap_init,		auth_ldap,	MECH_NOT_THREAD_SAFE },
+#endif
 #endif /* AUTH_LDAP */
 #ifdef AUTH_HTTPFORM
-    {   "httpform",     auth_httpform_init,     auth_httpform },
+#ifdef HAVE_PTHREAD_RWLOCK
+    {   "httpform",     auth_httpform_init,     auth_httpform,	0 },
+#else
+    {   "httpform",     auth_httpform_init,     auth_httpform,	MECH_NOT_THREAD_SAFE },
+#endif
 #endif /* AUTH_LDAP */
-    {	0,		0,			0 }
+    {	0,		0,			0,		0 }
 };
 
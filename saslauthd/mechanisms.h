@@ -42,8 +42,13 @@ typedef struct {
     char *(*authenticate)(const char *, const char *,
 			  const char *, const char *); /* authentication
 							  function */
+    int flags;				/* MECH_* below */
 } authmech_t;
 
+/* The mechanism can't be run by several threads at once, the
+ * thread models serialize it. */
+#define MECH_NOT_THREAD_SAFE	(1 << 0)
+
 extern authmech_t mechanisms[];		/* array of supported auth mechs */
 extern authmech_t *authmech;		/* auth mech daemon is using */
 /* END PUBLIC DEPENDENCIES */
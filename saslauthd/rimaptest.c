@@ -0,0 +1,400 @@
+/* rimaptest.c: saslauthd rimap test and benchmark, with a stand-in IMAP server
+ */
+/* 
+ * Copyright (c) 1998-2003 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer. 
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any other legal
+ *    details, please contact  
+ *      Office of Technology Transfer
+ *      Carnegie Mellon University
+ *      5000 Forbes Avenue
+ *      Pittsburgh, PA  15213-3890
+ *      (412) 268-4387, fax: (412) 268-7395
+ *      tech-transfer@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Runs auth_rimap() checks from several threads, as saslauthd -j
+ * does, against a stand-in IMAP server started on a local port, and
+ * checks every answer: a part of the checks (-w) is made with a wrong
+ * password.  Reports checks per second and how many connections the
+ * server was asked for, with the connection pool settings given
+ * (-P, -p), or without a pool.
+ *
+ * The stand-in takes any login with the password "secret", answers
+ * a LOGIN after a delay (-d microseconds, one at a time on a
+ * connection like a real server), refuses a LOGIN in the
+ * authenticated state and can drop idle connections (-i seconds).
+ * With -S it only serves, on the given port, for trying saslauthd
+ * itself with -a rimap -O 127.0.0.1/port.
+ */
+
+#include <saslauthd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#include "mechanisms.h"
+#include "globals.h"
+#include "utils.h"
+#include "auth_rimap.h"
+
+/* make utils.c, cache.c and auth_rimap.c happy */
+int flags = LOG_USE_STDERR;
+char *run_path = NULL;
+char *mech_option = NULL;
+int num_threads = 4;
+
+static long iterations = 1000;
+static int wrong_pct = 50;
+static int pool = 0;
+static int pipeline_depth = 1;
+static long login_delay = 0;
+static int idle_timeout = 0;
+
+static volatile long connections = 0;
+static volatile long errors = 0;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+	    "%s: usage: %s [-t threads] [-n checks per thread]\n"
+	    "              [-w percent wrong passwords] [-P pool size]\n"
+	    "              [-p pipeline] [-d login delay us] [-i idle s]\n"
+	    "       %s -S port [-d login delay us] [-i idle s]\n",
+	    prog, prog, prog);
+    exit(1);
+}
+
+/*****************************************************************
+ * The stand-in IMAP server, a thread per connection.
+ *****************************************************************/
+
+/* an IMAP atom or quoted string from *p, unquoted into out */
+static int get_astring(char **p, char *out, size_t len)
+{
+    char *s = *p;
+    size_t n = 0;
+
+    while (*s == ' ')
+	s++;
+    if (*s == '"') {
+	for (s++; *s && *s != '"'; s++) {
+	    if (*s == '\\' && s[1])
+		s++;
+	    if (n + 1 < len)
+		out[n++] = *s;
+	}
+	if (*s != '"')
+	    return -1;
+	s++;
+    } else {
+	while (*s && *s != ' ') {
+	    if (n + 1 < len)
+		out[n++] = *s;
+	    s++;
+	}
+	if (n == 0)
+	    return -1;
+    }
+    out[n] = '\0';
+    *p = s;
+    return 0;
+}
+
+static void reply(int fd, const char *tag, const char *text)
+{
+    char buf[512];
+    int n;
+
+    n = snprintf(buf, sizeof(buf), "%s %s\r\n", tag, text);
+    (void) write(fd, buf, n);
+}
+
+static void *imap_conn(void *arg)
+{
+    int fd = (int)(long)arg;
+    char buf[4096], line[1024], tag[64], cmd[64], user[256], pass[256];
+    struct pollfd pfd;
+    int len = 0, authenticated = 0, n;
+    char *nl, *p;
+
+    reply(fd, "*", "OK stand-in IMAP server ready");
+
+    for (;;) {
+	while (!(nl = memchr(buf, '\n', len))) {
+	    pfd.fd = fd;
+	    pfd.events = POLLIN;
+	    if (poll(&pfd, 1, idle_timeout ? idle_timeout * 1000 : -1) == 0) {
+		reply(fd, "*", "BYE Autologout; idle for too long");
+		goto done;
+	    }
+	    if (len == sizeof(buf))
+		len = 0;
+	    if ((n = read(fd, buf + len, sizeof(buf) - len)) <= 0)
+		goto done;
+	    len += n;
+	}
+
+	n = nl - buf;
+	if (n > 0 && buf[n - 1] == '\r')
+	    n--;
+	if (n >= (int)sizeof(line))
+	    n = sizeof(line) - 1;
+	memcpy(line, buf, n);
+	line[n] = '\0';
+	len -= nl + 1 - buf;
+	memmove(buf, nl + 1, len);
+
+	if (sscanf(line, "%63s %63s", tag, cmd) != 2) {
+	    reply(fd, "*", "BAD Missing command");
+	    continue;
+	}
+	p = line + strlen(tag) + 1 + strlen(cmd);
+
+	if (!strcasecmp(cmd, "LOGIN")) {
+	    if (login_delay)
+		usleep(login_delay);
+	    if (authenticated)
+		reply(fd, tag, "BAD Already logged in");
+	    else if (get_astring(&p, user, sizeof(user)) ||
+		     get_astring(&p, pass, sizeof(pass)))
+		reply(fd, tag, "BAD Invalid arguments");
+	    else if (strcmp(pass, "secret"))
+		reply(fd, tag, "NO Login failed");
+	    else {
+		authenticated = 1;
+		reply(fd, tag, "OK User logged in");
+	    }
+	} else if (!strcasecmp(cmd, "LOGOUT")) {
+	    reply(fd, "*", "BYE Logging out");
+	    reply(fd, tag, "OK Logout completed");
+	    break;
+	} else if (!strcasecmp(cmd, "NOOP")) {
+	    reply(fd, tag, "OK Noop completed");
+	} else {
+	    reply(fd, tag, "BAD Unknown command");
+	}
+    }
+
+ done:
+    close(fd);
+    return NULL;
+}
+
+static void *imap_server(void *arg)
+{
+    int sock = (int)(long)arg;
+    pthread_t tid;
+    int fd, on = 1;
+
+    for (;;) {
+	if ((fd = accept(sock, NULL, NULL)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    perror("accept");
+	    exit(1);
+	}
+	__sync_fetch_and_add(&connections, 1);
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	if (pthread_create(&tid, NULL, imap_conn, (void *)(long)fd) != 0) {
+	    close(fd);
+	    continue;
+	}
+	pthread_detach(tid);
+    }
+
+    return NULL;
+}
+
+/* listens on 127.0.0.1, port 0 for any; returns the port */
+static int start_server(int port, int foreground)
+{
+    struct sockaddr_in sin;
+    socklen_t sinlen = sizeof(sin);
+    pthread_t tid;
+    int sock, on = 1;
+
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+	perror("socket");
+	exit(1);
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(port);
+    if (bind(sock, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+	listen(sock, 128) < 0 ||
+	getsockname(sock, (struct sockaddr *)&sin, &sinlen) < 0) {
+	perror("bind");
+	exit(1);
+    }
+
+    if (foreground)
+	imap_server((void *)(long)sock);
+
+    if (pthread_create(&tid, NULL, imap_server, (void *)(long)sock) != 0) {
+	perror("pthread_create");
+	exit(1);
+    }
+
+    return ntohs(sin.sin_port);
+}
+
+/*****************************************************************
+ * The checks.
+ *****************************************************************/
+
+static void *run_checks(void *arg)
+{
+    unsigned int seed = (unsigned int)(long)arg;
+    char user[32];
+    char *reply;
+    int wrong;
+    long i;
+
+    for (i = 0; i < iterations; i++) {
+	snprintf(user, sizeof(user), "user%d", rand_r(&seed) % 1000);
+	wrong = rand_r(&seed) % 100 < wrong_pct;
+
+	reply = auth_rimap(user, wrong ? "wrong" : "secret", "imap", "");
+	if (strncmp(reply, wrong ? "NO" : "OK", 2)) {
+	    fprintf(stderr, "%s with the %s password: %s\n", user,
+		    wrong ? "wrong" : "right", reply);
+	    __sync_fetch_and_add(&errors, 1);
+	}
+	free(reply);
+    }
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    struct timeval start, end;
+    char conf[] = "/tmp/rimaptest.XXXXXX";
+    char host[64];
+    pthread_t *tids;
+    FILE *f;
+    double secs;
+    int serve = -1;
+    int port, fd, c, i;
+
+    while ((c = getopt(argc, argv, "t:n:w:P:p:d:i:S:")) != -1) {
+	switch (c) {
+	case 't':
+	    num_threads = atoi(optarg);
+	    break;
+	case 'n':
+	    iterations = atol(optarg);
+	    break;
+	case 'w':
+	    wrong_pct = atoi(optarg);
+	    break;
+	case 'P':
+	    pool = atoi(optarg);
+	    break;
+	case 'p':
+	    pipeline_depth = atoi(optarg);
+	    break;
+	case 'd':
+	    login_delay = atol(optarg);
+	    break;
+	case 'i':
+	    idle_timeout = atoi(optarg);
+	    break;
+	case 'S':
+	    serve = atoi(optarg);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (optind != argc || num_threads <= 0 || iterations <= 0)
+	usage(argv[0]);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (serve >= 0) {
+	start_server(serve, 1);
+	return 0;
+    }
+
+    port = start_server(0, 0);
+
+    if ((fd = mkstemp(conf)) < 0 || !(f = fdopen(fd, "w"))) {
+	perror(conf);
+	exit(1);
+    }
+    fprintf(f, "rimap_pool_size: %d\nrimap_pipeline: %d\n", pool, pipeline_depth);
+    fclose(f);
+
+    snprintf(host, sizeof(host), "127.0.0.1/%d", port);
+    mech_option = host;
+    rimap_config = conf;
+    if (auth_rimap_init() != 0) {
+	fprintf(stderr, "%s: auth_rimap_init failed\n", argv[0]);
+	unlink(conf);
+	exit(1);
+    }
+    unlink(conf);
+
+    tids = malloc(num_threads * sizeof(*tids));
+    gettimeofday(&start, NULL);
+    for (i = 0; i < num_threads; i++)
+	pthread_create(&tids[i], NULL, run_checks, (void *)(long)(i + 1));
+    for (i = 0; i < num_threads; i++)
+	pthread_join(tids[i], NULL);
+    gettimeofday(&end, NULL);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    printf("pool %d pipeline %d: %d threads x %ld checks, %d%% wrong: "
+	   "%.0f checks/s, %ld connections, %ld wrong answers\n",
+	   pool, pipeline_depth, num_threads, iterations, wrong_pct,
+	   num_threads * iterations / secs, connections, errors);
+
+    return errors ? 1 : 0;
+}
@@ -108,21 +108,35 @@
 #include <sys/un.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/uio.h>
+#ifdef USE_THREADS
+# include <pthread.h>
+#endif
 
 #include "globals.h"
 #include "saslauthd-main.h"
 #include "cache.h"
+#include "stats.h"
 #include "utils.h"
 
 /* max login + max realm + '@' */
 #define MAX_LOGIN_REALM_LEN (MAX_REQ_LEN * 2) + 1
 
+/* credentials handed to the refresh process, one per datagram */
+struct refresh_job {
+	unsigned short	length[4];	/* login, password, service, realm */
+	char		data[MAX_LOGIN_REALM_LEN + 3 * (MAX_REQ_LEN + 1)];
+};
+
 /****************************************
  * declarations/protos
  *****************************************/
 static void	show_version();
 static void	show_usage();
+static void	refresh_init();
+static void	refresh_loop(int);
+static void	refresh_queue(const char *, const char *, const char *, const char *);
 
 /****************************************
  * application globals
@@ -134,6 +148,10 @@ char		*run_path = NULL;	/* path to our working directory     */
 authmech_t	*auth_mech = NULL;	/* Authentication mechanism to use   */
 char		*mech_option = NULL;	/* mechanism-specific option	     */
 int		num_procs = 5;		/* The max number of worker processes*/
+int		num_threads = 0;	/* Worker threads, 0 for processes   */
+int		*cpu_list = NULL;	/* CPUs to bind worker threads to    */
+int		num_cpus = 0;		/* entries in the above              */
+int		stop_fd = -1;		/* readable once we're to stop       */
 
 
 /****************************************
@@ -146,6 +164,12 @@ static int 	pid_file_lock_fd; 		/* Descriptor to the open pid lock file  */
 static char	*pid_file;		/* Pid file name                         */
 static char	*pid_file_lock;		/* Pid lock file name                    */
 static int       startup_pipe[2] = { -1, -1 };
+static int	refresh_fd = -1;	/* Where cache refreshes are queued      */
+static int	stop_pipe[2] = { -1, -1 }; /* stop_fd and its write end      */
+static volatile sig_atomic_t stop_signalled = 0; /* SIGTERM/SIGINT seen  */
+#ifdef USE_THREADS
+static pthread_mutex_t mech_lock = PTHREAD_MUTEX_INITIALIZER; /* MECH_NOT_THREAD_SAFE */
+#endif
 
 int main(int argc, char **argv) {
 	int		option;
@@ -167,8 +191,12 @@ int main(int argc, char **argv) {
 	flags |= LOG_USE_STDERR;
 	flags |= AM_MASTER;
 
-	while ((option = getopt(argc, argv, "a:cdhO:lm:n:rs:t:vV")) != -1) {
+	while ((option = getopt(argc, argv, "a:A:cC:dehj:O:lm:n:rs:t:vV")) != -1) {
 		switch(option) {
+			case 'A':
+				set_cpu_affinity(optarg);
+				break;
+
 			case 'a':
 			        /* Only one at a time, please! */
 			        if(auth_mech_name) {
@@ -188,14 +216,26 @@ int main(int argc, char **argv) {
 				flags |= CACHE_ENABLED;
 				break;
 
+			case 'C':
+				cache_set_option(optarg);
+				break;
+
 			case 'd':
 				flags |= VERBOSE;
 				flags &= ~DETACH_TTY;
 				break;
 
+			case 'e':
+				flags |= USE_EVENT_MODEL;
+				break;
+
 			case 'h':
 				show_usage();
 				break;
+
+			case 'j':
+				set_max_threads(optarg);
+				break;
 				
 			case 'O':
 				set_mech_option(optarg);
@@ -242,6 +282,32 @@ int main(int argc, char **argv) {
 	if (run_path == NULL)
     		run_path = PATH_SASLAUTHD_RUNDIR;
 
+	if ((flags & USE_THREAD_MODEL) && (flags & USE_EVENT_MODEL)) {
+		logger(L_ERR, L_FUNC, "the -e and -j options can't be combined");
+		exit(1);
+	}
+
+	if (num_cpus > 0 && !(flags & USE_THREAD_MODEL)) {
+		logger(L_ERR, L_FUNC, "the -A option needs worker threads (-j)");
+		exit(1);
+	}
+
+#ifdef USE_DOORS_IPC
+	/*********************************************************
+	 * Door calls run on threads of their own. Say so now, the
+	 * cache picks its locking in cache_init(), before
+	 * ipc_init().
+	 **********************************************************/
+	flags |= USE_THREAD_MODEL;
+#endif
+
+	/*********************************************************
+	 * accept() needs no serializing between threads, and the
+	 * accept lock is a per process fcntl() lock anyway.
+	 **********************************************************/
+	if (flags & USE_THREAD_MODEL)
+		flags &= ~USE_ACCEPT_LOCK;
+
     	if (auth_mech_name == NULL) {
 		logger(L_ERR, L_FUNC, "no authentication mechanism specified");
 		show_usage();
@@ -252,6 +318,7 @@ int main(int argc, char **argv) {
 
 	if (flags & VERBOSE)  {
 		logger(L_DEBUG, L_FUNC, "num_procs  : %d", num_procs);
+		logger(L_DEBUG, L_FUNC, "num_threads: %d", num_threads);
 
 		if (mech_option == NULL)
 			logger(L_DEBUG, L_FUNC, "mech_option: NULL");
@@ -326,6 +393,12 @@ int main(int argc, char **argv) {
 	if (cache_init() != 0)
 		exit(1);
 
+	/*********************************************************
+	 * Statistics setup, before any workers are forked. Not
+	 * fatal, without it no statistics are kept.
+	 **********************************************************/
+	stats_init();
+
 	/*********************************************************
 	 * Call the ipc specific initializer. This should also
 	 * call detach_tty() at the appropriate point.
@@ -337,6 +410,11 @@ int main(int argc, char **argv) {
 	 **********************************************************/
 	atexit(server_exit);
 
+	/*********************************************************
+	 * Start the cache refresh process, if we need one.
+	 **********************************************************/
+	refresh_init();
+
 	/*********************************************************
 	 * If required, enable the process model.
 	 **********************************************************/
@@ -372,9 +450,12 @@ char *do_auth(const char *_login, const char *password, const char *service, con
 	struct cache_result	lkup_result;
 	char			*response;
 	int			cached = 0;
+	int			rc;
 	char			login_buff[MAX_LOGIN_REALM_LEN];
 	char			*login;
+	struct timeval		start, mech_start;
 
+	stats_begin(&start);
 
 	/***********************************************************
 	 * Check to concat the login and realm into a single login.
@@ -392,15 +473,39 @@ char *do_auth(const char *_login, const char *password, const char *service, con
 	    login = (char *)_login;
 	}
 
-	if (cache_lookup(login, realm, service, password, &lkup_result) == CACHE_OK) {	
+	rc = cache_lookup(login, realm, service, password, &lkup_result);
+
+	if (rc == CACHE_OK) {	
 		response = strdup("OK");
 		cached = 1;
+
+		if (lkup_result.status == CACHE_REFRESH)
+			refresh_queue(login, password, service, realm);
+	} else if (rc == CACHE_NEGATIVE) {
+		response = strdup("NO failed recently (cached)");
+		cached = 1;
+	} else if (rc == CACHE_THROTTLED) {
+		response = strdup("NO too many failures");
+		cached = 1;
 	} else {
+#ifdef USE_THREADS
+		if ((flags & USE_THREAD_MODEL) && (auth_mech->flags & MECH_NOT_THREAD_SAFE))
+			pthread_mutex_lock(&mech_lock);
+#endif
+		gettimeofday(&mech_start, NULL);
 		response = auth_mech->authenticate(login, password, service, realm);
+		stats_mech(&mech_start, response);
+#ifdef USE_THREADS
+		if ((flags & USE_THREAD_MODEL) && (auth_mech->flags & MECH_NOT_THREAD_SAFE))
+			pthread_mutex_unlock(&mech_lock);
+#endif
 
 		if (response == NULL) {
 			logger(L_ERR, L_FUNC, "internal mechanism failure: %s", auth_mech->name);
 			response = strdup("NO internal mechanism failure");
+
+			/* not the user's fault, don't count it */
+			lkup_result.status = CACHE_NO_FLUSH;
 		}
 	}
 
@@ -415,20 +520,28 @@ char *do_auth(const char *_login, const char *password, const char *service, con
 				logger(L_DEBUG, L_FUNC, "auth success: [user=%s] [service=%s] [realm=%s] [mech=%s]", \
 					login, service, realm, auth_mech->name);
 		}
+
+		stats_end(&start, response, cached);
 		return response;
 	}
 
 	if (strncmp(response, "NO", 2) == 0) {
+		if (!cached)
+			cache_commit_failure(&lkup_result);
+
 		logger(L_INFO, L_FUNC, "auth failure: [user=%s] [service=%s] [realm=%s] [mech=%s] [reason=%s]", \
 			login, service, realm, auth_mech->name,
 		        strlen(response) >= 4 ? response+3 : "Unknown");
 
+		stats_end(&start, response, cached);
 		return response;
 	}
 
 	logger(L_ERR, L_FUNC, "mechanism returned unknown response: %s", auth_mech->name);
 	response = strdup("NO internal mechanism failure");
 
+	stats_end(&start, response, cached);
+
 	return response;
 }
 
@@ -473,6 +586,82 @@ void set_max_procs(const char *procs) {
 }
 
 
+/*************************************************************
+ * Allow someone to set the number of worker threads to use
+ * in place of worker processes. Only applicable to unix ipc.
+ **************************************************************/
+void set_max_threads(const char *threads) {
+#if defined(USE_THREADS) && defined(USE_UNIX_IPC)
+	num_threads = atoi(threads);
+
+	if (num_threads < 0) {
+		logger(L_ERR, L_FUNC, "invalid number of worker threads defined");
+		exit(1);
+	}
+
+	if (num_threads > 0)
+		flags |= USE_THREAD_MODEL;
+	else
+		flags &= ~USE_THREAD_MODEL;
+#else
+	logger(L_ERR, L_FUNC, "worker threads are not supported on this platform");
+	exit(1);
+#endif
+
+	return;
+}
+
+
+/*************************************************************
+ * Allow someone to set the CPUs the worker threads are bound
+ * to, round robin, as a list of numbers and ranges: 0-3,6
+ **************************************************************/
+void set_cpu_affinity(const char *cpus) {
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	const char	*p = cpus;
+	char		*end;
+	long		first, last;
+
+	free(cpu_list);
+	cpu_list = NULL;
+	num_cpus = 0;
+
+	while (*p != '\0') {
+		first = last = strtol(p, &end, 10);
+
+		if (end != p && *end == '-')
+			last = strtol(p = end + 1, &end, 10);
+
+		if (end == p || first < 0 || last < first || last > 65535 ||
+		    (*end != ',' && *end != '\0')) {
+			logger(L_ERR, L_FUNC, "invalid cpu list: %s", cpus);
+			exit(1);
+		}
+
+		if ((cpu_list = realloc(cpu_list, (num_cpus + last - first + 1) * sizeof(int))) == NULL) {
+			logger(L_ERR, L_FUNC, "could not allocate memory");
+			exit(1);
+		}
+
+		while (first <= last)
+			cpu_list[num_cpus++] = first++;
+
+		p = (*end == ',') ? end + 1 : end;
+	}
+
+	if (num_cpus == 0) {
+		logger(L_ERR, L_FUNC, "invalid cpu list: %s", cpus);
+		exit(1);
+	}
+#else
+	logger(L_ERR, L_FUNC, "cpu affinity is not supported on this platform");
+	exit(1);
+#endif
+
+	return;
+}
+
+
 /*************************************************************
  * Allow someone to set the mechanism specific option
  **************************************************************/
@@ -526,6 +715,21 @@ void signal_setup() {
 	static struct sigaction act_sigint;
 	int			rc;
 
+	/**************************************************************
+	 * The stop pipe. The master's SIGTERM/SIGINT handler writes a
+	 * byte to it, every loop polls stop_fd and winds down from
+	 * there. It is never read, so all processes and threads see it.
+	 **************************************************************/
+	if (pipe(stop_pipe) == -1 ||
+	    fcntl(stop_pipe[1], F_SETFL, O_NONBLOCK) == -1) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "could not create the stop pipe");
+		logger(L_ERR, L_FUNC, "pipe: %s", strerror(rc));
+		exit(1);
+	}
+
+	stop_fd = stop_pipe[0];
+
 	/**************************************************************
 	 * Handler for SIGCHLD
 	 **************************************************************/
@@ -581,7 +785,7 @@ void signal_setup() {
 	/**************************************************************
 	 * Handler for SIGTERM
 	 **************************************************************/
-	act_sigterm.sa_handler = server_exit;
+	act_sigterm.sa_handler = handle_stop;
 	sigemptyset(&act_sigterm.sa_mask);
 
 	if (sigaction(SIGTERM, &act_sigterm, NULL) != 0) {
@@ -594,7 +798,7 @@ void signal_setup() {
 	/**************************************************************
 	 * Handler for SIGINT
 	 **************************************************************/
-	act_sigint.sa_handler = server_exit;
+	act_sigint.sa_handler = handle_stop;
 	sigemptyset(&act_sigint.sa_mask);
 
 	if (sigaction(SIGINT, &act_sigint, NULL) != 0) {
@@ -827,6 +1031,174 @@ void detach_tty() {
 }
 
 
+/*************************************************************
+ * Fork off the process that verifies aging cache entries in
+ * the background (soft timeout), and keep the socket its jobs
+ * are sent on. Jobs are datagrams, so every worker can write
+ * to the one socket and a full queue just drops them.
+ **************************************************************/
+void refresh_init() {
+	int	fds[2];
+	int	rc;
+
+	if (!(flags & CACHE_ENABLED) || !cache_refresh_enabled())
+		return;
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) == -1) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "could not create the cache refresh socket");
+		logger(L_ERR, L_FUNC, "socketpair: %s", strerror(rc));
+		exit(1);
+	}
+
+	if (have_baby() == 0) {
+		close(fds[1]);
+		refresh_loop(fds[0]);
+	}
+
+	close(fds[0]);
+	refresh_fd = fds[1];
+
+	if (fcntl(refresh_fd, F_SETFL, O_NONBLOCK) == -1) {
+		rc = errno;
+		logger(L_ERR, L_FUNC, "could not set the cache refresh socket non blocking");
+		logger(L_ERR, L_FUNC, "fcntl: %s", strerror(rc));
+		exit(1);
+	}
+}
+
+
+/*************************************************************
+ * The refresh process: ask the mechanism about the credentials
+ * we're sent and tell the cache what it said. Exits when the
+ * stop pipe says so, between jobs. Never returns.
+ **************************************************************/
+void refresh_loop(int fd) {
+	struct refresh_job	job;
+	struct pollfd		pfd[2];
+	char			*field[4];
+	char			*response;
+	ssize_t			n;
+	size_t			used;
+	int			verified;
+	int			x;
+
+	if (flags & VERBOSE)
+		logger(L_DEBUG, L_FUNC, "cache refresh process started");
+
+	for (;;) {
+		pfd[0].fd = fd;
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+		pfd[1].fd = stop_fd;
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+
+		if (poll(pfd, 2, -1) == -1 && errno != EINTR) {
+			logger(L_ERR, L_FUNC, "cache refresh poll: %s", strerror(errno));
+			exit(1);
+		}
+
+		if (stop_requested())
+			exit(0);
+
+		if (pfd[0].revents == 0)
+			continue;
+
+		if ((n = recv(fd, &job, sizeof(job), 0)) == -1) {
+			if (errno == EINTR)
+				continue;
+
+			logger(L_ERR, L_FUNC, "cache refresh recv: %s", strerror(errno));
+			exit(1);
+		}
+
+		/* every field is a string, with its '\0' */
+		used = 0;
+		x = 0;
+
+		if ((size_t)n >= sizeof(job.length)) {
+			n -= sizeof(job.length);
+
+			for (; x < 4; x++) {
+				field[x] = job.data + used;
+				used += job.length[x];
+
+				if (job.length[x] == 0 || used > (size_t)n ||
+				    job.data[used - 1] != '\0')
+					break;
+			}
+		}
+
+		if (x < 4) {
+			logger(L_ERR, L_FUNC, "bad cache refresh job");
+			continue;
+		}
+
+		response = auth_mech->authenticate(field[0], field[1], field[2], field[3]);
+
+		if (response == NULL)
+			verified = -1;
+		else if (strncmp(response, "OK", 2) == 0)
+			verified = 1;
+		else if (strncmp(response, "NO", 2) == 0)
+			verified = 0;
+		else
+			verified = -1;
+
+		cache_refreshed(field[0], field[3], field[2], field[1], verified);
+
+		if (flags & VERBOSE)
+			logger(L_DEBUG, L_FUNC, "refreshed: [user=%s] [service=%s] [realm=%s]: %s",
+			       field[0], field[2], field[3], response ? response : "internal mechanism failure");
+
+		if (response != NULL)
+			free(response);
+
+		memset(&job, 0, sizeof(job));
+	}
+}
+
+
+/*************************************************************
+ * Hand credentials to the refresh process. If that can't be
+ * done (the queue is full, say), give the refresh up so a
+ * later lookup can claim it again.
+ **************************************************************/
+void refresh_queue(const char *login, const char *password, const char *service, const char *realm) {
+	struct refresh_job	job;
+	const char		*field[4];
+	size_t			used = 0;
+	int			x;
+
+	field[0] = login;
+	field[1] = password;
+	field[2] = service;
+	field[3] = realm;
+
+	for (x = 0; x < 4; x++) {
+		job.length[x] = strlen(field[x]) + 1;
+
+		if (used + job.length[x] > sizeof(job.data))
+			break;
+
+		memcpy(job.data + used, field[x], job.length[x]);
+		used += job.length[x];
+	}
+
+	if (x < 4 || refresh_fd == -1 ||
+	    send(refresh_fd, &job, sizeof(job.length) + used, 0) == -1) {
+		if (flags & VERBOSE)
+			logger(L_DEBUG, L_FUNC, "could not queue cache refresh: [user=%s] [service=%s] [realm=%s]",
+			       login, service, realm);
+
+		cache_refreshed(login, realm, service, password, -1);
+	}
+
+	memset(&job, 0, sizeof(job));
+}
+
+
 /*************************************************************
  * Fork off a copy of ourselves. Return 0 if we're the child,
  * > 0 for the parent. Die if we can't fork (the environment
@@ -850,6 +1222,7 @@ pid_t have_baby() {
 	 **********************************************************/
 	if (pid == 0) {
 		flags &= ~AM_MASTER;
+		stats_fork();
         	return pid;
 	}
 
@@ -878,11 +1251,49 @@ void handle_sigchld() {
 }
 
 
+/*************************************************************
+ * SIGTERM and SIGINT. Cleaning up from here could run in the
+ * middle of a cache update, so only tell the loops to stop:
+ * the master through the stop pipe, which reaches everyone, a
+ * single child (an event worker being replaced, say) just for
+ * itself. They return, and server_exit() runs from exit().
+ **************************************************************/
+void handle_stop() {
+	int	saved_errno = errno;
+
+	stop_signalled = 1;
+
+	if (flags & AM_MASTER)
+		write(stop_pipe[1], "", 1);
+
+	errno = saved_errno;
+}
+
+
+/*************************************************************
+ * Return 1 if this process is to stop, 0 otherwise.
+ **************************************************************/
+int stop_requested() {
+	struct pollfd	pfd;
+
+	if (stop_signalled)
+		return 1;
+
+	pfd.fd = stop_fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	return stop_fd != -1 && poll(&pfd, 1, 0) > 0;
+}
+
+
 /*************************************************************
  * Do some final cleanup here.
  **************************************************************/
 void server_exit() {
 	struct flock    lock_st;
+	sigset_t	sigchld;
+	int		orderly;
 
 	/*********************************************************
 	 * If we're not the master process, don't do anything
@@ -894,8 +1305,31 @@ void server_exit() {
 		_exit(0);
 	}
 
+	/*********************************************************
+	 * The children are about to go. Their SIGCHLDs would only
+	 * interrupt us (in the middle of logging, say).
+	 **********************************************************/
+	sigemptyset(&sigchld);
+	sigaddset(&sigchld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &sigchld, NULL);
+
+	/*********************************************************
+	 * Stopping on a signal, the loops have finished (threads
+	 * joined) before we got here. Otherwise make sure all the
+	 * others stop too.
+	 **********************************************************/
+	orderly = stop_requested();
+
+	handle_stop();
 	kill(-master_pid, SIGTERM);
 
+	/*********************************************************
+	 * Wait for the children to finish what they're doing, the
+	 * cache must not be saved or unmapped under them.
+	 **********************************************************/
+	while (waitpid(-1, NULL, 0) > 0 || errno == EINTR)
+		;
+
 	/*********************************************************
 	 * Tidy up and delete the pid_file. (close will release the lock)
          * besides, we want to unlink it first anyway to avoid a race.
@@ -929,6 +1363,8 @@ void server_exit() {
  	 * Cleanup the cache, if it's enabled
 	 **********************************************************/
 	if (flags & CACHE_ENABLED) {
+		if (orderly)
+			cache_save_snapshot();
 		cache_cleanup_lock();
 		cache_cleanup_mm();
 	}
@@ -972,8 +1408,26 @@ void show_usage() {
     fprintf(stderr, "usage: saslauthd [options]\n\n");
     fprintf(stderr, "option information:\n");
     fprintf(stderr, "  -a <authmech>  Selects the authentication mechanism to use.\n");
+    fprintf(stderr, "  -A <cpus>      Bind the worker threads to these CPUs, round robin.\n");
+    fprintf(stderr, "                 Ex. 0-3,6 (needs -j).\n");
     fprintf(stderr, "  -c             Enable credential caching.\n");
+    fprintf(stderr, "  -C <name=val>  Set a credential cache option:\n");
+    fprintf(stderr, "                 lock=seqlock|fcntl|rwlock  slot locking method\n");
+    fprintf(stderr, "                 digest=siphash|md5  password digest (keyed siphash)\n");
+    fprintf(stderr, "                 soft_ttl=<seconds>  verify older entries again in the\n");
+    fprintf(stderr, "                                     background (0 = off)\n");
+    fprintf(stderr, "                 snapshot=<file>     keep the cache across restarts\n");
+    fprintf(stderr, "                 neg_ttl=<seconds>   refuse a failed password again\n");
+    fprintf(stderr, "                                     for this long (0 = off)\n");
+    fprintf(stderr, "                 max_failures=<n>    refuse a user after n failures in\n");
+    fprintf(stderr, "                                     a row (0 = off), each within\n");
+    fprintf(stderr, "                 fail_window=<seconds> of the one before (300)\n");
     fprintf(stderr, "  -d             Debugging (don't detach from tty, implies -V)\n");
+    fprintf(stderr, "  -e             Event-driven connection handling. A single process\n");
+    fprintf(stderr, "                 multiplexes all client connections and hands the\n");
+    fprintf(stderr, "                 requests to the worker processes (epoll only).\n");
+    fprintf(stderr, "  -j <threads>   Use this many worker threads in a single process\n");
+    fprintf(stderr, "                 in place of worker processes.\n");
     fprintf(stderr, "  -r             Combine the realm with the login before passing to authentication mechanism\n");
     fprintf(stderr, "                 Ex. login: \"foo\" realm: \"bar\" will get passed as login: \"foo@bar\"\n");
     fprintf(stderr, "                 The realm name is passed untouched.\n");
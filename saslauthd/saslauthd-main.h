@@ -58,6 +58,15 @@
 # define USE_UNIX_IPC
 #endif
 
+/****************************************************************
+ * POSIX threads: the doors IPC's server threads, or the thread
+ * model of the unix IPC where we have the process shared rwlocks
+ * (and so -lpthread) that it uses for the cache.
+ ****************************************************************/
+#if defined(USE_DOORS_IPC) || defined(HAVE_PTHREAD_RWLOCK)
+# define USE_THREADS
+#endif
+
 /* AIX uses a slight variant of this */
 #ifdef _AIX
 # define SALEN_TYPE size_t
@@ -83,6 +92,28 @@
 /* login, pw, service, realm buffer size */
 #define MAX_REQ_LEN		256     
 
+/* Protocol version 2: persistent connections carrying several
+ * requests, each tagged with a 32 bit request id. A client opts in
+ * by sending PROTO_V2_MARKER in place of the first login length,
+ * followed by the protocol version it speaks. Older servers reject
+ * the marker as an oversized login, so clients can fall back. */
+#define PROTO_V2_MARKER		0xffff
+#define PROTO_VERSION		2
+
+/* A client that sends PROTO_STATS_MARKER in place of the first
+ * login length gets the statistics report (see stats.c) as a
+ * single counted length string, then the connection is closed. */
+#define PROTO_STATS_MARKER	0xfffe
+
+/* seconds a worker waits on an idle v2 connection */
+#define PROTO_V2_IDLE_TIMEOUT	5
+
+/* requests a worker process or thread answers on one v2 connection
+ * before it closes it and goes back to accept(), so busy pooled
+ * clients can't keep every worker from new connections. Clients
+ * reconnect. */
+#define PROTO_V2_MAX_REQUESTS	32
+
 /* socket backlog when supported */
 #define SOCKET_BACKLOG  	32
 
@@ -91,11 +122,15 @@ extern char	*do_auth(const char *, const char *,
 			 const char *, const char *);
 extern void	set_auth_mech(const char *);
 extern void	set_max_procs(const char *);
+extern void	set_max_threads(const char *);
+extern void	set_cpu_affinity(const char *);
 extern void	set_mech_option(const char *);
 extern void	set_run_path(const char *);
 extern void	signal_setup();
 extern void	detach_tty();
 extern void	handle_sigchld();
+extern void	handle_stop();
+extern int	stop_requested();
 extern void	server_exit();
 extern pid_t	have_baby();
 
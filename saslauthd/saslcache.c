@@ -64,8 +64,9 @@ char	*make_time(time_t);
 * * module globals
 *****************************************/
 static  void            *shm_base = NULL;
-static  struct bucket   *table = NULL;
+static  struct cache_group *table = NULL;
 static  struct stats    *table_stats = NULL;
+static  struct cache_counters counters;
 
 /****************************************
 *****************************************/
@@ -85,6 +86,8 @@ int main(int argc, char **argv) {
 	char		shmid_buff[256];
 	char		cache_magic[64];
 	struct stat 	stat_buff;
+	struct cache_counters *ref_counters;
+	unsigned int	x;
 
 	while ((option = getopt(argc, argv, "dm:s")) != -1) {
 		switch(option) {
@@ -137,7 +140,24 @@ int main(int argc, char **argv) {
 	}
 
 	table_stats = shm_base + 64;
-	(char *)table = (char *)table_stats + 128;
+	table = (void *)((char *)table_stats + 128);
+
+	/* the lookup counters are kept per worker */
+	memset(&counters, 0, sizeof(counters));
+
+	for (x = 0; x < table_stats->counter_slots; x++) {
+		ref_counters = (struct cache_counters *)((char *)shm_base + table_stats->counters_offt) + x;
+
+		counters.hits += ref_counters->hits;
+		counters.misses += ref_counters->misses;
+		counters.lock_failures += ref_counters->lock_failures;
+		counters.attempts += ref_counters->attempts;
+		counters.evictions += ref_counters->evictions;
+		counters.negative_hits += ref_counters->negative_hits;
+		counters.throttled += ref_counters->throttled;
+		counters.refreshes += ref_counters->refreshes;
+		counters.refresh_failures += ref_counters->refresh_failures;
+	}
 
 	if (dump_stat_info == 0 && dump_user_info == 0)
 		dump_stat_info = 1;
@@ -158,22 +178,33 @@ int main(int argc, char **argv) {
 ****************************************************/
 void dump_cache_users(void) {
 
-	unsigned int		x;
+	unsigned int		x, y;
+	struct cache_group	*group;
 	struct bucket		*ref_bucket;
+	char			*key;
         time_t			epoch_to;
 
 	epoch_to = time(NULL) - table_stats->timeout;
 
 	fprintf(stdout, "\"user\",\"realm\",\"service\",\"created\",\"created_localtime\"\n");
 
-	for (x = 0; x < (table_stats->table_size * table_stats->max_buckets_per); x++) {
+	for (x = 0; x < table_stats->table_size; x++) {
+
+		group = table + x;
+
+		for (y = 0; y < CACHE_GROUP_SLOTS; y++) {
+
+			ref_bucket = group->buckets + y;
+
+			if (group->fp[y] == 0 || ref_bucket->negative ||
+			    ref_bucket->created <= epoch_to)
+				continue;
 
-		ref_bucket = table + x;
+			key = group->arena + ref_bucket->key_offt;
 
-		if (ref_bucket->created > epoch_to && *(ref_bucket->creds) != '\0') {
-			fprintf(stderr, "\"%s\",", ref_bucket->creds + ref_bucket->user_offt);
-			fprintf(stderr, "\"%s\",", ref_bucket->creds + ref_bucket->realm_offt);
-			fprintf(stderr, "\"%s\",", ref_bucket->creds + ref_bucket->service_offt);
+			fprintf(stderr, "\"%s\",", key);
+			fprintf(stderr, "\"%s\",", key + ref_bucket->user_len);
+			fprintf(stderr, "\"%s\",", key + ref_bucket->user_len + ref_bucket->realm_len);
 			fprintf(stderr, "\"%lu\",", ref_bucket->created);
 			fprintf(stderr, "\"%s\"\n", make_time(ref_bucket->created));
 		}
@@ -204,8 +235,8 @@ void dump_cache_stats(void) {
 
 		z = 0;
 
-		for (y = (x * table_stats->max_buckets_per); y < ((x + 1) * table_stats->max_buckets_per); y++) { 
-			if (table[y].created > epoch_to) {
+		for (y = 0; y < table_stats->max_buckets_per; y++) { 
+			if (table[x].fp[y] != 0 && table[x].buckets[y].created > epoch_to) {
 				buckets_in_use++;
 				z++;
 			}
@@ -235,17 +266,18 @@ void dump_cache_stats(void) {
 	fprintf(stdout, "Saslauthd Cache Detail:\n");
 	fprintf(stdout, "\n");
 	fprintf(stdout, "  timeout (seconds)           :  %d\n", table_stats->timeout);
-	fprintf(stdout, "  total slots allocated       :  %d\n", table_stats->table_size);
-	fprintf(stdout, "  slots in use                :  %d\n", slots_in_use);
+	fprintf(stdout, "  total groups allocated      :  %d\n", table_stats->table_size);
+	fprintf(stdout, "  groups in use               :  %d\n", slots_in_use);
 	fprintf(stdout, "  total buckets               :  %d\n", (table_stats->max_buckets_per * table_stats->table_size));
-	fprintf(stdout, "  buckets per slot            :  %d\n", table_stats->max_buckets_per);
+	fprintf(stdout, "  buckets per group           :  %d\n", table_stats->max_buckets_per);
 	fprintf(stdout, "  buckets in use              :  %d\n", buckets_in_use);
 	fprintf(stdout, "  hash table size (bytes)     :  %d\n", table_stats->bytes);
 	fprintf(stdout, "  bucket size (bytes)         :  %d\n", table_stats->sizeof_bucket);
-	fprintf(stdout, "  minimum slot allocation     :  %d\n", min_chain_length);
-	fprintf(stdout, "  maximum slot allocation     :  %d\n", max_chain_length);
-	fprintf(stdout, "  slots at maximum allocation :  %d\n", slots_max_chain);
-	fprintf(stdout, "  slots at minimum allocation :  %d\n", slots_min_chain);
+	fprintf(stdout, "  group size (bytes)          :  %d\n", table_stats->sizeof_group);
+	fprintf(stdout, "  minimum group allocation    :  %d\n", min_chain_length);
+	fprintf(stdout, "  maximum group allocation    :  %d\n", max_chain_length);
+	fprintf(stdout, "  groups at maximum allocation:  %d\n", slots_max_chain);
+	fprintf(stdout, "  groups at minimum allocation:  %d\n", slots_min_chain);
 
 	if (table_stats->table_size == 0)
 		a = 0;
@@ -254,17 +286,22 @@ void dump_cache_stats(void) {
 
 	fprintf(stdout, "  overall hash table load     :  %0.2f\n", a);
 	fprintf(stdout, "\n");
-	fprintf(stdout, "  hits*                       :  %d\n", table_stats->hits);
-	fprintf(stdout, "  misses*                     :  %d\n", table_stats->misses);
-	fprintf(stdout, "  total lookup attempts*      :  %d\n", table_stats->attempts);
+	fprintf(stdout, "  hits*                       :  %d\n", counters.hits);
+	fprintf(stdout, "  misses*                     :  %d\n", counters.misses);
+	fprintf(stdout, "  total lookup attempts*      :  %d\n", counters.attempts);
 
-	if (table_stats->attempts == 0)
+	if (counters.attempts == 0)
 		a = 0;
 	else
-		a = (table_stats->hits / (float)table_stats->attempts) * 100;
+		a = (counters.hits / (float)counters.attempts) * 100;
 
 	fprintf(stdout, "  hit ratio*                  :  %0.2f\n", a);
-	fprintf(stdout, "  flock failures*             :  %d\n", table_stats->lock_failures);
+	fprintf(stdout, "  flock failures*             :  %d\n", counters.lock_failures);
+	fprintf(stdout, "  evictions*                  :  %d\n", counters.evictions);
+	fprintf(stdout, "  negative hits*              :  %d\n", counters.negative_hits);
+	fprintf(stdout, "  throttled*                  :  %d\n", counters.throttled);
+	fprintf(stdout, "  refreshes*                  :  %d\n", counters.refreshes);
+	fprintf(stdout, "  refresh failures*           :  %d\n", counters.refresh_failures);
 	fprintf(stdout, "----------------------------------------\n");
 	fprintf(stdout, "* May not be completely accurate\n");
 	fprintf(stdout, "----------------------------------------\n\n");
@@ -0,0 +1,418 @@
+/* stats.c: saslauthd runtime statistics
+ */
+/* 
+ * Copyright (c) 1998-2003 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer. 
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any other legal
+ *    details, please contact  
+ *      Office of Technology Transfer
+ *      Carnegie Mellon University
+ *      5000 Forbes Avenue
+ *      Pittsburgh, PA  15213-3890
+ *      (412) 268-4387, fax: (412) 268-7395
+ *      tech-transfer@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Runtime statistics: request and mechanism counters, latency
+ * histograms (also per phase of the mechanism's work, for the
+ * mechanisms that time theirs) and the request queue depth, kept per worker in
+ * memory shared by all of saslauthd's processes and summed up by
+ * stats_report(), which also takes in the cache's counters and
+ * occupancy. The report is what clients get back for a
+ * PROTO_STATS_MARKER query on the mux socket, see ipc_unix.c.
+ */
+
+#include <saslauthd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#include "globals.h"
+#include "utils.h"
+#include "cache.h"
+#include "stats.h"
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/****************************************
+ * module globals
+ *****************************************/
+STATS_TLS int			stats_slot = 0;	/* ours, see stats_fork() */
+static struct stats_region	*region = NULL;
+
+static const char		*phase_names[STATS_PHASES] = {
+	"connect", "search", "bind", "group", "start", "authenticate", "account"
+};
+
+/****************************************
+ * declarations/protos
+ *****************************************/
+static int	stats_bucket(unsigned long);
+static unsigned long stats_elapsed(struct timeval *);
+static void	stats_printf(char *, size_t, size_t *, const char *, ...);
+static void	stats_histogram(char *, size_t, size_t *, const char *, const char *,
+				unsigned long *, unsigned long, unsigned long);
+
+
+/*************************************************************
+ * Map the memory the slots live in. To be called before any
+ * workers are forked. Returns 0 on success, -1 otherwise (the
+ * statistics are then just not kept).
+ **************************************************************/
+int stats_init(void) {
+	int		rc;
+
+#ifdef MAP_ANONYMOUS
+	region = mmap(NULL, sizeof(struct stats_region), PROT_READ|PROT_WRITE,
+		      MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+#else
+	region = (void *)-1;
+	errno = ENOSYS;
+#endif
+
+	if (region == (void *)-1) {
+		rc = errno;
+		region = NULL;
+		logger(L_ERR, L_FUNC, "could not map statistics, none will be kept");
+		logger(L_ERR, L_FUNC, "mmap: %s", strerror(rc));
+		return -1;
+	}
+
+	memset(region, 0, sizeof(struct stats_region));
+	stats_fork();
+
+	return 0;
+}
+
+
+/*************************************************************
+ * Pick our slot, called in every new process.
+ **************************************************************/
+void stats_fork(void) {
+
+	stats_slot = getpid() % STATS_SLOTS;
+}
+
+
+/*************************************************************
+ * Pick a slot for worker thread n of this process. Without
+ * thread local storage the threads share the process' slot.
+ **************************************************************/
+void stats_thread(int n) {
+
+#ifdef HAVE_THREAD_LOCAL
+	stats_slot = (getpid() + n) % STATS_SLOTS;
+#endif
+}
+
+
+/*************************************************************
+ * A request has come in.
+ **************************************************************/
+void stats_begin(struct timeval *start) {
+	struct worker_stats	*ws;
+
+	gettimeofday(start, NULL);
+
+	if (region == NULL)
+		return;
+
+	ws = region->slots + stats_slot;
+	STATS_ADD(ws->requests, 1);
+	STATS_ADD(ws->inflight, 1);
+}
+
+
+/*************************************************************
+ * A request that came in at start is answered with response
+ * (by the cache if cached is set).
+ **************************************************************/
+void stats_end(struct timeval *start, const char *response, int cached) {
+	struct worker_stats	*ws;
+	unsigned long		us;
+
+	if (region == NULL)
+		return;
+
+	us = stats_elapsed(start);
+	ws = region->slots + stats_slot;
+
+	if (response != NULL && strncmp(response, "OK", 2) == 0)
+		STATS_ADD(ws->ok, 1);
+	else
+		STATS_ADD(ws->no, 1);
+
+	if (cached)
+		STATS_ADD(ws->cached, 1);
+
+	STATS_ADD(ws->request_us, us);
+	STATS_ADD(ws->request_hist[stats_bucket(us)], 1);
+	STATS_ADD(ws->inflight, -1);
+}
+
+
+/*************************************************************
+ * The mechanism, called at start, answered with response.
+ **************************************************************/
+void stats_mech(struct timeval *start, const char *response) {
+	struct worker_stats	*ws;
+	unsigned long		us;
+
+	if (region == NULL)
+		return;
+
+	us = stats_elapsed(start);
+	ws = region->slots + stats_slot;
+
+	if (response == NULL ||
+	    (strncmp(response, "OK", 2) != 0 && strncmp(response, "NO", 2) != 0))
+		STATS_ADD(ws->mech_errors, 1);
+
+	STATS_ADD(ws->mech_calls, 1);
+	STATS_ADD(ws->mech_us, us);
+	STATS_ADD(ws->mech_hist[stats_bucket(us)], 1);
+}
+
+
+/*************************************************************
+ * A phase of the mechanism's work, begun at start, is done.
+ **************************************************************/
+void stats_phase(int phase, struct timeval *start) {
+	struct worker_stats	*ws;
+	unsigned long		us;
+
+	if (region == NULL || phase < 0 || phase >= STATS_PHASES)
+		return;
+
+	us = stats_elapsed(start);
+	ws = region->slots + stats_slot;
+
+	STATS_ADD(ws->phase_calls[phase], 1);
+	STATS_ADD(ws->phase_us[phase], us);
+	STATS_ADD(ws->phase_hist[phase][stats_bucket(us)], 1);
+}
+
+
+/*************************************************************
+ * The number of requests waiting for a worker (event model).
+ **************************************************************/
+void stats_set_queued(long queued) {
+
+	if (region != NULL)
+		region->queued = queued;
+}
+
+
+/*************************************************************
+ * Sum up the slots and write them out, with the cache's
+ * numbers, in the Prometheus text format: one "name value" (or
+ * "name{labels} value") line per sample. Returns the length of
+ * the report.
+ **************************************************************/
+size_t stats_report(char *buf, size_t len, const char *mech) {
+	struct worker_stats	*ws;
+	struct cache_counters	cc;
+	unsigned long		requests = 0, ok = 0, no = 0, cached = 0;
+	unsigned long		request_us = 0, mech_calls = 0, mech_errors = 0, mech_us = 0;
+	unsigned long		request_hist[STATS_HIST_BUCKETS];
+	unsigned long		mech_hist[STATS_HIST_BUCKETS];
+	unsigned long		phase_calls, phase_us;
+	unsigned long		phase_hist[STATS_HIST_BUCKETS];
+	unsigned int		used, negative, total;
+	long			inflight = 0;
+	size_t			off = 0;
+	char			labels[64];
+	int			x, y, z;
+
+
+	memset(request_hist, 0, sizeof(request_hist));
+	memset(mech_hist, 0, sizeof(mech_hist));
+
+	for (x = 0; region != NULL && x < STATS_SLOTS; x++) {
+		ws = region->slots + x;
+
+		requests += ws->requests;
+		ok += ws->ok;
+		no += ws->no;
+		cached += ws->cached;
+		inflight += ws->inflight;
+		request_us += ws->request_us;
+		mech_calls += ws->mech_calls;
+		mech_errors += ws->mech_errors;
+		mech_us += ws->mech_us;
+
+		for (y = 0; y < STATS_HIST_BUCKETS; y++) {
+			request_hist[y] += ws->request_hist[y];
+			mech_hist[y] += ws->mech_hist[y];
+		}
+	}
+
+	stats_printf(buf, len, &off, "saslauthd_requests_total %lu\n", requests);
+	stats_printf(buf, len, &off, "saslauthd_responses_total{result=\"ok\"} %lu\n", ok);
+	stats_printf(buf, len, &off, "saslauthd_responses_total{result=\"no\"} %lu\n", no);
+	stats_printf(buf, len, &off, "saslauthd_cached_responses_total %lu\n", cached);
+	stats_printf(buf, len, &off, "saslauthd_inflight %ld\n", inflight);
+	stats_printf(buf, len, &off, "saslauthd_queued %ld\n", region != NULL ? region->queued : 0L);
+	stats_histogram(buf, len, &off, "saslauthd_request_latency_us", "",
+			request_hist, request_us, requests - inflight);
+
+	snprintf(labels, sizeof(labels), "mech=\"%s\"", mech);
+	stats_printf(buf, len, &off, "saslauthd_mech_errors_total{%s} %lu\n", labels, mech_errors);
+	stats_histogram(buf, len, &off, "saslauthd_mech_latency_us", labels,
+			mech_hist, mech_us, mech_calls);
+
+	for (z = 0; z < STATS_PHASES; z++) {
+		phase_calls = phase_us = 0;
+		memset(phase_hist, 0, sizeof(phase_hist));
+
+		for (x = 0; region != NULL && x < STATS_SLOTS; x++) {
+			ws = region->slots + x;
+
+			phase_calls += ws->phase_calls[z];
+			phase_us += ws->phase_us[z];
+			for (y = 0; y < STATS_HIST_BUCKETS; y++)
+				phase_hist[y] += ws->phase_hist[z][y];
+		}
+
+		/* only the phases the mechanism has */
+		if (phase_calls == 0)
+			continue;
+
+		snprintf(labels, sizeof(labels), "mech=\"%s\",phase=\"%s\"", mech, phase_names[z]);
+		stats_histogram(buf, len, &off, "saslauthd_mech_phase_latency_us", labels,
+				phase_hist, phase_us, phase_calls);
+	}
+
+	if (flags & CACHE_ENABLED) {
+		cache_get_counters(&cc);
+		cache_get_occupancy(&used, &negative, &total);
+
+		stats_printf(buf, len, &off, "saslauthd_cache_lookups_total %u\n", cc.attempts);
+		stats_printf(buf, len, &off, "saslauthd_cache_hits_total %u\n", cc.hits);
+		stats_printf(buf, len, &off, "saslauthd_cache_misses_total %u\n", cc.misses);
+		stats_printf(buf, len, &off, "saslauthd_cache_negative_hits_total %u\n", cc.negative_hits);
+		stats_printf(buf, len, &off, "saslauthd_cache_throttled_total %u\n", cc.throttled);
+		stats_printf(buf, len, &off, "saslauthd_cache_evictions_total %u\n", cc.evictions);
+		stats_printf(buf, len, &off, "saslauthd_cache_lock_failures_total %u\n", cc.lock_failures);
+		stats_printf(buf, len, &off, "saslauthd_cache_refreshes_total %u\n", cc.refreshes);
+		stats_printf(buf, len, &off, "saslauthd_cache_refresh_failures_total %u\n", cc.refresh_failures);
+		stats_printf(buf, len, &off, "saslauthd_cache_buckets{state=\"used\"} %u\n", used - negative);
+		stats_printf(buf, len, &off, "saslauthd_cache_buckets{state=\"negative\"} %u\n", negative);
+		stats_printf(buf, len, &off, "saslauthd_cache_buckets{state=\"free\"} %u\n", total - used);
+	}
+
+	return off;
+}
+
+
+/*************************************************************
+ * Write a histogram out, its buckets made cumulative.
+ **************************************************************/
+static void stats_histogram(char *buf, size_t len, size_t *off, const char *name, const char *labels,
+			    unsigned long *hist, unsigned long sum, unsigned long count) {
+	unsigned long	cumulative = 0;
+	const char	*sep = *labels ? "," : "";
+	int		x;
+
+	for (x = 0; x < STATS_HIST_BUCKETS; x++) {
+		cumulative += hist[x];
+
+		if (x < STATS_HIST_BUCKETS - 1)
+			stats_printf(buf, len, off, "%s_bucket{%s%sle=\"%lu\"} %lu\n",
+				     name, labels, sep, 1UL << x, cumulative);
+		else
+			stats_printf(buf, len, off, "%s_bucket{%s%sle=\"+Inf\"} %lu\n",
+				     name, labels, sep, cumulative);
+	}
+
+	stats_printf(buf, len, off, *labels ? "%s_sum{%s} %lu\n" : "%s_sum%s %lu\n", name, labels, sum);
+	stats_printf(buf, len, off, *labels ? "%s_count{%s} %lu\n" : "%s_count%s %lu\n", name, labels, count);
+}
+
+
+/*************************************************************
+ * Append to the report, as much as fits.
+ **************************************************************/
+static void stats_printf(char *buf, size_t len, size_t *off, const char *format, ...) {
+	va_list		args;
+	int		n;
+
+	if (*off + 1 >= len)
+		return;
+
+	va_start(args, format);
+	n = vsnprintf(buf + *off, len - *off, format, args);
+	va_end(args);
+
+	if (n < 0)
+		return;
+
+	*off = (*off + n < len) ? *off + n : len - 1;
+}
+
+
+/*************************************************************
+ * The histogram bucket for a latency.
+ **************************************************************/
+static int stats_bucket(unsigned long us) {
+	int		x;
+
+	for (x = 0; x < STATS_HIST_BUCKETS - 1; x++) {
+		if (us <= (1UL << x))
+			return x;
+	}
+
+	return x;
+}
+
+
+/*************************************************************
+ * Microseconds since start.
+ **************************************************************/
+static unsigned long stats_elapsed(struct timeval *start) {
+	struct timeval	now;
+
+	gettimeofday(&now, NULL);
+
+	if (now.tv_sec < start->tv_sec)
+		return 0;
+
+	return (now.tv_sec - start->tv_sec) * 1000000UL + now.tv_usec - start->tv_usec;
+}
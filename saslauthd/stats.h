@@ -0,0 +1,128 @@
+/* stats.h: saslauthd runtime statistics
+ */
+/* 
+ * Copyright (c) 1998-2003 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer. 
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any other legal
+ *    details, please contact  
+ *      Office of Technology Transfer
+ *      Carnegie Mellon University
+ *      5000 Forbes Avenue
+ *      Pittsburgh, PA  15213-3890
+ *      (412) 268-4387, fax: (412) 268-7395
+ *      tech-transfer@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include "saslauthd.h"
+
+#include <sys/time.h>
+
+/****************************************************************
+* * Every worker counts into a slot of its own (picked by pid, so
+* * there may be the odd collision), each slot on cache lines of
+* * its own, so the request path never writes to a line another
+* * worker writes to. The adds are atomic where we can, which
+* * covers collisions and the threads of the doors model. The
+* * slots are summed up when the statistics are asked for.
+****************************************************************/
+#define STATS_SLOTS		64
+
+/* latency histograms: <= 1us, <= 2us, ... <= 2^23us (about 8s), more */
+#define STATS_HIST_BUCKETS	25
+
+/* largest report, it's sent as a counted length string */
+#define STATS_REPORT_MAX	32768
+
+/* phases of a mechanism's work, timed by the mechanisms that have them */
+#define STATS_PHASE_CONNECT	0
+#define STATS_PHASE_SEARCH	1
+#define STATS_PHASE_BIND	2
+#define STATS_PHASE_GROUP	3
+#define STATS_PHASE_START	4
+#define STATS_PHASE_AUTH	5
+#define STATS_PHASE_ACCOUNT	6
+#define STATS_PHASES		7
+
+#ifdef HAVE_SYNC_BUILTINS
+# define STATS_ADD(counter, n)	__sync_fetch_and_add(&(counter), (n))
+#else
+# define STATS_ADD(counter, n)	((counter) += (n))
+#endif
+
+/* with threads, each has a slot of its own where we can */
+#ifdef HAVE_THREAD_LOCAL
+# define STATS_TLS		__thread
+#else
+# define STATS_TLS
+#endif
+
+#define STATS_WORKER_LONGS	(9 + 2 * STATS_HIST_BUCKETS + \
+				 STATS_PHASES * (2 + STATS_HIST_BUCKETS))
+
+struct worker_stats {
+	volatile unsigned long	requests;
+	volatile unsigned long	ok;
+	volatile unsigned long	no;
+	volatile unsigned long	cached;		/* answered by the cache */
+	volatile long		inflight;	/* requests being worked on */
+	volatile unsigned long	request_us;
+	volatile unsigned long	mech_calls;
+	volatile unsigned long	mech_errors;	/* no or unknown response */
+	volatile unsigned long	mech_us;
+	volatile unsigned long	request_hist[STATS_HIST_BUCKETS];
+	volatile unsigned long	mech_hist[STATS_HIST_BUCKETS];
+	volatile unsigned long	phase_calls[STATS_PHASES];
+	volatile unsigned long	phase_us[STATS_PHASES];
+	volatile unsigned long	phase_hist[STATS_PHASES][STATS_HIST_BUCKETS];
+	char			pad[64 - STATS_WORKER_LONGS * sizeof(long) % 64];
+};
+
+struct stats_region {
+	volatile long		queued;		/* requests waiting for a worker */
+	char			pad[64 - sizeof(long)];
+	struct worker_stats	slots[STATS_SLOTS];
+};
+
+/* stats.c */
+extern STATS_TLS int stats_slot;
+extern int	stats_init(void);
+extern void	stats_fork(void);
+extern void	stats_thread(int);
+extern void	stats_begin(struct timeval *);
+extern void	stats_end(struct timeval *, const char *, int);
+extern void	stats_mech(struct timeval *, const char *);
+extern void	stats_phase(int, struct timeval *);
+extern void	stats_set_queued(long);
+extern size_t	stats_report(char *, size_t, const char *);
+
+#endif  /* _STATS_H */
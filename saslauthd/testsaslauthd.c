@@ -58,6 +58,7 @@
 #include <assert.h>
 
 #include "globals.h"
+#include "saslauthd-main.h"
 #include "utils.h"
 
 /* make utils.c happy */
@@ -246,6 +247,94 @@ static int saslauthd_verify_password(const char *saslauthd_path,
     return -1;
 }
 
+/* fetch and print the statistics report */
+static int saslauthd_stats(const char *saslauthd_path)
+{
+    static char response[65536];
+    unsigned short count;
+    int s, r;
+    struct sockaddr_un srvaddr;
+    char pwpath[sizeof(srvaddr.sun_path)];
+#ifdef USE_DOORS
+    door_arg_t arg;
+#endif
+
+    if (saslauthd_path) {
+	strncpy(pwpath, saslauthd_path, sizeof(pwpath));
+    } else {
+	if (strlen(PATH_SASLAUTHD_RUNDIR) + 4 + 1 > sizeof(pwpath))
+	    return -1;
+
+	strcpy(pwpath, PATH_SASLAUTHD_RUNDIR);
+	strcat(pwpath, "/mux");
+    }
+
+    count = htons(PROTO_STATS_MARKER);
+
+#ifdef USE_DOORS
+    s = open(pwpath, O_RDONLY);
+    if (s < 0) {
+	perror("open");
+	return -1;
+    }
+
+    arg.data_ptr = (char *)&count;
+    arg.data_size = sizeof(count);
+    arg.desc_ptr = NULL;
+    arg.desc_num = 0;
+    arg.rbuf = response;
+    arg.rsize = sizeof(response) - 1;
+
+    if(door_call(s, &arg) != 0) {
+	printf("NO \"door_call failed\"\n");
+	return -1;	
+    }
+
+    response[arg.data_size] = '\0';
+
+    close(s);
+#else
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == -1) {
+	perror("socket() ");
+	return -1;
+    }
+
+    memset((char *)&srvaddr, 0, sizeof(srvaddr));
+    srvaddr.sun_family = AF_UNIX;
+    strncpy(srvaddr.sun_path, pwpath, sizeof(srvaddr.sun_path));
+
+    r = connect(s, (struct sockaddr *) &srvaddr, sizeof(srvaddr));
+    if (r == -1) {
+        perror("connect() ");
+	return -1;
+    }
+
+    if (write(s, &count, sizeof(count)) != sizeof(count)) {
+        fprintf(stderr,"write failed\n");
+	return -1;
+    }
+
+    if (retry_read(s, &count, sizeof(count)) < (int) sizeof(count)) {
+        fprintf(stderr,"size read failed\n");
+	return -1;
+    }
+
+    count = ntohs(count);
+    if (retry_read(s, response, count) < count) {
+	close(s);
+        fprintf(stderr,"read failed\n");
+	return -1;
+    }
+    response[count] = '\0';
+
+    close(s);
+#endif /* USE_DOORS */
+
+    fputs(response, stdout);
+    return 0;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -258,9 +347,13 @@ main(int argc, char *argv[])
   int result;
   char *user_domain = NULL;
   int repeat = 0;
+  int stats = 0;
 
-  while ((c = getopt(argc, argv, "p:u:r:s:f:R:")) != EOF)
+  while ((c = getopt(argc, argv, "p:u:r:s:f:R:S")) != EOF)
       switch (c) {
+      case 'S':
+	  stats = 1;
+	  break;
       case 'R':
 	  repeat = atoi(optarg);
 	  break;
@@ -284,6 +377,9 @@ main(int argc, char *argv[])
 	  break;
     }
 
+  if (stats && !flag_error)
+    return saslauthd_stats(path) == 0 ? 0 : 1;
+
   if (!user || !password)
     flag_error = 1;
 
@@ -291,8 +387,9 @@ main(int argc, char *argv[])
     (void)fprintf(stderr,
 		  "%s: usage: %s -u username -p password\n"
 		  "              [-r realm] [-s servicename]\n"
-		  "              [-f socket path] [-R repeatnum]\n",
-		  argv[0], argv[0]);
+		  "              [-f socket path] [-R repeatnum]\n"
+		  "       %s -S [-f socket path]\n",
+		  argv[0], argv[0], argv[0]);
     exit(1);
   }
 
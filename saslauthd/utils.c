@@ -46,6 +46,7 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "utils.h"
@@ -227,6 +228,30 @@ int retry_writev(int fd, struct iovec *iov, int iovcnt) {
 	}
 }
 
+/**************************************************************
+ * A fingerprint of the files in the colon separated list, from
+ * their mtimes, sizes and inodes, that changes when one of them
+ * is written or replaced. Files that are not there count too.
+ **************************************************************/
+unsigned long files_stamp(const char *list) {
+	char		files[4096];
+	char		*file, *last;
+	struct stat	sb;
+	unsigned long	stamp = 0;
+
+	strlcpy(files, list, sizeof(files));
+
+	for (file = strtok_r(files, ":", &last); file; file = strtok_r(NULL, ":", &last)) {
+		stamp *= 31;
+		if (stat(file, &sb) == 0)
+			stamp += (unsigned long)sb.st_mtime * 31 * 31 + (unsigned long)sb.st_size * 31 + sb.st_ino;
+		else
+			stamp++;
+	}
+
+	return stamp;
+}
+
 #ifndef HAVE_STRLCPY
 /* strlcpy -- copy string smartly.
  *
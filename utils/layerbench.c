@@ -0,0 +1,427 @@
+/* layerbench.c -- security layer encode benchmark for CMU SASL
+ */
+/* 
+ * Copyright (c) 2004 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer. 
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any other legal
+ *    details, please contact  
+ *      Office of Technology Transfer
+ *      Carnegie Mellon University
+ *      5000 Forbes Avenue
+ *      Pittsburgh, PA  15213-3890
+ *      (412) 268-4387, fax: (412) 268-7395
+ *      tech-transfer@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Authenticates an in-process client and server and then times
+ * sasl_encodev() against sasl_encodev_into() for 4K, 64K and 1M
+ * messages.  Before any timing each way of encoding is checked by
+ * decoding its packets on the server.
+ *
+ * DIGEST-MD5 needs no setup: the password is handed to the server by
+ * a small auxprop plugin in this file.  GSSAPI needs a keytab and a
+ * credentials cache for the service named with -s and -h.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <sasl.h>
+#include <saslplug.h>
+
+#define PIECES 16	/* iovecs a message is handed over in */
+
+static const char *mech = "DIGEST-MD5";
+static const char *service = "rcmd";
+static const char *host = "localhost";
+static const char *user = "bench";
+static const char *password = "bench";
+static unsigned maxbufsize = 65536;
+static sasl_ssf_t min_ssf = 56;
+static sasl_ssf_t max_ssf = 256;
+static size_t volume = 256 * 1024 * 1024;	/* bytes encoded per run */
+
+static const size_t sizes[] = { 4096, 65536, 1024 * 1024 };
+#define NSIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+static void fail(const char *what, sasl_conn_t *conn, int result)
+{
+    fprintf(stderr, "layerbench: %s: %s\n", what,
+	    conn ? sasl_errdetail(conn) : sasl_errstring(result, NULL, NULL));
+    exit(1);
+}
+
+/* auxprop plugin: everyone's password is the one given with -p */
+static void bench_auxprop_lookup(void *glob_context __attribute__((unused)),
+				 sasl_server_params_t *sparams,
+				 unsigned flags,
+				 const char *userid __attribute__((unused)),
+				 unsigned ulen __attribute__((unused)))
+{
+    const struct propval *to_fetch, *cur;
+
+    if (flags & SASL_AUXPROP_AUTHZID) return;
+
+    to_fetch = sparams->utils->prop_get(sparams->propctx);
+    if (!to_fetch) return;
+
+    for (cur = to_fetch; cur->name; cur++) {
+	if (!strcmp(cur->name, "*" SASL_AUX_PASSWORD_PROP) && !cur->values) {
+	    sparams->utils->prop_set(sparams->propctx, cur->name,
+				     password, (unsigned) strlen(password));
+	}
+    }
+}
+
+static sasl_auxprop_plug_t bench_auxprop_plugin = {
+    0,				/* features */
+    0,				/* spare */
+    NULL,			/* glob_context */
+    NULL,			/* auxprop_free */
+    bench_auxprop_lookup,	/* auxprop_lookup */
+    "layerbench",		/* name */
+    NULL			/* auxprop_store */
+};
+
+static int bench_auxprop_init(const sasl_utils_t *utils
+			      __attribute__((unused)),
+			      int max_version,
+			      int *out_version,
+			      sasl_auxprop_plug_t **plug,
+			      const char *plugname __attribute__((unused)))
+{
+    if (max_version < SASL_AUXPROP_PLUG_VERSION) return SASL_BADVERS;
+
+    *out_version = SASL_AUXPROP_PLUG_VERSION;
+    *plug = &bench_auxprop_plugin;
+
+    return SASL_OK;
+}
+
+static int getopt_cb(void *context __attribute__((unused)),
+		     const char *plugin_name __attribute__((unused)),
+		     const char *option,
+		     const char **result,
+		     unsigned *len)
+{
+    if (!strcmp(option, "auxprop_plugin")) {
+	*result = "layerbench";
+	if (len) *len = 0;
+	return SASL_OK;
+    }
+
+    return SASL_FAIL;
+}
+
+static int simple_cb(void *context __attribute__((unused)),
+		     int id,
+		     const char **result,
+		     unsigned *len)
+{
+    if (id != SASL_CB_USER && id != SASL_CB_AUTHNAME) return SASL_BADPARAM;
+
+    *result = user;
+    if (len) *len = (unsigned) strlen(user);
+
+    return SASL_OK;
+}
+
+static int pass_cb(sasl_conn_t *conn __attribute__((unused)),
+		   void *context __attribute__((unused)),
+		   int id,
+		   sasl_secret_t **psecret)
+{
+    static sasl_secret_t *secret = NULL;
+    size_t len = strlen(password);
+
+    if (id != SASL_CB_PASS) return SASL_BADPARAM;
+
+    if (!secret) {
+	secret = malloc(sizeof(sasl_secret_t) + len);
+	if (!secret) return SASL_NOMEM;
+	secret->len = (unsigned) len;
+	memcpy(secret->data, password, len + 1);
+    }
+    *psecret = secret;
+
+    return SASL_OK;
+}
+
+static sasl_callback_t server_callbacks[] = {
+    { SASL_CB_GETOPT, (int (*)(void)) &getopt_cb, NULL },
+    { SASL_CB_LIST_END, NULL, NULL }
+};
+
+static sasl_callback_t client_callbacks[] = {
+    { SASL_CB_USER, (int (*)(void)) &simple_cb, NULL },
+    { SASL_CB_AUTHNAME, (int (*)(void)) &simple_cb, NULL },
+    { SASL_CB_PASS, (int (*)(void)) &pass_cb, NULL },
+    { SASL_CB_LIST_END, NULL, NULL }
+};
+
+/* run the exchange between the two ends */
+static void authenticate(sasl_conn_t *cconn, sasl_conn_t *sconn)
+{
+    const char *out, *mechusing;
+    unsigned outlen;
+    int cresult, sresult;
+
+    cresult = sasl_client_start(cconn, mech, NULL, &out, &outlen, &mechusing);
+    if (cresult != SASL_OK && cresult != SASL_CONTINUE)
+	fail("sasl_client_start", cconn, cresult);
+
+    sresult = sasl_server_start(sconn, mechusing, out, outlen,
+				&out, &outlen);
+    while (sresult == SASL_CONTINUE) {
+	cresult = sasl_client_step(cconn, out, outlen, NULL, &out, &outlen);
+	if (cresult != SASL_OK && cresult != SASL_CONTINUE)
+	    fail("sasl_client_step", cconn, cresult);
+	sresult = sasl_server_step(sconn, out, outlen, &out, &outlen);
+    }
+    if (sresult != SASL_OK) fail("server", sconn, sresult);
+
+    /* a last message from the server */
+    if (cresult == SASL_CONTINUE) {
+	cresult = sasl_client_step(cconn, out, outlen, NULL, &out, &outlen);
+	if (cresult != SASL_OK) fail("sasl_client_step", cconn, cresult);
+    }
+}
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* cut msg into PIECES iovecs */
+static void slice(char *msg, size_t size, struct iovec *invec)
+{
+    size_t piece = size / PIECES;
+    unsigned i;
+
+    for (i = 0; i < PIECES; i++) {
+	invec[i].iov_base = msg + i * piece;
+	invec[i].iov_len = (i == PIECES - 1) ? size - i * piece : piece;
+    }
+}
+
+/* the server gets msg back out of len bytes of packets */
+static void check(sasl_conn_t *sconn, const char *what,
+		  const char *packets, unsigned len,
+		  const char *msg, size_t size, char *scratch)
+{
+    const char *out;
+    unsigned outlen;
+    int result;
+
+    result = sasl_decode(sconn, packets, len, &out, &outlen);
+    if (result != SASL_OK) fail("sasl_decode", sconn, result);
+    if (outlen != size) {
+	fprintf(stderr, "layerbench: %s: %u bytes decoded, expected %lu\n",
+		what, outlen, (unsigned long) size);
+	exit(1);
+    }
+    memcpy(scratch, out, outlen);
+    if (memcmp(scratch, msg, size)) {
+	fprintf(stderr, "layerbench: %s: decoded data differs\n", what);
+	exit(1);
+    }
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+	    "usage: layerbench [-m mech] [-u user] [-p password] "
+	    "[-s service] [-h host]\n"
+	    "                  [-l min_ssf] [-L max_ssf] [-b maxbufsize] "
+	    "[-v megabytes]\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    sasl_conn_t *cconn, *sconn;
+    sasl_security_properties_t secprops;
+    const unsigned *maxoutbuf, *maxpacket;
+    const sasl_ssf_t *ssf;
+    struct iovec invec[PIECES], *outvec;
+    unsigned numout, maxout, i, j;
+    char *msg, *scratch, *packets;
+    const char *out;
+    unsigned outlen;
+    size_t s, iterations, n;
+    double t0, t_encodev, t_into;
+    int c, result;
+
+    while ((c = getopt(argc, argv, "m:u:p:s:h:l:L:b:v:")) != EOF) {
+	switch (c) {
+	case 'm': mech = optarg; break;
+	case 'u': user = optarg; break;
+	case 'p': password = optarg; break;
+	case 's': service = optarg; break;
+	case 'h': host = optarg; break;
+	case 'l': min_ssf = (sasl_ssf_t) atoi(optarg); break;
+	case 'L': max_ssf = (sasl_ssf_t) atoi(optarg); break;
+	case 'b': maxbufsize = (unsigned) atoi(optarg); break;
+	case 'v': volume = (size_t) atoi(optarg) * 1024 * 1024; break;
+	default: usage();
+	}
+    }
+    if (optind != argc) usage();
+
+    result = sasl_auxprop_add_plugin("layerbench", &bench_auxprop_init);
+    if (result != SASL_OK) fail("sasl_auxprop_add_plugin", NULL, result);
+    result = sasl_server_init(server_callbacks, "layerbench");
+    if (result != SASL_OK) fail("sasl_server_init", NULL, result);
+    result = sasl_client_init(client_callbacks);
+    if (result != SASL_OK) fail("sasl_client_init", NULL, result);
+
+    result = sasl_server_new(service, host, NULL, NULL, NULL, NULL, 0,
+			     &sconn);
+    if (result != SASL_OK) fail("sasl_server_new", NULL, result);
+    result = sasl_client_new(service, host, NULL, NULL, NULL, 0, &cconn);
+    if (result != SASL_OK) fail("sasl_client_new", NULL, result);
+
+    memset(&secprops, 0, sizeof(secprops));
+    secprops.min_ssf = min_ssf;
+    secprops.max_ssf = max_ssf;
+    secprops.maxbufsize = maxbufsize;
+    sasl_setprop(sconn, SASL_SEC_PROPS, &secprops);
+    sasl_setprop(cconn, SASL_SEC_PROPS, &secprops);
+
+    authenticate(cconn, sconn);
+
+    sasl_getprop(cconn, SASL_SSF, (const void **) &ssf);
+    sasl_getprop(cconn, SASL_MAXOUTBUF, (const void **) &maxoutbuf);
+    sasl_getprop(cconn, SASL_MAXPACKET, (const void **) &maxpacket);
+    printf("%s: ssf %u, maxoutbuf %u, maxpacket %u\n",
+	   mech, (unsigned) *ssf, *maxoutbuf, *maxpacket);
+
+    maxout = (unsigned) ((sizes[NSIZES - 1] + *maxoutbuf - 1) / *maxoutbuf);
+    msg = malloc(sizes[NSIZES - 1]);
+    scratch = malloc(sizes[NSIZES - 1]);
+    packets = malloc((size_t) maxout * *maxpacket);
+    outvec = malloc(maxout * sizeof(struct iovec));
+    if (!msg || !scratch || !packets || !outvec) {
+	fprintf(stderr, "layerbench: out of memory\n");
+	exit(1);
+    }
+    for (s = 0; s < sizes[NSIZES - 1]; s++) {
+	msg[s] = (char) (s * 7 + (s >> 8));
+    }
+
+    /* both ways must give the server the message back */
+    for (i = 0; i < NSIZES; i++) {
+	slice(msg, sizes[i], invec);
+
+	result = sasl_encodev(cconn, invec, PIECES, &out, &outlen);
+	if (result != SASL_OK) fail("sasl_encodev", cconn, result);
+	check(sconn, "sasl_encodev", out, outlen, msg, sizes[i], scratch);
+
+	for (j = 0; j < maxout; j++) {
+	    outvec[j].iov_base = packets + (size_t) j * *maxpacket;
+	    outvec[j].iov_len = *maxpacket;
+	}
+	numout = maxout;
+	result = sasl_encodev_into(cconn, invec, PIECES, outvec, &numout);
+	if (result != SASL_OK) fail("sasl_encodev_into", cconn, result);
+	/* the packets are decoded one by one, as if read off a socket */
+	for (j = 0, s = 0; j < numout; j++) {
+	    result = sasl_decode(sconn, outvec[j].iov_base,
+				 (unsigned) outvec[j].iov_len, &out, &outlen);
+	    if (result != SASL_OK) fail("sasl_decode", sconn, result);
+	    if (s + outlen > sizes[i] || memcmp(out, msg + s, outlen)) {
+		fprintf(stderr,
+			"layerbench: sasl_encodev_into: decoded data differs\n");
+		exit(1);
+	    }
+	    s += outlen;
+	}
+	if (s != sizes[i]) {
+	    fprintf(stderr, "layerbench: sasl_encodev_into: %lu bytes "
+		    "decoded, expected %lu\n",
+		    (unsigned long) s, (unsigned long) sizes[i]);
+	    exit(1);
+	}
+    }
+
+    /* from here on the server falls behind: encode only */
+    printf("%10s %12s %12s %8s\n", "size", "encodev", "encodev_into",
+	   "speedup");
+    for (i = 0; i < NSIZES; i++) {
+	slice(msg, sizes[i], invec);
+	iterations = volume / sizes[i];
+	if (iterations == 0) iterations = 1;
+
+	t0 = now();
+	for (n = 0; n < iterations; n++) {
+	    result = sasl_encodev(cconn, invec, PIECES, &out, &outlen);
+	    if (result != SASL_OK) fail("sasl_encodev", cconn, result);
+	}
+	t_encodev = now() - t0;
+
+	t0 = now();
+	for (n = 0; n < iterations; n++) {
+	    for (j = 0; j < maxout; j++) {
+		outvec[j].iov_len = *maxpacket;
+	    }
+	    numout = maxout;
+	    result = sasl_encodev_into(cconn, invec, PIECES, outvec, &numout);
+	    if (result != SASL_OK) fail("sasl_encodev_into", cconn, result);
+	}
+	t_into = now() - t0;
+
+	printf("%10lu %9.1f MB/s %7.1f MB/s %7.2fx\n",
+	       (unsigned long) sizes[i],
+	       iterations * sizes[i] / t_encodev / 1048576.0,
+	       iterations * sizes[i] / t_into / 1048576.0,
+	       t_encodev / t_into);
+    }
+
+    free(outvec);
+    free(packets);
+    free(scratch);
+    free(msg);
+    sasl_dispose(&cconn);
+    sasl_dispose(&sconn);
+    sasl_done();
+
+    return 0;
+}
@@ -66,8 +66,7 @@
 #include <saslutil.h>
 #include <prop.h>
 #include <md5global.h>
-#include <md5.h>
-#include <hmac-md5.h>
+#include <saslplug.h>	/* also md5.h and hmac-md5.h */
 
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
@@ -696,18 +695,71 @@ void test_init(void)
 }
 
 
+/*
+ * A mechanism that only counts how often its mech_avail is asked,
+ * to see that sasl_listmech() keeps its answer
+ */
+static int count_avail_calls = 0;
+
+static int count_avail(void *glob_context,
+		       sasl_server_params_t *sparams,
+		       void **conn_context)
+{
+    (void) glob_context; (void) sparams; (void) conn_context;
+
+    count_avail_calls++;
+    return SASL_OK;
+}
+
+static sasl_server_plug_t count_avail_plugins[] =
+{
+    {
+	"X-COUNT-AVAIL",		/* mech_name */
+	0,				/* max_ssf */
+	0,				/* security_flags */
+	0,				/* features */
+	NULL,				/* glob_context */
+	NULL,				/* mech_new */
+	NULL,				/* mech_step */
+	NULL,				/* mech_dispose */
+	NULL,				/* mech_free */
+	NULL,				/* setpass */
+	NULL,				/* user_query */
+	NULL,				/* idle */
+	&count_avail,			/* mech_avail */
+	NULL				/* spare */
+    }
+};
+
+static int count_avail_plug_init(const sasl_utils_t *utils,
+				 int max_version,
+				 int *out_version,
+				 sasl_server_plug_t **pluglist,
+				 int *plugcount)
+{
+    (void) utils; (void) max_version;
+
+    *out_version = SASL_SERVER_PLUG_VERSION;
+    *pluglist = count_avail_plugins;
+    *plugcount = 1;
+    return SASL_OK;
+}
+
 /* 
  * Tests sasl_listmech command
  */
 
 void test_listmech(void)
 {
-    sasl_conn_t *saslconn, *cconn;
+    sasl_conn_t *saslconn, *cconn, *countconn;
     int result;
     const char *str = NULL;
-    unsigned int plen;
-    unsigned lup, flag, pcount;
+    unsigned int plen, plen2;
+    unsigned lup, flag;
+    int pcount, pcount2;
     const char **list;
+    char *first;
+    sasl_security_properties_t secprops;
 
     /* test without initializing library */
     result = sasl_listmech(NULL, /* conn */
@@ -869,6 +921,79 @@ void test_listmech(void)
 	fatal("Number of mechs received doesn't match what we were told");
     }
 
+    /* Asking again is answered from the connection, but must still
+       follow its security properties */
+    result = sasl_listmech(saslconn, NULL, "", "%", "", &str, &plen, &pcount);
+    if (result != SASL_OK) fatal("Failed sasl_listmech()");
+
+    first = strdup(str);
+    if (!first) fatal("strdup failed");
+
+    result = sasl_listmech(saslconn, NULL, "", "%", "", &str, &plen2, &pcount2);
+    if (result != SASL_OK) fatal("Failed sasl_listmech() the second time");
+
+    if (strcmp(str, first) || plen2 != plen || pcount2 != pcount)
+	fatal("sasl_listmech() changed its answer for the same question");
+
+    result = sasl_listmech(saslconn, NULL, "<", ",", ">", &str, &plen2, NULL);
+    if (result != SASL_OK || str[0] != '<' || str[plen2 - 1] != '>')
+	fatal("sasl_listmech() didn't follow a new prefix and suffix");
+
+    memset(&secprops, 0, sizeof(secprops));
+    secprops.max_ssf = 256;
+    secprops.security_flags = SASL_SEC_NOANONYMOUS;
+    if (sasl_setprop(saslconn, SASL_SEC_PROPS, &secprops) != SASL_OK)
+	fatal("sasl_setprop(SASL_SEC_PROPS) failed");
+
+    result = sasl_listmech(saslconn, NULL, "", "%", "", &str, NULL, NULL);
+    if (result != SASL_OK) fatal("Failed sasl_listmech() with new secprops");
+
+    if (strstr(str, "ANONYMOUS"))
+	fatal("sasl_listmech() ignored new security properties");
+
+    free(first);
+
+    /* Without SASL_AUTH_EXTERNAL, EXTERNAL's mech_avail says
+       SASL_NOTDONE, so no list is kept and every call asks the mechs */
+    if (sasl_server_add_plugin("COUNT-AVAIL", &count_avail_plug_init)
+	!= SASL_OK)
+	fatal("can't add the X-COUNT-AVAIL plugin");
+
+    if (sasl_server_new("rcmd", myhostname,
+			NULL, NULL, NULL, NULL, 0,
+			&countconn) != SASL_OK)
+	fatal("can't sasl_server_new");
+
+    count_avail_calls = 0;
+    for (lup = 0; lup < 5; lup++) {
+	result = sasl_listmech(countconn, NULL, "", " ", "", &str, NULL, NULL);
+	if (result != SASL_OK) fatal("Failed sasl_listmech() on new conn");
+	if (!strstr(str, "X-COUNT-AVAIL"))
+	    fatal("sasl_listmech() didn't list X-COUNT-AVAIL");
+    }
+    if (count_avail_calls != 5) {
+	printf("mech_avail calls = %d\n", count_avail_calls);
+	fatal("sasl_listmech() kept a list made while a mech wasn't done");
+    }
+
+    /* Once all the mechs know, repeated calls must not ask them again */
+    if (sasl_setprop(countconn, SASL_AUTH_EXTERNAL, authname) != SASL_OK)
+	fatal("sasl_setprop(SASL_AUTH_EXTERNAL) failed");
+
+    count_avail_calls = 0;
+    for (lup = 0; lup < 5; lup++) {
+	result = sasl_listmech(countconn, NULL, "", " ", "", &str, NULL, NULL);
+	if (result != SASL_OK) fatal("Failed sasl_listmech() after AUTH_EXTERNAL");
+	if (!strstr(str, "EXTERNAL"))
+	    fatal("sasl_listmech() didn't notice SASL_AUTH_EXTERNAL");
+    }
+    if (count_avail_calls != 1) {
+	printf("mech_avail calls = %d\n", count_avail_calls);
+	fatal("sasl_listmech() asked mech_avail again for the same question");
+    }
+
+    sasl_dispose(&countconn);
+
     /* Call sasl done then make sure listmech doesn't work anymore */
     sasl_dispose(&saslconn);
     sasl_dispose(&cconn);
@@ -2296,8 +2421,12 @@ void testseclayer(char *mech, void *rock __attribute__((unused)))
 					    &no_int,
 					    &disable_seclayer };
     const unsigned num_properties = 7;
-    unsigned i;
+    unsigned i, j;
     const sasl_ssf_t *this_ssf;
+    const unsigned *maxpacket;
+    struct iovec invec[2], outvec[2];
+    char *bufs[2];
+    unsigned numout;
     unsigned outlen = 0, outlen2 = 0, totlen = 0;
     
     printf("%s --> security layer start\n", mech);
@@ -2505,6 +2634,57 @@ void testseclayer(char *mech, void *rock __attribute__((unused)))
 	fatal("did not get correct string back (2 blocks, 1 split)");
     }
 
+    cleanup_auth(&sconn, &cconn);
+
+    /* Encode into our own buffers */
+    if(doauth(mech, &sconn, &cconn, test_props[i], NULL, 0) != SASL_OK) {
+	fatal("doauth failed in testseclayer");
+    }
+
+    if(sasl_getprop(cconn, SASL_MAXPACKET, (const void **)&maxpacket)
+       != SASL_OK || *maxpacket == 0) {
+	fatal("sasl_getprop(SASL_MAXPACKET) in testseclayer");
+    }
+
+    invec[0].iov_base = invec[1].iov_base = (char *) txstring;
+    invec[0].iov_len = invec[1].iov_len = strlen(txstring);
+    numout = 0;
+    result = sasl_encodev_into(cconn, invec, 2, outvec, &numout);
+    if(result != SASL_BUFOVER) {
+	fatal("sasl_encodev_into did not fail with no buffers");
+    }
+
+    for(j = 0; j < 2; j++) {
+	outvec[j].iov_base = malloc(*maxpacket);
+	if(!outvec[j].iov_base) fatal("no memory");
+	outvec[j].iov_len = *maxpacket;
+	bufs[j] = outvec[j].iov_base;
+    }
+    numout = 2;
+    result = sasl_encodev_into(cconn, invec, 2, outvec, &numout);
+    if(result != SASL_OK || numout < 1) {
+	fatal("sasl_encodev_into failure");
+    }
+
+    memset(buf2, 0, 8192);
+    totlen = 0;
+    for(j = 0; j < numout; j++) {
+	result = sasl_decode(sconn, outvec[j].iov_base,
+			     (unsigned) outvec[j].iov_len, &out, &outlen);
+	if(result != SASL_OK) {
+	    printf("Failed with: %s\n", sasl_errstring(result, NULL, NULL));
+	    fatal("sasl_decode failure (sasl_encodev_into)");
+	}
+	memcpy(buf2 + totlen, out, outlen);
+	totlen += outlen;
+    }
+    for(j = 0; j < 2; j++) free(bufs[j]);
+
+    sprintf(buf, "%s%s", txstring, txstring);
+    if(strcmp(buf, buf2)) {
+	fatal("did not get correct string back (sasl_encodev_into)");
+    }
+
     cleanup_auth(&sconn, &cconn);
     
     } /* for each properties type we want to test */
@@ -2653,6 +2833,153 @@ void test_serverstart()
 
     if (result == SASL_OK) fatal("Said ok to invalid mechanism");
 
+    /* make it ready for another connection */
+    if (sasl_server_reset(NULL, buf, buf) == SASL_OK)
+	fatal("Said ok to null sasl_conn_t in sasl_server_reset()");
+
+    if (sasl_server_reset(saslconn, "foobar", buf) == SASL_OK)
+	fatal("Said ok to bad iplocalport in sasl_server_reset()");
+
+    if (sasl_server_reset(saslconn, buf, buf) != SASL_OK)
+	fatal("can't sasl_server_reset in test_serverstart");
+
+    result = sasl_server_start(saslconn,
+			       "foobar",
+			       NULL,
+			       0,
+			       &out,
+			       &outlen);
+
+    if (result == SASL_OK) fatal("Said ok to invalid mechanism after reset");
+
+    sasl_dispose(&saslconn);
+    sasl_done();
+}
+
+/* Authenticate a new client to saslconn, which has been sasl_server_reset()
+ * after an earlier session, and check what the server reports */
+void doauth_reset(char *mech, sasl_conn_t *saslconn, const char *buf,
+		  int want_layer)
+{
+    int result;
+    sasl_conn_t *clientconn;
+    const char *out, *out2;
+    unsigned outlen, outlen2;
+    sasl_interact_t *client_interact=NULL;
+    const char *mechusing;
+    const sasl_ssf_t *ssf;
+    const char *user;
+    const char *txstring = "THIS IS A TEST";
+
+    result = sasl_client_new("rcmd", myhostname, buf, buf, NULL, 0,
+			     &clientconn);
+    if (result != SASL_OK) fatal("sasl_client_new() failure in doauth_reset");
+
+    set_properties(clientconn, &security_props);
+    set_properties(saslconn, &security_props);
+
+    do {
+	result = sasl_client_start(clientconn, mech, &client_interact,
+				   &out, &outlen, &mechusing);
+	if (result == SASL_INTERACT) fillin_correctly(client_interact);
+    } while (result == SASL_INTERACT);
+
+    if (result < 0) fatal("sasl_client_start() error in doauth_reset");
+
+    result = sasl_server_start(saslconn, mech, out, outlen, &out, &outlen);
+
+    while (result == SASL_CONTINUE) {
+	do {
+	    result = sasl_client_step(clientconn, out, outlen,
+				      &client_interact, &out2, &outlen2);
+	    if (result == SASL_INTERACT) fillin_correctly(client_interact);
+	} while (result == SASL_INTERACT);
+
+	if (result < 0) fatal("sasl_client_step() error in doauth_reset");
+
+	result = sasl_server_step(saslconn, out2, outlen2, &out, &outlen);
+    }
+
+    if (result != SASL_OK) {
+	printf("%s: %s\n", mech, sasl_errdetail(saslconn));
+	fatal("authentication failed after sasl_server_reset");
+    }
+
+    if (sasl_getprop(saslconn, SASL_USERNAME, (const void **) &user) != SASL_OK
+	|| strcmp(user, username))
+	fatal("wrong SASL_USERNAME after sasl_server_reset");
+
+    if (sasl_getprop(saslconn, SASL_AUTHUSER, (const void **) &user) != SASL_OK
+	|| strcmp(user, authname))
+	fatal("wrong SASL_AUTHUSER after sasl_server_reset");
+
+    if (sasl_getprop(saslconn, SASL_SSF, (const void **) &ssf) != SASL_OK)
+	fatal("can't get SASL_SSF after sasl_server_reset");
+
+    if (want_layer ? *ssf == 0 : *ssf != 0)
+	fatal("wrong SASL_SSF after sasl_server_reset");
+
+    /* the layer has to be the new session's, and work */
+    if (want_layer) {
+	result = sasl_encode(clientconn, txstring, (unsigned) strlen(txstring),
+			     &out, &outlen);
+	if (result != SASL_OK) fatal("sasl_encode failure after sasl_server_reset");
+
+	result = sasl_decode(saslconn, out, outlen, &out2, &outlen2);
+	if (result != SASL_OK) fatal("sasl_decode failure after sasl_server_reset");
+
+	if (outlen2 != strlen(txstring) || memcmp(out2, txstring, outlen2))
+	    fatal("did not get correct string back after sasl_server_reset");
+    }
+
+    sasl_dispose(&clientconn);
+}
+
+/* Two full sessions on one server sasl_conn_t, the second with a
+ * security layer where the first had none */
+void test_serverreset()
+{
+    sasl_conn_t *saslconn;
+    const char *user;
+    struct sockaddr_in addr;
+    struct hostent *hp;
+    char buf[8192];
+
+    if (sasl_client_init(client_interactions) != SASL_OK)
+	fatal("can't sasl_client_init in test_serverreset");
+
+    if (sasl_server_init(goodsasl_cb,"TestSuite") != SASL_OK)
+	fatal("can't sasl_server_init in test_serverreset");
+
+    if ((hp = gethostbyname(myhostname)) == NULL) {
+        perror("gethostbyname");
+        fatal("can't gethostbyname in test_serverreset");
+    }
+
+    addr.sin_family = 0;
+    memcpy(&addr.sin_addr, hp->h_addr, hp->h_length);
+    addr.sin_port = htons(0);
+
+    sprintf(buf,"%s;%d", inet_ntoa(addr.sin_addr), 0);
+
+    if (sasl_server_new("rcmd", myhostname, NULL,
+			buf, buf, NULL, 0,
+			&saslconn) != SASL_OK) {
+	fatal("can't sasl_server_new in test_serverreset");
+    }
+
+    doauth_reset("PLAIN", saslconn, buf, 0);
+
+    if (sasl_server_reset(saslconn, buf, buf) != SASL_OK)
+	fatal("can't sasl_server_reset in test_serverreset");
+
+    /* nothing of the first session may be left */
+    if (sasl_getprop(saslconn, SASL_USERNAME, (const void **) &user)
+	!= SASL_NOTDONE)
+	fatal("SASL_USERNAME kept over sasl_server_reset");
+
+    doauth_reset("DIGEST-MD5", saslconn, buf, 1);
+
     sasl_dispose(&saslconn);
     sasl_done();
 }
@@ -3037,6 +3364,11 @@ int main(int argc, char **argv)
     if(mem_stat() != SASL_OK) fatal("memory error");
     printf("ok\n");
 
+    printf("Testing sasl_server_reset()...");
+    test_serverreset();
+    if(mem_stat() != SASL_OK) fatal("memory error");
+    printf("ok\n");
+
     if(!skip_do_correct) {
 	tosend_t tosend;
 	